@@ -2,7 +2,7 @@
 #pragma once
 
 #ifndef _WIN32_WINNT
-#define _WIN32_WINNT 0x0500
+#define _WIN32_WINNT 0x0501
 #endif						
 
 #define WIN32_LEAN_AND_MEAN
@@ -33,6 +33,7 @@
 #include "ifc_sysutils.h"
 #include "ifc_thread.h"
 #include "ifc_thread_psr.h"
+#include "ifc_task_pool.h"
 #include "ifc_sync_objs.h"
 #include "ifc_configmgr.h"
 #include "ifc_data_algo.h"
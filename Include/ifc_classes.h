@@ -61,6 +61,7 @@ class CClipboard;
 class CUrl;
 class CPacket;
 class CBits;
+class CTimerWheel;
 class CAutoInvokable;
 class CAutoInvoker;
 class CLogger;
@@ -2960,6 +2961,76 @@ public:
 	bool operator[] (int nIndex) const { return GetBit(nIndex); }
 };
 
+///////////////////////////////////////////////////////////////////////////////
+/// CTimerWheel - Hierarchical timer wheel.
+///
+/// @remarks
+///   @li Adding, removing and expiring a timer costs O(1), whatever the number of timers.
+///   @li The wheel has a root level of 256 ticks and 3 upper levels of 64 slots, so delays
+///       up to 2^26 ticks are kept exactly. Longer delays are clamped.
+///   @li CTimerWheel is not thread-safe.
+
+class CTimerWheel
+{
+public:
+	typedef PVOID TIMER_ID;
+private:
+	enum
+	{
+		ROOT_BITS = 8,
+		LEVEL_BITS = 6,
+		LEVEL_COUNT = 3,
+		ROOT_SIZE = 1 << ROOT_BITS,
+		LEVEL_SIZE = 1 << LEVEL_BITS,
+		MAX_DELAY_TICKS = (1 << (ROOT_BITS + LEVEL_BITS * LEVEL_COUNT)) - 1,
+	};
+
+	struct TIMER_NODE
+	{
+		TIMER_NODE *pPrev;
+		TIMER_NODE *pNext;
+		UINT nExpireTick;
+		PVOID pData;
+	};
+
+	TIMER_NODE m_RootSlots[ROOT_SIZE];                // The slots of the next 256 ticks.
+	TIMER_NODE m_LevelSlots[LEVEL_COUNT][LEVEL_SIZE]; // The slots of the far future.
+	UINT m_nTickMSecs;           // The length of a tick (ms).
+	UINT m_nNextTick;            // The next tick to be processed.
+	UINT m_nLastTicks;           // The GetTickCount() value of the last clock update.
+	UINT64 m_nElapsedMSecs;      // Milliseconds elapsed since the wheel was created.
+	int m_nCount;
+private:
+	static void InitSlot(TIMER_NODE& Slot);
+	static void LinkNode(TIMER_NODE& Slot, TIMER_NODE *pNode);
+	static void UnlinkNode(TIMER_NODE *pNode);
+	void UpdateClock();
+	void AddNode(TIMER_NODE *pNode);
+	int Cascade(int nLevel);
+	void FreeSlot(TIMER_NODE& Slot);
+public:
+	/// Constructor. @a nTickMSecs is the resolution of the timers.
+	explicit CTimerWheel(UINT nTickMSecs = 10);
+	/// Destructor.
+	virtual ~CTimerWheel();
+
+	/// Adds a timer which expires after @a nDelayMSecs and returns its id.
+	TIMER_ID Add(PVOID pData, UINT nDelayMSecs);
+	/// Removes a timer which is not expired yet.
+	void Remove(TIMER_ID nTimerId);
+	/// Removes all of the timers.
+	void Clear();
+	/// Processes the ticks up to the current time and appends the data of the expired
+	/// timers to @a Expired. The ids of these timers are no longer valid.
+	void Advance(CPointerList& Expired);
+	/// Returns the number of milliseconds until the next timer may expire.
+	/// Returns INFINITE if there are no timers.
+	DWORD GetNextTimeOut() const;
+
+	/// Returns the number of timers.
+	int GetCount() const { return m_nCount; }
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 /// CAutoInvokable - The base class for auto-invokable object.
 
@@ -64,6 +64,8 @@ class CCipher_IDEA;
 class CCipher_DES;
 class CCipher_Gost;
 
+class CInflater;
+
 ///////////////////////////////////////////////////////////////////////////////
 // Type Definitions
 
@@ -179,6 +181,15 @@ enum CRC32_TYPE
 	CRC32_SPECIAL,
 };
 
+// The data format accepted by CInflater
+enum INFLATE_FORMAT
+{
+	IF_AUTO,           // Any of the formats below, told by the first bytes
+	IF_GZIP,           // RFC 1952
+	IF_ZLIB,           // RFC 1950
+	IF_RAW,            // RFC 1951, no header or trailer
+};
+
 // Cipher context
 struct CCipherContext
 {
@@ -549,6 +560,110 @@ public:
 	virtual CCipherContext Context();
 };
 
+///////////////////////////////////////////////////////////////////////////////
+// CInflater - Streaming decoder of deflate data (gzip, zlib or raw).
+//
+// The data can be passed in pieces of any size. Memory use is bounded: a 32K
+// window, the Huffman tables, and the few input bytes of an incomplete step
+// carried over to the next call.
+
+class CInflater
+{
+private:
+	enum { WINDOW_SIZE = 32768, FAST_BITS = 9 };
+
+	enum INFLATE_STATE
+	{
+		IS_HEADER,
+		IS_BLOCK_HEADER,
+		IS_STORED,
+		IS_CODES,
+		IS_TRAILER,
+		IS_DONE,
+		IS_ERROR,
+	};
+
+	enum STEP_RESULT
+	{
+		SR_OK,
+		SR_NEED_INPUT,
+		SR_ERROR,
+	};
+
+	struct HUFFMAN
+	{
+		short Count[16];             // Number of codes of each length
+		short Symbol[288];           // Symbols ordered by their codes
+		WORD Fast[1 << FAST_BITS];   // (Symbol << 4 | Length) of the short codes, indexed by the next bits
+	};
+
+	struct CHECKPOINT
+	{
+		int nInputPos;
+		DWORD nBitBuf;
+		int nBitCount;
+	};
+
+private:
+	INFLATE_FORMAT m_nFormat;
+	INFLATE_FORMAT m_nDataFormat;     // The format found in the data when m_nFormat is IF_AUTO
+	INFLATE_STATE m_nState;
+	bool m_bLastBlock;
+	int m_nStoredLeft;
+	HUFFMAN m_LenCode;
+	HUFFMAN m_DistCode;
+	const HUFFMAN *m_pLenCode;
+	const HUFFMAN *m_pDistCode;
+	HUFFMAN m_FixedLenCode;
+	HUFFMAN m_FixedDistCode;
+	bool m_bFixedBuilt;
+
+	CBuffer m_Input;
+	int m_nInputSize;
+	int m_nInputPos;
+	DWORD m_nBitBuf;
+	int m_nBitCount;
+	CHECKPOINT m_Checkpoint;
+
+	CBuffer m_Window;
+	int m_nWindowPos;
+	int m_nFlushPos;
+	bool m_bWindowFull;
+	CStream *m_pOutStream;
+	INT64 m_nTotalOut;
+	DWORD m_nCrc32;
+	DWORD m_nAdler32;
+private:
+	void SaveCheckpoint();
+	void RestoreCheckpoint();
+	bool NeedBits(int nCount);
+	bool GetBits(int nCount, int& nValue);
+	void AlignToByte();
+
+	bool BuildHuffman(HUFFMAN& Huffman, const short *pLengths, int nCount, bool bAllowIncomplete);
+	STEP_RESULT Decode(const HUFFMAN& Huffman, int& nSymbol);
+
+	inline void PutByte(BYTE nByte);
+	void FlushWindow();
+
+	STEP_RESULT ReadHeader();
+	STEP_RESULT ReadBlockHeader();
+	STEP_RESULT ReadDynamicTables();
+	STEP_RESULT CopyStored();
+	STEP_RESULT DecodeCodes();
+	STEP_RESULT ReadTrailer();
+public:
+	CInflater(INFLATE_FORMAT nFormat = IF_AUTO);
+	virtual ~CInflater() {}
+
+	void Reset();
+	bool Inflate(const void *pData, int nSize, CStream& OutStream);
+
+	bool IsFinished() const { return m_nState == IS_DONE; }
+	bool IsError() const { return m_nState == IS_ERROR; }
+	INT64 GetTotalOut() const { return m_nTotalOut; }
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 
 /// @}
@@ -80,6 +80,9 @@ const TCHAR* const SEM_FILE_E_END_OF_FILE           = TEXT("Attempted to access
 
 const TCHAR* const SEM_IOCP_ERROR                   = TEXT("IOCP Error #%d");
 const TCHAR* const SEM_INVALID_OP_FOR_IOCP          = TEXT("Invalid operation for IOCP.");
+const TCHAR* const SEM_IOCP_TOO_MANY_BUFFERS        = TEXT("Too many buffers for one IOCP task.");
+
+const TCHAR* const SEM_TASK_POOL_ERROR              = TEXT("Task pool error #%d");
 
 const TCHAR* const SEM_PACKET_UNPACK_ERROR          = TEXT("Packet unpack error.");
 const TCHAR* const SEM_PACKET_PACK_ERROR            = TEXT("Packet pack error.");
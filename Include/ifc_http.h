@@ -31,6 +31,7 @@
 #include "ifc_sysutils.h"
 #include "ifc_socket.h"
 #include "ifc_iocp.h"
+#include "ifc_data_algo.h"
 #include "ifc_exceptions.h"
 
 /// The namespace of IFC.
@@ -44,15 +45,25 @@ namespace ifc
 // Classes
 
 class CUrl;
+class CHttpHeaderParser;
 class CHttpHeaderStrList;
 class CHttpEntityHeaderInfo;
 class CHttpRequestHeaderInfo;
 class CHttpResponseHeaderInfo;
 class CHttpRequest;
 class CHttpResponse;
+class CHttpRecvBuffer;
+class CHttpContentDecoder;
+class CHttpConnectionPool;
 class CCustomHttpClient;
 class CHttpClient;
 class CIocpHttpClient;
+struct CIocpHttpTask;
+class CIocpHttpMultiClient;
+class CHttpSegmentedDownloader;
+class CHttpServerRequest;
+class CHttpServerResponse;
+class CHttpServer;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Type Definitions
@@ -79,15 +90,69 @@ enum HTTP_NEXT_OP
 	HNO_EXIT,
 };
 
+/// Well-known header names, looked up in O(1) by CHttpHeaderParser and CHttpHeaderStrList
+enum HTTP_HEADER_ID
+{
+	HHI_UNKNOWN = -1,
+
+	HHI_CACHE_CONTROL,
+	HHI_CONNECTION,
+	HHI_CONTENT_DISPOSITION,
+	HHI_CONTENT_ENCODING,
+	HHI_CONTENT_LANGUAGE,
+	HHI_CONTENT_LENGTH,
+	HHI_CONTENT_RANGE,
+	HHI_CONTENT_TYPE,
+	HHI_CONTENT_VERSION,
+	HHI_DATE,
+	HHI_EXPIRES,
+	HHI_ETAG,
+	HHI_LAST_MODIFIED,
+	HHI_PRAGMA,
+	HHI_TRANSFER_ENCODING,
+	HHI_ACCEPT,
+	HHI_ACCEPT_CHARSET,
+	HHI_ACCEPT_ENCODING,
+	HHI_ACCEPT_LANGUAGE,
+	HHI_HOST,
+	HHI_FROM,
+	HHI_REFERER,
+	HHI_USER_AGENT,
+	HHI_RANGE,
+	HHI_ACCEPT_RANGES,
+	HHI_LOCATION,
+	HHI_SERVER,
+	HHI_EXPECT,
+
+	HHI_COUNT
+};
+
+/// The return value of CHttpHeaderParser::Feed()
+enum HTTP_PARSE_RESULT
+{
+	HPR_NEED_MORE,
+	HPR_DONE,
+	HPR_ERROR,
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 // Callback Definitions
 
+typedef int (*HTTP_ON_PRODUCE_CONTENT_PROC)(void *pParam, CHttpClient *pHttpClient,
+	void *pBuffer, int nSize);
 typedef void (*IOCPHTTP_ONDOWNLOADFILE_PROC)(void *pParam, CIocpHttpClient *pHttpClient,
 	LPCTSTR lpszUrl, LPCTSTR lpszLocalFileName, int nErrorCode);
 typedef void (*IOCPHTTP_ONREQUESTFILE_PROC)(void *pParam, CIocpHttpClient *pHttpClient,
 	LPCTSTR lpszUrl, int nErrorCode);
 typedef void (*IOCPHTTP_ONRECEIVEFILE_PROC)(void *pParam, CIocpHttpClient *pHttpClient,
 	void *pBuffer, int nSize, int nErrorCode);
+typedef void (*IOCPHTTP_ONTASKDONE_PROC)(void *pParam, CIocpHttpMultiClient *pHttpClient,
+	const CIocpHttpTask& Task, int nErrorCode);
+typedef void (*HTTPSEG_ONPROGRESS_PROC)(void *pParam, CHttpSegmentedDownloader *pDownloader,
+	INT64 nDoneSize, INT64 nFileSize);
+typedef void (*HTTPSVR_ON_REQUEST_PROC)(void *pParam, const CHttpServerRequest& Request,
+	CHttpServerResponse& Response);
+typedef int (*HTTPSVR_ON_PRODUCE_PROC)(void *pParam, void *pBuffer, int nSize);
 
 ///////////////////////////////////////////////////////////////////////////////
 // Constant Definitions
@@ -97,6 +162,11 @@ const TCHAR* const IFC_DEFAULT_USER_AGENT = TEXT("Mozilla/4.0 (compatible; IFC)"
 /// The default http port
 const int DEFAULT_HTTP_PORT = 80;
 
+/// Max size of a header parsed by CHttpHeaderParser by default
+const int HTTP_MAX_HEADER_SIZE = 1024*64;
+/// Max count of the "name: value" lines in a header
+const int HTTP_MAX_HEADER_COUNT = 100;
+
 /// Default Timeout defines:
 const int HTTP_TCP_CONNECT_TIMEOUT         = 1000*30;     // TCP connect timeout (ms).
 const int HTTP_SEND_REQ_HEADER_TIMEOUT     = 1000*30;     // Send request header timeout.
@@ -104,6 +174,33 @@ const int HTTP_SEND_REQ_CONT_BLOCK_TIMEOUT = 1000*60*2;   // Send request conten
 const int HTTP_RECV_RES_HEADER_TIMEOUT     = 1000*30;     // Receive response header timeout.
 const int HTTP_RECV_RES_CONT_BLOCK_TIMEOUT = 1000*60*2;   // Receive response content block timeout.
 const int HTTP_SOCKET_OP_TIMEOUT           = 1000*60*10;  // Socket operation (recv/send) timeout.
+const int HTTP_CONTINUE_TIMEOUT            = 1000*3;      // Wait for "100 Continue" before sending the content anyway.
+const int HTTP_TIMEOUT_CHECK_MIN_INTERVAL  = 100;         // Min interval of the timeout checks of the iocp client and server (ms).
+
+/// Default connection pool settings:
+const int HTTP_CONN_POOL_IDLE_TIMEOUT      = 1000*30;     // Idle time before a pooled connection is closed.
+const int HTTP_CONN_POOL_MAX_PER_HOST      = 8;           // Max idle connections kept for one host.
+
+/// Default CIocpHttpMultiClient settings:
+const int HTTP_MULTI_MAX_CONNS_PER_HOST    = 4;           // Max connections opened to one host.
+const int HTTP_MULTI_MAX_CONNECTIONS       = 256;         // Max connections opened in total.
+const int HTTP_MULTI_MAX_PIPELINE_DEPTH    = 4;           // Max requests in flight on one connection.
+const int HTTP_MULTI_RECV_BUFFER_SIZE      = 1024*16;     // The receive buffer size of one connection.
+
+/// Default CHttpSegmentedDownloader settings:
+const int HTTP_SEG_SEGMENT_COUNT           = 4;           // Ranges fetched at once.
+const int HTTP_SEG_MIN_SEGMENT_SIZE        = 1024*512;    // Smaller ranges are not split off.
+const int HTTP_SEG_MAX_RETRY_COUNT         = 3;           // Times a range is requested again without progress.
+const int HTTP_SEG_RETRY_DELAY             = 500;         // Delay before requesting a range again (ms), doubled on each failure.
+const int HTTP_SEG_SAVE_MAP_INTERVAL       = 1000*2;      // Interval of saving the segment map (ms).
+const int HTTP_SEG_RECV_BLOCK_SIZE         = 1024*64;     // Bytes received and written at a time.
+
+/// Default CHttpServer settings:
+const int HTTP_SVR_KEEP_ALIVE_TIMEOUT      = 1000*15;     // Idle time before a connection is closed.
+const int HTTP_SVR_MAX_HEADER_SIZE         = 1024*16;     // Max size of a request header.
+const int HTTP_SVR_MAX_CONTENT_SIZE        = 1024*1024*4; // Max size of a request content.
+const int HTTP_SVR_RECV_BLOCK_SIZE         = 1024*8;      // Bytes read from a connection at a time.
+const int HTTP_SVR_CHUNK_SIZE              = 1024*16;     // Max size of a chunk got from a producer.
 
 /// Error Codes:
 const int EC_HTTP_SUCCESS                  =  0;
@@ -117,6 +214,9 @@ const int EC_HTTP_CANNOT_CREATE_FILE       = -7;
 const int EC_HTTP_RESPONSE_TEXT_ERROR      = -8;
 const int EC_HTTP_CANNOT_RECV_CONTENT      = -9;
 const int EC_HTTP_IOCP_ERROR               = -10;
+const int EC_HTTP_FILE_WRITE_ERROR         = -11;
+const int EC_HTTP_CONTENT_DECODE_ERROR     = -12;
+const int EC_HTTP_CONTENT_PRODUCE_ERROR    = -13;
 
 ///////////////////////////////////////////////////////////////////////////////
 /// CHttpClientOptions
@@ -130,6 +230,10 @@ public:
 	int nRecvResHeaderTimeOut;             // Receive response header timeout.
 	int nRecvResContBlockTimeOut;          // Receive response content block timeout.
 	int nSocketOpTimeOut;                  // Socket operation (recv/send) timeout.
+	bool bUseConnectionPool;               // Lease keep-alive connections from CHttpConnectionPool.
+	bool bAcceptEncoding;                  // Ask for gzip/deflate content in CHttpClient::Get/Post and decode it.
+	bool bExpectContinue;                  // Send "Expect: 100-continue" before the request content of CHttpClient.
+	int nContinueTimeOut;                  // Wait for "100 Continue" before sending the content anyway.
 public:
 	CHttpClientOptions()
 	{
@@ -139,9 +243,66 @@ public:
 		nRecvResHeaderTimeOut = HTTP_RECV_RES_HEADER_TIMEOUT;
 		nRecvResContBlockTimeOut = HTTP_RECV_RES_CONT_BLOCK_TIMEOUT;
 		nSocketOpTimeOut = HTTP_SOCKET_OP_TIMEOUT;
+		bUseConnectionPool = true;
+		bAcceptEncoding = true;
+		bExpectContinue = false;
+		nContinueTimeOut = HTTP_CONTINUE_TIMEOUT;
 	}
 };
 
+///////////////////////////////////////////////////////////////////////////////
+/// CHttpHeaderParser - Incremental HTTP header parser.
+///
+/// @remarks
+///   The parser copies nothing and allocates nothing. It records the position of
+///   the start line and of each "name: value" pair in the caller's buffer, which
+///   must keep the header from its first byte for as long as the parser is used.
+///   Feed() can be called again each time more data is appended to the buffer
+///   (the buffer may move in between); it resumes at the first unscanned line.
+
+class CHttpHeaderParser
+{
+private:
+	struct HEADER_SPAN
+	{
+		int nNamePos, nNameLen;
+		int nValuePos, nValueLen;
+	};
+
+private:
+	const char *m_pBuffer;
+	int m_nMaxSize;
+	int m_nScanPos;
+	int m_nHeaderSize;
+	int m_nStartLinePos;
+	int m_nStartLineLen;
+	HTTP_PARSE_RESULT m_nState;
+	HEADER_SPAN m_Spans[HTTP_MAX_HEADER_COUNT];
+	int m_nCount;
+	int m_KnownIndex[HHI_COUNT];
+private:
+	bool ParseLine(int nPos, int nLen);
+	CString MakeString(int nPos, int nLen) const;
+public:
+	CHttpHeaderParser(int nMaxSize = HTTP_MAX_HEADER_SIZE);
+	virtual ~CHttpHeaderParser() {}
+
+	void Reset();
+	HTTP_PARSE_RESULT Feed(const char *pBuffer, int nSize);
+	void GetHeaders(CHttpHeaderStrList& Headers) const;
+
+	int GetHeaderSize() const { return m_nHeaderSize; }
+	int GetCount() const { return m_nCount; }
+	CString GetStartLine() const { return MakeString(m_nStartLinePos, m_nStartLineLen); }
+	CString GetName(int nIndex) const;
+	CString GetValue(int nIndex) const;
+	CString GetValue(HTTP_HEADER_ID nHeaderId) const;
+	bool HasHeader(HTTP_HEADER_ID nHeaderId) const { return m_KnownIndex[nHeaderId] >= 0; }
+
+	static HTTP_HEADER_ID FindHeaderId(const char *pName, int nLen);
+	static HTTP_HEADER_ID FindHeaderId(const wchar_t *pName, int nLen);
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 /// CHttpHeaderStrList
 
@@ -150,8 +311,13 @@ class CHttpHeaderStrList
 private:
 	CStrList m_Items;
 	CString m_strNameValueSep;
+	// The first line of each well-known header, built on the first lookup.
+	mutable int m_KnownIndex[HHI_COUNT];
+	mutable bool m_bIndexValid;
 private:
 	CString MakeLine(LPCTSTR lpszName, LPCTSTR lpszValue) const;
+	void IndexLine(int nIndex) const;
+	void BuildIndex() const;
 public:
 	CHttpHeaderStrList();
 	virtual ~CHttpHeaderStrList() {}
@@ -383,6 +549,129 @@ public:
 	void SetContentStream(CStream *pValue) { m_pContentStream = pValue; }
 };
 
+///////////////////////////////////////////////////////////////////////////////
+/// CHttpRecvBuffer - The read-ahead buffer of a http connection.
+///
+/// @remarks
+///   Data is received from the connection in large blocks and then parsed from the
+///   buffer, so the bytes beyond a header or a chunk line are kept for the next read.
+
+class CHttpRecvBuffer
+{
+public:
+	enum { DEF_BUFFER_SIZE = 1024*8 };     // The initial buffer size.
+	enum { MAX_BUFFER_SIZE = 1024*64 };    // The max size of data found by ReadUntil().
+private:
+	CTcpClient& m_TcpClient;
+	CBuffer m_Buffer;
+	int m_nReadPos;
+	int m_nWritePos;
+private:
+	int Fill(int nTimeOut);
+public:
+	CHttpRecvBuffer(CTcpClient& TcpClient);
+
+	/// Reads the data up to and including the delimiter. Returns the error code (EC_HTTP_XXX).
+	int ReadUntil(const char *pDelimiter, CBuffer& Data, int nTimeOut);
+	/// Reads a line terminated by CRLF (not included in strLine). Returns the error code (EC_HTTP_XXX).
+	int ReadLine(CString& strLine, int nTimeOut);
+	/// Reads exactly nSize bytes. Returns the error code (EC_HTTP_XXX).
+	int ReadExact(void *pBuffer, int nSize, int nTimeOut);
+	/// Reads exactly nBytes bytes into the stream. Returns the error code (EC_HTTP_XXX).
+	int ReadStream(CStream& Stream, INT64 nBytes, int nTimeOut);
+	/// Reads the buffered data first and then from the connection, returns the total number of bytes read, -1 if error.
+	int Read(void *pBuffer, int nSize, int nTimeOut = -1);
+
+	/// Discards the buffered data.
+	void Clear() { m_nReadPos = m_nWritePos = 0; }
+	/// Returns the number of bytes buffered but not read yet.
+	int GetDataSize() const { return m_nWritePos - m_nReadPos; }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// CHttpContentDecoder - Decodes the content written to it into the target stream.
+///
+/// @remarks
+///   Used for the gzip/deflate Content-Encoding. Written data is inflated at once,
+///   so the memory used does not grow with the content size.
+
+class CHttpContentDecoder : public CStream
+{
+private:
+	CInflater m_Inflater;
+	CStream& m_Target;
+public:
+	CHttpContentDecoder(CStream& Target, INFLATE_FORMAT nFormat);
+
+	virtual int Read(void *pBuffer, int nBytes) { return 0; }
+	virtual int Write(const void *pBuffer, int nBytes);
+	virtual INT64 Seek(INT64 nOffset, SEEK_ORIGIN nSeekOrigin) { return m_Inflater.GetTotalOut(); }
+
+	bool IsFinished() const { return m_Inflater.IsFinished(); }
+	bool IsError() const { return m_Inflater.IsError(); }
+
+	/// Returns the CInflater format of the Content-Encoding, false if it is not compressed.
+	static bool GetInflateFormat(const CString& strContentEncoding, INFLATE_FORMAT& nFormat);
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// CHttpConnectionPool - The process-wide pool of idle keep-alive connections.
+///
+/// @remarks
+///   Connections are keyed by the peer address. A leased connection is checked for
+///   liveness first, connections idle longer than the idle timeout are closed, and
+///   at most GetMaxPerHost() idle connections are kept for one host.
+
+class CHttpConnectionPool
+{
+private:
+	struct CONN_ITEM
+	{
+		SOCKET nSocketHandle;
+		UINT nIdleTicks;       // The tick count when the connection was released.
+	};
+
+	typedef std::deque<CONN_ITEM> CONN_LIST;
+	typedef std::map<INT64, CONN_LIST> HOST_MAP;   // <PeerAddrKey, CONN_LIST>
+
+private:
+	HOST_MAP m_Hosts;
+	int m_nIdleTimeOut;
+	int m_nMaxPerHost;
+	int m_nIdleCount;
+	UINT m_nLastSweepTicks;
+	CCriticalSection m_Lock;
+private:
+	static INT64 GetPeerAddrKey(const CPeerAddress& PeerAddr);
+	static bool IsConnectionAlive(SOCKET nSocketHandle);
+	static void CloseConnection(SOCKET nSocketHandle);
+	void RemoveExpired(CONN_LIST& ConnList, CONN_LIST& Expired);
+private:
+	CHttpConnectionPool();
+	static std::auto_ptr<CHttpConnectionPool> s_pSingleton;
+	static CCriticalSection s_SingletonLock;
+public:
+	virtual ~CHttpConnectionPool();
+	static CHttpConnectionPool& Instance();
+	static void Delete();
+
+	/// Attaches an idle connection of the peer to TcpClient, returns false if none is available.
+	bool Lease(const CPeerAddress& PeerAddr, CTcpClient& TcpClient);
+	/// Detaches the connection from TcpClient and keeps it in the pool (or closes it if the pool is full).
+	void Release(CTcpClient& TcpClient);
+	/// Closes the connections idle longer than the idle timeout.
+	void Sweep();
+	/// Closes all idle connections.
+	void Clear();
+
+	int GetIdleTimeOut() const { return m_nIdleTimeOut; }
+	int GetMaxPerHost() const { return m_nMaxPerHost; }
+	int GetIdleCount() const { return m_nIdleCount; }
+
+	void SetIdleTimeOut(int nValue) { m_nIdleTimeOut = Max(0, nValue); }
+	void SetMaxPerHost(int nValue) { m_nMaxPerHost = Max(0, nValue); }
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 /// CCustomHttpClient - HTTP client base class.
 
@@ -447,9 +736,18 @@ class CHttpClient : public CCustomHttpClient
 public:
 	friend class CAutoFinalizer;
 private:
-	int ReadLine(CString& strLine, int nTimeOut);
+	CHttpRecvBuffer m_RecvBuffer;
+	bool m_bChunkedContent;            // The request content is sent chunked, from the producer or the stream.
+	CCallBackDef<HTTP_ON_PRODUCE_CONTENT_PROC> m_ContentProducer;
+	bool m_bContentProduced;           // The producer has been called, so the content can not be sent again.
+	bool m_bExpectContinue;            // The current request waits for "100 Continue".
+private:
 	int ReadChunkSize(UINT& nChunkSize, int nTimeOut);
-	int ReadStream(CStream& Stream, int nBytes, int nTimeOut);
+	void ReleaseConnection();
+	void PrepareRequestContent();
+	void ClearRequestContent();
+	int WaitForContinue(bool& bSendContent);
+	int SendChunkedContent();
 protected:
 	int ExecuteHttpAction(HTTP_METHOD_TYPE nHttpMethod, LPCTSTR lpszUrl,
 		CStream *pRequestContent, CStream *pResponseContent);
@@ -461,7 +759,7 @@ protected:
 	int SendRequestHeader();
 	int SendRequestContent();
 	int RecvResponseHeader();
-	int RecvResponseContent();
+	int RecvResponseContent(bool bDecodeContent);
 public:
 	CHttpClient();
 	virtual ~CHttpClient();
@@ -470,6 +768,11 @@ public:
 	int Get(LPCTSTR lpszUrl, CStream *pResponseContent);
 	/// Sends a "POST" request to http server with the specified request content, and receives the response content. Returns the error code (EC_HTTP_XXX).
 	int Post(LPCTSTR lpszUrl, CStream *pRequestContent, CStream *pResponseContent);
+	/// Sends a "POST" request with the stream read to its end as chunked content, so its size need not be known. Returns the error code (EC_HTTP_XXX).
+	int PostChunked(LPCTSTR lpszUrl, CStream *pRequestContent, CStream *pResponseContent);
+	/// Sends a "POST" request with chunked content got from the producer, until it returns 0 (or -1 to abort). Returns the error code (EC_HTTP_XXX).
+	int PostChunked(LPCTSTR lpszUrl, HTTP_ON_PRODUCE_CONTENT_PROC pProc, void *pParam,
+		CStream *pResponseContent);
 
 	/// Downloads the entire file from the specified url. Returns the error code (EC_HTTP_XXX).
 	int DownloadFile(LPCTSTR lpszUrl, LPCTSTR lpszLocalFileName);
@@ -510,9 +813,11 @@ private:
 	public:
 		CString strUrl;
 		CString strLocalFileName;
-		CFileStream *pFileStream;
+		CIocpFileSink *pFileSink;
+		PVOID pBlock;              // The sink block being received into.
+		int nBlockDataSize;        // The bytes received into pBlock.
 	public:
-		CDownloadFileTask() : pFileStream(NULL) {}
+		CDownloadFileTask() : pFileSink(NULL), pBlock(NULL), nBlockDataSize(0) {}
 	};
 
 	struct CRequestFileTask
@@ -540,6 +845,7 @@ private:
 	CBuffer m_TransBuffer;
 	bool m_bWorking;
 	bool m_bDestroying;
+	CIocpObject *m_pIocpObject;
 
 	HTTP_METHOD_TYPE m_nHttpMethod;
 	CString m_strUrl;
@@ -555,19 +861,26 @@ private:
 private:
 	void InvokeCallBack();
 	void Finalize();
+	CIocpObject& GetIocp();
 
 	void PrepareHttpAction(HTTP_METHOD_TYPE nHttpMethod, LPCTSTR lpszUrl,
 		CStream *pRequestContent, CStream *pResponseContent);
 	void ExecuteHttpAction();
 	void TcpConnect();
+	void StartRecvToSink();
+	void RecvToSink();
+	void EndRecvToSink(int nErrorCode);
 
 	static void TcpConnectResultProc(void *pParam, CTcpClient *pTcpClient, bool bSuccess);
 	static void IocpCallBackProc(const CIocpTaskData& TaskData, void *pParam);
+	static void SinkBlockFreeProc(void *pParam, CIocpFileSink *pFileSink, int nErrorCode);
+	static void SinkFinishedProc(void *pParam, CIocpFileSink *pFileSink, int nErrorCode);
 public:
 	CIocpHttpClient();
 	virtual ~CIocpHttpClient();
 
-	/// Downloads the entire file from the specified url.
+	/// Downloads the entire file from the specified url. The content is received into
+	/// the blocks of a CIocpFileSink and written by overlapped writes on the iocp.
 	void DownloadFile(LPCTSTR lpszUrl, LPCTSTR lpszLocalFileName);
 	/// Sends the "GET" request to http server, and receives the response text and headers.
 	void RequestFile(LPCTSTR lpszUrl);
@@ -583,6 +896,481 @@ public:
 
 	/// Indicates whether the http client object is working.
 	bool IsWorking() { return m_bWorking; }
+
+	/// Uses the specified iocp object instead of the global one. Call it before any request.
+	void SetIocpObject(CIocpObject *pIocpObject) { m_pIocpObject = pIocpObject; }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// CIocpHttpTask - One request of CIocpHttpMultiClient and its response.
+
+struct CIocpHttpTask
+{
+public:
+	CString strUrl;                            // The request url.
+	CStream *pResponseContent;                 // Receives the response content, can be NULL.
+	PVOID pUserData;                           // The user data passed to AddTask().
+	CString strResponseText;                   // The status line, eg: "HTTP/1.1 200 OK".
+	int nResponseCode;                         // The response code, -1 if no response.
+	CHttpResponseHeaderInfo ResponseHeader;    // The response headers.
+public:
+	CIocpHttpTask() : pResponseContent(NULL), pUserData(NULL), nResponseCode(-1) {}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// CIocpHttpMultiClient - IOCP HTTP client which runs many GET requests at once.
+///
+/// @remarks
+///   Tasks are queued per host and sent over at most GetMaxConnsPerHost() keep-alive
+///   connections. Once a connection has returned a persistent HTTP/1.1 response, up
+///   to GetMaxPipelineDepth() requests are pipelined on it. All the sockets are driven
+///   by the iocp worker threads, and the callback is called once for every task from
+///   those threads. Redirects are not followed.
+
+class CIocpHttpMultiClient
+{
+public:
+	friend struct CIocpHttpConnHandler;
+
+private:
+	enum { MAX_RETRY_COUNT = 2 };    // Times a task is resent after its connection is closed.
+
+	enum RECV_STATE
+	{
+		RS_HEADER,             // receiving the response header
+		RS_CONTENT,            // receiving Content-Length bytes
+		RS_CONTENT_TO_EOF,     // receiving until the server closes the connection
+		RS_CHUNK_SIZE,         // receiving a chunk-size line
+		RS_CHUNK_DATA,         // receiving the chunk data and its CRLF
+		RS_CHUNK_TRAILER,      // receiving the trailer after the last chunk
+	};
+
+	struct HOST_ITEM;
+
+	struct TASK_ITEM
+	{
+		CIocpHttpTask Task;
+		HOST_ITEM *pHost;
+		CStringA strRequest;        // The request header text
+		int nRetryCount;
+	};
+
+	typedef std::deque<TASK_ITEM*> TASK_QUEUE;
+
+	struct HOST_ITEM
+	{
+		CString strHost;
+		int nPort;
+		TASK_QUEUE Pending;         // Tasks waiting for a connection
+		int nConnCount;             // Connections opened to the host
+	};
+
+	typedef std::map<CString, HOST_ITEM*> HOST_MAP;   // <"host:port", HOST_ITEM*>
+
+	struct CONNECTION
+	{
+		CIocpHttpMultiClient *pOwner;
+		HOST_ITEM *pHost;
+		CTcpClient TcpClient;
+		bool bConnected;
+		bool bClosing;              // No more tasks are assigned, freed when no operation is pending
+		bool bPersistent;           // The server keeps the connection alive, so requests can be pipelined
+		bool bKeepAlive;            // The response being received keeps the connection alive
+		TASK_QUEUE Pipeline;        // Assigned tasks in request order, the front one is being answered
+		int nUnsentCount;           // Tasks at the tail of Pipeline not sent yet
+		bool bSending;
+		bool bRecvPending;
+		CBuffer SendBuffer;
+		CBuffer RecvBuffer;
+		int nRecvSize;              // Bytes of unparsed data in RecvBuffer
+		RECV_STATE nRecvState;
+		CHttpHeaderParser HeaderParser;  // Resumes on the header being received
+		INT64 nRemainSize;          // Bytes left of the content, or of the current chunk and its CRLF
+		bool bResponseStarted;      // Some of the front task's response has arrived
+		int nErrorCode;             // The error passed to the front task on closing
+		UINT nLastActiveTicks;
+	};
+
+	struct DONE_ITEM
+	{
+		TASK_ITEM *pTask;
+		int nErrorCode;
+	};
+
+	typedef std::vector<DONE_ITEM> DONE_LIST;
+
+	class CCheckThread : public CThread
+	{
+	private:
+		CIocpHttpMultiClient& m_Owner;
+		HANDLE m_hWakeEvent;
+	protected:
+		virtual void Execute();
+		virtual void BeforeTerminate() { SetEvent(m_hWakeEvent); }
+	public:
+		CCheckThread(CIocpHttpMultiClient& Owner);
+		virtual ~CCheckThread();
+	};
+
+	friend class CCheckThread;
+
+private:
+	HOST_MAP m_Hosts;
+	CPointerList m_Connections;             // CONNECTION* list
+	int m_nTaskCount;
+	int m_nMaxConnsPerHost;
+	int m_nMaxConnections;
+	int m_nMaxPipelineDepth;
+	CHttpClientOptions m_Options;
+	CHttpRequestHeaderInfo m_RequestHeader;
+	CIocpObject *m_pIocpObject;
+	CCheckThread *m_pCheckThread;
+	bool m_bDestroying;
+	CCriticalSection m_Lock;
+	CCallBackDef<IOCPHTTP_ONTASKDONE_PROC> m_OnTaskDone;
+private:
+	CIocpObject& GetIocp();
+	CStringA MakeRequestText(const CUrl& Url);
+	static bool ParseResponseHeader(const CHttpHeaderParser& Parser, CIocpHttpTask& Task);
+
+	void Dispatch(HOST_ITEM *pHost, CPointerList& NewConns);
+	void DispatchAll(CPointerList& NewConns);
+	void StartConnections(const CPointerList& NewConns);
+	void StartSend(CONNECTION *pConn);
+	void PostRecv(CONNECTION *pConn);
+	void CloseConnection(CONNECTION *pConn, int nErrorCode);
+	void TryDestroyConnection(CONNECTION *pConn, DONE_LIST& DoneList, CPointerList& NewConns);
+	void RemoveHostIfUnused(HOST_ITEM *pHost);
+	void CompleteTask(TASK_ITEM *pTask, int nErrorCode, DONE_LIST& DoneList);
+	void DeliverTasks(DONE_LIST& DoneList);
+	UINT CheckTimeOut();
+
+	TASK_ITEM* GetFrontTask(CONNECTION *pConn);
+	void CompleteFrontTask(CONNECTION *pConn, DONE_LIST& DoneList, CPointerList& NewConns);
+	int ProcessRecvData(CONNECTION *pConn, DONE_LIST& DoneList, CPointerList& NewConns);
+	void OnSendComplete(CONNECTION *pConn, const CIocpTaskData& TaskData);
+	void OnRecvComplete(CONNECTION *pConn, const CIocpTaskData& TaskData);
+
+	static void TcpConnectResultProc(void *pParam, CTcpClient *pTcpClient, bool bSuccess);
+public:
+	CIocpHttpMultiClient();
+	virtual ~CIocpHttpMultiClient();
+
+	/// Queues a "GET" request, the callback is called when it is done. Returns false if the url is invalid.
+	bool AddTask(LPCTSTR lpszUrl, CStream *pResponseContent, PVOID pUserData = NULL);
+
+	/// Sets the callback called for every finished task.
+	void SetTaskDoneCallBack(IOCPHTTP_ONTASKDONE_PROC pProc, void *pParam = NULL);
+
+	/// Returns the number of tasks not finished yet.
+	int GetTaskCount() { return m_nTaskCount; }
+	/// Returns the number of connections opened or being opened.
+	int GetConnectionCount() { return m_Connections.GetCount(); }
+
+	int GetMaxConnsPerHost() const { return m_nMaxConnsPerHost; }
+	int GetMaxConnections() const { return m_nMaxConnections; }
+	int GetMaxPipelineDepth() const { return m_nMaxPipelineDepth; }
+
+	void SetMaxConnsPerHost(int nValue) { m_nMaxConnsPerHost = Max(1, nValue); }
+	void SetMaxConnections(int nValue) { m_nMaxConnections = Max(1, nValue); }
+	void SetMaxPipelineDepth(int nValue) { m_nMaxPipelineDepth = Max(1, nValue); }
+
+	/// The headers sent with every request. Call it before any request.
+	CHttpRequestHeaderInfo& RequestHeader() { return m_RequestHeader; }
+	/// The http client options (connect and receive timeouts).
+	CHttpClientOptions& Options() { return m_Options; }
+
+	/// Uses the specified iocp object instead of the global one. Call it before any request.
+	void SetIocpObject(CIocpObject *pIocpObject) { m_pIocpObject = pIocpObject; }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// CHttpSegmentedDownloader - Downloads a file over several connections at once.
+///
+/// @remarks
+///   A probe request (Range: bytes=0-0) finds the file size and whether the server
+///   accepts ranges. The file is preallocated and split into GetSegmentCount() ranges,
+///   each fetched by its own thread and CHttpClient and written at its own offset.
+///   The progress is saved to "<LocalFileName>.segs" every few seconds, so a later
+///   Download() of the same url resumes the unfinished ranges, as long as the size,
+///   ETag and Last-Modified of the remote file are unchanged. A server without range
+///   support is downloaded over one connection.
+
+class CHttpSegmentedDownloader
+{
+private:
+	struct SEGMENT
+	{
+		INT64 nStart;               // The first byte of the range.
+		INT64 nEnd;                 // The last byte of the range.
+		INT64 nDoneSize;            // The bytes written from nStart on.
+		int nErrorCode;
+	};
+
+	typedef std::vector<SEGMENT> SEGMENT_LIST;
+
+	class CSegmentThread : public CThread
+	{
+	private:
+		CHttpSegmentedDownloader& m_Owner;
+		int m_nIndex;
+	protected:
+		virtual void Execute();
+	public:
+		CSegmentThread(CHttpSegmentedDownloader& Owner, int nIndex) :
+			m_Owner(Owner), m_nIndex(nIndex) {}
+	};
+
+	friend class CSegmentThread;
+
+private:
+	CString m_strUrl;
+	CString m_strLocalFileName;
+	INT64 m_nFileSize;
+	CString m_strETag;
+	CString m_strLastModified;
+	SEGMENT_LIST m_Segments;
+	int m_nSegmentCount;
+	CHttpClientOptions m_Options;
+	CCriticalSection m_Lock;
+	CCallBackDef<HTTPSEG_ONPROGRESS_PROC> m_OnProgress;
+private:
+	CString GetMapFileName() const { return m_strLocalFileName + TEXT(".segs"); }
+	int Probe(bool& bAcceptRanges, bool& bEmptyFile);
+	bool LoadMap();
+	void SaveMap();
+	void SplitSegments();
+	void DownloadSegment(int nIndex);
+	bool IsSameFile(CHttpResponse& Response);
+	int ReceiveRange(CHttpClient& HttpClient, CFileStream& FileStream, CBuffer& Buffer,
+		int nIndex, INT64 nPos, INT64 nEnd);
+public:
+	CHttpSegmentedDownloader();
+	virtual ~CHttpSegmentedDownloader() {}
+
+	/// Downloads the file, resuming an unfinished download of it if any. Returns the error code (EC_HTTP_XXX).
+	int Download(LPCTSTR lpszUrl, LPCTSTR lpszLocalFileName);
+
+	/// Sets the callback called every few seconds during Download().
+	void SetProgressCallBack(HTTPSEG_ONPROGRESS_PROC pProc, void *pParam = NULL);
+
+	/// Returns the bytes of the file written so far.
+	INT64 GetDoneSize();
+	/// Returns the file size found by the probe request.
+	INT64 GetFileSize() const { return m_nFileSize; }
+
+	int GetSegmentCount() const { return m_nSegmentCount; }
+	void SetSegmentCount(int nValue) { m_nSegmentCount = Max(1, nValue); }
+
+	/// The http client options used by every connection.
+	CHttpClientOptions& Options() { return m_Options; }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// CHttpServerRequest - The request received by CHttpServer.
+
+class CHttpServerRequest : public CHttpRequestHeaderInfo
+{
+public:
+	friend class CHttpServer;
+private:
+	CString m_strMethod;
+	CString m_strUrl;                  // The request target, eg: "/status?verbose=1".
+	CString m_strPath;                 // The target without the query, eg: "/status".
+	CString m_strQuery;                // The query without '?', eg: "verbose=1".
+	HTTP_PROTO_VER m_nProtocolVersion;
+	CBuffer m_Content;
+	CPeerAddress m_PeerAddr;
+public:
+	CHttpServerRequest() : m_nProtocolVersion(HPV_1_1) {}
+
+	bool GetKeepAlive() const;
+	const CString& GetMethod() const { return m_strMethod; }
+	const CString& GetUrl() const { return m_strUrl; }
+	const CString& GetPath() const { return m_strPath; }
+	const CString& GetQuery() const { return m_strQuery; }
+	HTTP_PROTO_VER GetProtocolVersion() const { return m_nProtocolVersion; }
+	const CBuffer& GetContent() const { return m_Content; }
+	const CPeerAddress& GetPeerAddr() const { return m_PeerAddr; }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// CHttpServerResponse - The response filled in by the request handlers of CHttpServer.
+///
+/// @remarks
+///   The content is either the data written by Write(), a file set by SendFile(),
+///   or the data got from a producer set by SetProducer(). A producer is called
+///   from the iocp worker threads each time the previous chunk has been sent, and
+///   returns 0 at the end; the content is then sent chunked to HTTP/1.1 clients.
+
+class CHttpServerResponse : public CHttpResponseHeaderInfo
+{
+public:
+	friend class CHttpServer;
+private:
+	int m_nStatusCode;
+	CString m_strStatusText;
+	CBuffer m_Content;
+	int m_nContentSize;
+	CString m_strFileName;
+	CCallBackDef<HTTPSVR_ON_PRODUCE_PROC> m_Producer;
+public:
+	CHttpServerResponse();
+
+	virtual void BuildHeaders();
+
+	/// Sets the status code, the status text is the standard one if lpszText is NULL.
+	void SetStatus(int nCode, LPCTSTR lpszText = NULL);
+	/// Appends the data to the content.
+	void Write(const void *pBuffer, int nSize);
+	/// Appends the string to the content.
+	void Write(const CStringA& strText) { Write((LPCSTR)strText, strText.GetLength()); }
+	/// Sends the file as the content. 404 is sent if the file cannot be opened.
+	void SendFile(LPCTSTR lpszFileName) { m_strFileName = lpszFileName; }
+	/// Sets the producer of the content.
+	void SetProducer(HTTPSVR_ON_PRODUCE_PROC pProc, void *pParam = NULL);
+
+	int GetStatusCode() const { return m_nStatusCode; }
+	const CString& GetStatusText() const { return m_strStatusText; }
+	int GetContentSize() const { return m_nContentSize; }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// CHttpServer - An embedded HTTP/1.1 server driven by the iocp.
+///
+/// @remarks
+///   The connections are accepted by a CIocpTcpServer, and an idle connection holds
+///   no thread and no pending buffer. A connection alternates between reading and
+///   sending: all the complete requests in what has been read are handled in order
+///   and their responses are sent together, then the connection reads again. So
+///   pipelined requests are answered in one send. Keep-alive connections are closed
+///   after GetKeepAliveTimeOut() ms of idleness.
+///
+///   Handlers are called from the iocp worker threads, and are found in the route
+///   table by the request path: an exact path first, then the longest path ending
+///   with '*' whose prefix matches. Add the routes before Open().
+
+class CHttpServer
+{
+public:
+	friend struct CHttpServerSendHandler;
+
+private:
+	struct ROUTE_ITEM
+	{
+		CString strMethod;          // Empty for any method.
+		CString strPath;            // Ends with '*' to match the paths beginning with the rest.
+		CCallBackDef<HTTPSVR_ON_REQUEST_PROC> OnRequest;
+		CString strLocalDir;        // The directory of a static file route.
+	};
+
+	typedef std::vector<ROUTE_ITEM> ROUTE_LIST;
+
+	struct SEND_ITEM
+	{
+		CBuffer Data;               // Sent first: response headers and content in memory.
+		int nDataSize;
+		int nDataSentSize;
+		HANDLE hFile;               // The file sent after Data, or INVALID_HANDLE_VALUE.
+		INT64 nFileSize;
+		INT64 nFileSentSize;
+		CCallBackDef<HTTPSVR_ON_PRODUCE_PROC> Producer;    // Called after Data is sent.
+		bool bChunked;              // The producer's data is chunk-encoded.
+	};
+
+	typedef std::deque<SEND_ITEM*> SEND_QUEUE;
+
+	struct CONNECTION
+	{
+		CIocpTcpConnection *pTcpConn;
+		CBuffer RecvBuffer;
+		int nRecvSize;              // Bytes of unhandled data in RecvBuffer.
+		CHttpHeaderParser HeaderParser;  // Resumes on the header of the request being received.
+		SEND_QUEUE SendQueue;
+		bool bContinueSent;         // "100 Continue" was sent for the request being received.
+		bool bCloseAfterSend;
+		bool bWaitingRead;
+		UINT nLastActiveTicks;
+	};
+
+	class CCheckThread : public CThread
+	{
+	private:
+		CHttpServer& m_Owner;
+		HANDLE m_hWakeEvent;
+	protected:
+		virtual void Execute();
+		virtual void BeforeTerminate() { SetEvent(m_hWakeEvent); }
+	public:
+		CCheckThread(CHttpServer& Owner);
+		virtual ~CCheckThread();
+	};
+
+	friend class CCheckThread;
+
+private:
+	CIocpTcpServer m_TcpServer;
+	ROUTE_LIST m_Routes;
+	CPointerList m_Connections;     // CONNECTION* list
+	int m_nLiveConnCount;           // The connections not freed yet, including those being destroyed.
+	HANDLE m_hNoConnEvent;          // Signaled when m_nLiveConnCount drops to zero.
+	int m_nKeepAliveTimeOut;
+	CString m_strServerName;
+	long m_nRequestCount;
+	CCheckThread *m_pCheckThread;
+	CCriticalSection m_Lock;
+private:
+	CIocpObject& GetIocp() { return m_TcpServer.GetIocp(); }
+	static CString GetContentTypeByExt(const CString& strFileName);
+
+	const ROUTE_ITEM* FindRoute(const CHttpServerRequest& Request);
+	void HandleRequest(CHttpServerRequest& Request, CHttpServerResponse& Response);
+	void SendStaticFile(const ROUTE_ITEM& Route, const CHttpServerRequest& Request,
+		CHttpServerResponse& Response);
+	bool ParseRequestHeader(const CHttpHeaderParser& Parser, CHttpServerRequest& Request);
+	void QueueResponse(CONNECTION *pConn, const CHttpServerRequest& Request,
+		CHttpServerResponse& Response, bool bKeepAlive);
+	SEND_ITEM* QueueData(CONNECTION *pConn, const void *pBuffer, int nSize);
+	void QueueError(CONNECTION *pConn, int nStatusCode);
+	void ProcessRequests(CONNECTION *pConn);
+
+	void WaitRead(CONNECTION *pConn);
+	void SendNext(CONNECTION *pConn);
+	void DestroyConnection(CONNECTION *pConn);
+	UINT CheckTimeOut();
+
+	void OnReadable(CONNECTION *pConn, int nErrorCode);
+	void OnSendComplete(CONNECTION *pConn, const CIocpTaskData& TaskData);
+
+	static void OnAcceptConnProc(void *pParam, CTcpConnection *pConnection);
+	static void OnReadableProc(void *pParam, CIocpTcpConnection *pConnection, int nErrorCode);
+public:
+	CHttpServer();
+	virtual ~CHttpServer();
+
+	/// Starts listening on the port.
+	void Open(int nPort);
+	/// Stops listening and closes all the connections. Do not call it from the handlers.
+	void Close();
+	bool GetActive() { return m_TcpServer.GetActive(); }
+
+	/// Adds a route. lpszMethod is NULL or empty for any method.
+	void AddRoute(LPCTSTR lpszMethod, LPCTSTR lpszPath, HTTPSVR_ON_REQUEST_PROC pProc, void *pParam = NULL);
+	/// Serves the files under lpszLocalDir for the paths beginning with lpszUrlPrefix.
+	void AddStaticDir(LPCTSTR lpszUrlPrefix, LPCTSTR lpszLocalDir);
+
+	/// Returns the number of open connections.
+	int GetConnectionCount() { return m_Connections.GetCount(); }
+	/// Returns the number of requests handled.
+	int GetRequestCount() { return m_nRequestCount; }
+
+	int GetKeepAliveTimeOut() const { return m_nKeepAliveTimeOut; }
+	void SetKeepAliveTimeOut(int nValue) { m_nKeepAliveTimeOut = Max(1000, nValue); }
+	/// The value of the "Server" header.
+	void SetServerName(LPCTSTR lpszValue) { m_strServerName = lpszValue; }
+
+	/// Uses the specified iocp object instead of the global one. Call it before Open().
+	void SetIocpObject(CIocpObject *pIocpObject) { m_TcpServer.SetIocpObject(pIocpObject); }
 };
 
 ///////////////////////////////////////////////////////////////////////////////
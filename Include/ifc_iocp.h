@@ -32,6 +32,8 @@
 #include "ifc_socket.h"
 #include "ifc_exceptions.h"
 
+#include <new>
+
 /// The namespace of IFC.
 namespace ifc
 {
@@ -42,12 +44,17 @@ namespace ifc
 ///////////////////////////////////////////////////////////////////////////////
 // Classes
 
+class CIocpOptions;
 class CIocpParams;
 class CIocpTaskData;
 class CIocpBufferAllocator;
+class CIocpPendingCounter;
+class CIocpEngine;
+class CIocpPortEngine;
 class CIocpObject;
 class CIocpTcpConnection;
 class CIocpTcpServer;
+class CIocpFileSink;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Type Definitions
@@ -58,9 +65,31 @@ enum IOCP_TASK_TYPE
 	ITT_RECV = 2,
 };
 
+/// The max number of buffers in one scatter/gather task.
+const int IOCP_MAX_BUFFER_COUNT = 8;
+/// The max size of a typed completion handler (see CIocpObject::Send<HandlerType>).
+const int IOCP_HANDLER_STORAGE_SIZE = sizeof(PVOID) * 8;
+/// The max number of completions dequeued by a worker thread at a time.
+const int IOCP_MAX_BATCH_SIZE = 64;
+/// The default number of completions dequeued by a worker thread at a time.
+const int IOCP_DEF_BATCH_SIZE = 16;
+/// The default block size of CIocpFileSink.
+const int IOCP_FILESINK_BLOCK_SIZE = 1024*256;
+/// The default number of blocks of CIocpFileSink.
+const int IOCP_FILESINK_BLOCK_COUNT = 4;
+
 typedef void (*IOCP_CALLBACK_PROC)(const CIocpTaskData& TaskData, PVOID pParam);
 typedef CCallBackDef<IOCP_CALLBACK_PROC> IOCP_CALLBACK_DEF;
 
+typedef void (*IOCP_HANDLER_INVOKE_PROC)(PVOID pHandler, const CIocpTaskData& TaskData);
+typedef void (*IOCP_HANDLER_DESTROY_PROC)(PVOID pHandler);
+
+typedef void (*IOCP_TCPSVR_ON_READABLE_PROC)(void *pParam, CIocpTcpConnection *pConnection,
+	int nErrorCode);
+typedef void (*IOCP_FILESINK_PROC)(void *pParam, CIocpFileSink *pFileSink, int nErrorCode);
+
+struct IOCP_PENDING_ENTRY;
+
 ///////////////////////////////////////////////////////////////////////////////
 // Misc Routines
 
@@ -71,6 +100,28 @@ void DeleteIocpObject();
 // Indicates whether the global iocp object is created or not.
 bool IsIocpObjectAvailable();
 
+///////////////////////////////////////////////////////////////////////////////
+// CIocpOptions
+
+struct CIocpOptions
+{
+public:
+	int nWorkerThreadCount;      // 0 means (number of processors * 2 + 4).
+	int nBatchSize;              // Completions dequeued at a time (1 .. IOCP_MAX_BATCH_SIZE).
+	DWORD_PTR nAffinityMask;     // Processors the worker threads may run on. 0 for any.
+	int nNumaNode;               // NUMA node the worker threads are bound to. -1 for any.
+	bool bPinWorkerThreads;      // Binds each worker thread to a single processor of the above.
+public:
+	CIocpOptions()
+	{
+		nWorkerThreadCount = 0;
+		nBatchSize = IOCP_DEF_BATCH_SIZE;
+		nAffinityMask = 0;
+		nNumaNode = -1;
+		bPinWorkerThreads = false;
+	}
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 // CIocpParams
 
@@ -114,9 +165,24 @@ private:
 	CIocpParams m_Params;
 	PVOID m_pEntireDataBuf;
 	int m_nEntireDataSize;
+	WSABUF m_EntireBuffers[IOCP_MAX_BUFFER_COUNT];
+	int m_nEntireBufferCount;
+	int m_nOffset;
 	WSABUF m_WSABuffer;
+	WSABUF m_WSABuffers[IOCP_MAX_BUFFER_COUNT];
+	int m_nWSABufferCount;
 	int m_nBytesTrans;
 	int m_nErrorCode;
+	IOCP_PENDING_ENTRY *m_pPendingEntry;
+	IOCP_HANDLER_INVOKE_PROC m_pHandlerInvoke;
+	IOCP_HANDLER_DESTROY_PROC m_pHandlerDestroy;
+	union
+	{
+		INT64 nAlign;
+		PVOID pAlign;
+		double fAlign;
+		char Data[IOCP_HANDLER_STORAGE_SIZE];
+	} m_HandlerStorage;
 
 public:
 	CIocpTaskData();
@@ -130,8 +196,11 @@ public:
 	const CIocpParams& GetParams() const { return m_Params; }
 	char* GetEntireDataBuf() const { return (char*)m_pEntireDataBuf; }
 	int GetEntireDataSize() const { return m_nEntireDataSize; }
+	const WSABUF* GetEntireBuffers() const { return m_EntireBuffers; }
+	int GetEntireBufferCount() const { return m_nEntireBufferCount; }
+	int GetOffset() const { return m_nOffset; }
 	char* GetDataBuf() const { return (char*)m_WSABuffer.buf; }
-	int GetDataSize() const { return m_WSABuffer.len; }
+	int GetDataSize() const { return m_nEntireDataSize - m_nOffset; }
 	int GetBytesTrans() const { return m_nBytesTrans; }
 	int GetErrorCode() const { return m_nErrorCode; }
 };
@@ -144,17 +213,150 @@ struct CIocpOverlappedData
 };
 #pragma pack()
 
+///////////////////////////////////////////////////////////////////////////////
+// CIocpCompletion
+
+struct CIocpCompletion
+{
+	LPOVERLAPPED pOverlapped;
+	DWORD nBytesTrans;
+	int nErrorCode;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// CIocpEngine - The completion engine beneath CIocpObject.
+
+class CIocpEngine
+{
+public:
+	CIocpEngine() {}
+	virtual ~CIocpEngine() {}
+
+	/// Creates the completion queue.
+	virtual void Open(int nConcurrency) = 0;
+	/// Destroys the completion queue.
+	virtual void Close() = 0;
+	/// Returns the handle of the completion queue.
+	virtual HANDLE GetHandle() const = 0;
+
+	/// Binds a file handle or a socket to the completion queue.
+	virtual bool AssociateHandle(HANDLE hFileHandle) = 0;
+	/// Queues a completion packet directly.
+	virtual bool PostCompletion(DWORD nBytesTrans, LPOVERLAPPED pOverlapped) = 0;
+	/// Dequeues a completion packet. Returns false if the wait timed out.
+	virtual bool GetCompletion(CIocpCompletion& Entry, DWORD nTimeOut) = 0;
+	/// Dequeues up to nCount completion packets. Returns 0 if the wait timed out.
+	virtual int GetCompletions(CIocpCompletion *pEntries, int nCount, DWORD nTimeOut);
+
+	/// The following methods start an async operation.
+	/// They return 0 if the operation is started, otherwise the error code.
+	virtual int WriteFile(HANDLE hFileHandle, LPWSABUF pBuffer, LPOVERLAPPED pOverlapped) = 0;
+	virtual int ReadFile(HANDLE hFileHandle, LPWSABUF pBuffer, LPOVERLAPPED pOverlapped) = 0;
+	virtual int Send(SOCKET hSocketHandle, LPWSABUF pBuffers, int nBufferCount,
+		LPOVERLAPPED pOverlapped) = 0;
+	virtual int Recv(SOCKET hSocketHandle, LPWSABUF pBuffers, int nBufferCount,
+		LPOVERLAPPED pOverlapped) = 0;
+	virtual int SendTo(SOCKET hSocketHandle, const CPeerAddress& PeerAddr,
+		LPWSABUF pBuffers, int nBufferCount, LPOVERLAPPED pOverlapped) = 0;
+	/// Sends nBytes of the file from the offset in pOverlapped to the socket.
+	virtual int TransmitFile(SOCKET hSocketHandle, HANDLE hFileHandle, DWORD nBytes,
+		LPOVERLAPPED pOverlapped) = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// CIocpPortEngine - The completion engine based on the I/O completion port.
+
+class CIocpPortEngine : public CIocpEngine
+{
+private:
+	// The same layout as OVERLAPPED_ENTRY (Vista).
+	struct PORT_ENTRY
+	{
+		ULONG_PTR lpCompletionKey;
+		LPOVERLAPPED lpOverlapped;
+		ULONG_PTR Internal;
+		DWORD dwNumberOfBytesTransferred;
+	};
+
+	typedef BOOL (WINAPI *GET_QUEUED_COMPLETION_STATUS_EX_PROC)(HANDLE CompletionPort,
+		PORT_ENTRY *lpCompletionPortEntries, ULONG ulCount, PULONG ulNumEntriesRemoved,
+		DWORD dwMilliseconds, BOOL fAlertable);
+	typedef ULONG (WINAPI *RTL_NTSTATUS_TO_DOS_ERROR_PROC)(LONG Status);
+
+	HANDLE m_hIocpHandle;
+	GET_QUEUED_COMPLETION_STATUS_EX_PROC m_pGetQueuedCompletionStatusEx;
+	RTL_NTSTATUS_TO_DOS_ERROR_PROC m_pRtlNtStatusToDosError;
+public:
+	CIocpPortEngine();
+	virtual ~CIocpPortEngine();
+
+	virtual void Open(int nConcurrency);
+	virtual void Close();
+	virtual HANDLE GetHandle() const { return m_hIocpHandle; }
+
+	virtual bool AssociateHandle(HANDLE hFileHandle);
+	virtual bool PostCompletion(DWORD nBytesTrans, LPOVERLAPPED pOverlapped);
+	virtual bool GetCompletion(CIocpCompletion& Entry, DWORD nTimeOut);
+	virtual int GetCompletions(CIocpCompletion *pEntries, int nCount, DWORD nTimeOut);
+
+	virtual int WriteFile(HANDLE hFileHandle, LPWSABUF pBuffer, LPOVERLAPPED pOverlapped);
+	virtual int ReadFile(HANDLE hFileHandle, LPWSABUF pBuffer, LPOVERLAPPED pOverlapped);
+	virtual int Send(SOCKET hSocketHandle, LPWSABUF pBuffers, int nBufferCount,
+		LPOVERLAPPED pOverlapped);
+	virtual int Recv(SOCKET hSocketHandle, LPWSABUF pBuffers, int nBufferCount,
+		LPOVERLAPPED pOverlapped);
+	virtual int SendTo(SOCKET hSocketHandle, const CPeerAddress& PeerAddr,
+		LPWSABUF pBuffers, int nBufferCount, LPOVERLAPPED pOverlapped);
+	virtual int TransmitFile(SOCKET hSocketHandle, HANDLE hFileHandle, DWORD nBytes,
+		LPOVERLAPPED pOverlapped);
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// CIocpHandlerThunk - Calls and destroys a typed handler stored in CIocpTaskData.
+
+template <typename HandlerType>
+struct CIocpHandlerThunk
+{
+	static void Invoke(PVOID pHandler, const CIocpTaskData& TaskData)
+	{
+		(*(HandlerType*)pHandler)(TaskData);
+	}
+
+	static void Destroy(PVOID pHandler)
+	{
+		((HandlerType*)pHandler)->~HandlerType();
+	}
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 // CIocpBufferAllocator
 
 class CIocpBufferAllocator
 {
 private:
+	enum
+	{
+		SLAB_BUFFER_COUNT = 64,    // buffers carved from one slab
+		CACHE_CAPACITY = 64,       // max buffers held by a thread cache
+		CACHE_BATCH_SIZE = 32,     // buffers moved between a cache and the depot at a time
+	};
+
+	struct CThreadCache
+	{
+		int nCount;
+		PVOID pItems[CACHE_CAPACITY];
+	};
+
 	int m_nBufferSize;
-	CPointerList m_Items;
-	int m_nUsedCount;
-	CCriticalSection m_Lock;
+	PSLIST_HEADER m_pDepot;        // lock-free stack of the free buffers
+	DWORD m_nTlsIndex;             // slot of the calling thread's cache
+	CPointerList m_Slabs;
+	CPointerList m_Caches;
+	CCriticalSection m_Lock;       // guards m_Slabs and m_Caches only
+	long m_nUsedCount;
 private:
+	PVOID AllocSlab();
+	void FlushCache(CThreadCache *pCache, int nCount);
 	void Clear();
 public:
 	CIocpBufferAllocator(int nBufferSize);
@@ -162,6 +364,12 @@ public:
 
 	PVOID AllocBuffer();
 	void ReturnBuffer(PVOID pBuffer);
+	void ReturnBuffers(PVOID *pBuffers, int nCount);
+
+	/// Gives the calling thread a private buffer cache. For long-lived threads only.
+	void AttachThreadCache();
+	/// Returns the cached buffers of the calling thread to the depot.
+	void DetachThreadCache();
 
 	int GetUsedCount() const { return m_nUsedCount; }
 };
@@ -169,25 +377,45 @@ public:
 ///////////////////////////////////////////////////////////////////////////////
 // CIocpPendingCounter
 
+// The pending counts of one caller.
+struct IOCP_PENDING_ENTRY
+{
+	PVOID pCaller;
+	long nSendCount;
+	long nRecvCount;
+	long nTotalCount;
+	int nWaiterCount;
+	HANDLE hZeroEvent;     // created by the first waiter
+};
+
 class CIocpPendingCounter
 {
 private:
-	struct COUNT_DATA
+	enum { SHARD_COUNT = 64 };
+
+	typedef std::map<PVOID, IOCP_PENDING_ENTRY*> ITEMS;   // <pCaller, IOCP_PENDING_ENTRY*>
+
+	struct CShard
 	{
-		int nSendCount;
-		int nRecvCount;
+		ITEMS Items;
+		CCriticalSection Lock;
 	};
 
-	typedef std::map<PVOID, COUNT_DATA> ITEMS;   // <pCaller, COUNT_DATA>
-
-	ITEMS m_Items;
-	CCriticalSection m_Lock;
+	CShard m_Shards[SHARD_COUNT];
+private:
+	CShard& GetShard(PVOID pCaller);
+	IOCP_PENDING_ENTRY* Find(CShard& Shard, PVOID pCaller);
+	void FreeEntry(CShard& Shard, IOCP_PENDING_ENTRY *pEntry);
 public:
 	CIocpPendingCounter() {}
-	virtual ~CIocpPendingCounter() {}
-
-	void Inc(PVOID pCaller, IOCP_TASK_TYPE nTaskType);
-	void Dec(PVOID pCaller, IOCP_TASK_TYPE nTaskType);
+	virtual ~CIocpPendingCounter();
+
+	/// Adds a pending task. The returned entry stays valid until the matching Dec().
+	IOCP_PENDING_ENTRY* Inc(PVOID pCaller, IOCP_TASK_TYPE nTaskType);
+	/// Removes a pending task without looking up the caller.
+	void Dec(IOCP_PENDING_ENTRY *pEntry, IOCP_TASK_TYPE nTaskType);
+	/// Blocks until the caller has no pending tasks.
+	void WaitFor(PVOID pCaller);
 	int Get(PVOID pCaller);
 	int Get(IOCP_TASK_TYPE nTaskType);
 };
@@ -212,7 +440,9 @@ private:
 	};
 
 private:
-	HANDLE m_hIocpHandle;
+	CIocpOptions m_Options;
+	DWORD_PTR m_nWorkerAffinity;
+	CIocpEngine *m_pEngine;
 	CPointerList m_WorkerThreads;
 	CIocpBufferAllocator m_BufferAlloc;
 	CSeqNumberAlloc m_TaskSeqAlloc;
@@ -221,27 +451,77 @@ private:
 
 private:
 	static std::auto_ptr<CIocpObject> s_pSingleton;
+	static CIocpOptions s_DefaultOptions;
 
 private:
 	void Initialize();
 	void Finalize();
-	void ThrowGeneralError();
+	DWORD_PTR GetWorkerAffinity();
+	DWORD_PTR GetWorkerThreadAffinity(int nIndex);
+	CIocpOverlappedData* AllocOverlappedData(IOCP_TASK_TYPE nTaskType,
+		HANDLE hFileHandle, const WSABUF *pBuffers, int nBufferCount, int nOffset,
+		PVOID pCaller);
 	CIocpOverlappedData* CreateOverlappedData(IOCP_TASK_TYPE nTaskType,
 		HANDLE hFileHandle, PVOID pBuffer, int nSize, int nOffset,
 		const IOCP_CALLBACK_DEF& CallBackDef, PVOID pCaller,
 		const CIocpParams& Params);
+	CIocpOverlappedData* CreateOverlappedData(IOCP_TASK_TYPE nTaskType,
+		HANDLE hFileHandle, const WSABUF *pBuffers, int nBufferCount, int nOffset,
+		const IOCP_CALLBACK_DEF& CallBackDef, PVOID pCaller,
+		const CIocpParams& Params);
+	void AbortOverlappedData(CIocpOverlappedData *pOvDataPtr);
 	void DestroyOverlappedData(CIocpOverlappedData *pOvDataPtr);
+	void StartFileTask(CIocpOverlappedData *pOvDataPtr);
+	void StartSocketTask(CIocpOverlappedData *pOvDataPtr);
+
+	template <typename HandlerType>
+	CIocpOverlappedData* CreateOverlappedData(IOCP_TASK_TYPE nTaskType,
+		HANDLE hFileHandle, PVOID pBuffer, int nSize, int nOffset,
+		const HandlerType& Handler, PVOID pCaller)
+	{
+		C_ASSERT(sizeof(HandlerType) <= IOCP_HANDLER_STORAGE_SIZE);
+		IFC_ASSERT(pBuffer != NULL || nSize == 0);
+
+		WSABUF Buffer;
+		Buffer.buf = (char*)pBuffer;
+		Buffer.len = nSize;
+
+		CIocpOverlappedData *pResult = AllocOverlappedData(nTaskType, hFileHandle,
+			&Buffer, 1, nOffset, pCaller);
+		CIocpTaskData& TaskData = pResult->TaskData;
+
+		try
+		{
+			new (&TaskData.m_HandlerStorage) HandlerType(Handler);
+		}
+		catch (...)
+		{
+			AbortOverlappedData(pResult);
+			throw;
+		}
+
+		TaskData.m_pHandlerInvoke = &CIocpHandlerThunk<HandlerType>::Invoke;
+		TaskData.m_pHandlerDestroy = &CIocpHandlerThunk<HandlerType>::Destroy;
+
+		return pResult;
+	}
 	void PostError(int nErrorCode, CIocpOverlappedData *pOvDataPtr);
 	void InvokeCallBack(const CIocpTaskData& TaskData);
+	void ProcessCompletion(const CIocpCompletion& Entry);
 	void Work();
 
-private:
-	CIocpObject();
 public:
+	/// Creates an independent iocp object besides the global one.
+	explicit CIocpObject(const CIocpOptions& Options);
 	virtual ~CIocpObject();
 	static CIocpObject& Instance();
 	static void Delete();
 	static bool IsAvailable();
+	/// Sets the options used when the global object is created.
+	static void SetDefaultOptions(const CIocpOptions& Options) { s_DefaultOptions = Options; }
+
+	const CIocpOptions& GetOptions() const { return m_Options; }
+	CIocpEngine& GetEngine() { return *m_pEngine; }
 
 	bool AssociateHandle(HANDLE hFileHandle);
 	bool AssociateHandle(SOCKET hSocketHandle);
@@ -256,6 +536,91 @@ public:
 	void Recv(SOCKET hSocketHandle, PVOID pBuffer, int nSize, int nOffset,
 		const IOCP_CALLBACK_DEF& CallBackDef, PVOID pCaller, const CIocpParams& Params);
 
+	/// Scatter/gather versions. nOffset is the number of bytes of the buffer
+	/// list already transferred, the rest of the list is transferred in one call.
+	void SendV(SOCKET hSocketHandle, const WSABUF *pBuffers, int nBufferCount, int nOffset,
+		const IOCP_CALLBACK_DEF& CallBackDef, PVOID pCaller, const CIocpParams& Params);
+	void RecvV(SOCKET hSocketHandle, const WSABUF *pBuffers, int nBufferCount, int nOffset,
+		const IOCP_CALLBACK_DEF& CallBackDef, PVOID pCaller, const CIocpParams& Params);
+
+	/// Typed versions. The handler is copied into the task and called as
+	/// Handler(const CIocpTaskData& TaskData) when the operation completes.
+	/// sizeof(HandlerType) must not exceed IOCP_HANDLER_STORAGE_SIZE.
+	template <typename HandlerType>
+	void Send(HANDLE hFileHandle, PVOID pBuffer, int nSize, int nOffset,
+		const HandlerType& Handler, PVOID pCaller)
+	{
+		StartFileTask(CreateOverlappedData(ITT_SEND, hFileHandle, pBuffer, nSize,
+			nOffset, Handler, pCaller));
+	}
+
+	template <typename HandlerType>
+	void Recv(HANDLE hFileHandle, PVOID pBuffer, int nSize, int nOffset,
+		const HandlerType& Handler, PVOID pCaller)
+	{
+		StartFileTask(CreateOverlappedData(ITT_RECV, hFileHandle, pBuffer, nSize,
+			nOffset, Handler, pCaller));
+	}
+
+	template <typename HandlerType>
+	void Send(SOCKET hSocketHandle, PVOID pBuffer, int nSize, int nOffset,
+		const HandlerType& Handler, PVOID pCaller)
+	{
+		StartSocketTask(CreateOverlappedData(ITT_SEND, (HANDLE)hSocketHandle, pBuffer, nSize,
+			nOffset, Handler, pCaller));
+	}
+
+	template <typename HandlerType>
+	void Recv(SOCKET hSocketHandle, PVOID pBuffer, int nSize, int nOffset,
+		const HandlerType& Handler, PVOID pCaller)
+	{
+		StartSocketTask(CreateOverlappedData(ITT_RECV, (HANDLE)hSocketHandle, pBuffer, nSize,
+			nOffset, Handler, pCaller));
+	}
+
+	/// Issues a zero-byte receive, so that the handler is called once data or a
+	/// close is pending on the socket without any buffer being held meanwhile.
+	template <typename HandlerType>
+	void WaitReadable(SOCKET hSocketHandle, const HandlerType& Handler, PVOID pCaller)
+	{
+		StartSocketTask(CreateOverlappedData(ITT_RECV, (HANDLE)hSocketHandle, NULL, 0,
+			0, Handler, pCaller));
+	}
+
+	/// Writes the buffer to the file at nFilePos. The file must be opened with
+	/// FILE_FLAG_OVERLAPPED and associated with the iocp.
+	template <typename HandlerType>
+	void WriteFileAt(HANDLE hFileHandle, INT64 nFilePos, PVOID pBuffer, int nSize,
+		const HandlerType& Handler, PVOID pCaller)
+	{
+		CIocpOverlappedData *pOvDataPtr = CreateOverlappedData(ITT_SEND, hFileHandle,
+			pBuffer, nSize, 0, Handler, pCaller);
+
+		pOvDataPtr->Overlapped.Offset = (DWORD)nFilePos;
+		pOvDataPtr->Overlapped.OffsetHigh = (DWORD)(nFilePos >> 32);
+		StartFileTask(pOvDataPtr);
+	}
+
+	/// Sends nSize bytes of the file from nFilePos to the socket by TransmitFile(), so
+	/// the file data is not copied through user buffers. GetBytesTrans() of the task
+	/// is the number of bytes sent. Client editions of Windows run at most two
+	/// TransmitFile() calls at a time, the others wait in the kernel.
+	template <typename HandlerType>
+	void TransmitFile(SOCKET hSocketHandle, HANDLE hFileHandle, INT64 nFilePos, int nSize,
+		const HandlerType& Handler, PVOID pCaller)
+	{
+		CIocpOverlappedData *pOvDataPtr = CreateOverlappedData(ITT_SEND, (HANDLE)hSocketHandle,
+			NULL, 0, 0, Handler, pCaller);
+
+		pOvDataPtr->Overlapped.Offset = (DWORD)nFilePos;
+		pOvDataPtr->Overlapped.OffsetHigh = (DWORD)(nFilePos >> 32);
+
+		int nErrorCode = m_pEngine->TransmitFile(hSocketHandle, hFileHandle, nSize,
+			(LPOVERLAPPED)pOvDataPtr);
+		if (nErrorCode != 0)
+			PostError(nErrorCode, pOvDataPtr);
+	}
+
 	void SendTo(SOCKET hSocketHandle, const CPeerAddress& PeerAddr,
 		PVOID pBuffer, int nSize, int nOffset,
 		const IOCP_CALLBACK_DEF& CallBackDef, PVOID pCaller, const CIocpParams& Params);
@@ -269,6 +634,141 @@ public:
 	int GetUsedBufferCount() { return m_BufferAlloc.GetUsedCount(); }
 };
 
+///////////////////////////////////////////////////////////////////////////////
+// CIocpTcpConnection - The connection accepted by CIocpTcpServer.
+//
+// The socket is non-blocking and associated with the iocp. Instead of a thread
+// or a select() loop per connection, WaitReadable() asks for one OnReadable
+// notification from the iocp worker threads; RecvBuffer() (async mode) then
+// reads what is available. An idle connection holds no buffer and no thread.
+
+class CIocpTcpConnection : public CTcpConnection
+{
+public:
+	friend struct CIocpReadableHandler;
+private:
+	CIocpTcpServer& m_Server;
+protected:
+	virtual void OnReadable(int nErrorCode);
+public:
+	CIocpTcpConnection(CIocpTcpServer& Server, SOCKET nSocketHandle, const CPeerAddress& PeerAddr);
+	virtual ~CIocpTcpConnection();
+
+	/// Asks for one notification when data or a close is pending on the connection.
+	/// The notification is one-shot, call WaitReadable() again to keep watching.
+	/// The connection may be deleted in the callback if it is not waiting again;
+	/// to delete a waiting connection, Disconnect() it and delete it in the callback.
+	void WaitReadable();
+
+	CIocpTcpServer& GetServer() { return m_Server; }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// CIocpTcpServer - The TCP server driven by the iocp.
+//
+// The OnAcceptConn callback receives CIocpTcpConnection objects; call
+// WaitReadable() on them to start receiving OnReadable notifications.
+
+class CIocpTcpServer : public CTcpServer
+{
+public:
+	friend class CIocpTcpConnection;
+private:
+	CIocpObject *m_pIocpObject;    // The iocp object used. NULL for the global one.
+	CCallBackDef<IOCP_TCPSVR_ON_READABLE_PROC> m_OnReadable;
+protected:
+	virtual CTcpConnection* CreateConnection(SOCKET nSocketHandle, const CPeerAddress& PeerAddr);
+	virtual void AcceptConnection(CTcpConnection *pConnection);
+public:
+	CIocpTcpServer();
+	virtual ~CIocpTcpServer();
+
+	/// Sets the iocp object used by the server. NULL for the global one.
+	void SetIocpObject(CIocpObject *pIocpObject) { m_pIocpObject = pIocpObject; }
+	CIocpObject& GetIocp() { return m_pIocpObject? *m_pIocpObject : CIocpObject::Instance(); }
+
+	/// Sets OnReadable callback.
+	void SetOnReadableCallBack(IOCP_TCPSVR_ON_READABLE_PROC pProc, void *pParam = NULL);
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// CIocpFileSink - Writes data blocks to a file through the iocp.
+//
+// The caller fills a block got from AcquireBlock() and hands it to CommitBlock(),
+// which writes it at the end of the data written so far with an overlapped write,
+// so no thread waits for the disk. At most GetBlockCount() blocks exist: when all
+// of them are being written, AcquireBlock() returns NULL and the OnBlockFree
+// callback is called once from an iocp worker thread as soon as one is free again.
+// Finish() calls the OnFinished callback when all the writes are done.
+//
+// Preallocate() sets the file size up front. NTFS runs a write that extends the
+// valid data of a file synchronously, so it also tries SetFileValidData(), which
+// only succeeds for callers with SE_MANAGE_VOLUME_NAME enabled.
+
+class CIocpFileSink
+{
+public:
+	friend struct CIocpFileSinkHandler;
+private:
+	struct CALLBACK_ENTRY
+	{
+		DWORD nThreadId;                // The thread running the callbacks.
+		bool bDestroyed;                // Set if the sink is deleted in the callbacks.
+	};
+
+private:
+	CIocpObject& m_IocpObject;
+	HANDLE m_hFileHandle;
+	int m_nBlockSize;
+	int m_nBlockCount;
+	CPointerList m_Blocks;              // All the blocks.
+	CPointerList m_FreeBlocks;          // The blocks not being filled or written.
+	INT64 m_nWritePos;                  // The file position of the next committed block.
+	int m_nPendingCount;                // The number of writes in progress.
+	int m_nBusyCount;                   // The number of writes whose callbacks are not finished.
+	HANDLE m_hIdleEvent;                // Signaled whenever m_nBusyCount drops.
+	CPointerList m_CallBackEntries;     // The completions running the callbacks (CALLBACK_ENTRY*).
+	int m_nErrorCode;                   // The first write error, 0 if none.
+	bool m_bWaitingBlock;               // AcquireBlock() returned NULL.
+	bool m_bFinishing;                  // Finish() is waiting for the writes.
+	CCriticalSection m_Lock;
+	CCallBackDef<IOCP_FILESINK_PROC> m_OnBlockFree;
+	CCallBackDef<IOCP_FILESINK_PROC> m_OnFinished;
+private:
+	void OnWriteComplete(PVOID pBlock, const CIocpTaskData& TaskData);
+	int GetCallBackCount(DWORD nThreadId);
+public:
+	CIocpFileSink(CIocpObject& IocpObject, int nBlockSize = IOCP_FILESINK_BLOCK_SIZE,
+		int nBlockCount = IOCP_FILESINK_BLOCK_COUNT);
+	virtual ~CIocpFileSink();
+
+	/// Creates the file (overwrites the existing one) and allocates the blocks.
+	bool Open(LPCTSTR lpszFileName);
+	/// Waits for the pending writes and their callbacks, and closes the file.
+	/// The callbacks running on the calling thread are not waited for.
+	void Close();
+	/// Sets the file size to nSize before the data is written.
+	bool Preallocate(INT64 nSize);
+
+	/// Returns a free block of GetBlockSize() bytes, or NULL if none is free.
+	PVOID AcquireBlock();
+	/// Writes the first nDataSize bytes of the block, the block is freed afterwards.
+	void CommitBlock(PVOID pBlock, int nDataSize);
+	/// Calls the OnFinished callback once all the committed blocks are written.
+	void Finish();
+
+	/// Sets the callback called when a block is free after AcquireBlock() failed.
+	void SetOnBlockFreeCallBack(IOCP_FILESINK_PROC pProc, void *pParam = NULL);
+	/// Sets the callback of Finish().
+	void SetOnFinishedCallBack(IOCP_FILESINK_PROC pProc, void *pParam = NULL);
+
+	bool IsOpened() const { return m_hFileHandle != INVALID_HANDLE_VALUE; }
+	int GetBlockSize() const { return m_nBlockSize; }
+	int GetBlockCount() const { return m_nBlockCount; }
+	INT64 GetWritePos() const { return m_nWritePos; }
+	int GetErrorCode() const { return m_nErrorCode; }
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 
 /// @}
@@ -76,6 +76,7 @@ private:
 	CNamedPipeConnList *m_pConnList;       // The accepted connection list for this server.
 	int m_nMaxConnCount;                   // The maximum connection limit. 0 for unlimited.
 	bool m_bUseIocp;                       // Determines whether to use iocp or not.
+	CIocpObject *m_pIocpObject;            // The iocp object used. NULL for the global one.
 private:
 	void InternalClose();
 	void StartListenerThread();
@@ -103,6 +104,10 @@ public:
 	int GetCurConnCount() const;
 	bool IsUseIocp() const { return m_bUseIocp; }
 	CNamedPipeConnList& GetConnList() { return *m_pConnList; }
+
+	/// Uses the specified iocp object instead of the global one. Call it before Open().
+	void SetIocpObject(CIocpObject *pIocpObject) { m_pIocpObject = pIocpObject; }
+	CIocpObject& GetIocp() { return (m_pIocpObject != NULL) ? *m_pIocpObject : GetIocpObject(); }
 };
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -57,6 +57,7 @@ class CListenerThread;
 class CUdpListenerThread;
 class CUdpListenerThreadPool;
 class CTcpListenerThread;
+class CDnsResolver;
 class CTcpConnectorPool;
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -106,6 +107,14 @@ const int SS_EHOSTDOWN          = WSAEHOSTDOWN;
 const int SS_EHOSTUNREACH       = WSAEHOSTUNREACH;
 const int SS_ENOTEMPTY          = WSAENOTEMPTY;
 
+const int UDP_DEF_RECV_BATCH_SIZE  = 16;   // The default number of datagrams received at a time.
+const int UDP_MAX_RECV_BATCH_SIZE  = 64;   // The max number of datagrams received at a time.
+
+const int DNS_CACHE_TTL            = 5*60*1000;  // The lifetime of a resolved name in the cache (ms).
+const int DNS_NEGATIVE_CACHE_TTL   = 10*1000;    // The lifetime of a failed lookup in the cache (ms).
+const int DNS_MAX_CACHE_SIZE       = 4096;       // The max number of names kept in the cache.
+const int DNS_RESOLVER_THREAD_COUNT = 2;         // The number of threads doing the async lookups.
+
 ///////////////////////////////////////////////////////////////////////////////
 // IFC Socket Error Message
 
@@ -202,15 +211,28 @@ struct CPeerAddress
 
 #pragma pack()
 
+///////////////////////////////////////////////////////////////////////////////
+// CUdpDatagram - One datagram of a batch.
+
+struct CUdpDatagram
+{
+	void *pBuffer;              // The datagram data.
+	int nSize;                  // The datagram size (bytes).
+	CPeerAddress PeerAddr;      // The source or destination address.
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 // Procedure Type Defines
 
 typedef void (*UDPSVR_ON_RECV_DATA_PROC)(void *pParam, void *pPacketBuffer,
 	int nPacketSize, const CPeerAddress& PeerAddr);
+typedef void (*UDPSVR_ON_RECV_BATCH_PROC)(void *pParam, const CUdpDatagram *pDatagrams,
+	int nCount);
 typedef void (*TCPSVR_ON_CREATE_CONN_PROC)(void *pParam, SOCKET nSocketHandle,
 	const CPeerAddress& PeerAddr, CTcpConnection*& pConnection);
 typedef void (*TCPSVR_ON_ACCEPT_CONN_PROC)(void *pParam, CTcpConnection *pConnection);
 typedef void (*TCPCP_ON_RESULT_PROC)(void *pParam, CTcpClient *pTcpClient, bool bSuccess);
+typedef void (*DNS_ON_RESOLVED_PROC)(void *pParam, LPCTSTR lpszHost, DWORD nIp, bool bSuccess);
 
 ///////////////////////////////////////////////////////////////////////////////
 // Misc Routines
@@ -237,6 +259,7 @@ void GetLocalIpList(CStrList& IpList);
 /// Returns the local machine IP address.
 CString GetLocalIp();
 /// Resolves the host name and return the IP address, returns empty string if failed.
+/// The result is taken from the global CDnsResolver cache when possible.
 CString LookupHostAddr(LPCTSTR lpszHost);
 /// Throws the socket exception of the last error.
 void IfcThrowSocketLastError();
@@ -245,6 +268,10 @@ void IfcThrowSocketLastError();
 CTcpConnectorPool& GetTcpConnectorPoolObject();
 // Delete the global CTcpConnectorPool object.
 void DeleteTcpConnectorPoolObject();
+// Returns the global CDnsResolver object.
+CDnsResolver& GetDnsResolverObject();
+// Delete the global CDnsResolver object.
+void DeleteDnsResolverObject();
 
 ///////////////////////////////////////////////////////////////////////////////
 /// CIfcSocket - The base socket class.
@@ -292,6 +319,8 @@ public:
 	void SetBlockMode(bool bValue);
 	/// Attachs the object to the specified socket handle.
 	void SetHandle(SOCKET nValue);
+	/// Detaches the socket handle from the object without closing it, and returns the handle.
+	SOCKET Detach();
 };
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -299,6 +328,8 @@ public:
 
 class CUdpSocket : public CIfcSocket
 {
+private:
+	int SendTo(void *pBuffer, int nSize, const SOCK_ADDR& Addr);
 public:
 	CUdpSocket()
 	{
@@ -312,7 +343,14 @@ public:
 	/// Receives data from the socket.
 	int RecvBuffer(void *pBuffer, int nSize, CPeerAddress& PeerAddr);
 	/// Sends data through the socket.
+	/// If the socket is non-blocking, waits for the send buffer to have room.
 	int SendBuffer(void *pBuffer, int nSize, const CPeerAddress& PeerAddr, int nSendTimes = 1);
+	/// Sends a batch of datagrams in order, and stops at the first one that fails.
+	///
+	/// @return
+	///   The number of datagrams sent. If it is less than @a nCount, the datagram at that
+	///   index failed (see IfcSocketGetLastError()) and the rest were not sent.
+	int SendBuffers(const CUdpDatagram *pDatagrams, int nCount);
 
 	virtual void Open();
 };
@@ -337,9 +375,12 @@ private:
 	int m_nLocalPort;
 	bool m_bForceBind;
 	CUdpListenerThreadPool *m_pListenerThreadPool;
+	DWORD_PTR m_nListenerAffinity;
+	int m_nRecvBatchSize;
 	CCallBackDef<UDPSVR_ON_RECV_DATA_PROC> m_OnRecvData;
+	CCallBackDef<UDPSVR_ON_RECV_BATCH_PROC> m_OnRecvBatch;
 private:
-	void DataReceived(void *pPacketBuffer, int nPacketSize, const CPeerAddress& PeerAddr);
+	void DataReceived(const CUdpDatagram *pDatagrams, int nCount);
 protected:
 	virtual void StartListenerThreads();
 	virtual void StopListenerThreads();
@@ -362,8 +403,20 @@ public:
 	/// Sets the listener thread count.
 	void SetListenerThreadCount(int nValue);
 
+	/// Returns the processors the listener threads may run on, 0 for any.
+	DWORD_PTR GetListenerAffinityMask() { return m_nListenerAffinity; }
+	/// Binds the listener threads to the processors in the mask, takes effect on the next Open().
+	void SetListenerAffinityMask(DWORD_PTR nValue) { m_nListenerAffinity = nValue; }
+
+	/// Returns the max number of datagrams a listener thread receives at a time.
+	int GetRecvBatchSize() { return m_nRecvBatchSize; }
+	/// Sets the max number of datagrams a listener thread receives at a time.
+	void SetRecvBatchSize(int nValue);
+
 	/// Sets OnRecvData callback.
 	void SetOnRecvDataCallBack(UDPSVR_ON_RECV_DATA_PROC pProc, void *pParam = NULL);
+	/// Sets OnRecvBatch callback. If set, it's called instead of OnRecvData.
+	void SetOnRecvBatchCallBack(UDPSVR_ON_RECV_BATCH_PROC pProc, void *pParam = NULL);
 };
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -466,6 +519,11 @@ public:
 	/// Checks the async connect state.
 	/// This function will never throw any exceptions.
 	int CheckAsyncConnectState(int nTimeOutMSecs = -1);
+
+	/// Attaches the client to a connected socket handle.
+	void Attach(SOCKET nSocketHandle, const CPeerAddress& PeerAddr);
+	/// Detaches the connected socket handle from the client without closing it.
+	SOCKET Detach();
 };
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -482,12 +540,12 @@ private:
 	int m_nLocalPort;
 	bool m_bForceBind;
 	CTcpListenerThread *m_pListenerThread;
+	DWORD_PTR m_nListenerAffinity;
 	CCallBackDef<TCPSVR_ON_CREATE_CONN_PROC> m_OnCreateConn;
 	CCallBackDef<TCPSVR_ON_ACCEPT_CONN_PROC> m_OnAcceptConn;
-private:
-	CTcpConnection* CreateConnection(SOCKET nSocketHandle, const CPeerAddress& PeerAddr);
-	void AcceptConnection(CTcpConnection *pConnection);
 protected:
+	virtual CTcpConnection* CreateConnection(SOCKET nSocketHandle, const CPeerAddress& PeerAddr);
+	virtual void AcceptConnection(CTcpConnection *pConnection);
 	virtual void StartListenerThread();
 	virtual void StopListenerThread();
 public:
@@ -507,6 +565,11 @@ public:
 
 	CTcpSocket& GetSocket() { return m_Socket; }
 
+	/// Returns the processors the listener thread may run on, 0 for any.
+	DWORD_PTR GetListenerAffinityMask() { return m_nListenerAffinity; }
+	/// Binds the listener thread to the processors in the mask, takes effect on the next Open().
+	void SetListenerAffinityMask(DWORD_PTR nValue) { m_nListenerAffinity = nValue; }
+
 	/// Sets OnCreateConn callback.
 	void SetOnCreateConnCallBack(TCPSVR_ON_CREATE_CONN_PROC pProc, void *pParam = NULL);
 	/// Sets OnAcceptConn callback.
@@ -554,6 +617,8 @@ private:
 	CPointerList m_ThreadList;
 	int m_nMaxThreadCount;
 	CCriticalSection m_Lock;
+	HANDLE m_hRecvEvent;        // Auto-reset, wakes up one listener thread per FD_READ.
+	HANDLE m_hStopEvent;
 public:
 	explicit CUdpListenerThreadPool(CUdpServer *pUdpServer);
 	virtual ~CUdpListenerThreadPool();
@@ -568,6 +633,8 @@ public:
 	void SetMaxThreadCount(int nValue) { m_nMaxThreadCount = nValue; }
 
 	CUdpServer& GetUdpServer() { return *m_pUdpServer; }
+	HANDLE GetRecvEvent() { return m_hRecvEvent; }
+	HANDLE GetStopEvent() { return m_hStopEvent; }
 };
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -577,10 +644,108 @@ class CTcpListenerThread : public CListenerThread
 {
 private:
 	CTcpServer *m_pTcpServer;
+	WSAEVENT m_hAcceptEvent;
+	HANDLE m_hStopEvent;
+private:
+	void AcceptConnections();
 protected:
+	virtual void BeforeTerminate();
 	virtual void Execute();
 public:
 	explicit CTcpListenerThread(CTcpServer *pTcpServer);
+	virtual ~CTcpListenerThread();
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// CDnsResolver - The caching host name resolver.
+///
+/// Resolved names are kept for DNS_CACHE_TTL and failed lookups for DNS_NEGATIVE_CACHE_TTL.
+/// Concurrent lookups of the same name share one query. Names loaded from a hosts file
+/// override the system resolver and never expire.
+
+class CDnsResolver
+{
+public:
+	class CWorkerThread : public CThread
+	{
+	private:
+		CDnsResolver& m_Owner;
+	protected:
+		virtual void Execute() { m_Owner.Process(this); }
+	public:
+		CWorkerThread(CDnsResolver& Owner) : m_Owner(Owner) {}
+	};
+
+	friend class CWorkerThread;
+
+private:
+	typedef CCallBackDef<DNS_ON_RESOLVED_PROC> CALLBACK_ITEM;
+	typedef std::vector<CALLBACK_ITEM> CALLBACK_LIST;
+
+	struct CACHE_ITEM
+	{
+		DWORD nIp;                  // IP (Host byte order), 0 if the lookup failed
+		UINT nCacheTicks;           // Timestamp of the item cached
+		UINT nTimeToLive;           // The lifetime of the item (ms)
+	};
+
+	struct QUERY_ITEM
+	{
+		CString strHost;            // The host name (lowercase)
+		HANDLE hDoneEvent;          // Signaled when the query completes
+		int nRefCount;              // The owner plus the synchronous waiters
+		DWORD nIp;                  // The result
+		bool bSuccess;
+		CALLBACK_LIST Callbacks;    // The async waiters
+	};
+
+	typedef std::map<CString, CACHE_ITEM> CACHE_MAP;     // <Host, CACHE_ITEM>
+	typedef std::map<CString, QUERY_ITEM*> QUERY_MAP;    // <Host, QUERY_ITEM*>
+	typedef std::map<CString, DWORD> HOSTS_MAP;          // <Host, IP>
+	typedef std::deque<QUERY_ITEM*> QUERY_QUEUE;
+
+	CACHE_MAP m_Cache;
+	QUERY_MAP m_Queries;
+	HOSTS_MAP m_Hosts;
+	QUERY_QUEUE m_QueryQueue;          // Queries waiting for a worker thread
+	CCriticalSection m_Lock;
+	CCriticalSection m_NotifyLock;     // Held while the async waiters are called back
+	CSemaphoreObject m_QueueSemaphore; // Counts the items of m_QueryQueue
+	CObjectList<CWorkerThread> m_WorkerThreads;
+private:
+	void Process(CWorkerThread *pThread);
+	void StartWorkerThreads();
+	void StopWorkerThreads();
+	bool FindCached(const CString& strHost, DWORD& nIp, bool& bSuccess);
+	QUERY_ITEM* CreateQuery(const CString& strHost);
+	void ReleaseQuery(QUERY_ITEM *pQuery);
+	void ExecuteQuery(QUERY_ITEM *pQuery);
+	void PurgeCache();
+
+	static CString GetHostKey(LPCTSTR lpszHost);
+	static bool ParseIp(LPCTSTR lpszHost, DWORD& nIp);
+private:
+	CDnsResolver();
+	static std::auto_ptr<CDnsResolver> s_pSingleton;
+	static CCriticalSection s_SingletonLock;
+public:
+	virtual ~CDnsResolver();
+	static CDnsResolver& Instance();
+	static void Delete();
+
+	/// Resolves the host name, blocks until the result is available.
+	bool Lookup(LPCTSTR lpszHost, DWORD& nIp);
+	/// Resolves the host name asynchronously. The callback is invoked before returning
+	/// if the result is cached, otherwise it is invoked by the thread completing the lookup.
+	void Resolve(LPCTSTR lpszHost, DNS_ON_RESOLVED_PROC pOnResolvedProc, void *pProcParam = NULL);
+	/// Removes the pending async callbacks, none of them is running when returns.
+	void RemoveCallbacks(DNS_ON_RESOLVED_PROC pOnResolvedProc, void *pProcParam);
+
+	/// Loads the "IP name [name...]" lines of a hosts file as overrides.
+	bool LoadHostsFile(LPCTSTR lpszFileName);
+	void AddHost(LPCTSTR lpszHost, DWORD nIp);
+	void ClearHosts();
+	void ClearCache();
 };
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -597,6 +762,9 @@ public:
 		int nTimeOutMSecs;                 // The connect timeout (ms, -1 is infinite)
 		UINT nStartTicks;                  // Timestamp of task added
 		int nConnectState;                 // The connect state (enum ASYNC_CONNECT_STATE)
+		CTimerWheel::TIMER_ID nTimerId;    // The timeout timer, NULL if none
+		DWORD nConnectToIp;                // The resolved IP (Host byte order), 0 if not resolved yet
+		bool bResolving;                   // Waiting for CDnsResolver
 		CCallBackDef<TCPCP_ON_RESULT_PROC> OnResult;  // The callback
 	};
 
@@ -620,13 +788,21 @@ private:
 	TASK_LIST m_AddList;
 	CCriticalSection m_Lock;
 	CWorkerThread *m_pWorkerThread;
+	CTimerWheel m_TimerWheel;          // The connect timeouts
+	HANDLE m_hWakeEvent;               // Signaled on new tasks and on stopping
+	HANDLE m_hConnectEvent;            // Signaled on FD_CONNECT of any connecting socket
 private:
 	void Process(CWorkerThread *pThread);
 	void ProcessAddList();
 	void ProcessConnect();
+	void ProcessTimeOut();
 	void ProcessResult();
+	void StartConnect(TASK_ITEM *pTask);
+	void ReleaseTask(TASK_ITEM *pTask);
 
 	TASK_ITEM* FindTask(CTcpClient *pTcpClient);
+
+	static void OnDnsResolved(void *pParam, LPCTSTR lpszHost, DWORD nIp, bool bSuccess);
 private:
 	CTcpConnectorPool();
 	static std::auto_ptr<CTcpConnectorPool> s_pSingleton;
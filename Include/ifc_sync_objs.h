@@ -46,6 +46,17 @@ class CCriticalSection;
 class CMutexObject;
 class CEventObject;
 class CSemaphoreObject;
+class CLightMutex;
+class CRWLock;
+class CAutoLightLocker;
+class CAutoReadLocker;
+class CAutoWriteLocker;
+
+///////////////////////////////////////////////////////////////////////////////
+// Constant Definitions
+
+/// The default number of spins before a CLightMutex waiter goes to sleep.
+const int LIGHT_MUTEX_SPIN_COUNT = 4000;
 
 ///////////////////////////////////////////////////////////////////////////////
 /// CAutoLocker - The auto locker class.
@@ -180,6 +191,117 @@ public:
 	virtual bool Unlock(int nCount);
 };
 
+///////////////////////////////////////////////////////////////////////////////
+/// CLightMutex - The spin-then-park mutex.
+///
+/// An uncontended Lock()/Unlock() pair costs two interlocked operations and is inlined.
+/// A contended Lock() spins for a while, then sleeps on an event which is created on the
+/// first contention. Unlike CCriticalSection, the mutex is not recursive and not a
+/// CSyncObject, use CAutoLightLocker to lock it in a scope.
+
+class CLightMutex
+{
+private:
+	volatile LONG m_nState;            // 0: unlocked, 1: locked, 2: locked and may have waiters
+	HANDLE volatile m_hParkEvent;      // The waiters sleep on it
+	int m_nSpinCount;
+private:
+	CLightMutex(const CLightMutex&);
+	CLightMutex& operator = (const CLightMutex&);
+
+	void LockSlow();
+	void WakeWaiter();
+public:
+	/// Constructor. The spinning is skipped on a single processor machine.
+	explicit CLightMutex(int nSpinCount = LIGHT_MUTEX_SPIN_COUNT);
+	/// Destructor.
+	~CLightMutex();
+
+	/// Locks the mutex.
+	void Lock() { if (InterlockedCompareExchange(&m_nState, 1, 0) != 0) LockSlow(); }
+	/// Unlocks the mutex.
+	void Unlock() { if (InterlockedExchange(&m_nState, 0) == 2) WakeWaiter(); }
+	/// Try to perform the lock operation, returns false if already locked.
+	bool TryLock() { return InterlockedCompareExchange(&m_nState, 1, 0) == 0; }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// CRWLock - The reader-writer lock.
+///
+/// Any number of readers or one writer may hold the lock. A waiting writer blocks the new
+/// readers, so writers are not starved by a steady stream of readers. The lock is not
+/// recursive, and a reader cannot be upgraded to a writer.
+
+class CRWLock
+{
+private:
+	CLightMutex m_Lock;                // Guards the counters
+	HANDLE m_hReadSemaphore;           // The waiting readers sleep on it
+	HANDLE m_hWriteSemaphore;          // The waiting writers sleep on it
+	int m_nActiveCount;                // Readers holding the lock, or -1 if a writer holds it
+	int m_nWaitingReaders;
+	int m_nWaitingWriters;
+private:
+	CRWLock(const CRWLock&);
+	CRWLock& operator = (const CRWLock&);
+
+	void Release();
+public:
+	/// Constructor.
+	CRWLock();
+	/// Destructor.
+	~CRWLock();
+
+	/// Locks the object for reading.
+	void LockShared();
+	/// Locks the object for writing.
+	void LockExclusive();
+	/// Try to lock the object for reading, returns false if it would block.
+	bool TryLockShared();
+	/// Try to lock the object for writing, returns false if it would block.
+	bool TryLockExclusive();
+	/// Unlocks the object locked for reading.
+	void UnlockShared() { Release(); }
+	/// Unlocks the object locked for writing.
+	void UnlockExclusive() { Release(); }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// CAutoLightLocker - Locks a CLightMutex in a scope.
+
+class CAutoLightLocker
+{
+private:
+	CLightMutex& m_Mutex;
+public:
+	explicit CAutoLightLocker(CLightMutex& Mutex) : m_Mutex(Mutex) { m_Mutex.Lock(); }
+	~CAutoLightLocker() { m_Mutex.Unlock(); }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// CAutoReadLocker - Locks a CRWLock for reading in a scope.
+
+class CAutoReadLocker
+{
+private:
+	CRWLock& m_Lock;
+public:
+	explicit CAutoReadLocker(CRWLock& Lock) : m_Lock(Lock) { m_Lock.LockShared(); }
+	~CAutoReadLocker() { m_Lock.UnlockShared(); }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// CAutoWriteLocker - Locks a CRWLock for writing in a scope.
+
+class CAutoWriteLocker
+{
+private:
+	CRWLock& m_Lock;
+public:
+	explicit CAutoWriteLocker(CRWLock& Lock) : m_Lock(Lock) { m_Lock.LockExclusive(); }
+	~CAutoWriteLocker() { m_Lock.UnlockExclusive(); }
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 
 /// @}
@@ -0,0 +1,232 @@
+/****************************************************************************\
+*                                                                            *
+*  IFC (Iris Foundation Classes) Project                                     *
+*  http://github.com/haoxingeng/ifc                                          *
+*                                                                            *
+*  Copyright 2008 HaoXinGeng (haoxingeng@gmail.com)                          *
+*  All rights reserved.                                                      *
+*                                                                            *
+*  Licensed under the Apache License, Version 2.0 (the "License");           *
+*  you may not use this file except in compliance with the License.          *
+*  You may obtain a copy of the License at                                   *
+*                                                                            *
+*      http://www.apache.org/licenses/LICENSE-2.0                            *
+*                                                                            *
+*  Unless required by applicable law or agreed to in writing, software       *
+*  distributed under the License is distributed on an "AS IS" BASIS,         *
+*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+*  See the License for the specific language governing permissions and       *
+*  limitations under the License.                                            *
+*                                                                            *
+\****************************************************************************/
+
+/// @file ifc_task_pool.h
+/// Defines the work-stealing task pool classes.
+
+#pragma once
+
+#include "ifc_options.h"
+#include "ifc_global_defs.h"
+#include "ifc_classes.h"
+#include "ifc_thread.h"
+#include "ifc_sync_objs.h"
+
+/// The namespace of IFC.
+namespace ifc
+{
+
+/// @addtogroup Classes
+/// @{
+
+///////////////////////////////////////////////////////////////////////////////
+// Classes
+
+class CTask;
+class CProcTask;
+class CTaskPool;
+
+///////////////////////////////////////////////////////////////////////////////
+// Constant Definitions
+
+/// The max milliseconds an idle worker sleeps before looking for work again.
+const int TASK_POOL_IDLE_MSECS = 100;
+/// The number of chunks ParallelFor() splits the range into for each worker.
+const int TASK_POOL_CHUNKS_PER_WORKER = 4;
+
+///////////////////////////////////////////////////////////////////////////////
+// Type Definitions
+
+typedef void (*TASK_PROC)(void *pParam);
+typedef void (*PARALLEL_FOR_PROC)(void *pParam, int nIndex);
+
+///////////////////////////////////////////////////////////////////////////////
+// Misc Routines
+
+// Returns the global CTaskPool object, which is started on first access.
+CTaskPool& GetTaskPoolObject();
+// Delete the global CTaskPool object.
+void DeleteTaskPoolObject();
+
+///////////////////////////////////////////////////////////////////////////////
+/// CTask - The base class of task.
+///
+/// A task is reference counted. It is created with one reference owned by the creator, the
+/// pool holds another one while the task is queued. A task also serves as the future of its
+/// own result: the derived class keeps the result in its members, which are valid after Wait().
+
+class CTask
+{
+public:
+	friend class CTaskPool;
+private:
+	volatile LONG m_nRefCount;
+	volatile LONG m_bDone;                 // Indicates whether Execute() has returned.
+	bool m_bFailed;                        // Indicates whether Execute() threw an exception.
+	HANDLE volatile m_hDoneEvent;          // Created on the first Wait(), NULL before.
+	CTaskPool *m_pPool;                    // The pool the task is submitted to.
+	CCriticalSection m_Lock;
+	std::vector<CTask*> m_Continuations;   // Tasks submitted when this task is done.
+private:
+	void Run();
+	void NotifyDone();
+	HANDLE GetDoneEvent();
+protected:
+	/// The worker procedure of task.
+	virtual void Execute() = 0;
+public:
+	CTask();
+	virtual ~CTask();
+
+	void AddRef();
+	void Release();
+
+	/// Waits for the task to be done, returns false if timed out.
+	/// When called from a worker of the pool, runs other tasks while waiting.
+	bool Wait(DWORD nTimeOut = INFINITE);
+	/// Submits @a pTask to the same pool after this task is done.
+	void ContinueWith(CTask *pTask);
+
+	bool IsDone() const { return m_bDone != 0; }
+	bool IsFailed() const { return m_bFailed; }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// CProcTask - The task calling a procedure.
+
+class CProcTask : public CTask
+{
+private:
+	CCallBackDef<TASK_PROC> m_Proc;
+protected:
+	virtual void Execute() { m_Proc.pProc(m_Proc.pParam); }
+public:
+	CProcTask(TASK_PROC pProc, void *pParam)
+		{ m_Proc.pProc = pProc;  m_Proc.pParam = pParam; }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// CTaskPool - The work-stealing task pool.
+///
+/// Every worker has its own deque. A worker pushes the tasks it submits to the back of its
+/// deque and takes them from the back, idle workers steal from the front of the others.
+/// Tasks submitted from other threads (IOCP completion threads, for example) go to a shared
+/// queue, so offloading CPU work never blocks the submitter.
+
+class CTaskPool
+{
+public:
+	friend class CTask;
+
+	class CWorkerThread : public CThread
+	{
+	private:
+		CTaskPool& m_Pool;
+		int m_nIndex;
+	protected:
+		virtual void Execute() { m_Pool.Process(this); }
+	public:
+		CWorkerThread(CTaskPool& Pool, int nIndex) : m_Pool(Pool), m_nIndex(nIndex) {}
+		int GetIndex() const { return m_nIndex; }
+	};
+
+	friend class CWorkerThread;
+
+private:
+	typedef std::deque<CTask*> TASK_DEQUE;
+
+	struct WORKER_QUEUE
+	{
+		CCriticalSection Lock;
+		TASK_DEQUE Tasks;
+	};
+
+	struct PARALLEL_FOR_CONTEXT
+	{
+		CCallBackDef<PARALLEL_FOR_PROC> Proc;
+		volatile LONG nNext;               // The first index not taken yet
+		int nEnd;
+		int nGrainSize;
+		volatile LONG nRemainCount;        // The number of indexes not done yet
+		HANDLE hDoneEvent;                 // Signaled when nRemainCount drops to 0
+		volatile LONG nRefCount;           // The caller plus the tasks
+	};
+
+	class CParallelForTask : public CTask
+	{
+	private:
+		PARALLEL_FOR_CONTEXT *m_pContext;
+	protected:
+		virtual void Execute() { CTaskPool::RunParallelFor(*m_pContext); }
+	public:
+		CParallelForTask(PARALLEL_FOR_CONTEXT *pContext) : m_pContext(pContext)
+			{ InterlockedIncrement(&m_pContext->nRefCount); }
+		virtual ~CParallelForTask() { CTaskPool::ReleaseContext(m_pContext); }
+	};
+
+	int m_nThreadCount;
+	CObjectList<CWorkerThread> m_Threads;
+	WORKER_QUEUE *m_pQueues;           // One queue for each worker
+	WORKER_QUEUE m_SharedQueue;        // Tasks submitted by non-worker threads
+	DWORD m_nTlsIndex;                 // The CWorkerThread of the calling thread
+	HANDLE m_hWakeSemaphore;           // Released for idle workers on new tasks
+	volatile LONG m_nIdleCount;        // The number of workers waiting on m_hWakeSemaphore
+	volatile LONG m_nPendingCount;     // The number of tasks submitted but not done
+private:
+	void Process(CWorkerThread *pThread);
+	CTask* FindTask(int nIndex);
+	bool RunOneTask(int nIndex);
+	void WakeWorker();
+	int GetCurrentIndex();
+
+	static void RunParallelFor(PARALLEL_FOR_CONTEXT& Context);
+	static void ReleaseContext(PARALLEL_FOR_CONTEXT *pContext);
+public:
+	/// Constructor. The number of processors is used if @a nThreadCount <= 0.
+	CTaskPool(int nThreadCount = 0);
+	virtual ~CTaskPool();
+
+	void Start();
+	/// Stops the workers, the tasks not run yet are dropped.
+	void Stop();
+
+	/// Submits a task, the pool keeps a reference until the task is done.
+	void Submit(CTask *pTask);
+	/// Submits a procedure. The returned task must be released by the caller.
+	CTask* Submit(TASK_PROC pProc, void *pParam = NULL);
+
+	/// Calls @a pProc for each index in [nBegin, nEnd) in parallel, returns when all are done.
+	/// The calling thread runs a share of the range too.
+	void ParallelFor(int nBegin, int nEnd, PARALLEL_FOR_PROC pProc, void *pParam = NULL,
+		int nGrainSize = 0);
+
+	int GetThreadCount() const { return m_nThreadCount; }
+	int GetPendingCount() const { return m_nPendingCount; }
+	/// Indicates whether the calling thread is a worker of the pool.
+	bool IsWorkerThread() { return GetCurrentIndex() >= 0; }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+/// @}
+
+} // namespace ifc
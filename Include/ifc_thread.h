@@ -70,6 +70,9 @@ private:
 	THREAD_EXEC_PROC m_pExecProc;   // Used by CThread::Create().
 	void *m_pThreadParam;           // Used by CThread::Create().
 	bool m_bFinished;               // Indicates whether the execution of ThreadExecProc() is finished.
+	DWORD_PTR m_nAffinityMask;      // The processors the thread may run on, 0 for any.
+	UINT m_nStackSize;              // The stack size reserved for the thread, 0 for the default size.
+	CString m_strName;              // The name of the thread shown by the debuggers and profilers.
 protected:
 	/// Provides an virtual method to contain the code which executes when the thread is run.
 	/// Override Execute and insert the code that should be executed when the thread runs. Execute is
@@ -151,6 +154,12 @@ public:
 	int GetReturnValue() const { return m_nReturnValue; }
 	/// Determines whether the thread object is automatically destroyed when the thread terminates.
 	bool GetFreeOnTerminate() const { return m_bFreeOnTerminate; }
+	/// Returns the processors the thread may run on, 0 for any.
+	DWORD_PTR GetAffinityMask() const { return m_nAffinityMask; }
+	/// Returns the stack size reserved for the thread, 0 for the default size.
+	UINT GetStackSize() const { return m_nStackSize; }
+	/// Returns the name of the thread.
+	const CString& GetName() const { return m_strName; }
 	/// Returns the elapsed seconds since Terminate() or SetTerminated(true) was called.
 	int GetTermElapsedSecs() const;
 
@@ -162,6 +171,12 @@ public:
 	void SetReturnValue(int nValue) { m_nReturnValue = nValue; }
 	/// Specifies whether the thread object is automatically destroyed when the thread terminates.
 	void SetFreeOnTerminate(bool bValue) { m_bFreeOnTerminate = bValue; }
+	/// Binds the thread to the processors in the mask, 0 lets it run on any processor.
+	void SetAffinityMask(DWORD_PTR nValue);
+	/// Specifies the stack size reserved for the thread, takes effect only before Run().
+	void SetStackSize(UINT nValue) { m_nStackSize = nValue; }
+	/// Names the thread for the debuggers and profilers.
+	void SetName(LPCTSTR lpszName);
 };
 
 #else
@@ -185,6 +200,9 @@ private:
 	THREAD_EXEC_PROC m_pExecProc;   // Used by CThread::Create().
 	void *m_pThreadParam;           // Used by CThread::Create().
 	bool m_bFinished;               // Indicates whether the execution of ThreadExecProc() is finished.
+	DWORD_PTR m_nAffinityMask;      // The processors the thread may run on, 0 for any.
+	UINT m_nStackSize;              // The stack size reserved for the thread, 0 for the default size.
+	CString m_strName;              // The name of the thread shown by the debuggers and profilers.
 protected:
 	/// Provides an abstract virtual method to contain the code which executes when the thread is run.
 	/// Override Execute and insert the code that should be executed when the thread runs. Execute is 
@@ -263,6 +281,12 @@ public:
 	int GetReturnValue() const { return m_nReturnValue; }
 	/// Determines whether the thread object is automatically destroyed when the thread terminates. 
 	bool GetFreeOnTerminate() const { return m_bFreeOnTerminate; }
+	/// Returns the processors the thread may run on, 0 for any.
+	DWORD_PTR GetAffinityMask() const { return m_nAffinityMask; }
+	/// Returns the stack size reserved for the thread, 0 for the default size.
+	UINT GetStackSize() const { return m_nStackSize; }
+	/// Returns the name of the thread.
+	const CString& GetName() const { return m_strName; }
 	/// Returns the elapsed seconds since Terminate() or SetTerminated(true) was called.
 	int GetTermElapsedSecs() const;
 
@@ -274,6 +298,12 @@ public:
 	void SetReturnValue(int nValue) { m_nReturnValue = nValue; }
 	/// Specifies whether the thread object is automatically destroyed when the thread terminates. 
 	void SetFreeOnTerminate(bool bValue) { m_bFreeOnTerminate = bValue; }
+	/// Binds the thread to the processors in the mask, 0 lets it run on any processor.
+	void SetAffinityMask(DWORD_PTR nValue);
+	/// Specifies the stack size reserved for the thread, takes effect only before Run().
+	void SetStackSize(UINT nValue) { m_nStackSize = nValue; }
+	/// Names the thread for the debuggers and profilers.
+	void SetName(LPCTSTR lpszName);
 };
 
 #endif
@@ -30,6 +30,7 @@
 #include "ifc_classes.h"
 #include "ifc_thread.h"
 #include "ifc_sync_objs.h"
+#include "ifc_task_pool.h"
 
 /// The namespace of IFC.
 namespace ifc
@@ -50,9 +51,20 @@ class CDaemonJobPsr;
 
 /// The default sleep time in millisecond of thread processor.
 const int DEF_THREAD_PSR_SHEEP_MSECS = 1;
+/// The sleep time which makes the thread processor sleep until it is interrupted.
+const int THREAD_PSR_SLEEP_INFINITE = -1;
+
+///////////////////////////////////////////////////////////////////////////////
+// Type Definitions
+
+typedef void (*THREAD_PSR_TASK_PROC)(void *pParam);
 
 ///////////////////////////////////////////////////////////////////////////////
 /// CThreadProcessor - Thread processor class.
+///
+/// The worker thread runs the posted tasks and Process() in turn, and sleeps between the rounds
+/// unless NeedSleep() is cleared. With THREAD_PSR_SLEEP_INFINITE as the sleep time the processor
+/// is event driven: it only wakes up on Post(), InterruptSleep() or Stop().
 
 class CThreadProcessor
 {
@@ -79,6 +91,7 @@ public:
 		CSleepController();
 		~CSleepController();
 
+		/// Sleeps until timed out or interrupted, THREAD_PSR_SLEEP_INFINITE never times out.
 		void Sleep(int nMilliseconds);
 		void InterruptSleep();
 
@@ -87,23 +100,41 @@ public:
 	};
 
 private:
+	typedef std::deque< CCallBackDef<THREAD_PSR_TASK_PROC> > TASK_QUEUE;
+
 	CWorkerThread *m_pWorkerThread;
+	CString m_strWorkerName;           // The name of the worker thread
+	DWORD_PTR m_nWorkerAffinity;       // The processors the worker thread may run on, 0 for any
+	TASK_QUEUE m_TaskQueue;            // The posted tasks
+	CCriticalSection m_TaskLock;
+private:
+	bool RunPostedTasks();
 protected:
 	CSleepController m_SleepController;
 protected:
 	/// Invoked automatically by Stop() before terminate the processor thread.
 	virtual void BeforeTerminate() {}
-	/// The worker procedure of thread processor.
-	virtual void Process() = 0;
+	/// The worker procedure of thread processor, does nothing by default.
+	virtual void Process() {}
 public:
-	CThreadProcessor();
+	CThreadProcessor(int nSleepMSecs = DEF_THREAD_PSR_SHEEP_MSECS);
 	virtual ~CThreadProcessor();
 
 	/// Starts the thread processor.
 	void Start();
-	/// Stops the thread processor.
+	/// Stops the thread processor, the tasks not run yet are kept for the next Start().
 	void Stop();
 
+	/// Queues a task to be run by the worker thread, and wakes it up.
+	void Post(THREAD_PSR_TASK_PROC pProc, void *pParam = NULL);
+	/// Returns the number of the posted tasks not run yet.
+	int GetPostedCount();
+
+	/// Names the worker thread for the debuggers and profilers.
+	void SetWorkerName(LPCTSTR lpszName);
+	/// Binds the worker thread to the processors in the mask, 0 lets it run on any processor.
+	void SetWorkerAffinityMask(DWORD_PTR nValue);
+
 	/// Returns the current worker thread.
 	CThread& GetWorkerThread() { return *m_pWorkerThread; }
 	/// Returns the sleep controller.
@@ -123,6 +154,7 @@ private:
 	CDaemonJobPsr *m_pJobPsr;              // The own job processor.
 	UINT m_nLastProcTicks;                 // The last process time.
 	UINT m_nProcessCount;                  // The execution count of Process() currently (0-based).
+	CTask *m_pTask;                        // The task running the job on the task pool, NULL if none.
 protected:
 	UINT m_nDelay;                         // The delay time in millisecond of first process.
 	UINT m_nInterval;                      // The interval in millisecond of job execution.
@@ -144,13 +176,44 @@ public:
 ///////////////////////////////////////////////////////////////////////////////
 /// CDaemonJobPsr - The daemon job processor class.
 
+///
+/// The jobs are kept in a timer wheel ordered by their due time, and the worker thread
+/// sleeps until the next job is due or a job is added. If a task pool is set, the due jobs
+/// run on the pool, so a slow job does not delay the others. A job is never run concurrently
+/// with itself, its next run is scheduled after the current one returns.
+
 class CDaemonJobPsr : public CThreadProcessor
 {
+private:
+	class CJobTask : public CTask
+	{
+	private:
+		CDaemonJobPsr& m_JobPsr;
+		CDaemonJob *m_pJob;
+	protected:
+		virtual void Execute();
+	public:
+		CJobTask(CDaemonJobPsr& JobPsr, CDaemonJob *pJob) : m_JobPsr(JobPsr), m_pJob(pJob) {}
+	};
+
+	friend class CJobTask;
+
 private:
 	typedef CObjectList<CDaemonJob> CJobList;
+	typedef std::vector<CDaemonJob*> CJobArray;
 
 	CJobList m_JobList;
-	CJobList m_AddList;
+	CJobArray m_AddList;                   // Jobs added but not scheduled yet
+	CJobArray m_DoneList;                  // Jobs returned from the task pool
+	CCriticalSection m_Lock;
+	CTimerWheel m_TimerWheel;              // The due times of the idle jobs
+	CTaskPool *m_pTaskPool;
+private:
+	void ScheduleJob(CDaemonJob *pJob);
+	void RunJob(CDaemonJob *pJob);
+	void OnJobDone(CDaemonJob *pJob);
+	void WaitForTasks();
+	static void ExecuteJob(CDaemonJob *pJob);
 protected:
 	virtual void BeforeTerminate();
 	virtual void Process();
@@ -162,6 +225,11 @@ public:
 	void AddJob(CDaemonJob *pJob);
 	/// Stops the worker thread, and destroy all job objects.
 	void Terminate();
+
+	/// Runs the due jobs on @a pTaskPool, or on the worker thread if NULL (the default).
+	/// Must be called before Start().
+	void SetTaskPool(CTaskPool *pTaskPool) { m_pTaskPool = pTaskPool; }
+	CTaskPool* GetTaskPool() const { return m_pTaskPool; }
 };
 
 ///////////////////////////////////////////////////////////////////////////////
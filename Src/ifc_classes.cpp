@@ -5203,6 +5203,243 @@ CBits& CBits::operator = (const CBits& rhs)
 	return *this;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// CTimerWheel
+
+CTimerWheel::CTimerWheel(UINT nTickMSecs) :
+	m_nTickMSecs(Max(nTickMSecs, (UINT)1)),
+	m_nNextTick(0),
+	m_nLastTicks(GetTickCount()),
+	m_nElapsedMSecs(0),
+	m_nCount(0)
+{
+	for (int i = 0; i < ROOT_SIZE; i++)
+		InitSlot(m_RootSlots[i]);
+	for (int nLevel = 0; nLevel < LEVEL_COUNT; nLevel++)
+		for (int i = 0; i < LEVEL_SIZE; i++)
+			InitSlot(m_LevelSlots[nLevel][i]);
+}
+
+//-----------------------------------------------------------------------------
+
+CTimerWheel::~CTimerWheel()
+{
+	Clear();
+}
+
+//-----------------------------------------------------------------------------
+
+void CTimerWheel::InitSlot(TIMER_NODE& Slot)
+{
+	Slot.pPrev = &Slot;
+	Slot.pNext = &Slot;
+}
+
+//-----------------------------------------------------------------------------
+
+void CTimerWheel::LinkNode(TIMER_NODE& Slot, TIMER_NODE *pNode)
+{
+	pNode->pPrev = Slot.pPrev;
+	pNode->pNext = &Slot;
+	Slot.pPrev->pNext = pNode;
+	Slot.pPrev = pNode;
+}
+
+//-----------------------------------------------------------------------------
+
+void CTimerWheel::UnlinkNode(TIMER_NODE *pNode)
+{
+	pNode->pPrev->pNext = pNode->pNext;
+	pNode->pNext->pPrev = pNode->pPrev;
+}
+
+//-----------------------------------------------------------------------------
+
+void CTimerWheel::UpdateClock()
+{
+	UINT nTicks = GetTickCount();
+	m_nElapsedMSecs += (UINT)(nTicks - m_nLastTicks);
+	m_nLastTicks = nTicks;
+}
+
+//-----------------------------------------------------------------------------
+
+// Puts the node into the slot matching its distance from the next tick.
+void CTimerWheel::AddNode(TIMER_NODE *pNode)
+{
+	UINT nDiff = pNode->nExpireTick - m_nNextTick;
+
+	if ((int)nDiff < 0)
+	{
+		pNode->nExpireTick = m_nNextTick;
+		nDiff = 0;
+	}
+	else if (nDiff > MAX_DELAY_TICKS)
+	{
+		pNode->nExpireTick = m_nNextTick + MAX_DELAY_TICKS;
+		nDiff = MAX_DELAY_TICKS;
+	}
+
+	if (nDiff < ROOT_SIZE)
+	{
+		LinkNode(m_RootSlots[pNode->nExpireTick & (ROOT_SIZE - 1)], pNode);
+		return;
+	}
+
+	for (int nLevel = 0; nLevel < LEVEL_COUNT; nLevel++)
+	{
+		int nShift = ROOT_BITS + LEVEL_BITS * nLevel;
+		if (nLevel == LEVEL_COUNT - 1 || nDiff < ((UINT)1 << (nShift + LEVEL_BITS)))
+		{
+			LinkNode(m_LevelSlots[nLevel][(pNode->nExpireTick >> nShift) & (LEVEL_SIZE - 1)], pNode);
+			break;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+// Moves the timers of the current slot of the level down to the lower levels,
+// returns the index of that slot.
+int CTimerWheel::Cascade(int nLevel)
+{
+	int nIndex = (m_nNextTick >> (ROOT_BITS + LEVEL_BITS * nLevel)) & (LEVEL_SIZE - 1);
+	TIMER_NODE& Slot = m_LevelSlots[nLevel][nIndex];
+	TIMER_NODE *pNode = Slot.pNext;
+
+	InitSlot(Slot);
+	while (pNode != &Slot)
+	{
+		TIMER_NODE *pNext = pNode->pNext;
+		AddNode(pNode);
+		pNode = pNext;
+	}
+
+	return nIndex;
+}
+
+//-----------------------------------------------------------------------------
+
+void CTimerWheel::FreeSlot(TIMER_NODE& Slot)
+{
+	TIMER_NODE *pNode = Slot.pNext;
+	while (pNode != &Slot)
+	{
+		TIMER_NODE *pNext = pNode->pNext;
+		delete pNode;
+		pNode = pNext;
+	}
+	InitSlot(Slot);
+}
+
+//-----------------------------------------------------------------------------
+
+CTimerWheel::TIMER_ID CTimerWheel::Add(PVOID pData, UINT nDelayMSecs)
+{
+	UpdateClock();
+
+	TIMER_NODE *pNode = new TIMER_NODE();
+	pNode->pData = pData;
+	pNode->nExpireTick = (UINT)((m_nElapsedMSecs + nDelayMSecs + m_nTickMSecs - 1) / m_nTickMSecs);
+
+	AddNode(pNode);
+	m_nCount++;
+
+	return pNode;
+}
+
+//-----------------------------------------------------------------------------
+
+void CTimerWheel::Remove(TIMER_ID nTimerId)
+{
+	TIMER_NODE *pNode = (TIMER_NODE*)nTimerId;
+	if (pNode != NULL)
+	{
+		UnlinkNode(pNode);
+		delete pNode;
+		m_nCount--;
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+void CTimerWheel::Clear()
+{
+	for (int i = 0; i < ROOT_SIZE; i++)
+		FreeSlot(m_RootSlots[i]);
+	for (int nLevel = 0; nLevel < LEVEL_COUNT; nLevel++)
+		for (int i = 0; i < LEVEL_SIZE; i++)
+			FreeSlot(m_LevelSlots[nLevel][i]);
+
+	m_nCount = 0;
+}
+
+//-----------------------------------------------------------------------------
+
+void CTimerWheel::Advance(CPointerList& Expired)
+{
+	UpdateClock();
+
+	UINT nCurTick = (UINT)(m_nElapsedMSecs / m_nTickMSecs);
+
+	// Nothing to expire, just catches up with the clock.
+	if (m_nCount == 0)
+	{
+		m_nNextTick = nCurTick + 1;
+		return;
+	}
+
+	while ((int)(nCurTick - m_nNextTick) >= 0)
+	{
+		int nIndex = m_nNextTick & (ROOT_SIZE - 1);
+
+		if (nIndex == 0)
+		{
+			for (int nLevel = 0; nLevel < LEVEL_COUNT; nLevel++)
+				if (Cascade(nLevel) != 0) break;
+		}
+
+		TIMER_NODE& Slot = m_RootSlots[nIndex];
+		TIMER_NODE *pNode = Slot.pNext;
+
+		InitSlot(Slot);
+		while (pNode != &Slot)
+		{
+			TIMER_NODE *pNext = pNode->pNext;
+			Expired.Add(pNode->pData);
+			delete pNode;
+			m_nCount--;
+			pNode = pNext;
+		}
+
+		m_nNextTick++;
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+DWORD CTimerWheel::GetNextTimeOut() const
+{
+	if (m_nCount == 0) return INFINITE;
+
+	// Timers of the upper levels move into the root slots at the next cascade
+	// point (root index 0), so the scan stops there.
+	UINT nTick = m_nNextTick;
+	while ((nTick & (ROOT_SIZE - 1)) != 0)
+	{
+		const TIMER_NODE& Slot = m_RootSlots[nTick & (ROOT_SIZE - 1)];
+		if (Slot.pNext != &Slot) break;
+		nTick++;
+	}
+
+	UINT64 nElapsedMSecs = m_nElapsedMSecs + (UINT)(GetTickCount() - m_nLastTicks);
+	UINT nCurTick = (UINT)(nElapsedMSecs / m_nTickMSecs);
+	if ((int)(nTick - nCurTick) <= 0) return 0;
+
+	UINT64 nExpireMSecs = (nElapsedMSecs / m_nTickMSecs + (nTick - nCurTick)) * m_nTickMSecs;
+	return (DWORD)(nExpireMSecs - nElapsedMSecs);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // CLogger
 
@@ -3468,6 +3468,662 @@ CCipherContext CCipher_Gost::Context()
 	return context;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// CInflater
+
+// Base lengths and extra bits of the length symbols 257..285.
+static const short INFLATE_LEN_BASE[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const short INFLATE_LEN_EXTRA[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+
+// Base distances and extra bits of the distance symbols 0..29.
+static const short INFLATE_DIST_BASE[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+	8193, 12289, 16385, 24577 };
+static const short INFLATE_DIST_EXTRA[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+// The order in which the code length code lengths are stored.
+static const short INFLATE_CLEN_ORDER[19] = {
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+//-----------------------------------------------------------------------------
+
+CInflater::CInflater(INFLATE_FORMAT nFormat) :
+	m_nFormat(nFormat),
+	m_bFixedBuilt(false)
+{
+	m_Window.SetSize(WINDOW_SIZE);
+	Reset();
+}
+
+//-----------------------------------------------------------------------------
+
+void CInflater::Reset()
+{
+	m_nDataFormat = m_nFormat;
+	m_nState = IS_HEADER;
+	m_bLastBlock = false;
+	m_nStoredLeft = 0;
+	m_pLenCode = NULL;
+	m_pDistCode = NULL;
+
+	m_nInputSize = 0;
+	m_nInputPos = 0;
+	m_nBitBuf = 0;
+	m_nBitCount = 0;
+	SaveCheckpoint();
+
+	m_nWindowPos = 0;
+	m_nFlushPos = 0;
+	m_bWindowFull = false;
+	m_pOutStream = NULL;
+	m_nTotalOut = 0;
+	m_nCrc32 = 0;
+	m_nAdler32 = 1;
+}
+
+//-----------------------------------------------------------------------------
+// A step that runs out of input is undone and tried again on the next call, so
+// it never has to be resumed from the middle.
+
+void CInflater::SaveCheckpoint()
+{
+	m_Checkpoint.nInputPos = m_nInputPos;
+	m_Checkpoint.nBitBuf = m_nBitBuf;
+	m_Checkpoint.nBitCount = m_nBitCount;
+}
+
+//-----------------------------------------------------------------------------
+
+void CInflater::RestoreCheckpoint()
+{
+	m_nInputPos = m_Checkpoint.nInputPos;
+	m_nBitBuf = m_Checkpoint.nBitBuf;
+	m_nBitCount = m_Checkpoint.nBitCount;
+}
+
+//-----------------------------------------------------------------------------
+
+bool CInflater::NeedBits(int nCount)
+{
+	const BYTE *pInput = (const BYTE*)m_Input.Data();
+
+	while (m_nBitCount < nCount)
+	{
+		if (m_nInputPos >= m_nInputSize)
+			return false;
+		m_nBitBuf |= (DWORD)pInput[m_nInputPos++] << m_nBitCount;
+		m_nBitCount += 8;
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+
+bool CInflater::GetBits(int nCount, int& nValue)
+{
+	if (!NeedBits(nCount))
+		return false;
+
+	nValue = (int)(m_nBitBuf & ((1UL << nCount) - 1));
+	m_nBitBuf >>= nCount;
+	m_nBitCount -= nCount;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+
+void CInflater::AlignToByte()
+{
+	int nCount = m_nBitCount % 8;
+	m_nBitBuf >>= nCount;
+	m_nBitCount -= nCount;
+}
+
+//-----------------------------------------------------------------------------
+// Builds the canonical Huffman code from the code lengths of the symbols.
+// Incomplete codes are accepted when bAllowIncomplete is true, or when they
+// have a single code.
+
+bool CInflater::BuildHuffman(HUFFMAN& Huffman, const short *pLengths, int nCount, bool bAllowIncomplete)
+{
+	short Offsets[16];
+	int nLen, nSymbol;
+
+	memset(Huffman.Count, 0, sizeof(Huffman.Count));
+	memset(Huffman.Fast, 0, sizeof(Huffman.Fast));
+
+	for (nSymbol = 0; nSymbol < nCount; nSymbol++)
+		Huffman.Count[pLengths[nSymbol]]++;
+	if (Huffman.Count[0] == nCount)
+		return true;
+
+	int nLeft = 1;
+	for (nLen = 1; nLen < 16; nLen++)
+	{
+		nLeft <<= 1;
+		nLeft -= Huffman.Count[nLen];
+		if (nLeft < 0)
+			return false;
+	}
+
+	if (nLeft > 0 && !bAllowIncomplete && nCount - Huffman.Count[0] != 1)
+		return false;
+
+	Offsets[1] = 0;
+	for (nLen = 1; nLen < 15; nLen++)
+		Offsets[nLen + 1] = Offsets[nLen] + Huffman.Count[nLen];
+
+	for (nSymbol = 0; nSymbol < nCount; nSymbol++)
+		if (pLengths[nSymbol] != 0)
+			Huffman.Symbol[Offsets[pLengths[nSymbol]]++] = (short)nSymbol;
+
+	// The codes are stored from their first bit on, so the table is indexed by
+	// the bit-reversed codes.
+	int nCode = 0, nIndex = 0;
+	for (nLen = 1; nLen <= FAST_BITS; nLen++)
+	{
+		for (int i = 0; i < Huffman.Count[nLen]; i++)
+		{
+			int nReversed = 0;
+			for (int nBit = 0; nBit < nLen; nBit++)
+				nReversed |= ((nCode >> nBit) & 1) << (nLen - 1 - nBit);
+
+			WORD nEntry = (WORD)((Huffman.Symbol[nIndex] << 4) | nLen);
+			for (int j = nReversed; j < (1 << FAST_BITS); j += (1 << nLen))
+				Huffman.Fast[j] = nEntry;
+
+			nCode++;
+			nIndex++;
+		}
+		nCode <<= 1;
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Decodes a symbol. Short codes are looked up in one step, the others are
+// decoded bit by bit.
+
+CInflater::STEP_RESULT CInflater::Decode(const HUFFMAN& Huffman, int& nSymbol)
+{
+	if (NeedBits(FAST_BITS))
+	{
+		int nEntry = Huffman.Fast[m_nBitBuf & ((1 << FAST_BITS) - 1)];
+		if (nEntry != 0)
+		{
+			int nLen = nEntry & 15;
+			m_nBitBuf >>= nLen;
+			m_nBitCount -= nLen;
+			nSymbol = nEntry >> 4;
+			return SR_OK;
+		}
+	}
+
+	int nCode = 0, nFirst = 0, nIndex = 0;
+	for (int nLen = 1; nLen < 16; nLen++)
+	{
+		int nBit;
+		if (!GetBits(1, nBit))
+			return SR_NEED_INPUT;
+
+		nCode |= nBit;
+		int nCount = Huffman.Count[nLen];
+		if (nCode - nCount < nFirst)
+		{
+			nSymbol = Huffman.Symbol[nIndex + (nCode - nFirst)];
+			return SR_OK;
+		}
+
+		nIndex += nCount;
+		nFirst = (nFirst + nCount) << 1;
+		nCode <<= 1;
+	}
+
+	return SR_ERROR;
+}
+
+//-----------------------------------------------------------------------------
+
+inline void CInflater::PutByte(BYTE nByte)
+{
+	((PBYTE)m_Window.Data())[m_nWindowPos++] = nByte;
+
+	if (m_nWindowPos == WINDOW_SIZE)
+	{
+		FlushWindow();
+		m_nWindowPos = 0;
+		m_nFlushPos = 0;
+		m_bWindowFull = true;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Writes the bytes decoded since the last flush to the output stream.
+
+void CInflater::FlushWindow()
+{
+	int nSize = m_nWindowPos - m_nFlushPos;
+	if (nSize <= 0) return;
+
+	PBYTE pData = (PBYTE)m_Window.Data() + m_nFlushPos;
+	m_pOutStream->WriteBuffer(pData, nSize);
+
+	if (m_nDataFormat == IF_GZIP)
+		m_nCrc32 = CalcCrc32(pData, nSize, m_nCrc32 ^ 0xFFFFFFFF, CRC32_STANDARD);
+	else if (m_nDataFormat == IF_ZLIB)
+	{
+		DWORD s1 = m_nAdler32 & 0xFFFF, s2 = m_nAdler32 >> 16;
+		for (int i = 0; i < nSize; )
+		{
+			// 5552 bytes can be summed before the sums may overflow.
+			int nEnd = Min(nSize, i + 5552);
+			for (; i < nEnd; i++)
+			{
+				s1 += pData[i];
+				s2 += s1;
+			}
+			s1 %= 65521;
+			s2 %= 65521;
+		}
+		m_nAdler32 = (s2 << 16) | s1;
+	}
+
+	m_nTotalOut += nSize;
+	m_nFlushPos = m_nWindowPos;
+}
+
+//-----------------------------------------------------------------------------
+
+CInflater::STEP_RESULT CInflater::ReadHeader()
+{
+	int nValue, i;
+
+	if (m_nDataFormat == IF_AUTO)
+	{
+		if (!NeedBits(16))
+			return SR_NEED_INPUT;
+
+		int nByte0 = m_nBitBuf & 0xFF;
+		int nByte1 = (m_nBitBuf >> 8) & 0xFF;
+
+		if (nByte0 == 0x1F && nByte1 == 0x8B)
+			m_nDataFormat = IF_GZIP;
+		else if ((nByte0 & 0x0F) == 8 && (nByte0 >> 4) <= 7 && (nByte0 * 256 + nByte1) % 31 == 0)
+			m_nDataFormat = IF_ZLIB;
+		else
+			m_nDataFormat = IF_RAW;
+	}
+
+	if (m_nDataFormat == IF_GZIP)
+	{
+		int nId1, nId2, nMethod, nFlags;
+		if (!GetBits(8, nId1) || !GetBits(8, nId2) || !GetBits(8, nMethod) || !GetBits(8, nFlags))
+			return SR_NEED_INPUT;
+		if (nId1 != 0x1F || nId2 != 0x8B || nMethod != 8 || (nFlags & 0xE0) != 0)
+			return SR_ERROR;
+
+		// MTIME, XFL, OS
+		for (i = 0; i < 6; i++)
+			if (!GetBits(8, nValue)) return SR_NEED_INPUT;
+
+		// FEXTRA
+		if (nFlags & 0x04)
+		{
+			int nLenLo, nLenHi;
+			if (!GetBits(8, nLenLo) || !GetBits(8, nLenHi))
+				return SR_NEED_INPUT;
+			for (i = 0; i < (nLenLo | (nLenHi << 8)); i++)
+				if (!GetBits(8, nValue)) return SR_NEED_INPUT;
+		}
+
+		// FNAME, FCOMMENT
+		for (int nFlag = 0x08; nFlag <= 0x10; nFlag <<= 1)
+		{
+			if (nFlags & nFlag)
+			{
+				do
+				{
+					if (!GetBits(8, nValue)) return SR_NEED_INPUT;
+				}
+				while (nValue != 0);
+			}
+		}
+
+		// FHCRC
+		if (nFlags & 0x02)
+		{
+			if (!GetBits(16, nValue)) return SR_NEED_INPUT;
+		}
+	}
+	else if (m_nDataFormat == IF_ZLIB)
+	{
+		int nCmf, nFlg;
+		if (!GetBits(8, nCmf) || !GetBits(8, nFlg))
+			return SR_NEED_INPUT;
+
+		// Preset dictionaries (FDICT) are not used by HTTP.
+		if ((nCmf & 0x0F) != 8 || (nCmf * 256 + nFlg) % 31 != 0 || (nFlg & 0x20) != 0)
+			return SR_ERROR;
+	}
+
+	m_nState = IS_BLOCK_HEADER;
+	return SR_OK;
+}
+
+//-----------------------------------------------------------------------------
+
+CInflater::STEP_RESULT CInflater::ReadBlockHeader()
+{
+	int nFinal, nType;
+	if (!GetBits(1, nFinal) || !GetBits(2, nType))
+		return SR_NEED_INPUT;
+
+	m_bLastBlock = (nFinal != 0);
+
+	switch (nType)
+	{
+	case 0:    // stored
+		{
+			int nLen, nLenComplement;
+			AlignToByte();
+			if (!GetBits(16, nLen) || !GetBits(16, nLenComplement))
+				return SR_NEED_INPUT;
+			if (nLen != (~nLenComplement & 0xFFFF))
+				return SR_ERROR;
+
+			m_nStoredLeft = nLen;
+			m_nState = IS_STORED;
+			return SR_OK;
+		}
+
+	case 1:    // fixed Huffman codes
+		{
+			if (!m_bFixedBuilt)
+			{
+				short Lengths[288];
+				int i;
+
+				for (i = 0; i < 144; i++) Lengths[i] = 8;
+				for (; i < 256; i++) Lengths[i] = 9;
+				for (; i < 280; i++) Lengths[i] = 7;
+				for (; i < 288; i++) Lengths[i] = 8;
+				BuildHuffman(m_FixedLenCode, Lengths, 288, true);
+
+				for (i = 0; i < 30; i++) Lengths[i] = 5;
+				BuildHuffman(m_FixedDistCode, Lengths, 30, true);
+
+				m_bFixedBuilt = true;
+			}
+
+			m_pLenCode = &m_FixedLenCode;
+			m_pDistCode = &m_FixedDistCode;
+			m_nState = IS_CODES;
+			return SR_OK;
+		}
+
+	case 2:    // dynamic Huffman codes
+		return ReadDynamicTables();
+
+	default:
+		return SR_ERROR;
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+CInflater::STEP_RESULT CInflater::ReadDynamicTables()
+{
+	int nLenCount, nDistCount, nCodeCount, nValue;
+	if (!GetBits(5, nLenCount) || !GetBits(5, nDistCount) || !GetBits(4, nCodeCount))
+		return SR_NEED_INPUT;
+
+	nLenCount += 257;
+	nDistCount += 1;
+	nCodeCount += 4;
+	if (nLenCount > 286 || nDistCount > 30)
+		return SR_ERROR;
+
+	short Lengths[286 + 30];
+	memset(Lengths, 0, sizeof(Lengths));
+
+	for (int i = 0; i < nCodeCount; i++)
+	{
+		if (!GetBits(3, nValue)) return SR_NEED_INPUT;
+		Lengths[INFLATE_CLEN_ORDER[i]] = (short)nValue;
+	}
+
+	HUFFMAN CodeLenCode;
+	if (!BuildHuffman(CodeLenCode, Lengths, 19, false))
+		return SR_ERROR;
+
+	int nIndex = 0;
+	while (nIndex < nLenCount + nDistCount)
+	{
+		int nSymbol;
+		STEP_RESULT nResult = Decode(CodeLenCode, nSymbol);
+		if (nResult != SR_OK)
+			return nResult;
+
+		if (nSymbol < 16)
+			Lengths[nIndex++] = (short)nSymbol;
+		else
+		{
+			short nLen = 0;
+			int nRepeat;
+
+			if (nSymbol == 16)
+			{
+				if (nIndex == 0) return SR_ERROR;
+				nLen = Lengths[nIndex - 1];
+				if (!GetBits(2, nRepeat)) return SR_NEED_INPUT;
+				nRepeat += 3;
+			}
+			else if (nSymbol == 17)
+			{
+				if (!GetBits(3, nRepeat)) return SR_NEED_INPUT;
+				nRepeat += 3;
+			}
+			else
+			{
+				if (!GetBits(7, nRepeat)) return SR_NEED_INPUT;
+				nRepeat += 11;
+			}
+
+			if (nIndex + nRepeat > nLenCount + nDistCount)
+				return SR_ERROR;
+			while (nRepeat-- > 0)
+				Lengths[nIndex++] = nLen;
+		}
+	}
+
+	// A block without the end-of-block code never ends.
+	if (Lengths[256] == 0)
+		return SR_ERROR;
+
+	if (!BuildHuffman(m_LenCode, Lengths, nLenCount, false) ||
+		!BuildHuffman(m_DistCode, Lengths + nLenCount, nDistCount, false))
+		return SR_ERROR;
+
+	m_pLenCode = &m_LenCode;
+	m_pDistCode = &m_DistCode;
+	m_nState = IS_CODES;
+	return SR_OK;
+}
+
+//-----------------------------------------------------------------------------
+
+CInflater::STEP_RESULT CInflater::CopyStored()
+{
+	// The bytes already taken into the bit buffer come first.
+	while (m_nStoredLeft > 0 && m_nBitCount >= 8)
+	{
+		PutByte((BYTE)m_nBitBuf);
+		m_nBitBuf >>= 8;
+		m_nBitCount -= 8;
+		m_nStoredLeft--;
+	}
+
+	const BYTE *pInput = (const BYTE*)m_Input.Data();
+	while (m_nStoredLeft > 0 && m_nInputPos < m_nInputSize)
+	{
+		PutByte(pInput[m_nInputPos++]);
+		m_nStoredLeft--;
+	}
+
+	SaveCheckpoint();
+	if (m_nStoredLeft > 0)
+		return SR_NEED_INPUT;
+
+	m_nState = (m_bLastBlock ? IS_TRAILER : IS_BLOCK_HEADER);
+	return SR_OK;
+}
+
+//-----------------------------------------------------------------------------
+// Decodes the literals and matches of a block. The checkpoint is moved after
+// each of them, as their output can not be taken back.
+
+CInflater::STEP_RESULT CInflater::DecodeCodes()
+{
+	const PBYTE pWindow = (PBYTE)m_Window.Data();
+
+	while (true)
+	{
+		int nSymbol;
+		STEP_RESULT nResult = Decode(*m_pLenCode, nSymbol);
+		if (nResult != SR_OK)
+			return nResult;
+
+		if (nSymbol < 256)
+			PutByte((BYTE)nSymbol);
+		else if (nSymbol == 256)
+		{
+			m_nState = (m_bLastBlock ? IS_TRAILER : IS_BLOCK_HEADER);
+			return SR_OK;
+		}
+		else
+		{
+			int nLen, nDist, nDistSymbol;
+
+			nSymbol -= 257;
+			if (nSymbol >= 29)
+				return SR_ERROR;
+			if (!GetBits(INFLATE_LEN_EXTRA[nSymbol], nLen))
+				return SR_NEED_INPUT;
+			nLen += INFLATE_LEN_BASE[nSymbol];
+
+			nResult = Decode(*m_pDistCode, nDistSymbol);
+			if (nResult != SR_OK)
+				return nResult;
+			if (nDistSymbol >= 30)
+				return SR_ERROR;
+			if (!GetBits(INFLATE_DIST_EXTRA[nDistSymbol], nDist))
+				return SR_NEED_INPUT;
+			nDist += INFLATE_DIST_BASE[nDistSymbol];
+
+			if (!m_bWindowFull && nDist > m_nWindowPos)
+				return SR_ERROR;
+
+			while (nLen-- > 0)
+				PutByte(pWindow[(m_nWindowPos - nDist) & (WINDOW_SIZE - 1)]);
+		}
+
+		SaveCheckpoint();
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+CInflater::STEP_RESULT CInflater::ReadTrailer()
+{
+	int Bytes[8];
+	int nByteCount = (m_nDataFormat == IF_GZIP ? 8 : (m_nDataFormat == IF_ZLIB ? 4 : 0));
+
+	AlignToByte();
+	for (int i = 0; i < nByteCount; i++)
+		if (!GetBits(8, Bytes[i])) return SR_NEED_INPUT;
+
+	FlushWindow();
+
+	if (m_nDataFormat == IF_GZIP)
+	{
+		// CRC32 and ISIZE, little-endian.
+		DWORD nCrc32 = Bytes[0] | (Bytes[1] << 8) | (Bytes[2] << 16) | ((DWORD)Bytes[3] << 24);
+		DWORD nSize = Bytes[4] | (Bytes[5] << 8) | (Bytes[6] << 16) | ((DWORD)Bytes[7] << 24);
+		if (nCrc32 != m_nCrc32 || nSize != (DWORD)m_nTotalOut)
+			return SR_ERROR;
+	}
+	else if (m_nDataFormat == IF_ZLIB)
+	{
+		// ADLER32, big-endian.
+		DWORD nAdler32 = ((DWORD)Bytes[0] << 24) | (Bytes[1] << 16) | (Bytes[2] << 8) | Bytes[3];
+		if (nAdler32 != m_nAdler32)
+			return SR_ERROR;
+	}
+
+	m_nState = IS_DONE;
+	return SR_OK;
+}
+
+//-----------------------------------------------------------------------------
+// Decodes the data into the stream. Returns false if the data is corrupt.
+// The data after the end of the compressed stream is ignored.
+
+bool CInflater::Inflate(const void *pData, int nSize, CStream& OutStream)
+{
+	if (m_nState == IS_ERROR) return false;
+	if (m_nState == IS_DONE) return true;
+
+	// Keeps the input of the unfinished step, followed by the new data.
+	int nLeftSize = m_nInputSize - m_nInputPos;
+	if (nLeftSize > 0 && m_nInputPos > 0)
+		memmove(m_Input.Data(), m_Input.Data() + m_nInputPos, nLeftSize);
+	m_nInputSize = nLeftSize;
+	m_nInputPos = 0;
+
+	if (m_nInputSize + nSize > m_Input.GetSize())
+		m_Input.SetSize(m_nInputSize + nSize);
+	memcpy(m_Input.Data() + m_nInputSize, pData, nSize);
+	m_nInputSize += nSize;
+
+	m_pOutStream = &OutStream;
+	STEP_RESULT nResult = SR_OK;
+
+	while (nResult == SR_OK && m_nState != IS_DONE)
+	{
+		SaveCheckpoint();
+
+		switch (m_nState)
+		{
+		case IS_HEADER:        nResult = ReadHeader();       break;
+		case IS_BLOCK_HEADER:  nResult = ReadBlockHeader();  break;
+		case IS_STORED:        nResult = CopyStored();       break;
+		case IS_CODES:         nResult = DecodeCodes();      break;
+		case IS_TRAILER:       nResult = ReadTrailer();      break;
+		default:               nResult = SR_ERROR;           break;
+		}
+	}
+
+	if (nResult == SR_NEED_INPUT)
+		RestoreCheckpoint();
+	else if (nResult == SR_ERROR)
+		m_nState = IS_ERROR;
+
+	if (m_nState != IS_ERROR)
+		FlushWindow();
+	m_pOutStream = NULL;
+
+	return (m_nState != IS_ERROR);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 
 } // namespace ifc
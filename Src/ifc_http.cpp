@@ -55,10 +55,280 @@ CString GetHttpMethodStr(HTTP_METHOD_TYPE nHttpMethod)
 	}
 }
 
+//-----------------------------------------------------------------------------
+
+CString GetHttpStatusText(int nStatusCode)
+{
+	switch (nStatusCode)
+	{
+	case 100:  return TEXT("Continue");
+	case 200:  return TEXT("OK");
+	case 201:  return TEXT("Created");
+	case 204:  return TEXT("No Content");
+	case 206:  return TEXT("Partial Content");
+	case 301:  return TEXT("Moved Permanently");
+	case 302:  return TEXT("Found");
+	case 304:  return TEXT("Not Modified");
+	case 400:  return TEXT("Bad Request");
+	case 403:  return TEXT("Forbidden");
+	case 404:  return TEXT("Not Found");
+	case 405:  return TEXT("Method Not Allowed");
+	case 413:  return TEXT("Request Entity Too Large");
+	case 431:  return TEXT("Request Header Fields Too Large");
+	case 500:  return TEXT("Internal Server Error");
+	case 501:  return TEXT("Not Implemented");
+	case 503:  return TEXT("Service Unavailable");
+	default:   return TEXT("Unknown");
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CHttpHeaderParser
+
+// The names of HTTP_HEADER_ID.
+static const char* const HTTP_HEADER_NAMES[HHI_COUNT] =
+{
+	"Cache-Control", "Connection", "Content-Disposition", "Content-Encoding",
+	"Content-Language", "Content-Length", "Content-Range", "Content-Type",
+	"Content-Version", "Date", "Expires", "ETag",
+	"Last-Modified", "Pragma", "Transfer-Encoding", "Accept",
+	"Accept-Charset", "Accept-Encoding", "Accept-Language", "Host",
+	"From", "Referer", "User-Agent", "Range",
+	"Accept-Ranges", "Location", "Server", "Expect",
+};
+
+// The slots of the perfect hash used by FindHeaderIdT(). Each name of
+// HTTP_HEADER_NAMES falls in a slot of its own.
+static const HTTP_HEADER_ID HTTP_HEADER_HASH_TABLE[64] =
+{
+	HHI_UNKNOWN, HHI_REFERER, HHI_CACHE_CONTROL, HHI_SERVER,
+	HHI_TRANSFER_ENCODING, HHI_ACCEPT_RANGES, HHI_LOCATION, HHI_ETAG,
+	HHI_FROM, HHI_CONTENT_ENCODING, HHI_UNKNOWN, HHI_RANGE,
+	HHI_UNKNOWN, HHI_UNKNOWN, HHI_UNKNOWN, HHI_UNKNOWN,
+	HHI_UNKNOWN, HHI_UNKNOWN, HHI_PRAGMA, HHI_UNKNOWN,
+	HHI_UNKNOWN, HHI_UNKNOWN, HHI_UNKNOWN, HHI_UNKNOWN,
+	HHI_UNKNOWN, HHI_UNKNOWN, HHI_UNKNOWN, HHI_UNKNOWN,
+	HHI_CONTENT_LANGUAGE, HHI_UNKNOWN, HHI_CONTENT_LENGTH, HHI_UNKNOWN,
+	HHI_ACCEPT, HHI_UNKNOWN, HHI_CONTENT_DISPOSITION, HHI_UNKNOWN,
+	HHI_EXPECT, HHI_ACCEPT_ENCODING, HHI_CONTENT_VERSION, HHI_UNKNOWN,
+	HHI_UNKNOWN, HHI_UNKNOWN, HHI_ACCEPT_CHARSET, HHI_UNKNOWN,
+	HHI_CONTENT_TYPE, HHI_DATE, HHI_CONTENT_RANGE, HHI_UNKNOWN,
+	HHI_USER_AGENT, HHI_EXPIRES, HHI_UNKNOWN, HHI_UNKNOWN,
+	HHI_UNKNOWN, HHI_UNKNOWN, HHI_UNKNOWN, HHI_LAST_MODIFIED,
+	HHI_ACCEPT_LANGUAGE, HHI_UNKNOWN, HHI_UNKNOWN, HHI_UNKNOWN,
+	HHI_UNKNOWN, HHI_HOST, HHI_CONNECTION, HHI_UNKNOWN,
+};
+
+//-----------------------------------------------------------------------------
+
+template <class CharType>
+inline UINT LowerAsciiChar(CharType ch)
+{
+	return (ch >= 'A' && ch <= 'Z') ? (UINT)(ch + ('a' - 'A')) : (UINT)ch;
+}
+
+//-----------------------------------------------------------------------------
+// Hashes the length and three letters of the name, then compares the name with
+// the only well-known name in that slot.
+
+template <class CharType>
+HTTP_HEADER_ID FindHeaderIdT(const CharType *pName, int nLen)
+{
+	if (nLen <= 0) return HHI_UNKNOWN;
+
+	UINT nHash = nLen * 2 + LowerAsciiChar(pName[0]) * 17 + LowerAsciiChar(pName[nLen - 1]) +
+		LowerAsciiChar(pName[nLen / 2]) * 3;
+	HTTP_HEADER_ID nResult = HTTP_HEADER_HASH_TABLE[nHash & 63];
+
+	if (nResult != HHI_UNKNOWN)
+	{
+		const char *pKnownName = HTTP_HEADER_NAMES[nResult];
+		for (int i = 0; i < nLen; i++)
+		{
+			if (pKnownName[i] == 0 || LowerAsciiChar(pKnownName[i]) != LowerAsciiChar(pName[i]))
+				return HHI_UNKNOWN;
+		}
+		if (pKnownName[nLen] != 0)
+			nResult = HHI_UNKNOWN;
+	}
+
+	return nResult;
+}
+
+//-----------------------------------------------------------------------------
+
+CHttpHeaderParser::CHttpHeaderParser(int nMaxSize) :
+	m_nMaxSize(nMaxSize)
+{
+	Reset();
+}
+
+//-----------------------------------------------------------------------------
+
+void CHttpHeaderParser::Reset()
+{
+	m_pBuffer = NULL;
+	m_nScanPos = 0;
+	m_nHeaderSize = 0;
+	m_nStartLinePos = -1;
+	m_nStartLineLen = 0;
+	m_nState = HPR_NEED_MORE;
+	m_nCount = 0;
+
+	for (int i = 0; i < HHI_COUNT; i++)
+		m_KnownIndex[i] = -1;
+}
+
+//-----------------------------------------------------------------------------
+// Records a "name: value" line. Folded lines (starting with a space) are not
+// accepted, as RFC 7230 allows.
+
+bool CHttpHeaderParser::ParseLine(int nPos, int nLen)
+{
+	const char *pLine = m_pBuffer + nPos;
+
+	if (pLine[0] == ' ' || pLine[0] == '\t' || m_nCount >= HTTP_MAX_HEADER_COUNT)
+		return false;
+
+	const char *pColon = (const char*)memchr(pLine, ':', nLen);
+	if (pColon == NULL || pColon == pLine)
+		return false;
+
+	HEADER_SPAN& Span = m_Spans[m_nCount];
+
+	Span.nNamePos = nPos;
+	Span.nNameLen = (int)(pColon - pLine);
+	while (Span.nNameLen > 0 && (pLine[Span.nNameLen - 1] == ' ' || pLine[Span.nNameLen - 1] == '\t'))
+		Span.nNameLen--;
+
+	Span.nValuePos = (int)(pColon - m_pBuffer) + 1;
+	while (Span.nValuePos < nPos + nLen && (m_pBuffer[Span.nValuePos] == ' ' || m_pBuffer[Span.nValuePos] == '\t'))
+		Span.nValuePos++;
+
+	Span.nValueLen = nPos + nLen - Span.nValuePos;
+	while (Span.nValueLen > 0 && (m_pBuffer[Span.nValuePos + Span.nValueLen - 1] == ' ' ||
+		m_pBuffer[Span.nValuePos + Span.nValueLen - 1] == '\t'))
+		Span.nValueLen--;
+
+	HTTP_HEADER_ID nHeaderId = FindHeaderId(pLine, Span.nNameLen);
+	if (nHeaderId != HHI_UNKNOWN && m_KnownIndex[nHeaderId] < 0)
+		m_KnownIndex[nHeaderId] = m_nCount;
+
+	m_nCount++;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+
+CString CHttpHeaderParser::MakeString(int nPos, int nLen) const
+{
+	return (nLen > 0 ? CString(m_pBuffer + nPos, nLen) : CString());
+}
+
+//-----------------------------------------------------------------------------
+// Scans the complete lines not scanned yet. pBuffer must start with the header,
+// and nSize is the size of all the data received so far.
+
+HTTP_PARSE_RESULT CHttpHeaderParser::Feed(const char *pBuffer, int nSize)
+{
+	m_pBuffer = pBuffer;
+
+	while (m_nState == HPR_NEED_MORE)
+	{
+		const char *pLineEnd = (m_nScanPos < nSize ?
+			(const char*)memchr(pBuffer + m_nScanPos, '\n', nSize - m_nScanPos) : NULL);
+		if (pLineEnd == NULL)
+		{
+			if (nSize > m_nMaxSize)
+				m_nState = HPR_ERROR;
+			break;
+		}
+
+		int nLineEnd = (int)(pLineEnd - pBuffer);
+		int nLen = nLineEnd - m_nScanPos;
+		if (nLen > 0 && pBuffer[nLineEnd - 1] == '\r')
+			nLen--;
+
+		if (nLineEnd >= m_nMaxSize)
+			m_nState = HPR_ERROR;
+		else if (m_nStartLinePos < 0)
+		{
+			// Empty lines before the start line are ignored.
+			if (nLen > 0)
+			{
+				m_nStartLinePos = m_nScanPos;
+				m_nStartLineLen = nLen;
+			}
+		}
+		else if (nLen == 0)
+		{
+			m_nHeaderSize = nLineEnd + 1;
+			m_nState = HPR_DONE;
+		}
+		else if (!ParseLine(m_nScanPos, nLen))
+			m_nState = HPR_ERROR;
+
+		m_nScanPos = nLineEnd + 1;
+	}
+
+	return m_nState;
+}
+
+//-----------------------------------------------------------------------------
+// Fills the list with the "name: value" lines, as read by ParseHeaders().
+
+void CHttpHeaderParser::GetHeaders(CHttpHeaderStrList& Headers) const
+{
+	Headers.Clear();
+
+	for (int i = 0; i < m_nCount; i++)
+	{
+		const HEADER_SPAN& Span = m_Spans[i];
+		Headers.Add(MakeString(Span.nNamePos, Span.nValuePos + Span.nValueLen - Span.nNamePos));
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+CString CHttpHeaderParser::GetName(int nIndex) const
+{
+	return MakeString(m_Spans[nIndex].nNamePos, m_Spans[nIndex].nNameLen);
+}
+
+//-----------------------------------------------------------------------------
+
+CString CHttpHeaderParser::GetValue(int nIndex) const
+{
+	return MakeString(m_Spans[nIndex].nValuePos, m_Spans[nIndex].nValueLen);
+}
+
+//-----------------------------------------------------------------------------
+
+CString CHttpHeaderParser::GetValue(HTTP_HEADER_ID nHeaderId) const
+{
+	int nIndex = m_KnownIndex[nHeaderId];
+	return (nIndex >= 0 ? GetValue(nIndex) : CString());
+}
+
+//-----------------------------------------------------------------------------
+
+HTTP_HEADER_ID CHttpHeaderParser::FindHeaderId(const char *pName, int nLen)
+{
+	return FindHeaderIdT(pName, nLen);
+}
+
+//-----------------------------------------------------------------------------
+
+HTTP_HEADER_ID CHttpHeaderParser::FindHeaderId(const wchar_t *pName, int nLen)
+{
+	return FindHeaderIdT(pName, nLen);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // CHttpHeaderStrList
 
-CHttpHeaderStrList::CHttpHeaderStrList()
+CHttpHeaderStrList::CHttpHeaderStrList() :
+	m_bIndexValid(false)
 {
 	m_strNameValueSep = TEXT(":");
 }
@@ -72,9 +342,50 @@ CString CHttpHeaderStrList::MakeLine(LPCTSTR lpszName, LPCTSTR lpszValue) const
 
 //-----------------------------------------------------------------------------
 
+// Puts the line in the index if it is the first one of a well-known header.
+
+void CHttpHeaderStrList::IndexLine(int nIndex) const
+{
+	const CString& strLine = m_Items[nIndex];
+	int nPos = strLine.Find(m_strNameValueSep);
+
+	if (nPos > 0)
+	{
+		LPCTSTR lpszName = strLine;
+		while (nPos > 0 && _istspace(lpszName[0]))
+		{
+			lpszName++;
+			nPos--;
+		}
+		while (nPos > 0 && _istspace(lpszName[nPos - 1]))
+			nPos--;
+
+		HTTP_HEADER_ID nHeaderId = CHttpHeaderParser::FindHeaderId(lpszName, nPos);
+		if (nHeaderId != HHI_UNKNOWN && m_KnownIndex[nHeaderId] < 0)
+			m_KnownIndex[nHeaderId] = nIndex;
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+void CHttpHeaderStrList::BuildIndex() const
+{
+	for (int i = 0; i < HHI_COUNT; i++)
+		m_KnownIndex[i] = -1;
+	for (int i = 0; i < m_Items.GetCount(); i++)
+		IndexLine(i);
+
+	m_bIndexValid = true;
+}
+
+//-----------------------------------------------------------------------------
+
 int CHttpHeaderStrList::Add(LPCTSTR lpszStr)
 {
-	return m_Items.Add(lpszStr);
+	int nIndex = m_Items.Add(lpszStr);
+	if (m_bIndexValid)
+		IndexLine(nIndex);
+	return nIndex;
 }
 
 //-----------------------------------------------------------------------------
@@ -82,6 +393,7 @@ int CHttpHeaderStrList::Add(LPCTSTR lpszStr)
 void CHttpHeaderStrList::Delete(int nIndex)
 {
 	m_Items.Delete(nIndex);
+	m_bIndexValid = false;
 }
 
 //-----------------------------------------------------------------------------
@@ -89,6 +401,7 @@ void CHttpHeaderStrList::Delete(int nIndex)
 void CHttpHeaderStrList::Clear()
 {
 	m_Items.Clear();
+	m_bIndexValid = false;
 }
 
 //-----------------------------------------------------------------------------
@@ -107,7 +420,10 @@ void CHttpHeaderStrList::MoveToTop(const CStrList& NameList)
 	{
 		int nIndex = IndexOfName(NameList[i]);
 		if (nIndex >= 0)
+		{
 			m_Items.Move(nIndex, 0);
+			m_bIndexValid = false;
+		}
 	}
 }
 
@@ -115,6 +431,15 @@ void CHttpHeaderStrList::MoveToTop(const CStrList& NameList)
 
 int CHttpHeaderStrList::IndexOfName(LPCTSTR lpszName) const
 {
+	// Well-known headers are found in the index.
+	HTTP_HEADER_ID nHeaderId = CHttpHeaderParser::FindHeaderId(lpszName, lstrlen(lpszName));
+	if (nHeaderId != HHI_UNKNOWN)
+	{
+		if (!m_bIndexValid)
+			BuildIndex();
+		return m_KnownIndex[nHeaderId];
+	}
+
 	int nResult = -1;
 
 	for (int i = 0; i < m_Items.GetCount(); i++)
@@ -198,8 +523,9 @@ void CHttpHeaderStrList::SetValue(LPCTSTR lpszName, LPCTSTR lpszValue)
 	else
 	{
 		if (nIndex < 0)
-			nIndex = Add(TEXT(""));
-		m_Items.SetString(nIndex, MakeLine(strName, strValue));
+			Add(MakeLine(strName, strValue));
+		else
+			m_Items.SetString(nIndex, MakeLine(strName, strValue));
 	}
 }
 
@@ -559,1129 +885,3862 @@ HTTP_PROTO_VER CHttpResponse::GetResponseVersion() const
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// CCustomHttpClient
+// CHttpRecvBuffer
 
-CCustomHttpClient::CCustomHttpClient() :
-	m_Request(*this),
-	m_Response(*this),
-	m_bHandleRedirects(true),
-	m_nRedirectCount(0),
-	m_bLastKeepAlive(false)
+CHttpRecvBuffer::CHttpRecvBuffer(CTcpClient& TcpClient) :
+	m_TcpClient(TcpClient),
+	m_Buffer(DEF_BUFFER_SIZE),
+	m_nReadPos(0),
+	m_nWritePos(0)
 {
-	EnsureNetworkInited();
+	// nothing
 }
 
-CCustomHttpClient::~CCustomHttpClient()
+//-----------------------------------------------------------------------------
+// Returns the time left of nTimeOut since nStartTicks (a negative timeout never expires).
+
+static int GetRemainTimeOut(UINT nStartTicks, int nTimeOut)
 {
-	// nothing
+	if (nTimeOut < 0)
+		return nTimeOut;
+	return Max(0, nTimeOut - (int)GetTickDiff(nStartTicks, GetTickCount()));
 }
 
 //-----------------------------------------------------------------------------
+// Waits for the connection to be readable and receives as much as the buffer can hold.
+// Returns the number of bytes received, 0 if timeout, -1 if error.
 
-CPeerAddress CCustomHttpClient::GetPeerAddrFromUrl(CUrl& Url)
+int CHttpRecvBuffer::Fill(int nTimeOut)
 {
-	CPeerAddress PeerAddr(0, 0);
-
-	if (!Url.GetHost().IsEmpty())
+	int nDataSize = GetDataSize();
+	if (m_nReadPos > 0)
 	{
-		CString strIp = LookupHostAddr(Url.GetHost());
-		if (!strIp.IsEmpty())
-		{
-			PeerAddr.nIp = StringToIp(strIp);
-			PeerAddr.nPort = StrToInt(Url.GetPort(), DEFAULT_HTTP_PORT);
-		}
+		if (nDataSize > 0)
+			memmove(m_Buffer.Data(), m_Buffer.Data() + m_nReadPos, nDataSize);
+		m_nReadPos = 0;
+		m_nWritePos = nDataSize;
 	}
 
-	return PeerAddr;
-}
+	if (m_nWritePos >= m_Buffer.GetSize())
+		m_Buffer.SetSize(m_Buffer.GetSize() * 2);
 
-//-----------------------------------------------------------------------------
+	if (!m_TcpClient.IsConnected())
+		return -1;
 
-void CCustomHttpClient::MakeRequestBuffer(CBuffer& Buffer)
-{
-	m_Request.BuildHeaders();
+	SOCKET nSocketHandle = m_TcpClient.GetSocket().GetHandle();
+	fd_set fds;
+	struct timeval tv;
 
-	CString strText;
-	strText = m_Request.GetMethod() + TEXT(" ") + m_Request.GetUrl() +
-		TEXT(" HTTP/") + GetHttpProtoVerStr(m_Request.GetProtocolVersion()) +
-		TEXT("\r\n");
+	FD_ZERO(&fds);
+	FD_SET((DWORD)nSocketHandle, &fds);
+	tv.tv_sec = (nTimeOut >= 0 ? nTimeOut / 1000 : 0);
+	tv.tv_usec = (nTimeOut >= 0 ? (nTimeOut % 1000) * 1000 : 0);
 
-	for (int i = 0; i < m_Request.GetRawHeaders().GetCount(); i++)
-	{
-		CString s = m_Request.GetRawHeaders()[i];
-		if (!s.IsEmpty())
-			strText = strText + s + TEXT("\r\n");
-	}
+	int r = select(0, &fds, NULL, NULL, (nTimeOut >= 0 ? &tv : NULL));
+	if (r <= 0)
+		return r;
 
-	strText += TEXT("\r\n");
+	r = m_TcpClient.RecvBuffer(m_Buffer.Data() + m_nWritePos,
+		m_Buffer.GetSize() - m_nWritePos, false);
+	if (r > 0)
+		m_nWritePos += r;
 
-	CStringA strBuffer(strText);
-	Buffer.Assign(strBuffer.GetBuffer(), strBuffer.GetLength());
+	return r;
 }
 
 //-----------------------------------------------------------------------------
 
-int CCustomHttpClient::BeforeRequest(HTTP_METHOD_TYPE nHttpMethod, LPCTSTR lpszUrl,
-	CStream *pRequestContent, CStream *pResponseContent,
-	INT64 nReqStreamPos, INT64 nResStreamPos)
+int CHttpRecvBuffer::ReadUntil(const char *pDelimiter, CBuffer& Data, int nTimeOut)
 {
-	IFC_ASSERT(nHttpMethod == HMT_GET || nHttpMethod == HMT_POST);
+	int nDelimLen = (int)strlen(pDelimiter);
+	UINT nStartTicks = GetTickCount();
+	int nScanPos = 0;
 
-	if (nHttpMethod == HMT_POST)
-	{
-		m_TcpClient.Disconnect();
+	IFC_ASSERT(nDelimLen > 0);
 
-		// Currently when issuing a POST, IFC HTTP will automatically set the protocol
-		// to version 1.0 independently of the value it had initially. This is because
-		// there are some servers that don't respect the RFC to the full extent. In
-		// particular, they don't respect sending/not sending the Expect: 100-Continue
-		// header. Until we find an optimum solution that does NOT break the RFC, we
-		// will restrict POSTS to version 1.0.
-		m_Request.SetProtocolVersion(HPV_1_0);
+	while (true)
+	{
+		// Only the bytes received since the last scan need to be searched.
+		const char *pData = m_Buffer.Data() + m_nReadPos;
+		int nDataSize = GetDataSize();
 
-		// Usual posting request have default ContentType is "application/x-www-form-urlencoded"
-		if (m_Request.GetContentType().IsEmpty() ||
-			SameText(m_Request.GetContentType(), TEXT("text/html")))
+		for (int i = nScanPos; i + nDelimLen <= nDataSize; i++)
 		{
-			m_Request.SetContentType(TEXT("application/x-www-form-urlencoded"));
+			if (pData[i] == pDelimiter[0] && memcmp(pData + i, pDelimiter, nDelimLen) == 0)
+			{
+				int nSize = i + nDelimLen;
+				Data.Assign(pData, nSize);
+				m_nReadPos += nSize;
+				return EC_HTTP_SUCCESS;
+			}
 		}
-	}
+		nScanPos = Max(0, nDataSize - nDelimLen + 1);
 
-	CUrl Url(lpszUrl);
-	if (m_nRedirectCount == 0)
-	{
-		if (Url.GetHost().IsEmpty())
-			return EC_HTTP_URL_ERROR;
-		m_Url = Url;
-	}
-	else
-	{
-		if (Url.GetHost().IsEmpty())
-		{
-			CUrl OldUrl = m_Url;
-			m_Url = Url;
-			m_Url.SetProtocol(OldUrl.GetProtocol());
-			m_Url.SetHost(OldUrl.GetHost());
-			m_Url.SetPort(OldUrl.GetPort());
-		}
-		else
-			m_Url = Url;
-	}
+		if (nDataSize >= MAX_BUFFER_SIZE)
+			return EC_HTTP_RESPONSE_TEXT_ERROR;
 
-	if (pRequestContent)
-		pRequestContent->SetPosition(nReqStreamPos);
-	if (pResponseContent)
-	{
-		pResponseContent->SetSize(nResStreamPos);
-		pResponseContent->SetPosition(nResStreamPos);
+		int nRemainTimeOut = GetRemainTimeOut(nStartTicks, nTimeOut);
+		int r = Fill(nRemainTimeOut);
+		if (r < 0)
+			return EC_HTTP_SOCKET_ERROR;
+		if (r == 0 && nRemainTimeOut == 0)
+			return EC_HTTP_RECV_TIMEOUT;
 	}
+}
 
-	m_Request.SetMethod(GetHttpMethodStr(nHttpMethod));
-	m_Request.SetUrl(m_Url.GetUrl(CUrl::URL_PATH | CUrl::URL_FILENAME | CUrl::URL_PARAMS));
-
-	//if (m_Request.GetReferer().IsEmpty())
-	//	m_Request.SetReferer(m_Url.GetUrl(CUrl::URL_ALL & ~(CUrl::URL_FILENAME | CUrl::URL_BOOKMARK | CUrl::URL_PARAMS)));
-
-	int nPort = StrToInt(Url.GetPort(), DEFAULT_HTTP_PORT);
-	m_Request.SetHost(nPort == DEFAULT_HTTP_PORT ?
-		m_Url.GetHost() : m_Url.GetHost() + TEXT(":") + IntToStr(nPort));
+//-----------------------------------------------------------------------------
 
-	m_Request.SetContentLength(pRequestContent?
-		pRequestContent->GetSize() - pRequestContent->GetPosition() : -1);
-	m_Request.SetContentStream(pRequestContent);
+int CHttpRecvBuffer::ReadLine(CString& strLine, int nTimeOut)
+{
+	CBuffer Line;
+	int nResult = ReadUntil("\r\n", Line, nTimeOut);
 
-	m_Response.Clear();
-	m_Response.SetContentStream(pResponseContent);
+	if (nResult == EC_HTTP_SUCCESS)
+	{
+		std::string s;
+		if (Line.GetSize() > 2)
+			s.assign(Line.Data(), Line.GetSize() - 2);
+		strLine = CA2T(s.c_str());
+	}
 
-	return EC_HTTP_SUCCESS;
+	return nResult;
 }
 
 //-----------------------------------------------------------------------------
 
-void CCustomHttpClient::CheckResponseHeader(char *pBuffer, int nSize, bool& bFinished, bool& bError)
+int CHttpRecvBuffer::ReadExact(void *pBuffer, int nSize, int nTimeOut)
 {
-	bFinished = bError = false;
-
-	if (nSize >= 4)
-	{
-		char *p = pBuffer + nSize - 4;
-		if (p[0] == '\r' && p[1] == '\n' && p[2] == '\r' && p[3] == '\n')
-			bFinished = true;
+	int nReadSize = Read(pBuffer, nSize, nTimeOut);
 
-		if (_strnicmp(pBuffer, "HTTP", 4) != 0)
-			bError = true;
-	}
+	if (nReadSize == nSize)
+		return EC_HTTP_SUCCESS;
+	else if (nReadSize < 0 || !m_TcpClient.IsConnected())
+		return EC_HTTP_SOCKET_ERROR;
+	else
+		return EC_HTTP_RECV_TIMEOUT;
 }
 
 //-----------------------------------------------------------------------------
 
-bool CCustomHttpClient::ParseResponseHeader(void *pBuffer, int nSize)
+int CHttpRecvBuffer::ReadStream(CStream& Stream, INT64 nBytes, int nTimeOut)
 {
-	bool bResult = true;
-	CMemoryStream Stream;
-	Stream.Write(pBuffer, nSize);
+	const int BLOCK_SIZE = 1024*64;
 
-	CStrList Lines;
-	Lines.SetLineBreak(TEXT("\r\n"));
-	Stream.SetPosition(0);
-	Lines.LoadFromStream(Stream, false);
+	int nResult = EC_HTTP_SUCCESS;
+	UINT nStartTicks = GetTickCount();
+	INT64 nRemainSize = nBytes;
+	CBuffer Buffer((int)Min(nBytes, (INT64)BLOCK_SIZE));
 
-	if (Lines.GetCount() > 0)
+	while (nRemainSize > 0)
 	{
-		CString str = Lines[0];
-		if (str.Mid(0, 7).CompareNoCase(TEXT("HTTP/1.")) == 0)
-			m_Response.SetResponseText(str);
-		else
-			bResult = false;
-	}
-	else
-		bResult = false;
+		int nBlockSize = (int)Min(nRemainSize, (INT64)BLOCK_SIZE);
+		nResult = ReadExact(Buffer.Data(), nBlockSize, GetRemainTimeOut(nStartTicks, nTimeOut));
+		if (nResult != EC_HTTP_SUCCESS)
+			break;
 
-	if (bResult)
-	{
-		m_Response.GetRawHeaders().Clear();
-		for (int i = 1; i < Lines.GetCount(); i++)
-		{
-			if (!Lines[i].IsEmpty())
-				m_Response.GetRawHeaders().Add(Lines[i]);
-		}
-		m_Response.ParseHeaders();
+		nRemainSize -= nBlockSize;
+		Stream.WriteBuffer(Buffer.Data(), nBlockSize);
 	}
 
-	return bResult;
+	return nResult;
 }
 
 //-----------------------------------------------------------------------------
+// Small reads are served through the buffer, large ones are received in place.
 
-HTTP_NEXT_OP CCustomHttpClient::ProcessResponseHeader()
+int CHttpRecvBuffer::Read(void *pBuffer, int nSize, int nTimeOut)
 {
-	HTTP_NEXT_OP nResult = HNO_EXIT;
+	UINT nStartTicks = GetTickCount();
+	int nResult = 0;
 
-	int nResponseCode = m_Response.GetResponseCode();
-	int nResponseDigit = nResponseCode / 100;
+	while (nResult < nSize)
+	{
+		int nDataSize = GetDataSize();
+		if (nDataSize > 0)
+		{
+			int nCopySize = Min(nDataSize, nSize - nResult);
+			memcpy((char*)pBuffer + nResult, m_Buffer.Data() + m_nReadPos, nCopySize);
+			m_nReadPos += nCopySize;
+			nResult += nCopySize;
+			continue;
+		}
 
-	m_bLastKeepAlive = m_Response.GetKeepAlive();
+		int nRemainSize = nSize - nResult;
+		int nRemainTimeOut = GetRemainTimeOut(nStartTicks, nTimeOut);
 
-	// Handle Redirects
-	if ((nResponseDigit == 3 && nResponseCode != 304) ||
-		(!m_Response.GetLocation().IsEmpty() && nResponseCode != 201))
-	{
-		m_nRedirectCount++;
-		if (m_bHandleRedirects)
-			nResult = HNO_REDIRECT;
-	}
-	else if (nResponseDigit == 2)
-	{
-		nResult = HNO_RECV_CONTENT;
+		if (nRemainSize >= m_Buffer.GetSize())
+		{
+			int r = m_TcpClient.RecvBuffer((char*)pBuffer + nResult, nRemainSize, true, nRemainTimeOut);
+			if (r < 0)
+				return (nResult > 0 ? nResult : -1);
+			nResult += r;
+			break;
+		}
+		else
+		{
+			int r = Fill(nRemainTimeOut);
+			if (r < 0)
+				return (nResult > 0 ? nResult : -1);
+			if (r == 0 && nRemainTimeOut == 0)
+				break;
+		}
 	}
 
 	return nResult;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// CHttpContentDecoder
+
+CHttpContentDecoder::CHttpContentDecoder(CStream& Target, INFLATE_FORMAT nFormat) :
+	m_Inflater(nFormat),
+	m_Target(Target)
+{
+	// nothing
+}
+
 //-----------------------------------------------------------------------------
+// Corrupt data is not reported as a write error; the caller checks IsError(),
+// so the rest of the content can be drained from the connection.
 
-void CCustomHttpClient::TcpDisconnect(bool bForce)
+int CHttpContentDecoder::Write(const void *pBuffer, int nBytes)
 {
-	if (!m_bLastKeepAlive || bForce)
-		m_TcpClient.Disconnect();
+	m_Inflater.Inflate(pBuffer, nBytes, m_Target);
+	return nBytes;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// CHttpClient
+//-----------------------------------------------------------------------------
 
-CHttpClient::CHttpClient()
+bool CHttpContentDecoder::GetInflateFormat(const CString& strContentEncoding, INFLATE_FORMAT& nFormat)
 {
-	// nothing
+	CString strEncoding(strContentEncoding);
+	strEncoding.Trim();
+
+	if (SameText(strEncoding, TEXT("gzip")) || SameText(strEncoding, TEXT("x-gzip")))
+		nFormat = IF_GZIP;
+	// Some servers send raw deflate data instead of the zlib format of RFC 2616.
+	else if (SameText(strEncoding, TEXT("deflate")))
+		nFormat = IF_AUTO;
+	else
+		return false;
+
+	return true;
 }
 
-CHttpClient::~CHttpClient()
+///////////////////////////////////////////////////////////////////////////////
+// CHttpConnectionPool
+
+std::auto_ptr<CHttpConnectionPool> CHttpConnectionPool::s_pSingleton(NULL);
+CCriticalSection CHttpConnectionPool::s_SingletonLock;
+
+//-----------------------------------------------------------------------------
+
+CHttpConnectionPool::CHttpConnectionPool() :
+	m_nIdleTimeOut(HTTP_CONN_POOL_IDLE_TIMEOUT),
+	m_nMaxPerHost(HTTP_CONN_POOL_MAX_PER_HOST),
+	m_nIdleCount(0),
+	m_nLastSweepTicks(GetTickCount())
 {
 	// nothing
 }
 
 //-----------------------------------------------------------------------------
 
-int CHttpClient::ReadLine(CString& strLine, int nTimeOut)
+CHttpConnectionPool::~CHttpConnectionPool()
 {
-	int nResult = EC_HTTP_SUCCESS;
-	UINT nStartTicks = GetTickCount();
-	CMemoryStream Stream;
-	char ch;
+	Clear();
+}
 
-	while (true)
+//-----------------------------------------------------------------------------
+
+// Called by many CHttpClient threads at once, so the pool is created under the lock.
+CHttpConnectionPool& CHttpConnectionPool::Instance()
+{
+	if (s_pSingleton.get() == NULL)
 	{
-		int nRemainTimeOut = Max(0, nTimeOut - (int)GetTickDiff(nStartTicks, GetTickCount()));
+		CAutoLocker Locker(s_SingletonLock);
+		if (s_pSingleton.get() == NULL)
+			s_pSingleton.reset(new CHttpConnectionPool());
+	}
+	return *s_pSingleton;
+}
 
-		int r = m_TcpClient.RecvBuffer(&ch, sizeof(ch), true, nRemainTimeOut);
-		if (r < 0)
-		{
-			nResult = EC_HTTP_SOCKET_ERROR;
-			break;
-		}
-		else if (r > 0)
-		{
-			Stream.Write(&ch, sizeof(ch));
+//-----------------------------------------------------------------------------
 
-			char *pBuffer = Stream.GetMemory();
-			int nSize = (int)Stream.GetSize();
-			bool bFinished = false;
+void CHttpConnectionPool::Delete()
+{
+	CAutoLocker Locker(s_SingletonLock);
+	s_pSingleton.reset(NULL);
+}
 
-			if (nSize >= 2)
-			{
-				char *p = pBuffer + nSize - 2;
-				if (p[0] == '\r' && p[1] == '\n')
-					bFinished = true;
-			}
+//-----------------------------------------------------------------------------
 
-			if (bFinished)
-				break;
-		}
+INT64 CHttpConnectionPool::GetPeerAddrKey(const CPeerAddress& PeerAddr)
+{
+	return ((INT64)PeerAddr.nIp << 32) | (DWORD)PeerAddr.nPort;
+}
 
-		if (GetTickDiff(nStartTicks, GetTickCount()) > (UINT)nTimeOut)
-		{
-			nResult = EC_HTTP_RECV_TIMEOUT;
-			break;
-		}
-	}
+//-----------------------------------------------------------------------------
+// An idle connection must have nothing to read: readable data means either
+// the peer has closed it or it sent something we did not ask for.
 
-	if (nResult == EC_HTTP_SUCCESS)
-	{
-		std::string s;
-		if (Stream.GetSize() > 0)
-			s.assign(Stream.GetMemory(), (int)Stream.GetSize());
-		strLine = CA2T(s.c_str());
-	}
+bool CHttpConnectionPool::IsConnectionAlive(SOCKET nSocketHandle)
+{
+	char ch;
+	int r = recv(nSocketHandle, &ch, sizeof(ch), MSG_PEEK);
+	return (r < 0 && WSAGetLastError() == WSAEWOULDBLOCK);
+}
 
-	return nResult;
+//-----------------------------------------------------------------------------
+
+void CHttpConnectionPool::CloseConnection(SOCKET nSocketHandle)
+{
+	shutdown(nSocketHandle, SS_SD_BOTH);
+	closesocket(nSocketHandle);
 }
 
 //-----------------------------------------------------------------------------
+// Moves the expired connections of ConnList (oldest first) to Expired.
 
-int CHttpClient::ReadChunkSize(UINT& nChunkSize, int nTimeOut)
+void CHttpConnectionPool::RemoveExpired(CONN_LIST& ConnList, CONN_LIST& Expired)
 {
-	CString strLine;
-	int nResult = ReadLine(strLine, nTimeOut);
-	if (nResult == EC_HTTP_SUCCESS)
+	UINT nTicks = GetTickCount();
+
+	while (!ConnList.empty() &&
+		GetTickDiff(ConnList.front().nIdleTicks, nTicks) >= (UINT)m_nIdleTimeOut)
 	{
-		int i = strLine.Find(';');
-		if (i >= 0)
-			strLine = strLine.Left(i);
-		nChunkSize = (UINT)_tcstol(strLine, NULL, 16);
+		Expired.push_back(ConnList.front());
+		ConnList.pop_front();
+		m_nIdleCount--;
 	}
-
-	return nResult;
 }
 
 //-----------------------------------------------------------------------------
 
-int CHttpClient::ReadStream(CStream& Stream, int nBytes, int nTimeOut)
+bool CHttpConnectionPool::Lease(const CPeerAddress& PeerAddr, CTcpClient& TcpClient)
 {
-	const int BLOCK_SIZE = 1024*64;
-
-	int nResult = EC_HTTP_SUCCESS;
-	UINT nStartTicks = GetTickCount();
-	INT64 nRemainSize = nBytes;
-	CBuffer Buffer(BLOCK_SIZE);
+	INT64 nKey = GetPeerAddrKey(PeerAddr);
 
-	while (nRemainSize > 0)
+	while (true)
 	{
-		int nBlockSize = (int)Min(nRemainSize, (INT64)BLOCK_SIZE);
-		int nRemainTimeOut = Max(0, nTimeOut - (int)GetTickDiff(nStartTicks, GetTickCount()));
-		int nRecvSize = m_TcpClient.RecvBuffer(Buffer.Data(), nBlockSize, true, nRemainTimeOut);
+		SOCKET nSocketHandle = INVALID_SOCKET;
+		CONN_LIST Expired;
 
-		if (nRecvSize < 0)
 		{
-			nResult = EC_HTTP_SOCKET_ERROR;
-			break;
+			CAutoLocker Locker(m_Lock);
+
+			HOST_MAP::iterator iter = m_Hosts.find(nKey);
+			if (iter != m_Hosts.end())
+			{
+				CONN_LIST& ConnList = iter->second;
+				RemoveExpired(ConnList, Expired);
+
+				// The most recently used connection is the most likely to be alive.
+				if (!ConnList.empty())
+				{
+					nSocketHandle = ConnList.back().nSocketHandle;
+					ConnList.pop_back();
+					m_nIdleCount--;
+				}
+				if (ConnList.empty())
+					m_Hosts.erase(iter);
+			}
 		}
 
-		nRemainSize -= nRecvSize;
-		Stream.WriteBuffer(Buffer.Data(), nRecvSize);
+		for (int i = 0; i < (int)Expired.size(); i++)
+			CloseConnection(Expired[i].nSocketHandle);
 
-		if (GetTickDiff(nStartTicks, GetTickCount()) > (UINT)nTimeOut)
-		{
-			nResult = EC_HTTP_RECV_TIMEOUT;
+		if (nSocketHandle == INVALID_SOCKET)
 			break;
+
+		if (IsConnectionAlive(nSocketHandle))
+		{
+			TcpClient.Attach(nSocketHandle, PeerAddr);
+			return true;
 		}
+		else
+			CloseConnection(nSocketHandle);
 	}
 
-	return nResult;
+	return false;
 }
 
 //-----------------------------------------------------------------------------
 
-int CHttpClient::ExecuteHttpAction(HTTP_METHOD_TYPE nHttpMethod, LPCTSTR lpszUrl,
-	CStream *pRequestContent, CStream *pResponseContent)
+void CHttpConnectionPool::Release(CTcpClient& TcpClient)
 {
-	class CAutoFinalizer
-	{
-	private:
-		CHttpClient& m_Owner;
-	public:
-		CAutoFinalizer(CHttpClient& Owner) : m_Owner(Owner) {}
-		~CAutoFinalizer() { m_Owner.TcpDisconnect(); }
-	} AutoFinalizer(*this);
+	if (!TcpClient.IsConnected()) return;
 
-	bool bNeedRecvContent = (pResponseContent != NULL);
-	bool bCanRecvContent = false;
+	CPeerAddress PeerAddr = TcpClient.GetPeerAddr();
+	bool bAdded = false;
 
-	int nResult = ExecuteHttpRequest(nHttpMethod, lpszUrl, pRequestContent,
-		pResponseContent, bNeedRecvContent, bCanRecvContent);
+	{
+		CAutoLocker Locker(m_Lock);
 
-	if (nResult == EC_HTTP_SUCCESS && bNeedRecvContent)
-		nResult = RecvResponseContent();
+		CONN_LIST& ConnList = m_Hosts[GetPeerAddrKey(PeerAddr)];
+		if ((int)ConnList.size() < m_nMaxPerHost)
+		{
+			CONN_ITEM Item;
+			Item.nSocketHandle = TcpClient.Detach();
+			Item.nIdleTicks = GetTickCount();
+			ConnList.push_back(Item);
+			m_nIdleCount++;
+			bAdded = true;
+		}
+		else if (ConnList.empty())
+			m_Hosts.erase(GetPeerAddrKey(PeerAddr));
+	}
 
-	return nResult;
+	if (!bAdded)
+		TcpClient.Disconnect();
+
+	if (GetTickDiff(m_nLastSweepTicks, GetTickCount()) >= (UINT)m_nIdleTimeOut)
+		Sweep();
 }
 
 //-----------------------------------------------------------------------------
 
-int CHttpClient::ExecuteHttpRequest(HTTP_METHOD_TYPE nHttpMethod, LPCTSTR lpszUrl,
-	CStream *pRequestContent, CStream *pResponseContent, bool bNeedRecvContent,
-	bool& bCanRecvContent)
+void CHttpConnectionPool::Sweep()
 {
-	int nResult = EC_HTTP_SUCCESS;
+	CONN_LIST Expired;
 
-	CString strUrl(lpszUrl);
-	INT64 nReqStreamPos = (pRequestContent? pRequestContent->GetPosition() : 0);
-	INT64 nResStreamPos = (pResponseContent? pResponseContent->GetPosition() : 0);
-
-	bCanRecvContent = false;
-	m_nRedirectCount = 0;
-
-	while (true)
 	{
-		nResult = BeforeRequest(nHttpMethod, strUrl, pRequestContent, pResponseContent,
-			nReqStreamPos, nResStreamPos);
+		CAutoLocker Locker(m_Lock);
 
-		if (nResult == EC_HTTP_SUCCESS) nResult = TcpConnect();
-		if (nResult == EC_HTTP_SUCCESS) nResult = SendRequestHeader();
-		if (nResult == EC_HTTP_SUCCESS) nResult = SendRequestContent();
-		if (nResult == EC_HTTP_SUCCESS) nResult = RecvResponseHeader();
+		m_nLastSweepTicks = GetTickCount();
 
-		if (nResult == EC_HTTP_SUCCESS)
+		HOST_MAP::iterator iter = m_Hosts.begin();
+		while (iter != m_Hosts.end())
 		{
-			HTTP_NEXT_OP nNextOp = ProcessResponseHeader();
-
-			if (nNextOp == HNO_REDIRECT)
-			{
-				strUrl = m_Response.GetLocation();
-			}
-			else if (nNextOp == HNO_RECV_CONTENT)
-			{
-				bCanRecvContent = true;
-				break;
-			}
+			RemoveExpired(iter->second, Expired);
+			if (iter->second.empty())
+				m_Hosts.erase(iter++);
 			else
-				break;
+				++iter;
 		}
-		else
-			break;
 	}
 
-	if (nResult == EC_HTTP_SUCCESS && bNeedRecvContent && !bCanRecvContent)
-		nResult = EC_HTTP_CANNOT_RECV_CONTENT;
-
-	return nResult;
+	for (int i = 0; i < (int)Expired.size(); i++)
+		CloseConnection(Expired[i].nSocketHandle);
 }
 
 //-----------------------------------------------------------------------------
 
-int CHttpClient::TcpConnect()
+void CHttpConnectionPool::Clear()
 {
-	if (!m_bLastKeepAlive)
-		m_TcpClient.Disconnect();
+	CAutoLocker Locker(m_Lock);
 
-	if (m_TcpClient.IsConnected())
+	for (HOST_MAP::iterator iter = m_Hosts.begin(); iter != m_Hosts.end(); ++iter)
 	{
-		CPeerAddress PeerAddr = GetPeerAddrFromUrl(m_Url);
-		if (m_TcpClient.GetPeerAddr() != PeerAddr)
-			m_TcpClient.Disconnect();
+		CONN_LIST& ConnList = iter->second;
+		for (int i = 0; i < (int)ConnList.size(); i++)
+			CloseConnection(ConnList[i].nSocketHandle);
 	}
 
-	if (!m_TcpClient.IsConnected())
-	{
-		CPeerAddress PeerAddr = GetPeerAddrFromUrl(m_Url);
-		int nState = m_TcpClient.AsyncConnect(IpToString(PeerAddr.nIp),
-			PeerAddr.nPort, m_Options.nTcpConnectTimeOut);
+	m_Hosts.clear();
+	m_nIdleCount = 0;
+}
 
-		if (nState != ACS_CONNECTED)
-			return EC_HTTP_SOCKET_ERROR;
-	}
+///////////////////////////////////////////////////////////////////////////////
+// CCustomHttpClient
 
-	if (m_TcpClient.IsConnected())
-	{
-		SOCKET hHandle = m_TcpClient.GetSocket().GetHandle();
-		int nTimeOut = m_Options.nSocketOpTimeOut;
-		::setsockopt(hHandle, SOL_SOCKET, SO_SNDTIMEO, (char*)&nTimeOut, sizeof(nTimeOut));
-		::setsockopt(hHandle, SOL_SOCKET, SO_RCVTIMEO, (char*)&nTimeOut, sizeof(nTimeOut));
-	}
+CCustomHttpClient::CCustomHttpClient() :
+	m_Request(*this),
+	m_Response(*this),
+	m_bHandleRedirects(true),
+	m_nRedirectCount(0),
+	m_bLastKeepAlive(false)
+{
+	EnsureNetworkInited();
+}
 
-	return EC_HTTP_SUCCESS;
+CCustomHttpClient::~CCustomHttpClient()
+{
+	// nothing
 }
 
 //-----------------------------------------------------------------------------
 
-int CHttpClient::SendRequestHeader()
+CPeerAddress CCustomHttpClient::GetPeerAddrFromUrl(CUrl& Url)
 {
-	int nResult = EC_HTTP_SUCCESS;
-	CBuffer Buffer;
-	MakeRequestBuffer(Buffer);
+	CPeerAddress PeerAddr(0, 0);
+
+	if (!Url.GetHost().IsEmpty())
+	{
+		DWORD nIp;
+		if (CDnsResolver::Instance().Lookup(Url.GetHost(), nIp))
+		{
+			PeerAddr.nIp = nIp;
+			PeerAddr.nPort = StrToInt(Url.GetPort(), DEFAULT_HTTP_PORT);
+		}
+	}
+
+	return PeerAddr;
+}
+
+//-----------------------------------------------------------------------------
+
+void CCustomHttpClient::MakeRequestBuffer(CBuffer& Buffer)
+{
+	m_Request.BuildHeaders();
+
+	CString strText;
+	strText = m_Request.GetMethod() + TEXT(" ") + m_Request.GetUrl() +
+		TEXT(" HTTP/") + GetHttpProtoVerStr(m_Request.GetProtocolVersion()) +
+		TEXT("\r\n");
+
+	for (int i = 0; i < m_Request.GetRawHeaders().GetCount(); i++)
+	{
+		CString s = m_Request.GetRawHeaders()[i];
+		if (!s.IsEmpty())
+			strText = strText + s + TEXT("\r\n");
+	}
+
+	strText += TEXT("\r\n");
+
+	CStringA strBuffer(strText);
+	Buffer.Assign(strBuffer.GetBuffer(), strBuffer.GetLength());
+}
+
+//-----------------------------------------------------------------------------
+
+int CCustomHttpClient::BeforeRequest(HTTP_METHOD_TYPE nHttpMethod, LPCTSTR lpszUrl,
+	CStream *pRequestContent, CStream *pResponseContent,
+	INT64 nReqStreamPos, INT64 nResStreamPos)
+{
+	IFC_ASSERT(nHttpMethod == HMT_GET || nHttpMethod == HMT_POST);
+
+	if (nHttpMethod == HMT_POST)
+	{
+		m_TcpClient.Disconnect();
+
+		// Currently when issuing a POST, IFC HTTP will automatically set the protocol
+		// to version 1.0 independently of the value it had initially. This is because
+		// there are some servers that don't respect the RFC to the full extent. In
+		// particular, they don't respect sending/not sending the Expect: 100-Continue
+		// header. Until we find an optimum solution that does NOT break the RFC, we
+		// will restrict POSTS to version 1.0.
+		m_Request.SetProtocolVersion(HPV_1_0);
+
+		// Usual posting request have default ContentType is "application/x-www-form-urlencoded"
+		if (m_Request.GetContentType().IsEmpty() ||
+			SameText(m_Request.GetContentType(), TEXT("text/html")))
+		{
+			m_Request.SetContentType(TEXT("application/x-www-form-urlencoded"));
+		}
+	}
+
+	CUrl Url(lpszUrl);
+	if (m_nRedirectCount == 0)
+	{
+		if (Url.GetHost().IsEmpty())
+			return EC_HTTP_URL_ERROR;
+		m_Url = Url;
+	}
+	else
+	{
+		if (Url.GetHost().IsEmpty())
+		{
+			CUrl OldUrl = m_Url;
+			m_Url = Url;
+			m_Url.SetProtocol(OldUrl.GetProtocol());
+			m_Url.SetHost(OldUrl.GetHost());
+			m_Url.SetPort(OldUrl.GetPort());
+		}
+		else
+			m_Url = Url;
+	}
+
+	if (pRequestContent)
+		pRequestContent->SetPosition(nReqStreamPos);
+	if (pResponseContent)
+	{
+		pResponseContent->SetSize(nResStreamPos);
+		pResponseContent->SetPosition(nResStreamPos);
+	}
+
+	m_Request.SetMethod(GetHttpMethodStr(nHttpMethod));
+	m_Request.SetUrl(m_Url.GetUrl(CUrl::URL_PATH | CUrl::URL_FILENAME | CUrl::URL_PARAMS));
+
+	//if (m_Request.GetReferer().IsEmpty())
+	//	m_Request.SetReferer(m_Url.GetUrl(CUrl::URL_ALL & ~(CUrl::URL_FILENAME | CUrl::URL_BOOKMARK | CUrl::URL_PARAMS)));
+
+	int nPort = StrToInt(Url.GetPort(), DEFAULT_HTTP_PORT);
+	m_Request.SetHost(nPort == DEFAULT_HTTP_PORT ?
+		m_Url.GetHost() : m_Url.GetHost() + TEXT(":") + IntToStr(nPort));
+
+	m_Request.SetContentLength(pRequestContent?
+		pRequestContent->GetSize() - pRequestContent->GetPosition() : -1);
+	m_Request.SetContentStream(pRequestContent);
+
+	m_Response.Clear();
+	m_Response.SetContentStream(pResponseContent);
+
+	return EC_HTTP_SUCCESS;
+}
+
+//-----------------------------------------------------------------------------
+
+void CCustomHttpClient::CheckResponseHeader(char *pBuffer, int nSize, bool& bFinished, bool& bError)
+{
+	bFinished = bError = false;
+
+	if (nSize >= 4)
+	{
+		char *p = pBuffer + nSize - 4;
+		if (p[0] == '\r' && p[1] == '\n' && p[2] == '\r' && p[3] == '\n')
+			bFinished = true;
+
+		if (_strnicmp(pBuffer, "HTTP", 4) != 0)
+			bError = true;
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+bool CCustomHttpClient::ParseResponseHeader(void *pBuffer, int nSize)
+{
+	bool bResult = true;
+	CHttpHeaderParser Parser;
+
+	if (Parser.Feed((const char*)pBuffer, nSize) == HPR_DONE)
+	{
+		CString str = Parser.GetStartLine();
+		if (str.Mid(0, 7).CompareNoCase(TEXT("HTTP/1.")) == 0)
+			m_Response.SetResponseText(str);
+		else
+			bResult = false;
+	}
+	else
+		bResult = false;
+
+	if (bResult)
+	{
+		Parser.GetHeaders(m_Response.GetRawHeaders());
+		m_Response.ParseHeaders();
+	}
+
+	return bResult;
+}
+
+//-----------------------------------------------------------------------------
+
+HTTP_NEXT_OP CCustomHttpClient::ProcessResponseHeader()
+{
+	HTTP_NEXT_OP nResult = HNO_EXIT;
+
+	int nResponseCode = m_Response.GetResponseCode();
+	int nResponseDigit = nResponseCode / 100;
+
+	m_bLastKeepAlive = m_Response.GetKeepAlive();
+
+	// Handle Redirects
+	if ((nResponseDigit == 3 && nResponseCode != 304) ||
+		(!m_Response.GetLocation().IsEmpty() && nResponseCode != 201))
+	{
+		m_nRedirectCount++;
+		if (m_bHandleRedirects)
+			nResult = HNO_REDIRECT;
+	}
+	else if (nResponseDigit == 2)
+	{
+		nResult = HNO_RECV_CONTENT;
+	}
+
+	return nResult;
+}
+
+//-----------------------------------------------------------------------------
+
+void CCustomHttpClient::TcpDisconnect(bool bForce)
+{
+	if (!m_bLastKeepAlive || bForce)
+		m_TcpClient.Disconnect();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CHttpClient
+
+CHttpClient::CHttpClient() :
+	m_RecvBuffer(m_TcpClient),
+	m_bChunkedContent(false),
+	m_bContentProduced(false),
+	m_bExpectContinue(false)
+{
+	// nothing
+}
+
+CHttpClient::~CHttpClient()
+{
+	// nothing
+}
+
+//-----------------------------------------------------------------------------
+
+int CHttpClient::ReadChunkSize(UINT& nChunkSize, int nTimeOut)
+{
+	CString strLine;
+	int nResult = m_RecvBuffer.ReadLine(strLine, nTimeOut);
+	if (nResult == EC_HTTP_SUCCESS)
+	{
+		int i = strLine.Find(';');
+		if (i >= 0)
+			strLine = strLine.Left(i);
+		nChunkSize = (UINT)_tcstol(strLine, NULL, 16);
+	}
+
+	return nResult;
+}
+
+//-----------------------------------------------------------------------------
+
+void CHttpClient::ReleaseConnection()
+{
+	if (m_Options.bUseConnectionPool && m_bLastKeepAlive &&
+		m_RecvBuffer.GetDataSize() == 0 && m_TcpClient.IsConnected())
+	{
+		CHttpConnectionPool::Instance().Release(m_TcpClient);
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+int CHttpClient::ExecuteHttpAction(HTTP_METHOD_TYPE nHttpMethod, LPCTSTR lpszUrl,
+	CStream *pRequestContent, CStream *pResponseContent)
+{
+	class CAutoFinalizer
+	{
+	private:
+		CHttpClient& m_Owner;
+	public:
+		CAutoFinalizer(CHttpClient& Owner) : m_Owner(Owner) {}
+		~CAutoFinalizer() { m_Owner.TcpDisconnect(); m_Owner.ClearRequestContent(); }
+	} AutoFinalizer(*this);
+
+	bool bNeedRecvContent = (pResponseContent != NULL);
+	bool bCanRecvContent = false;
+
+	// Ranges are not compressed, as their offsets would refer to the encoded data.
+	bool bAskEncoding = (m_Options.bAcceptEncoding && bNeedRecvContent &&
+		m_Request.GetAcceptEncoding().IsEmpty() && m_Request.GetRange().IsEmpty());
+	if (bAskEncoding)
+		m_Request.SetAcceptEncoding(TEXT("gzip, deflate"));
+
+	int nResult = ExecuteHttpRequest(nHttpMethod, lpszUrl, pRequestContent,
+		pResponseContent, bNeedRecvContent, bCanRecvContent);
+
+	if (bAskEncoding)
+		m_Request.SetAcceptEncoding(TEXT(""));
+
+	if (nResult == EC_HTTP_SUCCESS && bNeedRecvContent)
+		nResult = RecvResponseContent(bAskEncoding);
+
+	// The response has been read completely, so the connection can serve other clients.
+	if (nResult == EC_HTTP_SUCCESS && bNeedRecvContent)
+		ReleaseConnection();
+
+	return nResult;
+}
+
+//-----------------------------------------------------------------------------
+
+int CHttpClient::ExecuteHttpRequest(HTTP_METHOD_TYPE nHttpMethod, LPCTSTR lpszUrl,
+	CStream *pRequestContent, CStream *pResponseContent, bool bNeedRecvContent,
+	bool& bCanRecvContent)
+{
+	int nResult = EC_HTTP_SUCCESS;
+
+	CString strUrl(lpszUrl);
+	INT64 nReqStreamPos = (pRequestContent? pRequestContent->GetPosition() : 0);
+	INT64 nResStreamPos = (pResponseContent? pResponseContent->GetPosition() : 0);
+
+	bCanRecvContent = false;
+	m_nRedirectCount = 0;
+
+	while (true)
+	{
+		bool bSendContent = true;
+
+		nResult = BeforeRequest(nHttpMethod, strUrl, pRequestContent, pResponseContent,
+			nReqStreamPos, nResStreamPos);
+		if (nResult == EC_HTTP_SUCCESS)
+			PrepareRequestContent();
+
+		if (nResult == EC_HTTP_SUCCESS) nResult = TcpConnect();
+		if (nResult == EC_HTTP_SUCCESS) nResult = SendRequestHeader();
+		if (nResult == EC_HTTP_SUCCESS) nResult = WaitForContinue(bSendContent);
+		if (nResult == EC_HTTP_SUCCESS && bSendContent) nResult = SendRequestContent();
+		if (nResult == EC_HTTP_SUCCESS && bSendContent) nResult = RecvResponseHeader();
+
+		if (nResult == EC_HTTP_SUCCESS)
+		{
+			HTTP_NEXT_OP nNextOp = ProcessResponseHeader();
+
+			// The server answered without the content, which can not be sent on
+			// this connection any more.
+			if (!bSendContent)
+				m_bLastKeepAlive = false;
+			// Produced content can not be sent to the new location again.
+			if (nNextOp == HNO_REDIRECT && m_bContentProduced)
+				nNextOp = HNO_EXIT;
+
+			if (nNextOp == HNO_REDIRECT)
+			{
+				strUrl = m_Response.GetLocation();
+			}
+			else if (nNextOp == HNO_RECV_CONTENT)
+			{
+				bCanRecvContent = true;
+				break;
+			}
+			else
+				break;
+		}
+		else
+			break;
+	}
+
+	if (nResult == EC_HTTP_SUCCESS && bNeedRecvContent && !bCanRecvContent)
+		nResult = EC_HTTP_CANNOT_RECV_CONTENT;
+
+	return nResult;
+}
+
+//-----------------------------------------------------------------------------
+
+int CHttpClient::TcpConnect()
+{
+	if (!m_bLastKeepAlive)
+		m_TcpClient.Disconnect();
+
+	if (m_TcpClient.IsConnected())
+	{
+		CPeerAddress PeerAddr = GetPeerAddrFromUrl(m_Url);
+		if (m_TcpClient.GetPeerAddr() != PeerAddr)
+			m_TcpClient.Disconnect();
+	}
+
+	if (!m_TcpClient.IsConnected())
+	{
+		m_RecvBuffer.Clear();
+
+		// POST requests are not retried, so they never go out on a pooled connection
+		// which the server may have closed just before the request arrives.
+		CPeerAddress PeerAddr = GetPeerAddrFromUrl(m_Url);
+		bool bLeased = (m_Options.bUseConnectionPool &&
+			SameText(m_Request.GetMethod(), GetHttpMethodStr(HMT_GET)) &&
+			CHttpConnectionPool::Instance().Lease(PeerAddr, m_TcpClient));
+
+		if (!bLeased)
+		{
+			int nState = m_TcpClient.AsyncConnect(IpToString(PeerAddr.nIp),
+				PeerAddr.nPort, m_Options.nTcpConnectTimeOut);
+
+			if (nState != ACS_CONNECTED)
+				return EC_HTTP_SOCKET_ERROR;
+		}
+	}
+
+	if (m_TcpClient.IsConnected())
+	{
+		SOCKET hHandle = m_TcpClient.GetSocket().GetHandle();
+		int nTimeOut = m_Options.nSocketOpTimeOut;
+		::setsockopt(hHandle, SOL_SOCKET, SO_SNDTIMEO, (char*)&nTimeOut, sizeof(nTimeOut));
+		::setsockopt(hHandle, SOL_SOCKET, SO_RCVTIMEO, (char*)&nTimeOut, sizeof(nTimeOut));
+	}
+
+	return EC_HTTP_SUCCESS;
+}
+
+//-----------------------------------------------------------------------------
+
+int CHttpClient::SendRequestHeader()
+{
+	int nResult = EC_HTTP_SUCCESS;
+	CBuffer Buffer;
+	MakeRequestBuffer(Buffer);
 
 	int r = m_TcpClient.SendBuffer(Buffer.Data(), Buffer.GetSize(), true, m_Options.nSendReqHeaderTimeOut);
 	if (r != Buffer.GetSize())
 		nResult = EC_HTTP_SOCKET_ERROR;
 
-	return nResult;
+	return nResult;
+}
+
+//-----------------------------------------------------------------------------
+
+// Sets the headers for chunked content and "Expect: 100-continue", both of
+// which need HTTP/1.1.
+
+void CHttpClient::PrepareRequestContent()
+{
+	bool bHasContent = (m_bChunkedContent || m_Request.GetContentStream() != NULL);
+	m_bExpectContinue = (m_Options.bExpectContinue && bHasContent);
+
+	m_Request.SetTransferEncoding(m_bChunkedContent ? TEXT("chunked") : TEXT(""));
+	if (m_bChunkedContent)
+		m_Request.SetContentLength(-1);
+	m_Request.GetCustomHeaders().SetValue(TEXT("Expect"),
+		m_bExpectContinue ? TEXT("100-continue") : TEXT(""));
+
+	if (m_bChunkedContent || m_bExpectContinue)
+		m_Request.SetProtocolVersion(HPV_1_1);
+}
+
+//-----------------------------------------------------------------------------
+
+void CHttpClient::ClearRequestContent()
+{
+	m_bChunkedContent = false;
+	m_ContentProducer = CCallBackDef<HTTP_ON_PRODUCE_CONTENT_PROC>();
+	m_bContentProduced = false;
+	m_bExpectContinue = false;
+}
+
+//-----------------------------------------------------------------------------
+// Waits for the answer to "Expect: 100-continue". bSendContent is false if the
+// server has sent the final response instead, which is then in m_Response.
+
+int CHttpClient::WaitForContinue(bool& bSendContent)
+{
+	bSendContent = true;
+	if (!m_bExpectContinue) return EC_HTTP_SUCCESS;
+
+	CBuffer Buffer;
+	int nResult = m_RecvBuffer.ReadUntil("\r\n\r\n", Buffer, m_Options.nContinueTimeOut);
+
+	// Servers that ignore the expectation never answer, so the content is sent anyway.
+	if (nResult == EC_HTTP_RECV_TIMEOUT)
+		return EC_HTTP_SUCCESS;
+
+	if (nResult == EC_HTTP_SUCCESS)
+	{
+		bool bFinished, bError;
+		CheckResponseHeader(Buffer.Data(), Buffer.GetSize(), bFinished, bError);
+		if (bError || !ParseResponseHeader(Buffer.Data(), Buffer.GetSize()))
+			nResult = EC_HTTP_RESPONSE_TEXT_ERROR;
+		else if (m_Response.GetResponseCode() != 100)
+			bSendContent = false;
+	}
+
+	return nResult;
+}
+
+//-----------------------------------------------------------------------------
+// Sends the content got from the producer (or read from the stream) in chunks,
+// till it gives no more data.
+
+int CHttpClient::SendChunkedContent()
+{
+	// Room for the chunk size line before the data, eg: "10000\r\n".
+	const int CHUNK_HEAD_SIZE = 10;
+	const int BLOCK_SIZE = 1024*64;
+
+	int nResult = EC_HTTP_SUCCESS;
+	CStream *pStream = m_Request.GetContentStream();
+	CBuffer Buffer(CHUNK_HEAD_SIZE + BLOCK_SIZE + 2);
+	bool bLastChunk = false;
+
+	while (!bLastChunk)
+	{
+		char *pData = Buffer.Data() + CHUNK_HEAD_SIZE;
+		int nSize;
+
+		if (m_ContentProducer.pProc != NULL)
+		{
+			m_bContentProduced = true;
+			nSize = m_ContentProducer.pProc(m_ContentProducer.pParam, this, pData, BLOCK_SIZE);
+		}
+		else
+			nSize = (pStream != NULL ? pStream->Read(pData, BLOCK_SIZE) : 0);
+
+		if (nSize < 0 || nSize > BLOCK_SIZE)
+		{
+			nResult = EC_HTTP_CONTENT_PRODUCE_ERROR;
+			break;
+		}
+
+		// The last chunk "0\r\n\r\n" is made the same way.
+		bLastChunk = (nSize == 0);
+
+		CStringA strHead;
+		strHead.Format("%X\r\n", nSize);
+		int nHeadPos = CHUNK_HEAD_SIZE - strHead.GetLength();
+		memcpy(Buffer.Data() + nHeadPos, (LPCSTR)strHead, strHead.GetLength());
+		memcpy(pData + nSize, "\r\n", 2);
+
+		int nChunkSize = strHead.GetLength() + nSize + 2;
+		int r = m_TcpClient.SendBuffer(Buffer.Data() + nHeadPos, nChunkSize, true, m_Options.nSendReqContBlockTimeOut);
+		if (r < 0)
+		{
+			nResult = EC_HTTP_SOCKET_ERROR;
+			break;
+		}
+		else if (r != nChunkSize)
+		{
+			nResult = EC_HTTP_SEND_TIMEOUT;
+			break;
+		}
+	}
+
+	return nResult;
+}
+
+//-----------------------------------------------------------------------------
+
+int CHttpClient::SendRequestContent()
+{
+	int nResult = EC_HTTP_SUCCESS;
+
+	if (m_bChunkedContent)
+		return SendChunkedContent();
+
+	CStream *pStream = m_Request.GetContentStream();
+	if (!pStream) return nResult;
+
+	const int BLOCK_SIZE = 1024*64;
+
+	CBuffer Buffer(BLOCK_SIZE);
+
+	while (true)
+	{
+		int nReadSize = pStream->Read(Buffer.Data(), BLOCK_SIZE);
+		if (nReadSize > 0)
+		{
+			int r = m_TcpClient.SendBuffer(Buffer.Data(), nReadSize, true, m_Options.nSendReqContBlockTimeOut);
+			if (r < 0)
+			{
+				nResult = EC_HTTP_SOCKET_ERROR;
+				break;
+			}
+			else if (r != nReadSize)
+			{
+				nResult = EC_HTTP_SEND_TIMEOUT;
+				break;
+			}
+		}
+
+		if (nReadSize < BLOCK_SIZE) break;
+	}
+
+	return nResult;
+}
+
+//-----------------------------------------------------------------------------
+
+int CHttpClient::RecvResponseHeader()
+{
+	const int RECV_TIMEOUT = m_Options.nRecvResHeaderTimeOut;
+
+	int nResult = EC_HTTP_SUCCESS;
+	UINT nStartTicks = GetTickCount();
+
+	do
+	{
+		CBuffer Buffer;
+		int nRemainTimeOut = Max(0, RECV_TIMEOUT - (int)GetTickDiff(nStartTicks, GetTickCount()));
+
+		nResult = m_RecvBuffer.ReadUntil("\r\n\r\n", Buffer, nRemainTimeOut);
+		if (nResult == EC_HTTP_SUCCESS)
+		{
+			bool bFinished, bError;
+			CheckResponseHeader(Buffer.Data(), Buffer.GetSize(), bFinished, bError);
+			if (bError || !ParseResponseHeader(Buffer.Data(), Buffer.GetSize()))
+				nResult = EC_HTTP_RESPONSE_TEXT_ERROR;
+		}
+	}
+	while (m_Response.GetResponseCode() == 100 && nResult == EC_HTTP_SUCCESS);
+
+	return nResult;
+}
+
+//-----------------------------------------------------------------------------
+
+// Decodes the compressed content only if bDecodeContent, ie. the client itself asked for
+// it. A caller setting its own Accept-Encoding gets the content as sent.
+int CHttpClient::RecvResponseContent(bool bDecodeContent)
+{
+	int nResult = EC_HTTP_SUCCESS;
+	if (!m_Response.GetContentStream()) return nResult;
+
+	// Compressed content goes through the decoder on its way to the stream.
+	CStream *pStream = m_Response.GetContentStream();
+	std::auto_ptr<CHttpContentDecoder> pDecoder;
+	INFLATE_FORMAT nFormat;
+
+	if (bDecodeContent &&
+		CHttpContentDecoder::GetInflateFormat(m_Response.GetContentEncoding(), nFormat))
+	{
+		pDecoder.reset(new CHttpContentDecoder(*pStream, nFormat));
+		pStream = pDecoder.get();
+	}
+
+	CString strTransferEncoding = m_Response.GetTransferEncoding();
+	if (strTransferEncoding.MakeLower().Find(TEXT("chunked")) >= 0)
+	{
+		while (true)
+		{
+			int nTimeOut = m_Options.nRecvResContBlockTimeOut;
+			UINT nChunkSize = 0;
+			nResult = ReadChunkSize(nChunkSize, nTimeOut);
+			if (nResult != EC_HTTP_SUCCESS)
+				break;
+
+			if (nChunkSize != 0)
+			{
+				nResult = m_RecvBuffer.ReadStream(*pStream, nChunkSize, nTimeOut);
+				if (nResult != EC_HTTP_SUCCESS)
+					break;
+				if (pDecoder.get() && pDecoder->IsError())
+				{
+					nResult = EC_HTTP_CONTENT_DECODE_ERROR;
+					break;
+				}
+
+				CString strCrLf;
+				nResult = m_RecvBuffer.ReadLine(strCrLf, nTimeOut);
+				if (nResult != EC_HTTP_SUCCESS)
+					break;
+			}
+			else
+			{
+				// Skips the trailer up to the empty line, so the connection can be reused.
+				CString strLine;
+				do
+				{
+					nResult = m_RecvBuffer.ReadLine(strLine, nTimeOut);
+				}
+				while (nResult == EC_HTTP_SUCCESS && !strLine.IsEmpty());
+				break;
+			}
+		}
+	}
+	else
+	{
+		INT64 nContentLength = m_Response.GetContentLength();
+		if (nContentLength <= 0)
+			nResult = EC_HTTP_CONTENT_LENGTH_ERROR;
+
+		if (nResult == EC_HTTP_SUCCESS)
+		{
+			const int BLOCK_SIZE = 1024*64;
+
+			INT64 nRemainSize = nContentLength;
+			CBuffer Buffer(BLOCK_SIZE);
+
+			while (nRemainSize > 0)
+			{
+				int nBlockSize = (int)Min(nRemainSize, (INT64)BLOCK_SIZE);
+				int nRecvSize = m_RecvBuffer.Read(Buffer.Data(), nBlockSize,
+					m_Options.nRecvResContBlockTimeOut);
+
+				if (nRecvSize < 0)
+				{
+					nResult = EC_HTTP_SOCKET_ERROR;
+					break;
+				}
+
+				nRemainSize -= nRecvSize;
+				pStream->WriteBuffer(Buffer.Data(), nRecvSize);
+
+				if (pDecoder.get() && pDecoder->IsError())
+				{
+					nResult = EC_HTTP_CONTENT_DECODE_ERROR;
+					break;
+				}
+			}
+		}
+	}
+
+	// The encoded data must end with the content.
+	if (nResult == EC_HTTP_SUCCESS && pDecoder.get() && !pDecoder->IsFinished())
+		nResult = EC_HTTP_CONTENT_DECODE_ERROR;
+
+	return nResult;
+}
+
+//-----------------------------------------------------------------------------
+
+int CHttpClient::Get(LPCTSTR lpszUrl, CStream *pResponseContent)
+{
+	return ExecuteHttpAction(HMT_GET, lpszUrl, NULL, pResponseContent);
+}
+
+//-----------------------------------------------------------------------------
+
+int CHttpClient::Post(LPCTSTR lpszUrl, CStream *pRequestContent, CStream *pResponseContent)
+{
+	IFC_ASSERT(pRequestContent != NULL);
+	return ExecuteHttpAction(HMT_POST, lpszUrl, pRequestContent, pResponseContent);
+}
+
+//-----------------------------------------------------------------------------
+
+int CHttpClient::PostChunked(LPCTSTR lpszUrl, CStream *pRequestContent, CStream *pResponseContent)
+{
+	IFC_ASSERT(pRequestContent != NULL);
+
+	m_bChunkedContent = true;
+	return ExecuteHttpAction(HMT_POST, lpszUrl, pRequestContent, pResponseContent);
+}
+
+//-----------------------------------------------------------------------------
+
+int CHttpClient::PostChunked(LPCTSTR lpszUrl, HTTP_ON_PRODUCE_CONTENT_PROC pProc, void *pParam,
+	CStream *pResponseContent)
+{
+	IFC_ASSERT(pProc != NULL);
+
+	m_bChunkedContent = true;
+	m_ContentProducer.pProc = pProc;
+	m_ContentProducer.pParam = pParam;
+	return ExecuteHttpAction(HMT_POST, lpszUrl, NULL, pResponseContent);
+}
+
+//-----------------------------------------------------------------------------
+
+int CHttpClient::DownloadFile(LPCTSTR lpszUrl, LPCTSTR lpszLocalFileName)
+{
+	ForceDirectories(ExtractFilePath(lpszLocalFileName));
+	CFileStream fs;
+	if (!fs.Open(lpszLocalFileName, FM_CREATE | FM_SHARE_DENY_WRITE))
+		return EC_HTTP_CANNOT_CREATE_FILE;
+
+	int nResult = Get(lpszUrl, &fs);
+	if (nResult != EC_HTTP_SUCCESS)
+		DeleteFile(lpszLocalFileName);
+	return nResult;
+}
+
+//-----------------------------------------------------------------------------
+
+int CHttpClient::RequestFile(LPCTSTR lpszUrl)
+{
+	bool bCanRecvContent;
+	int nResult = ExecuteHttpRequest(HMT_GET, lpszUrl, NULL, NULL, true, bCanRecvContent);
+	if (nResult != EC_HTTP_SUCCESS || !bCanRecvContent)
+		TcpDisconnect(true);
+	return nResult;
+}
+
+//-----------------------------------------------------------------------------
+
+int CHttpClient::ReceiveFile(void *pBuffer, int nSize, int nTimeOutMSecs)
+{
+	return m_RecvBuffer.Read(pBuffer, nSize, nTimeOutMSecs);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CIocpHttpClient
+
+CIocpHttpClient::CIocpHttpClient() :
+	m_nCurOpType(OT_NONE),
+	m_nCurOpStep(OS_NONE),
+	m_nErrorCode(EC_HTTP_SUCCESS),
+	m_nHttpMethod(HMT_GET),
+	m_pRequestContent(NULL),
+	m_pResponseContent(NULL),
+	m_nReqStreamPos(0),
+	m_nResStreamPos(0),
+	m_nRemainContentSize(0),
+	m_bWorking(false),
+	m_bDestroying(false),
+	m_pIocpObject(NULL)
+{
+	// nothing
+}
+
+//-----------------------------------------------------------------------------
+
+CIocpHttpClient::~CIocpHttpClient()
+{
+	IFC_ASSERT(m_pIocpObject != NULL || IsIocpObjectAvailable());
+	IFC_ASSERT(!GetIocp().IsInWorkerThread());
+
+	m_bDestroying = true;
+	GetTcpConnectorPoolObject().RemoveTask(&m_TcpClient);
+	m_TcpClient.Disconnect();
+	GetIocp().WaitForComplete(this);
+	Finalize();
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpHttpClient::InvokeCallBack()
+{
+	class CAutoFinalizer
+	{
+	private:
+		CIocpHttpClient& m_Owner;
+	public:
+		CAutoFinalizer(CIocpHttpClient& Owner) : m_Owner(Owner) {}
+		~CAutoFinalizer() { m_Owner.m_bWorking = false; }
+	} AutoFinalizer(*this);
+
+	Finalize();
+
+	OPER_TYPE nOldOpType = m_nCurOpType;
+	m_nCurOpType = OT_NONE;
+
+	switch (nOldOpType)
+	{
+	case OT_DOWNLOAD_FILE:
+		{
+			TcpDisconnect();
+
+			if (m_OnDownloadFile.pProc)
+			{
+				m_OnDownloadFile.pProc(
+					m_OnDownloadFile.pParam,
+					this,
+					m_DownloadFileTask.strUrl,
+					m_DownloadFileTask.strLocalFileName,
+					m_nErrorCode
+					);
+			}
+		}
+		break;
+
+	case OT_REQUEST_FILE:
+		if (m_OnRequestFile.pProc)
+		{
+			m_OnRequestFile.pProc(
+				m_OnRequestFile.pParam,
+				this,
+				m_RequestFileTask.strUrl,
+				m_nErrorCode
+				);
+		}
+		break;
+
+	case OT_RECEIVE_FILE:
+		if (m_OnReceiveFile.pProc)
+		{
+			m_OnReceiveFile.pProc(
+				m_OnReceiveFile.pParam,
+				this,
+				m_ReceiveFileTask.pBuffer,
+				m_ReceiveFileTask.nSize,
+				m_nErrorCode
+				);
+		}
+		break;
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpHttpClient::Finalize()
+{
+	// Called by both the destructor and the sink callbacks, only one of them deletes the sink.
+	CIocpFileSink *pFileSink = (CIocpFileSink*)InterlockedExchangePointer(
+		(PVOID*)&m_DownloadFileTask.pFileSink, NULL);
+	delete pFileSink;
+	m_DownloadFileTask.pBlock = NULL;
+
+	if (m_nCurOpType == OT_DOWNLOAD_FILE)
+	{
+		if (m_bDestroying || m_nErrorCode != EC_HTTP_SUCCESS)
+			DeleteFile(m_DownloadFileTask.strLocalFileName);
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+CIocpObject& CIocpHttpClient::GetIocp()
+{
+	return (m_pIocpObject != NULL) ? *m_pIocpObject : GetIocpObject();
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpHttpClient::PrepareHttpAction(HTTP_METHOD_TYPE nHttpMethod, LPCTSTR lpszUrl,
+	CStream *pRequestContent, CStream *pResponseContent)
+{
+	m_nHttpMethod = nHttpMethod;
+	m_strUrl = lpszUrl;
+
+	m_pRequestContent = pRequestContent;
+	m_pResponseContent = pResponseContent;
+	m_nReqStreamPos = (pRequestContent? pRequestContent->GetPosition() : 0);
+	m_nResStreamPos = (pResponseContent? pResponseContent->GetPosition() : 0);
+
+	m_nRedirectCount = 0;
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpHttpClient::ExecuteHttpAction()
+{
+	m_nCurOpStep = OS_NONE;
+
+	int nResult = BeforeRequest(m_nHttpMethod, m_strUrl, m_pRequestContent, m_pResponseContent,
+		m_nReqStreamPos, m_nResStreamPos);
+
+	if (nResult == EC_HTTP_SUCCESS)
+	{
+		m_nCurOpStep = OS_TCP_CONNECT;
+		TcpConnect();
+	}
+	else
+	{
+		m_nErrorCode = nResult;
+		InvokeCallBack();
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpHttpClient::TcpConnect()
+{
+	if (!m_bLastKeepAlive)
+		m_TcpClient.Disconnect();
+
+	if (m_TcpClient.IsConnected())
+	{
+		CPeerAddress PeerAddr = GetPeerAddrFromUrl(m_Url);
+		if (m_TcpClient.GetPeerAddr() != PeerAddr)
+			m_TcpClient.Disconnect();
+	}
+
+	if (!m_TcpClient.IsConnected())
+	{
+		GetTcpConnectorPoolObject().AddTask(&m_TcpClient, m_Url.GetHost(),
+			StrToInt(m_Url.GetPort(), DEFAULT_HTTP_PORT), TcpConnectResultProc,
+			this, m_Options.nTcpConnectTimeOut);
+	}
+	else
+		TcpConnectResultProc(this, &m_TcpClient, true);
+}
+
+//-----------------------------------------------------------------------------
+
+// Starts receiving the content of DownloadFile() into the blocks of the file sink.
+void CIocpHttpClient::StartRecvToSink()
+{
+	INT64 nContentLength = m_Response.GetContentLength();
+	if (nContentLength <= 0)
+	{
+		m_nErrorCode = EC_HTTP_CONTENT_LENGTH_ERROR;
+		InvokeCallBack();
+		return;
+	}
+
+	m_nRemainContentSize = nContentLength;
+	m_DownloadFileTask.pFileSink->Preallocate(nContentLength);
+	RecvToSink();
+}
+
+//-----------------------------------------------------------------------------
+
+// Receives the next piece of the content into the current block of the file sink.
+// If all the blocks are being written, SinkBlockFreeProc() resumes it later.
+void CIocpHttpClient::RecvToSink()
+{
+	CDownloadFileTask& Task = m_DownloadFileTask;
+
+	if (Task.pBlock == NULL)
+	{
+		Task.pBlock = Task.pFileSink->AcquireBlock();
+		if (Task.pBlock == NULL) return;
+		Task.nBlockDataSize = 0;
+	}
+
+	int nSize = (int)Min(m_nRemainContentSize,
+		(INT64)(Task.pFileSink->GetBlockSize() - Task.nBlockDataSize));
+
+	GetIocp().Recv((SOCKET)m_TcpClient.GetSocket().GetHandle(),
+		Task.pBlock, Task.nBlockDataSize + nSize, Task.nBlockDataSize,
+		IOCP_CALLBACK_DEF(IocpCallBackProc, NULL), this, CIocpParams());
+}
+
+//-----------------------------------------------------------------------------
+
+// Completes DownloadFile() once the pending writes of the file sink are done.
+void CIocpHttpClient::EndRecvToSink(int nErrorCode)
+{
+	if (nErrorCode != EC_HTTP_SUCCESS)
+	{
+		TcpDisconnect(true);
+		m_nErrorCode = nErrorCode;
+	}
+
+	m_DownloadFileTask.pFileSink->Finish();
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpHttpClient::TcpConnectResultProc(void *pParam, CTcpClient *pTcpClient, bool bSuccess)
+{
+	CIocpHttpClient *pThis = (CIocpHttpClient*)pParam;
+	if (bSuccess)
+	{
+		pThis->m_nCurOpStep = OS_SEND_REQUEST_HEADER;
+
+		SOCKET nSocketHandle = pTcpClient->GetSocket().GetHandle();
+		pThis->GetIocp().AssociateHandle(nSocketHandle);
+
+		pThis->MakeRequestBuffer(pThis->m_TransBuffer);
+		pThis->GetIocp().Send((SOCKET)nSocketHandle, pThis->m_TransBuffer.Data(),
+			pThis->m_TransBuffer.GetSize(), 0, IOCP_CALLBACK_DEF(IocpCallBackProc, NULL),
+			pThis, CIocpParams());
+	}
+	else
+	{
+		pThis->m_nErrorCode = EC_HTTP_SOCKET_ERROR;
+		pThis->InvokeCallBack();
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpHttpClient::IocpCallBackProc(const CIocpTaskData& TaskData, void *pParam)
+{
+	CIocpHttpClient *pThis = (CIocpHttpClient*)TaskData.GetCaller();
+	if (pThis->m_bDestroying) return;
+
+	bool bRecvToSink = (pThis->m_nCurOpType == OT_DOWNLOAD_FILE &&
+		pThis->m_nCurOpStep == OS_RECV_RESPONSE_CONTENT);
+
+	if (TaskData.GetErrorCode() != 0)
+	{
+		if (bRecvToSink)
+		{
+			pThis->EndRecvToSink(EC_HTTP_IOCP_ERROR);
+			return;
+		}
+
+		pThis->TcpDisconnect(true);
+		pThis->m_nErrorCode = EC_HTTP_IOCP_ERROR;
+		pThis->InvokeCallBack();
+		return;
+	}
+
+	if (TaskData.GetBytesTrans() < TaskData.GetDataSize())
+	{
+		if (TaskData.GetTaskType() == ITT_SEND)
+		{
+			pThis->GetIocp().Send((SOCKET)TaskData.GetFileHandle(),
+				TaskData.GetEntireDataBuf(),
+				TaskData.GetEntireDataSize(),
+				(int)(TaskData.GetDataBuf() - TaskData.GetEntireDataBuf() + TaskData.GetBytesTrans()),
+				TaskData.GetCallBack(), TaskData.GetCaller(), TaskData.GetParams());
+		}
+		else if (TaskData.GetTaskType() == ITT_RECV)
+		{
+			pThis->GetIocp().Recv((SOCKET)TaskData.GetFileHandle(),
+				TaskData.GetEntireDataBuf(),
+				TaskData.GetEntireDataSize(),
+				(int)(TaskData.GetDataBuf() - TaskData.GetEntireDataBuf() + TaskData.GetBytesTrans()),
+				TaskData.GetCallBack(), TaskData.GetCaller(), TaskData.GetParams());
+		}
+
+		return;
+	}
+
+	if (pThis->m_nCurOpType == OT_DOWNLOAD_FILE || pThis->m_nCurOpType == OT_REQUEST_FILE)
+	{
+		switch (pThis->m_nCurOpStep)
+		{
+		case OS_SEND_REQUEST_HEADER:
+			{
+				pThis->m_nCurOpStep = OS_RECV_RESPONSE_HEADER;
+				pThis->m_TransBuffer.Clear();
+				pThis->IocpCallBackProc(TaskData, pParam);
+				break;
+			}
+
+		case OS_RECV_RESPONSE_HEADER:
+			{
+				bool bHeaderRecved, bError;
+				pThis->CheckResponseHeader(pThis->m_TransBuffer.Data(),
+					 pThis->m_TransBuffer.GetSize(), bHeaderRecved, bError);
+				if (bError)
+				{
+					pThis->m_nErrorCode = EC_HTTP_RESPONSE_TEXT_ERROR;
+					pThis->InvokeCallBack();
+					break;
+				}
+
+				if (bHeaderRecved)
+				{
+					bool bOk = pThis->ParseResponseHeader(pThis->m_TransBuffer.Data(),
+						pThis->m_TransBuffer.GetSize());
+					if (!bOk)
+					{
+						pThis->m_nErrorCode = EC_HTTP_RESPONSE_TEXT_ERROR;
+						pThis->InvokeCallBack();
+						break;
+					}
+
+					HTTP_NEXT_OP nNextOp = pThis->ProcessResponseHeader();
+					if (nNextOp == HNO_REDIRECT)
+					{
+						pThis->m_strUrl = pThis->m_Response.GetLocation();
+						pThis->ExecuteHttpAction();
+					}
+					else if (nNextOp == HNO_RECV_CONTENT)
+					{
+						pThis->m_nCurOpStep = OS_RECV_RESPONSE_CONTENT;
+						pThis->m_TransBuffer.Clear();
+
+						if (pThis->m_nCurOpType == OT_DOWNLOAD_FILE)
+							pThis->StartRecvToSink();
+						else if (pThis->m_Response.GetContentStream() != NULL)
+							pThis->IocpCallBackProc(TaskData, pParam);
+						else
+							pThis->InvokeCallBack();
+					}
+					else
+					{
+						pThis->m_nErrorCode = EC_HTTP_CANNOT_RECV_CONTENT;
+						pThis->InvokeCallBack();
+					}
+				}
+				else
+				{
+					pThis->m_TransBuffer.SetSize(pThis->m_TransBuffer.GetSize() + 1);
+					pThis->GetIocp().Recv((SOCKET)TaskData.GetFileHandle(),
+						pThis->m_TransBuffer.Data(), pThis->m_TransBuffer.GetSize(),
+						pThis->m_TransBuffer.GetSize() - 1,
+						TaskData.GetCallBack(), TaskData.GetCaller(), TaskData.GetParams());
+				}
+
+				break;
+			}
+
+		case OS_RECV_RESPONSE_CONTENT:
+			{
+				if (bRecvToSink)
+				{
+					CDownloadFileTask& Task = pThis->m_DownloadFileTask;
+					int nBytes = TaskData.GetEntireDataSize() - Task.nBlockDataSize;
+
+					Task.nBlockDataSize += nBytes;
+					pThis->m_nRemainContentSize -= nBytes;
+
+					if (Task.nBlockDataSize == Task.pFileSink->GetBlockSize() ||
+						pThis->m_nRemainContentSize <= 0)
+					{
+						Task.pFileSink->CommitBlock(Task.pBlock, Task.nBlockDataSize);
+						Task.pBlock = NULL;
+						Task.nBlockDataSize = 0;
+					}
+
+					if (pThis->m_nRemainContentSize <= 0)
+						pThis->EndRecvToSink(EC_HTTP_SUCCESS);
+					else if (Task.pFileSink->GetErrorCode() != 0)
+						pThis->EndRecvToSink(EC_HTTP_FILE_WRITE_ERROR);
+					else
+						pThis->RecvToSink();
+					break;
+				}
+
+				INT64 nContentLength = pThis->m_Response.GetContentLength();
+				if (nContentLength <= 0)
+				{
+					pThis->m_nErrorCode = EC_HTTP_CONTENT_LENGTH_ERROR;
+					pThis->InvokeCallBack();
+					break;
+				}
+
+				if (pThis->m_TransBuffer.GetSize() == 0)
+				{
+					pThis->m_nRemainContentSize = nContentLength;
+				}
+				else
+				{
+					pThis->m_nRemainContentSize -= pThis->m_TransBuffer.GetSize();
+					pThis->m_Response.GetContentStream()->WriteBuffer(
+						pThis->m_TransBuffer.Data(), pThis->m_TransBuffer.GetSize());
+
+					if (pThis->m_nRemainContentSize <= 0)
+					{
+						pThis->InvokeCallBack();
+						break;
+					}
+				}
+
+				if (pThis->m_nRemainContentSize > 0)
+				{
+					const int BLOCK_SIZE = 1024*64;
+					int nBlockSize = (int)Min(pThis->m_nRemainContentSize, (INT64)BLOCK_SIZE);
+
+					pThis->m_TransBuffer.SetSize(nBlockSize);
+
+					pThis->GetIocp().Recv((SOCKET)TaskData.GetFileHandle(),
+						pThis->m_TransBuffer.Data(), pThis->m_TransBuffer.GetSize(), 0,
+						TaskData.GetCallBack(), TaskData.GetCaller(), TaskData.GetParams());
+				}
+
+				break;
+			}
+		}
+	}
+	else if (pThis->m_nCurOpType == OT_RECEIVE_FILE)
+	{
+		pThis->InvokeCallBack();
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpHttpClient::SinkBlockFreeProc(void *pParam, CIocpFileSink *pFileSink, int nErrorCode)
+{
+	CIocpHttpClient *pThis = (CIocpHttpClient*)pParam;
+	if (pThis->m_bDestroying) return;
+
+	if (nErrorCode != 0)
+		pThis->EndRecvToSink(EC_HTTP_FILE_WRITE_ERROR);
+	else
+		pThis->RecvToSink();
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpHttpClient::SinkFinishedProc(void *pParam, CIocpFileSink *pFileSink, int nErrorCode)
+{
+	CIocpHttpClient *pThis = (CIocpHttpClient*)pParam;
+	if (pThis->m_bDestroying) return;
+
+	if (nErrorCode != 0 && pThis->m_nErrorCode == EC_HTTP_SUCCESS)
+		pThis->m_nErrorCode = EC_HTTP_FILE_WRITE_ERROR;
+
+	pThis->InvokeCallBack();
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpHttpClient::DownloadFile(LPCTSTR lpszUrl, LPCTSTR lpszLocalFileName)
+{
+	IFC_ASSERT(m_nCurOpType == OT_NONE);
+
+	m_bWorking = true;
+	m_nCurOpType = OT_DOWNLOAD_FILE;
+	m_nErrorCode = EC_HTTP_SUCCESS;
+
+	m_DownloadFileTask.strUrl = lpszUrl;
+	m_DownloadFileTask.strLocalFileName = lpszLocalFileName;
+	m_DownloadFileTask.pFileSink = NULL;
+	m_DownloadFileTask.pBlock = NULL;
+	m_DownloadFileTask.nBlockDataSize = 0;
+
+	ForceDirectories(ExtractFilePath(lpszLocalFileName));
+
+	m_DownloadFileTask.pFileSink = new CIocpFileSink(GetIocp());
+	m_DownloadFileTask.pFileSink->SetOnBlockFreeCallBack(SinkBlockFreeProc, this);
+	m_DownloadFileTask.pFileSink->SetOnFinishedCallBack(SinkFinishedProc, this);
+	if (m_DownloadFileTask.pFileSink->Open(lpszLocalFileName))
+	{
+		PrepareHttpAction(HMT_GET, lpszUrl, NULL, NULL);
+		ExecuteHttpAction();
+	}
+	else
+	{
+		m_nErrorCode = EC_HTTP_CANNOT_CREATE_FILE;
+		InvokeCallBack();
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpHttpClient::RequestFile(LPCTSTR lpszUrl)
+{
+	IFC_ASSERT(m_nCurOpType == OT_NONE);
+
+	m_bWorking = true;
+	m_nCurOpType = OT_REQUEST_FILE;
+	m_nErrorCode = EC_HTTP_SUCCESS;
+
+	m_RequestFileTask.strUrl = lpszUrl;
+
+	PrepareHttpAction(HMT_GET, lpszUrl, NULL, NULL);
+	ExecuteHttpAction();
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpHttpClient::ReceiveFile(void *pBuffer, int nSize)
+{
+	IFC_ASSERT(m_nCurOpType == OT_NONE);
+
+	m_bWorking = true;
+	m_nCurOpType = OT_RECEIVE_FILE;
+	m_nErrorCode = EC_HTTP_SUCCESS;
+
+	m_ReceiveFileTask.pBuffer = pBuffer;
+	m_ReceiveFileTask.nSize = nSize;
+
+	GetIocp().Recv((SOCKET)m_TcpClient.GetSocket().GetHandle(),
+		pBuffer, nSize, 0, IOCP_CALLBACK_DEF(IocpCallBackProc, NULL), this, CIocpParams());
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpHttpClient::SetDownloadFileCallBack(IOCPHTTP_ONDOWNLOADFILE_PROC pProc, void *pParam)
+{
+	m_OnDownloadFile.pProc = pProc;
+	m_OnDownloadFile.pParam = pParam;
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpHttpClient::SetRequestFileCallBack(IOCPHTTP_ONREQUESTFILE_PROC pProc, void *pParam)
+{
+	m_OnRequestFile.pProc = pProc;
+	m_OnRequestFile.pParam = pParam;
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpHttpClient::SetReceiveFileCallBack(IOCPHTTP_ONRECEIVEFILE_PROC pProc, void *pParam)
+{
+	m_OnReceiveFile.pProc = pProc;
+	m_OnReceiveFile.pParam = pParam;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CIocpHttpConnHandler - Completion handler of the CIocpHttpMultiClient sockets.
+
+struct CIocpHttpConnHandler
+{
+	CIocpHttpMultiClient::CONNECTION *pConnection;
+
+	CIocpHttpConnHandler(CIocpHttpMultiClient::CONNECTION *pConn) : pConnection(pConn) {}
+
+	void operator()(const CIocpTaskData& TaskData) const
+	{
+		if (TaskData.GetTaskType() == ITT_SEND)
+			pConnection->pOwner->OnSendComplete(pConnection, TaskData);
+		else
+			pConnection->pOwner->OnRecvComplete(pConnection, TaskData);
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// CIocpHttpMultiClient
+
+CIocpHttpMultiClient::CCheckThread::CCheckThread(CIocpHttpMultiClient& Owner) :
+	m_Owner(Owner)
+{
+	m_hWakeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+}
+
+//-----------------------------------------------------------------------------
+
+CIocpHttpMultiClient::CCheckThread::~CCheckThread()
+{
+	CloseHandle(m_hWakeEvent);
+}
+
+//-----------------------------------------------------------------------------
+
+// Sleeps until the next connection may time out, or until Terminate() wakes it up.
+void CIocpHttpMultiClient::CCheckThread::Execute()
+{
+	UINT nWaitMSecs = 0;
+
+	while (!GetTerminated())
+	{
+		WaitForSingleObject(m_hWakeEvent, nWaitMSecs);
+		if (!GetTerminated())
+			nWaitMSecs = m_Owner.CheckTimeOut();
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+CIocpHttpMultiClient::CIocpHttpMultiClient() :
+	m_nTaskCount(0),
+	m_nMaxConnsPerHost(HTTP_MULTI_MAX_CONNS_PER_HOST),
+	m_nMaxConnections(HTTP_MULTI_MAX_CONNECTIONS),
+	m_nMaxPipelineDepth(HTTP_MULTI_MAX_PIPELINE_DEPTH),
+	m_pIocpObject(NULL),
+	m_pCheckThread(NULL),
+	m_bDestroying(false)
+{
+	EnsureNetworkInited();
+	GetTcpConnectorPoolObject().Start();
+
+	m_pCheckThread = new CCheckThread(*this);
+	m_pCheckThread->Run();
+}
+
+//-----------------------------------------------------------------------------
+
+CIocpHttpMultiClient::~CIocpHttpMultiClient()
+{
+	IFC_ASSERT(m_pIocpObject != NULL || IsIocpObjectAvailable());
+	IFC_ASSERT(!GetIocp().IsInWorkerThread());
+
+	m_bDestroying = true;
+
+	m_pCheckThread->Terminate();
+	m_pCheckThread->WaitFor();
+	delete m_pCheckThread;
+	m_pCheckThread = NULL;
+
+	// The connector pool must not be called with m_Lock held (it calls back with its own lock).
+	CPointerList Connecting;
+	{
+		CAutoLocker Locker(m_Lock);
+		for (int i = 0; i < m_Connections.GetCount(); i++)
+		{
+			CONNECTION *pConn = (CONNECTION*)m_Connections[i];
+			if (!pConn->bConnected)
+				Connecting.Add(pConn);
+		}
+	}
+	for (int i = 0; i < Connecting.GetCount(); i++)
+		GetTcpConnectorPoolObject().RemoveTask(&((CONNECTION*)Connecting[i])->TcpClient);
+
+	{
+		CAutoLocker Locker(m_Lock);
+		for (int i = 0; i < m_Connections.GetCount(); i++)
+			CloseConnection((CONNECTION*)m_Connections[i], EC_HTTP_SOCKET_ERROR);
+	}
+
+	GetIocp().WaitForComplete(this);
+
+	for (int i = 0; i < m_Connections.GetCount(); i++)
+	{
+		CONNECTION *pConn = (CONNECTION*)m_Connections[i];
+		for (int j = 0; j < (int)pConn->Pipeline.size(); j++)
+			delete pConn->Pipeline[j];
+		pConn->TcpClient.Disconnect();
+		delete pConn;
+	}
+	m_Connections.Clear();
+
+	for (HOST_MAP::iterator iter = m_Hosts.begin(); iter != m_Hosts.end(); ++iter)
+	{
+		HOST_ITEM *pHost = iter->second;
+		for (int j = 0; j < (int)pHost->Pending.size(); j++)
+			delete pHost->Pending[j];
+		delete pHost;
+	}
+	m_Hosts.clear();
+}
+
+//-----------------------------------------------------------------------------
+
+CIocpObject& CIocpHttpMultiClient::GetIocp()
+{
+	return (m_pIocpObject != NULL) ? *m_pIocpObject : GetIocpObject();
+}
+
+//-----------------------------------------------------------------------------
+
+CStringA CIocpHttpMultiClient::MakeRequestText(const CUrl& Url)
+{
+	int nPort = StrToInt(Url.GetPort(), DEFAULT_HTTP_PORT);
+	m_RequestHeader.SetHost(nPort == DEFAULT_HTTP_PORT ?
+		Url.GetHost() : Url.GetHost() + TEXT(":") + IntToStr(nPort));
+	m_RequestHeader.SetConnection(true);
+	m_RequestHeader.BuildHeaders();
+
+	CString strText;
+	strText = GetHttpMethodStr(HMT_GET) + TEXT(" ") +
+		Url.GetUrl(CUrl::URL_PATH | CUrl::URL_FILENAME | CUrl::URL_PARAMS) +
+		TEXT(" HTTP/") + GetHttpProtoVerStr(HPV_1_1) + TEXT("\r\n");
+
+	for (int i = 0; i < m_RequestHeader.GetRawHeaders().GetCount(); i++)
+	{
+		CString s = m_RequestHeader.GetRawHeaders()[i];
+		if (!s.IsEmpty())
+			strText = strText + s + TEXT("\r\n");
+	}
+
+	strText += TEXT("\r\n");
+
+	return CStringA(strText);
+}
+
+//-----------------------------------------------------------------------------
+
+bool CIocpHttpMultiClient::ParseResponseHeader(const CHttpHeaderParser& Parser, CIocpHttpTask& Task)
+{
+	CString s = Parser.GetStartLine();
+	if (s.Mid(0, 7).CompareNoCase(TEXT("HTTP/1.")) != 0)
+		return false;
+
+	// eg: HTTP/1.1 200 OK
+	Task.strResponseText = s;
+	FetchStr(s);
+	s = s.Trim();
+	Task.nResponseCode = StrToInt(FetchStr(s), -1);
+
+	Parser.GetHeaders(Task.ResponseHeader.GetRawHeaders());
+	Task.ResponseHeader.ParseHeaders();
+
+	return (Task.nResponseCode >= 100);
+}
+
+//-----------------------------------------------------------------------------
+// Assigns the pending tasks of the host to its open connections, and opens new
+// connections (returned in NewConns) while tasks are still waiting.
+
+void CIocpHttpMultiClient::Dispatch(HOST_ITEM *pHost, CPointerList& NewConns)
+{
+	int nConnectingCount = 0;
+
+	for (int i = 0; i < m_Connections.GetCount() && !pHost->Pending.empty(); i++)
+	{
+		CONNECTION *pConn = (CONNECTION*)m_Connections[i];
+		if (pConn->pHost != pHost || pConn->bClosing)
+			continue;
+
+		if (!pConn->bConnected)
+		{
+			nConnectingCount++;
+			continue;
+		}
+
+		int nDepth = (pConn->bPersistent ? m_nMaxPipelineDepth : 1);
+		if (pConn->Pipeline.empty())
+			pConn->nLastActiveTicks = GetTickCount();
+
+		while (!pHost->Pending.empty() && (int)pConn->Pipeline.size() < nDepth)
+		{
+			pConn->Pipeline.push_back(pHost->Pending.front());
+			pHost->Pending.pop_front();
+			pConn->nUnsentCount++;
+		}
+
+		if (pConn->nUnsentCount > 0 && !pConn->bSending)
+			StartSend(pConn);
+	}
+
+	while ((int)pHost->Pending.size() > nConnectingCount &&
+		pHost->nConnCount < m_nMaxConnsPerHost)
+	{
+		if (m_Connections.GetCount() >= m_nMaxConnections)
+		{
+			// Give the slot of an idle connection of another host to this one.
+			for (int i = 0; i < m_Connections.GetCount(); i++)
+			{
+				CONNECTION *pConn = (CONNECTION*)m_Connections[i];
+				if (pConn->bConnected && !pConn->bClosing && pConn->Pipeline.empty())
+				{
+					CloseConnection(pConn, EC_HTTP_SOCKET_ERROR);
+					break;
+				}
+			}
+			break;
+		}
+
+		CONNECTION *pConn = new CONNECTION();
+		pConn->pOwner = this;
+		pConn->pHost = pHost;
+		pConn->bConnected = false;
+		pConn->bClosing = false;
+		pConn->bPersistent = false;
+		pConn->bKeepAlive = false;
+		pConn->nUnsentCount = 0;
+		pConn->bSending = false;
+		pConn->bRecvPending = false;
+		pConn->nRecvSize = 0;
+		pConn->nRecvState = RS_HEADER;
+		pConn->nRemainSize = 0;
+		pConn->bResponseStarted = false;
+		pConn->nErrorCode = EC_HTTP_SUCCESS;
+		pConn->nLastActiveTicks = GetTickCount();
+
+		m_Connections.Add(pConn);
+		pHost->nConnCount++;
+		nConnectingCount++;
+		NewConns.Add(pConn);
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpHttpMultiClient::DispatchAll(CPointerList& NewConns)
+{
+	for (HOST_MAP::iterator iter = m_Hosts.begin(); iter != m_Hosts.end(); ++iter)
+	{
+		if (!iter->second->Pending.empty())
+			Dispatch(iter->second, NewConns);
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpHttpMultiClient::StartConnections(const CPointerList& NewConns)
+{
+	for (int i = 0; i < NewConns.GetCount(); i++)
+	{
+		CONNECTION *pConn = (CONNECTION*)NewConns[i];
+		GetTcpConnectorPoolObject().AddTask(&pConn->TcpClient, pConn->pHost->strHost,
+			pConn->pHost->nPort, TcpConnectResultProc, pConn, m_Options.nTcpConnectTimeOut);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Sends the requests of all the unsent tasks in one write.
+
+void CIocpHttpMultiClient::StartSend(CONNECTION *pConn)
+{
+	CStringA strText;
+	for (int i = (int)pConn->Pipeline.size() - pConn->nUnsentCount; i < (int)pConn->Pipeline.size(); i++)
+		strText += pConn->Pipeline[i]->strRequest;
+
+	pConn->nUnsentCount = 0;
+	pConn->bSending = true;
+	pConn->SendBuffer.Assign(strText.GetString(), strText.GetLength());
+
+	GetIocp().Send(pConn->TcpClient.GetSocket().GetHandle(), pConn->SendBuffer.Data(),
+		pConn->SendBuffer.GetSize(), 0, CIocpHttpConnHandler(pConn), this);
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpHttpMultiClient::PostRecv(CONNECTION *pConn)
+{
+	if (pConn->RecvBuffer.GetSize() == 0)
+		pConn->RecvBuffer.SetSize(HTTP_MULTI_RECV_BUFFER_SIZE);
+
+	pConn->bRecvPending = true;
+	GetIocp().Recv(pConn->TcpClient.GetSocket().GetHandle(), pConn->RecvBuffer.Data(),
+		pConn->RecvBuffer.GetSize(), pConn->nRecvSize, CIocpHttpConnHandler(pConn), this);
+}
+
+//-----------------------------------------------------------------------------
+// Stops using the connection. Closing the socket makes the pending operations
+// complete with an error (shutdown alone does not end a pending WSARecv), and the
+// connection is freed by TryDestroyConnection() after the last one.
+
+void CIocpHttpMultiClient::CloseConnection(CONNECTION *pConn, int nErrorCode)
+{
+	if (!pConn->bClosing)
+	{
+		pConn->bClosing = true;
+		pConn->nErrorCode = nErrorCode;
+	}
+
+	if (pConn->bConnected)
+		pConn->TcpClient.Disconnect();
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpHttpMultiClient::TryDestroyConnection(CONNECTION *pConn, DONE_LIST& DoneList,
+	CPointerList& NewConns)
+{
+	if (!pConn->bClosing || pConn->bSending || pConn->bRecvPending || m_bDestroying)
+		return;
+
+	HOST_ITEM *pHost = pConn->pHost;
+	TASK_QUEUE Retry;
+
+	for (int i = 0; i < (int)pConn->Pipeline.size(); i++)
+	{
+		TASK_ITEM *pTask = pConn->Pipeline[i];
+
+		if (i == 0 && pConn->bResponseStarted)
+		{
+			// A content without length ends when the server closes the connection.
+			bool bEof = (pConn->nRecvState == RS_CONTENT_TO_EOF &&
+				pConn->nErrorCode == EC_HTTP_SOCKET_ERROR);
+			CompleteTask(pTask, (bEof ? EC_HTTP_SUCCESS : pConn->nErrorCode), DoneList);
+		}
+		else if (pTask->nRetryCount < MAX_RETRY_COUNT)
+		{
+			// The request was not answered, so it is sent again on another connection.
+			pTask->nRetryCount++;
+			Retry.push_back(pTask);
+		}
+		else
+			CompleteTask(pTask, pConn->nErrorCode, DoneList);
+	}
+
+	for (int i = (int)Retry.size() - 1; i >= 0; i--)
+		pHost->Pending.push_front(Retry[i]);
+
+	m_Connections.Remove(pConn);
+	pHost->nConnCount--;
+	pConn->TcpClient.Disconnect();
+	delete pConn;
+
+	DispatchAll(NewConns);
+	RemoveHostIfUnused(pHost);
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpHttpMultiClient::RemoveHostIfUnused(HOST_ITEM *pHost)
+{
+	if (pHost->Pending.empty() && pHost->nConnCount == 0)
+	{
+		for (HOST_MAP::iterator iter = m_Hosts.begin(); iter != m_Hosts.end(); ++iter)
+		{
+			if (iter->second == pHost)
+			{
+				m_Hosts.erase(iter);
+				break;
+			}
+		}
+		delete pHost;
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpHttpMultiClient::CompleteTask(TASK_ITEM *pTask, int nErrorCode, DONE_LIST& DoneList)
+{
+	DONE_ITEM Item;
+	Item.pTask = pTask;
+	Item.nErrorCode = nErrorCode;
+	DoneList.push_back(Item);
+
+	m_nTaskCount--;
+}
+
+//-----------------------------------------------------------------------------
+// Calls the callback for the finished tasks and frees them. m_Lock must not be held.
+
+void CIocpHttpMultiClient::DeliverTasks(DONE_LIST& DoneList)
+{
+	for (int i = 0; i < (int)DoneList.size(); i++)
+	{
+		TASK_ITEM *pTask = DoneList[i].pTask;
+
+		if (m_OnTaskDone.pProc && !m_bDestroying)
+			m_OnTaskDone.pProc(m_OnTaskDone.pParam, this, pTask->Task, DoneList[i].nErrorCode);
+
+		delete pTask;
+	}
+
+	DoneList.clear();
+}
+
+//-----------------------------------------------------------------------------
+
+// Closes the connections idle for too long, and returns the milliseconds until the
+// next one may time out.
+UINT CIocpHttpMultiClient::CheckTimeOut()
+{
+	CAutoLocker Locker(m_Lock);
+	UINT nTicks = GetTickCount();
+
+	// The connections opened or made busy later do not time out sooner than this.
+	UINT nResult = (UINT)Max(Min(HTTP_CONN_POOL_IDLE_TIMEOUT, m_Options.nRecvResContBlockTimeOut), 0);
+
+	for (int i = 0; i < m_Connections.GetCount(); i++)
+	{
+		CONNECTION *pConn = (CONNECTION*)m_Connections[i];
+		if (!pConn->bConnected || pConn->bClosing)
+			continue;
+
+		UINT nIdleMSecs = GetTickDiff(pConn->nLastActiveTicks, nTicks);
+		UINT nTimeOut = (UINT)(pConn->Pipeline.empty() ?
+			HTTP_CONN_POOL_IDLE_TIMEOUT : m_Options.nRecvResContBlockTimeOut);
+
+		if (nIdleMSecs >= nTimeOut)
+			CloseConnection(pConn, EC_HTTP_RECV_TIMEOUT);
+		else
+			nResult = Min(nResult, nTimeOut - nIdleMSecs);
+	}
+
+	return Max(nResult, (UINT)HTTP_TIMEOUT_CHECK_MIN_INTERVAL);
+}
+
+//-----------------------------------------------------------------------------
+
+CIocpHttpMultiClient::TASK_ITEM* CIocpHttpMultiClient::GetFrontTask(CONNECTION *pConn)
+{
+	CAutoLocker Locker(m_Lock);
+	return pConn->Pipeline.empty() ? NULL : pConn->Pipeline.front();
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpHttpMultiClient::CompleteFrontTask(CONNECTION *pConn, DONE_LIST& DoneList,
+	CPointerList& NewConns)
+{
+	CAutoLocker Locker(m_Lock);
+
+	CompleteTask(pConn->Pipeline.front(), EC_HTTP_SUCCESS, DoneList);
+	pConn->Pipeline.pop_front();
+
+	pConn->nRecvState = RS_HEADER;
+	pConn->bResponseStarted = false;
+
+	if (pConn->bKeepAlive)
+		Dispatch(pConn->pHost, NewConns);
+	else
+		CloseConnection(pConn, EC_HTTP_SOCKET_ERROR);
+}
+
+//-----------------------------------------------------------------------------
+// Parses the received data, writes the content to the streams and completes the
+// tasks answered in full. Only the receiving thread of the connection calls it.
+
+int CIocpHttpMultiClient::ProcessRecvData(CONNECTION *pConn, DONE_LIST& DoneList,
+	CPointerList& NewConns)
+{
+	char *pData = pConn->RecvBuffer.Data();
+	int nPos = 0;
+	int nResult = EC_HTTP_SUCCESS;
+	bool bNeedMore = false;
+
+	while (nResult == EC_HTTP_SUCCESS && !bNeedMore && !pConn->bClosing &&
+		nPos < pConn->nRecvSize)
+	{
+		TASK_ITEM *pTask = GetFrontTask(pConn);
+		if (pTask == NULL)
+		{
+			// Data that nobody asked for.
+			nResult = EC_HTTP_RESPONSE_TEXT_ERROR;
+			break;
+		}
+
+		char *p = pData + nPos;
+		int nSize = pConn->nRecvSize - nPos;
+		CStream *pStream = pTask->Task.pResponseContent;
+
+		pConn->bResponseStarted = true;
+
+		switch (pConn->nRecvState)
+		{
+		case RS_HEADER:
+			{
+				CHttpHeaderParser& Parser = pConn->HeaderParser;
+				HTTP_PARSE_RESULT nParseResult = Parser.Feed(p, nSize);
+
+				if (nParseResult == HPR_NEED_MORE)
+				{
+					if (nSize >= pConn->RecvBuffer.GetSize())
+						nResult = EC_HTTP_RESPONSE_TEXT_ERROR;
+					bNeedMore = true;
+					break;
+				}
+
+				nPos += Parser.GetHeaderSize();
+
+				bool bOk = (nParseResult == HPR_DONE && ParseResponseHeader(Parser, pTask->Task));
+				Parser.Reset();
+				if (!bOk)
+				{
+					nResult = EC_HTTP_RESPONSE_TEXT_ERROR;
+					break;
+				}
+
+				int nCode = pTask->Task.nResponseCode;
+				CHttpResponseHeaderInfo& Header = pTask->Task.ResponseHeader;
+				CString strConnection = Header.GetConnection();
+				CString strTransferEncoding = Header.GetTransferEncoding();
+
+				if (nCode / 100 == 1)
+					break;    // interim response, the real one follows
+
+				bool bHttp11 = SameText(pTask->Task.strResponseText.Mid(5, 3), GetHttpProtoVerStr(HPV_1_1));
+				pConn->bKeepAlive = SameText(strConnection, TEXT("keep-alive")) ||
+					(bHttp11 && !SameText(strConnection, TEXT("close")));
+
+				if (nCode == 204 || nCode == 304)
+					CompleteFrontTask(pConn, DoneList, NewConns);
+				else if (strTransferEncoding.MakeLower().Find(TEXT("chunked")) >= 0)
+					pConn->nRecvState = RS_CHUNK_SIZE;
+				else if (Header.HasContentLength())
+				{
+					pConn->nRecvState = RS_CONTENT;
+					pConn->nRemainSize = Header.GetContentLength();
+					if (pConn->nRemainSize == 0)
+						CompleteFrontTask(pConn, DoneList, NewConns);
+				}
+				else
+				{
+					pConn->nRecvState = RS_CONTENT_TO_EOF;
+					pConn->bKeepAlive = false;
+				}
+
+				// Only HTTP/1.1 servers are trusted to answer pipelined requests in order.
+				if (pConn->bKeepAlive && bHttp11)
+					pConn->bPersistent = true;
+				break;
+			}
+
+		case RS_CONTENT:
+		case RS_CONTENT_TO_EOF:
+			{
+				int nBlockSize = (pConn->nRecvState == RS_CONTENT ?
+					(int)Min((INT64)nSize, pConn->nRemainSize) : nSize);
+
+				if (pStream)
+					pStream->WriteBuffer(p, nBlockSize);
+				nPos += nBlockSize;
+
+				if (pConn->nRecvState == RS_CONTENT)
+				{
+					pConn->nRemainSize -= nBlockSize;
+					if (pConn->nRemainSize == 0)
+						CompleteFrontTask(pConn, DoneList, NewConns);
+				}
+				break;
+			}
+
+		case RS_CHUNK_SIZE:
+		case RS_CHUNK_TRAILER:
+			{
+				int nLineSize = -1;
+				for (int i = 0; i + 2 <= nSize && nLineSize < 0; i++)
+					if (p[i] == '\r' && p[i+1] == '\n')
+						nLineSize = i;
+
+				if (nLineSize < 0)
+				{
+					if (nSize >= pConn->RecvBuffer.GetSize())
+						nResult = EC_HTTP_RESPONSE_TEXT_ERROR;
+					bNeedMore = true;
+					break;
+				}
+
+				nPos += nLineSize + 2;
+
+				if (pConn->nRecvState == RS_CHUNK_TRAILER)
+				{
+					if (nLineSize == 0)
+						CompleteFrontTask(pConn, DoneList, NewConns);
+				}
+				else
+				{
+					std::string strLine(p, nLineSize);
+					INT64 nChunkSize = (INT64)strtoul(strLine.c_str(), NULL, 16);
+
+					if (nChunkSize == 0)
+						pConn->nRecvState = RS_CHUNK_TRAILER;
+					else
+					{
+						pConn->nRecvState = RS_CHUNK_DATA;
+						pConn->nRemainSize = nChunkSize + 2;
+					}
+				}
+				break;
+			}
+
+		case RS_CHUNK_DATA:
+			{
+				int nBlockSize = (int)Min((INT64)nSize, pConn->nRemainSize);
+				int nDataSize = (int)Min((INT64)nBlockSize, Max(pConn->nRemainSize - 2, (INT64)0));
+
+				if (pStream && nDataSize > 0)
+					pStream->WriteBuffer(p, nDataSize);
+				nPos += nBlockSize;
+
+				pConn->nRemainSize -= nBlockSize;
+				if (pConn->nRemainSize == 0)
+					pConn->nRecvState = RS_CHUNK_SIZE;
+				break;
+			}
+		}
+	}
+
+	// Keep the unparsed bytes at the head of the buffer for the next receive.
+	if (nPos > 0)
+	{
+		if (nPos < pConn->nRecvSize)
+			memmove(pData, pData + nPos, pConn->nRecvSize - nPos);
+		pConn->nRecvSize -= nPos;
+	}
+
+	return nResult;
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpHttpMultiClient::OnSendComplete(CONNECTION *pConn, const CIocpTaskData& TaskData)
+{
+	DONE_LIST DoneList;
+	CPointerList NewConns;
+
+	{
+		CAutoLocker Locker(m_Lock);
+
+		if (TaskData.GetErrorCode() == 0 && !pConn->bClosing &&
+			TaskData.GetBytesTrans() < TaskData.GetDataSize())
+		{
+			GetIocp().Send((SOCKET)TaskData.GetFileHandle(),
+				TaskData.GetEntireDataBuf(),
+				TaskData.GetEntireDataSize(),
+				(int)(TaskData.GetDataBuf() - TaskData.GetEntireDataBuf() + TaskData.GetBytesTrans()),
+				CIocpHttpConnHandler(pConn), this);
+			return;
+		}
+
+		pConn->bSending = false;
+
+		if (TaskData.GetErrorCode() != 0)
+			CloseConnection(pConn, EC_HTTP_IOCP_ERROR);
+		else if (pConn->nUnsentCount > 0 && !pConn->bClosing)
+			StartSend(pConn);
+
+		TryDestroyConnection(pConn, DoneList, NewConns);
+	}
+
+	StartConnections(NewConns);
+	DeliverTasks(DoneList);
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpHttpMultiClient::OnRecvComplete(CONNECTION *pConn, const CIocpTaskData& TaskData)
+{
+	DONE_LIST DoneList;
+	CPointerList NewConns;
+	int nErrorCode = EC_HTTP_SOCKET_ERROR;
+
+	// A zero-byte receive (the server has closed the connection) is reported as an error too.
+	if (TaskData.GetErrorCode() == 0 && !m_bDestroying)
+	{
+		pConn->nRecvSize += TaskData.GetBytesTrans();
+
+		try
+		{
+			nErrorCode = ProcessRecvData(pConn, DoneList, NewConns);
+		}
+		catch (IFC_EXCEPT_OBJ e)
+		{
+			IFC_DELETE_MFC_EXCEPT_OBJ(e);
+			nErrorCode = EC_HTTP_UNKNOWN_ERROR;
+		}
+	}
+
+	{
+		CAutoLocker Locker(m_Lock);
+
+		pConn->bRecvPending = false;
+		pConn->nLastActiveTicks = GetTickCount();
+
+		if (nErrorCode == EC_HTTP_SUCCESS && !pConn->bClosing)
+			PostRecv(pConn);
+		else
+			CloseConnection(pConn, nErrorCode);
+
+		TryDestroyConnection(pConn, DoneList, NewConns);
+	}
+
+	StartConnections(NewConns);
+	DeliverTasks(DoneList);
 }
 
 //-----------------------------------------------------------------------------
+// Called by the connector pool with its lock held, so the new connections are
+// handed to it directly rather than through another thread.
 
-int CHttpClient::SendRequestContent()
+void CIocpHttpMultiClient::TcpConnectResultProc(void *pParam, CTcpClient *pTcpClient, bool bSuccess)
 {
-	int nResult = EC_HTTP_SUCCESS;
+	CONNECTION *pConn = (CONNECTION*)pParam;
+	CIocpHttpMultiClient *pThis = pConn->pOwner;
+	DONE_LIST DoneList;
+	CPointerList NewConns;
 
-	CStream *pStream = m_Request.GetContentStream();
-	if (!pStream) return nResult;
+	{
+		CAutoLocker Locker(pThis->m_Lock);
 
-	const int BLOCK_SIZE = 1024*64;
+		if (pThis->m_bDestroying) return;
 
-	CBuffer Buffer(BLOCK_SIZE);
+		if (bSuccess)
+			bSuccess = pThis->GetIocp().AssociateHandle(pTcpClient->GetSocket().GetHandle());
 
-	while (true)
-	{
-		int nReadSize = pStream->Read(Buffer.Data(), BLOCK_SIZE);
-		if (nReadSize > 0)
+		if (bSuccess)
 		{
-			int r = m_TcpClient.SendBuffer(Buffer.Data(), nReadSize, true, m_Options.nSendReqContBlockTimeOut);
-			if (r < 0)
+			pConn->bConnected = true;
+			pConn->nLastActiveTicks = GetTickCount();
+			pThis->PostRecv(pConn);
+			pThis->Dispatch(pConn->pHost, NewConns);
+		}
+		else
+		{
+			HOST_ITEM *pHost = pConn->pHost;
+
+			pThis->m_Connections.Remove(pConn);
+			pHost->nConnCount--;
+			pTcpClient->Disconnect();
+			delete pConn;
+
+			// Nothing will take the waiting tasks if no connection to the host is working.
+			bool bHostAlive = false;
+			for (int i = 0; i < pThis->m_Connections.GetCount() && !bHostAlive; i++)
 			{
-				nResult = EC_HTTP_SOCKET_ERROR;
-				break;
+				CONNECTION *p = (CONNECTION*)pThis->m_Connections[i];
+				bHostAlive = (p->pHost == pHost && p->bConnected && !p->bClosing);
 			}
-			else if (r != nReadSize)
+
+			if (!bHostAlive)
 			{
-				nResult = EC_HTTP_SEND_TIMEOUT;
-				break;
+				while (!pHost->Pending.empty())
+				{
+					pThis->CompleteTask(pHost->Pending.front(), EC_HTTP_SOCKET_ERROR, DoneList);
+					pHost->Pending.pop_front();
+				}
 			}
-		}
 
-		if (nReadSize < BLOCK_SIZE) break;
+			pThis->DispatchAll(NewConns);
+			pThis->RemoveHostIfUnused(pHost);
+		}
 	}
 
-	return nResult;
+	pThis->StartConnections(NewConns);
+	pThis->DeliverTasks(DoneList);
 }
 
 //-----------------------------------------------------------------------------
 
-int CHttpClient::RecvResponseHeader()
+bool CIocpHttpMultiClient::AddTask(LPCTSTR lpszUrl, CStream *pResponseContent, PVOID pUserData)
 {
-	const int RECV_TIMEOUT = m_Options.nRecvResHeaderTimeOut;
+	CUrl Url(lpszUrl);
+	if (Url.GetHost().IsEmpty())
+		return false;
 
-	int nResult = EC_HTTP_SUCCESS;
-	UINT nStartTicks = GetTickCount();
+	int nPort = StrToInt(Url.GetPort(), DEFAULT_HTTP_PORT);
+	CString strHostKey = Url.GetHost() + TEXT(":") + IntToStr(nPort);
+	strHostKey.MakeLower();
+
+	CPointerList NewConns;
 
-	do
 	{
-		CMemoryStream Stream;
-		char ch;
+		CAutoLocker Locker(m_Lock);
 
-		while (true)
+		HOST_ITEM *pHost;
+		HOST_MAP::iterator iter = m_Hosts.find(strHostKey);
+		if (iter != m_Hosts.end())
+			pHost = iter->second;
+		else
 		{
-			int nRemainTimeOut = Max(0, RECV_TIMEOUT - (int)GetTickDiff(nStartTicks, GetTickCount()));
+			pHost = new HOST_ITEM();
+			pHost->strHost = Url.GetHost();
+			pHost->nPort = nPort;
+			pHost->nConnCount = 0;
+			m_Hosts[strHostKey] = pHost;
+		}
 
-			int r = m_TcpClient.RecvBuffer(&ch, sizeof(ch), true, nRemainTimeOut);
-			if (r < 0)
-			{
-				nResult = EC_HTTP_SOCKET_ERROR;
-				break;
-			}
-			else if (r > 0)
-			{
-				Stream.Write(&ch, sizeof(ch));
+		TASK_ITEM *pTask = new TASK_ITEM();
+		pTask->Task.strUrl = lpszUrl;
+		pTask->Task.pResponseContent = pResponseContent;
+		pTask->Task.pUserData = pUserData;
+		pTask->pHost = pHost;
+		pTask->strRequest = MakeRequestText(Url);
+		pTask->nRetryCount = 0;
 
-				bool bFinished, bError;
-				CheckResponseHeader(Stream.GetMemory(), (int)Stream.GetSize(), bFinished, bError);
-				if (bError)
-				{
-					nResult = EC_HTTP_RESPONSE_TEXT_ERROR;
-					break;
-				}
-				if (bFinished)
-					break;
-			}
+		pHost->Pending.push_back(pTask);
+		m_nTaskCount++;
 
-			if (GetTickDiff(nStartTicks, GetTickCount()) > (UINT)RECV_TIMEOUT)
-			{
-				nResult = EC_HTTP_RECV_TIMEOUT;
-				break;
-			}
-		}
+		Dispatch(pHost, NewConns);
+	}
 
-		if (nResult == EC_HTTP_SUCCESS)
-		{
-			if (!ParseResponseHeader(Stream.GetMemory(), (int)Stream.GetSize()))
-				nResult = EC_HTTP_RESPONSE_TEXT_ERROR;
-		}
+	StartConnections(NewConns);
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpHttpMultiClient::SetTaskDoneCallBack(IOCPHTTP_ONTASKDONE_PROC pProc, void *pParam)
+{
+	m_OnTaskDone.pProc = pProc;
+	m_OnTaskDone.pParam = pParam;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CHttpSegmentedDownloader::CSegmentThread
+
+void CHttpSegmentedDownloader::CSegmentThread::Execute()
+{
+	m_Owner.DownloadSegment(m_nIndex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CHttpSegmentedDownloader
+
+CHttpSegmentedDownloader::CHttpSegmentedDownloader() :
+	m_nFileSize(0),
+	m_nSegmentCount(HTTP_SEG_SEGMENT_COUNT)
+{
+	// nothing
+}
+
+//-----------------------------------------------------------------------------
+
+// Finds the file size and the range support with a one-byte range request.
+int CHttpSegmentedDownloader::Probe(bool& bAcceptRanges, bool& bEmptyFile)
+{
+	CHttpClient HttpClient;
+	HttpClient.Options() = m_Options;
+	HttpClient.HttpRequest().SetRange(0, 0);
+
+	bAcceptRanges = false;
+	bEmptyFile = false;
+	int nResult = HttpClient.RequestFile(m_strUrl);
+	HttpClient.Disconnect();
+
+	// The range 0-0 is not satisfiable (416) only if the file is empty.
+	CHttpResponse& Response = HttpClient.HttpResponse();
+	if (Response.GetResponseCode() == 416 ||
+		(nResult == EC_HTTP_SUCCESS && Response.GetResponseCode() / 100 == 2 &&
+		Response.GetContentLength() == 0))
+	{
+		bEmptyFile = true;
+		return EC_HTTP_SUCCESS;
 	}
-	while (m_Response.GetResponseCode() == 100 && nResult == EC_HTTP_SUCCESS);
 
-	return nResult;
+	if (nResult != EC_HTTP_SUCCESS)
+		return nResult;
+
+	if (Response.GetResponseCode() == 206 && Response.HasContentRangeInstance())
+	{
+		bAcceptRanges = true;
+		m_nFileSize = Response.GetContentRangeInstanceLength();
+		m_strETag = Response.GetETag();
+		m_strLastModified = Response.GetLastModified();
+	}
+
+	return EC_HTTP_SUCCESS;
+}
+
+//-----------------------------------------------------------------------------
+
+// Loads the segment map of an unfinished download of the same file.
+bool CHttpSegmentedDownloader::LoadMap()
+{
+	CString strMapFileName = GetMapFileName();
+	if (!FileExists(strMapFileName) || ifc::GetFileSize(m_strLocalFileName) != m_nFileSize)
+		return false;
+
+	CMemIniFile IniFile(strMapFileName);
+	LPCTSTR lpszSection = TEXT("Download");
+
+	if (IniFile.ReadString(lpszSection, TEXT("Url")) != m_strUrl ||
+		StrToInt64(IniFile.ReadString(lpszSection, TEXT("FileSize")), -1) != m_nFileSize ||
+		IniFile.ReadString(lpszSection, TEXT("ETag")) != m_strETag ||
+		IniFile.ReadString(lpszSection, TEXT("LastModified")) != m_strLastModified)
+		return false;
+
+	int nCount = IniFile.ReadInteger(lpszSection, TEXT("SegmentCount"), 0);
+	if (nCount <= 0)
+		return false;
+
+	SEGMENT_LIST Segments;
+	INT64 nNextStart = 0;
+
+	for (int i = 0; i < nCount; i++)
+	{
+		CString strSection = FormatString(TEXT("Segment%d"), i);
+		SEGMENT Segment;
+
+		Segment.nStart = StrToInt64(IniFile.ReadString(strSection, TEXT("Start")), -1);
+		Segment.nEnd = StrToInt64(IniFile.ReadString(strSection, TEXT("End")), -1);
+		Segment.nDoneSize = StrToInt64(IniFile.ReadString(strSection, TEXT("DoneSize")), -1);
+		Segment.nErrorCode = EC_HTTP_SUCCESS;
+
+		// The ranges must cover the file one after another.
+		if (Segment.nStart != nNextStart || Segment.nEnd < Segment.nStart ||
+			Segment.nDoneSize < 0 || Segment.nDoneSize > Segment.nEnd - Segment.nStart + 1)
+			return false;
+
+		nNextStart = Segment.nEnd + 1;
+		Segments.push_back(Segment);
+	}
+
+	if (nNextStart != m_nFileSize)
+		return false;
+
+	m_Segments = Segments;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+
+// Writes the segment map to a temporary file and then replaces the old one with it.
+void CHttpSegmentedDownloader::SaveMap()
+{
+	SEGMENT_LIST Segments;
+	{
+		CAutoLocker Locker(m_Lock);
+		Segments = m_Segments;
+	}
+
+	CString strMapFileName = GetMapFileName();
+	CString strTempFileName = strMapFileName + TEXT(".tmp");
+	LPCTSTR lpszSection = TEXT("Download");
+
+	CMemIniFile IniFile(strTempFileName);
+	IniFile.Clear();
+	IniFile.WriteString(lpszSection, TEXT("Url"), m_strUrl);
+	IniFile.WriteString(lpszSection, TEXT("FileSize"), IntToStr(m_nFileSize));
+	IniFile.WriteString(lpszSection, TEXT("ETag"), m_strETag);
+	IniFile.WriteString(lpszSection, TEXT("LastModified"), m_strLastModified);
+	IniFile.WriteInteger(lpszSection, TEXT("SegmentCount"), (int)Segments.size());
+
+	for (int i = 0; i < (int)Segments.size(); i++)
+	{
+		CString strSection = FormatString(TEXT("Segment%d"), i);
+		IniFile.WriteString(strSection, TEXT("Start"), IntToStr(Segments[i].nStart));
+		IniFile.WriteString(strSection, TEXT("End"), IntToStr(Segments[i].nEnd));
+		IniFile.WriteString(strSection, TEXT("DoneSize"), IntToStr(Segments[i].nDoneSize));
+	}
+
+	IniFile.UpdateFile();
+	MoveFileEx(strTempFileName, strMapFileName, MOVEFILE_REPLACE_EXISTING);
+}
+
+//-----------------------------------------------------------------------------
+
+void CHttpSegmentedDownloader::SplitSegments()
+{
+	INT64 nCount = Max((INT64)1, Min((INT64)m_nSegmentCount, m_nFileSize / HTTP_SEG_MIN_SEGMENT_SIZE));
+	INT64 nSegmentSize = m_nFileSize / nCount;
+
+	m_Segments.clear();
+	for (INT64 i = 0; i < nCount; i++)
+	{
+		SEGMENT Segment;
+		Segment.nStart = i * nSegmentSize;
+		Segment.nEnd = (i == nCount - 1 ? m_nFileSize : Segment.nStart + nSegmentSize) - 1;
+		Segment.nDoneSize = 0;
+		Segment.nErrorCode = EC_HTTP_SUCCESS;
+		m_Segments.push_back(Segment);
+	}
 }
 
 //-----------------------------------------------------------------------------
 
-int CHttpClient::RecvResponseContent()
+// Called in the segment thread. Requests the rest of the range until it is done,
+// giving up after HTTP_SEG_MAX_RETRY_COUNT attempts in a row without progress.
+void CHttpSegmentedDownloader::DownloadSegment(int nIndex)
 {
+	CHttpClient HttpClient;
+	HttpClient.Options() = m_Options;
+
+	CFileStream FileStream;
+	CBuffer Buffer(HTTP_SEG_RECV_BLOCK_SIZE);
 	int nResult = EC_HTTP_SUCCESS;
-	if (!m_Response.GetContentStream()) return nResult;
+	int nRetryCount = 0;
 
-	CString strTransferEncoding = m_Response.GetTransferEncoding();
-	if (strTransferEncoding.MakeLower().Find(TEXT("chunked")) >= 0)
+	if (!FileStream.Open(m_strLocalFileName, FM_OPEN_WRITE | FM_SHARE_DENY_NONE))
+		nResult = EC_HTTP_CANNOT_CREATE_FILE;
+
+	while (FileStream.IsOpen())
 	{
-		while (true)
+		INT64 nPos, nEnd;
 		{
-			int nTimeOut = m_Options.nRecvResContBlockTimeOut;
-			UINT nChunkSize = 0;
-			nResult = ReadChunkSize(nChunkSize, nTimeOut);
-			if (nResult != EC_HTTP_SUCCESS)
-				break;
+			CAutoLocker Locker(m_Lock);
+			SEGMENT& Segment = m_Segments[nIndex];
+			nPos = Segment.nStart + Segment.nDoneSize;
+			nEnd = Segment.nEnd;
+		}
 
-			if (nChunkSize != 0)
-			{
-				nResult = ReadStream(*m_Response.GetContentStream(), nChunkSize, nTimeOut);
-				if (nResult != EC_HTTP_SUCCESS)
-					break;
+		if (nPos > nEnd)
+		{
+			nResult = EC_HTTP_SUCCESS;
+			break;
+		}
 
-				CString strCrLf;
-				nResult = ReadLine(strCrLf, nTimeOut);
-				if (nResult != EC_HTTP_SUCCESS)
-					break;
+		nResult = ReceiveRange(HttpClient, FileStream, Buffer, nIndex, nPos, nEnd);
+		if (nResult != EC_HTTP_SUCCESS)
+		{
+			HttpClient.Disconnect();
+
+			bool bProgressed;
+			{
+				CAutoLocker Locker(m_Lock);
+				SEGMENT& Segment = m_Segments[nIndex];
+				bProgressed = (Segment.nStart + Segment.nDoneSize > nPos);
 			}
-			else
+
+			nRetryCount = (bProgressed ? 0 : nRetryCount + 1);
+			if (nRetryCount > HTTP_SEG_MAX_RETRY_COUNT)
 				break;
+
+			// Backs off before asking the server again.
+			Sleep(HTTP_SEG_RETRY_DELAY << nRetryCount);
 		}
 	}
+
+	CAutoLocker Locker(m_Lock);
+	m_Segments[nIndex].nErrorCode = nResult;
+}
+
+//-----------------------------------------------------------------------------
+
+// Checks that the response is of the probed file. Last-Modified is compared when
+// the server sends no ETag.
+bool CHttpSegmentedDownloader::IsSameFile(CHttpResponse& Response)
+{
+	if (!m_strETag.IsEmpty() || !Response.GetETag().IsEmpty())
+		return Response.GetETag() == m_strETag;
 	else
+		return Response.GetLastModified() == m_strLastModified;
+}
+
+//-----------------------------------------------------------------------------
+
+// Receives the bytes from nPos to nEnd of the file and writes them at their offset.
+int CHttpSegmentedDownloader::ReceiveRange(CHttpClient& HttpClient, CFileStream& FileStream,
+	CBuffer& Buffer, int nIndex, INT64 nPos, INT64 nEnd)
+{
+	HttpClient.HttpRequest().SetRange(nPos, nEnd);
+
+	int nResult = HttpClient.RequestFile(m_strUrl);
+	if (nResult != EC_HTTP_SUCCESS)
+		return nResult;
+
+	// The server must send the range asked for, of the same file.
+	CHttpResponse& Response = HttpClient.HttpResponse();
+	if (Response.GetResponseCode() != 206 || Response.GetContentRangeStart() != nPos ||
+		!IsSameFile(Response))
+		return EC_HTTP_CANNOT_RECV_CONTENT;
+
+	FileStream.SetPosition(nPos);
+
+	while (nPos <= nEnd)
 	{
-		INT64 nContentLength = m_Response.GetContentLength();
-		if (nContentLength <= 0)
-			nResult = EC_HTTP_CONTENT_LENGTH_ERROR;
+		int nSize = (int)Min(nEnd - nPos + 1, (INT64)Buffer.GetSize());
+		int nRecvSize = HttpClient.ReceiveFile(Buffer.Data(), nSize,
+			m_Options.nRecvResContBlockTimeOut);
 
-		if (nResult == EC_HTTP_SUCCESS)
+		if (nRecvSize < 0)
+			return EC_HTTP_SOCKET_ERROR;
+		if (nRecvSize == 0)
+			return EC_HTTP_RECV_TIMEOUT;
+		if (FileStream.Write(Buffer.Data(), nRecvSize) != nRecvSize)
+			return EC_HTTP_CANNOT_CREATE_FILE;
+
+		nPos += nRecvSize;
+
+		CAutoLocker Locker(m_Lock);
+		m_Segments[nIndex].nDoneSize += nRecvSize;
+	}
+
+	return EC_HTTP_SUCCESS;
+}
+
+//-----------------------------------------------------------------------------
+
+int CHttpSegmentedDownloader::Download(LPCTSTR lpszUrl, LPCTSTR lpszLocalFileName)
+{
+	m_strUrl = lpszUrl;
+	m_strLocalFileName = lpszLocalFileName;
+	m_nFileSize = 0;
+	m_strETag.Empty();
+	m_strLastModified.Empty();
+	m_Segments.clear();
+
+	bool bAcceptRanges, bEmptyFile;
+	int nResult = Probe(bAcceptRanges, bEmptyFile);
+	if (nResult != EC_HTTP_SUCCESS)
+		return nResult;
+
+	if (bEmptyFile)
+	{
+		DeleteFile(GetMapFileName());
+		ForceDirectories(ExtractFilePath(lpszLocalFileName));
+
+		CFileStream FileStream;
+		if (!FileStream.Open(lpszLocalFileName, FM_CREATE | FM_SHARE_DENY_WRITE))
+			return EC_HTTP_CANNOT_CREATE_FILE;
+		return EC_HTTP_SUCCESS;
+	}
+
+	if (!bAcceptRanges)
+	{
+		DeleteFile(GetMapFileName());
+
+		CHttpClient HttpClient;
+		HttpClient.Options() = m_Options;
+		return HttpClient.DownloadFile(m_strUrl, m_strLocalFileName);
+	}
+
+	if (!LoadMap())
+	{
+		ForceDirectories(ExtractFilePath(lpszLocalFileName));
+
+		CFileStream FileStream;
+		if (!FileStream.Open(lpszLocalFileName, FM_CREATE | FM_SHARE_DENY_WRITE))
+			return EC_HTTP_CANNOT_CREATE_FILE;
+		FileStream.SetSize(m_nFileSize);
+		FileStream.Close();
+
+		SplitSegments();
+		SaveMap();
+	}
+
+	CPointerList Threads;
+	for (int i = 0; i < (int)m_Segments.size(); i++)
+	{
+		if (m_Segments[i].nDoneSize > m_Segments[i].nEnd - m_Segments[i].nStart)
+			continue;
+
+		CSegmentThread *pThread = new CSegmentThread(*this, i);
+		Threads.Add(pThread);
+		pThread->Run();
+	}
+
+	// Saves the progress while the threads are running.
+	for (int i = 0; i < Threads.GetCount(); i++)
+	{
+		CSegmentThread *pThread = (CSegmentThread*)Threads[i];
+		while (WaitForSingleObject(pThread->GetHandle(), HTTP_SEG_SAVE_MAP_INTERVAL) == WAIT_TIMEOUT)
 		{
-			const int BLOCK_SIZE = 1024*64;
+			SaveMap();
+			if (m_OnProgress.pProc)
+				m_OnProgress.pProc(m_OnProgress.pParam, this, GetDoneSize(), m_nFileSize);
+		}
+
+		pThread->WaitFor();
+		delete pThread;
+	}
+
+	nResult = EC_HTTP_SUCCESS;
+	for (int i = 0; i < (int)m_Segments.size(); i++)
+		if (m_Segments[i].nErrorCode != EC_HTTP_SUCCESS)
+		{
+			nResult = m_Segments[i].nErrorCode;
+			break;
+		}
+
+	if (nResult == EC_HTTP_SUCCESS)
+		DeleteFile(GetMapFileName());
+	else
+		SaveMap();
+
+	if (m_OnProgress.pProc)
+		m_OnProgress.pProc(m_OnProgress.pParam, this, GetDoneSize(), m_nFileSize);
+
+	return nResult;
+}
+
+//-----------------------------------------------------------------------------
+
+void CHttpSegmentedDownloader::SetProgressCallBack(HTTPSEG_ONPROGRESS_PROC pProc, void *pParam)
+{
+	m_OnProgress.pProc = pProc;
+	m_OnProgress.pParam = pParam;
+}
+
+//-----------------------------------------------------------------------------
+
+INT64 CHttpSegmentedDownloader::GetDoneSize()
+{
+	CAutoLocker Locker(m_Lock);
+
+	INT64 nResult = 0;
+	for (int i = 0; i < (int)m_Segments.size(); i++)
+		nResult += m_Segments[i].nDoneSize;
+	return nResult;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CHttpServerRequest
 
-			INT64 nRemainSize = nContentLength;
-			CBuffer Buffer(BLOCK_SIZE);
+bool CHttpServerRequest::GetKeepAlive() const
+{
+	if (m_nProtocolVersion == HPV_1_0)
+		return SameText(GetConnection(), TEXT("keep-alive"));
+	else
+		return !SameText(GetConnection(), TEXT("close"));
+}
 
-			while (nRemainSize > 0)
-			{
-				int nBlockSize = (int)Min(nRemainSize, (INT64)BLOCK_SIZE);
-				int nRecvSize = m_TcpClient.RecvBuffer(Buffer.Data(), nBlockSize,
-					true, m_Options.nRecvResContBlockTimeOut);
+///////////////////////////////////////////////////////////////////////////////
+// CHttpServerResponse
 
-				if (nRecvSize < 0)
-				{
-					nResult = EC_HTTP_SOCKET_ERROR;
-					break;
-				}
+CHttpServerResponse::CHttpServerResponse() :
+	m_nStatusCode(200),
+	m_strStatusText(TEXT("OK")),
+	m_nContentSize(0)
+{
+	m_strCacheControl.Empty();
+	m_strPragma.Empty();
+}
 
-				nRemainSize -= nRecvSize;
-				m_Response.GetContentStream()->WriteBuffer(Buffer.Data(), nRecvSize);
-			}
-		}
-	}
+//-----------------------------------------------------------------------------
 
-	return nResult;
+void CHttpServerResponse::BuildHeaders()
+{
+	CHttpResponseHeaderInfo::BuildHeaders();
+
+	if (!m_strLocation.IsEmpty())
+		m_RawHeaders.SetValue(TEXT("Location"), m_strLocation);
+	if (!m_strServer.IsEmpty())
+		m_RawHeaders.SetValue(TEXT("Server"), m_strServer);
 }
 
 //-----------------------------------------------------------------------------
 
-int CHttpClient::Get(LPCTSTR lpszUrl, CStream *pResponseContent)
+void CHttpServerResponse::SetStatus(int nCode, LPCTSTR lpszText)
 {
-	return ExecuteHttpAction(HMT_GET, lpszUrl, NULL, pResponseContent);
+	m_nStatusCode = nCode;
+	m_strStatusText = (lpszText != NULL ? CString(lpszText) : GetHttpStatusText(nCode));
 }
 
 //-----------------------------------------------------------------------------
 
-int CHttpClient::Post(LPCTSTR lpszUrl, CStream *pRequestContent, CStream *pResponseContent)
+void CHttpServerResponse::Write(const void *pBuffer, int nSize)
 {
-	IFC_ASSERT(pRequestContent != NULL);
-	return ExecuteHttpAction(HMT_POST, lpszUrl, pRequestContent, pResponseContent);
+	if (m_nContentSize + nSize > m_Content.GetSize())
+		m_Content.SetSize(Max(m_nContentSize + nSize, m_Content.GetSize() * 2));
+
+	memcpy(m_Content.Data() + m_nContentSize, pBuffer, nSize);
+	m_nContentSize += nSize;
 }
 
 //-----------------------------------------------------------------------------
 
-int CHttpClient::DownloadFile(LPCTSTR lpszUrl, LPCTSTR lpszLocalFileName)
+void CHttpServerResponse::SetProducer(HTTPSVR_ON_PRODUCE_PROC pProc, void *pParam)
 {
-	ForceDirectories(ExtractFilePath(lpszLocalFileName));
-	CFileStream fs;
-	if (!fs.Open(lpszLocalFileName, FM_CREATE | FM_SHARE_DENY_WRITE))
-		return EC_HTTP_CANNOT_CREATE_FILE;
+	m_Producer.pProc = pProc;
+	m_Producer.pParam = pParam;
+}
 
-	int nResult = Get(lpszUrl, &fs);
-	if (nResult != EC_HTTP_SUCCESS)
-		DeleteFile(lpszLocalFileName);
-	return nResult;
+///////////////////////////////////////////////////////////////////////////////
+// CHttpServerSendHandler
+
+struct CHttpServerSendHandler
+{
+	CHttpServer *pServer;
+	CHttpServer::CONNECTION *pConn;
+
+	void operator() (const CIocpTaskData& TaskData) const
+	{
+		pServer->OnSendComplete(pConn, TaskData);
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// CHttpServer::CCheckThread
+
+CHttpServer::CCheckThread::CCheckThread(CHttpServer& Owner) :
+	m_Owner(Owner)
+{
+	m_hWakeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
 }
 
 //-----------------------------------------------------------------------------
 
-int CHttpClient::RequestFile(LPCTSTR lpszUrl)
+CHttpServer::CCheckThread::~CCheckThread()
 {
-	bool bCanRecvContent;
-	int nResult = ExecuteHttpRequest(HMT_GET, lpszUrl, NULL, NULL, true, bCanRecvContent);
-	if (nResult != EC_HTTP_SUCCESS || !bCanRecvContent)
-		TcpDisconnect(true);
-	return nResult;
+	CloseHandle(m_hWakeEvent);
 }
 
 //-----------------------------------------------------------------------------
 
-int CHttpClient::ReceiveFile(void *pBuffer, int nSize, int nTimeOutMSecs)
+// Sleeps until the next connection may time out, or until Close() terminates it.
+void CHttpServer::CCheckThread::Execute()
 {
-	return m_TcpClient.RecvBuffer(pBuffer, nSize, true, nTimeOutMSecs);
+	UINT nWaitMSecs = 0;
+
+	while (!GetTerminated())
+	{
+		WaitForSingleObject(m_hWakeEvent, nWaitMSecs);
+		if (!GetTerminated())
+			nWaitMSecs = m_Owner.CheckTimeOut();
+	}
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// CIocpHttpClient
-
-CIocpHttpClient::CIocpHttpClient() :
-	m_nCurOpType(OT_NONE),
-	m_nCurOpStep(OS_NONE),
-	m_nErrorCode(EC_HTTP_SUCCESS),
-	m_nHttpMethod(HMT_GET),
-	m_pRequestContent(NULL),
-	m_pResponseContent(NULL),
-	m_nReqStreamPos(0),
-	m_nResStreamPos(0),
-	m_nRemainContentSize(0),
-	m_bWorking(false),
-	m_bDestroying(false)
+// CHttpServer
+
+CHttpServer::CHttpServer() :
+	m_nLiveConnCount(0),
+	m_nKeepAliveTimeOut(HTTP_SVR_KEEP_ALIVE_TIMEOUT),
+	m_strServerName(TEXT("IFC")),
+	m_nRequestCount(0),
+	m_pCheckThread(NULL)
 {
-	// nothing
+	m_hNoConnEvent = CreateEvent(NULL, TRUE, TRUE, NULL);
+	m_TcpServer.SetOnAcceptConnCallBack(OnAcceptConnProc, this);
+	m_TcpServer.SetOnReadableCallBack(OnReadableProc, this);
 }
 
 //-----------------------------------------------------------------------------
 
-CIocpHttpClient::~CIocpHttpClient()
+CHttpServer::~CHttpServer()
 {
-	IFC_ASSERT(IsIocpObjectAvailable());
-	IFC_ASSERT(!GetIocpObject().IsInWorkerThread());
-
-	m_bDestroying = true;
-	GetTcpConnectorPoolObject().RemoveTask(&m_TcpClient);
-	m_TcpClient.Disconnect();
-	GetIocpObject().WaitForComplete(this);
-	Finalize();
+	Close();
+	CloseHandle(m_hNoConnEvent);
 }
 
 //-----------------------------------------------------------------------------
 
-void CIocpHttpClient::InvokeCallBack()
+CString CHttpServer::GetContentTypeByExt(const CString& strFileName)
 {
-	class CAutoFinalizer
-	{
-	private:
-		CIocpHttpClient& m_Owner;
-	public:
-		CAutoFinalizer(CIocpHttpClient& Owner) : m_Owner(Owner) {}
-		~CAutoFinalizer() { m_Owner.m_bWorking = false; }
-	} AutoFinalizer(*this);
+	CString strExt = ExtractFileExt(strFileName);
+
+	if (SameText(strExt, TEXT(".html")) || SameText(strExt, TEXT(".htm")))
+		return TEXT("text/html");
+	if (SameText(strExt, TEXT(".txt")))
+		return TEXT("text/plain");
+	if (SameText(strExt, TEXT(".css")))
+		return TEXT("text/css");
+	if (SameText(strExt, TEXT(".js")))
+		return TEXT("application/javascript");
+	if (SameText(strExt, TEXT(".json")))
+		return TEXT("application/json");
+	if (SameText(strExt, TEXT(".xml")))
+		return TEXT("text/xml");
+	if (SameText(strExt, TEXT(".png")))
+		return TEXT("image/png");
+	if (SameText(strExt, TEXT(".jpg")) || SameText(strExt, TEXT(".jpeg")))
+		return TEXT("image/jpeg");
+	if (SameText(strExt, TEXT(".gif")))
+		return TEXT("image/gif");
+	if (SameText(strExt, TEXT(".svg")))
+		return TEXT("image/svg+xml");
+	if (SameText(strExt, TEXT(".ico")))
+		return TEXT("image/x-icon");
+
+	return TEXT("application/octet-stream");
+}
 
-	Finalize();
+//-----------------------------------------------------------------------------
 
-	OPER_TYPE nOldOpType = m_nCurOpType;
-	m_nCurOpType = OT_NONE;
+// Returns the route with the same path, or else the longest matching "xxx*" route.
+const CHttpServer::ROUTE_ITEM* CHttpServer::FindRoute(const CHttpServerRequest& Request)
+{
+	const ROUTE_ITEM *pResult = NULL;
+	int nMatchLen = -1;
 
-	switch (nOldOpType)
+	for (int i = 0; i < (int)m_Routes.size(); i++)
 	{
-	case OT_DOWNLOAD_FILE:
-		{
-			TcpDisconnect();
+		const ROUTE_ITEM& Route = m_Routes[i];
 
-			if (m_nErrorCode != EC_HTTP_SUCCESS)
-				DeleteFile(m_DownloadFileTask.strLocalFileName);
+		if (!Route.strMethod.IsEmpty() && Route.strMethod != Request.GetMethod() &&
+			!(Route.strMethod == TEXT("GET") && Request.GetMethod() == TEXT("HEAD")))
+			continue;
 
-			if (m_OnDownloadFile.pProc)
+		if (Route.strPath.Right(1) == TEXT("*"))
+		{
+			int nLen = Route.strPath.GetLength() - 1;
+			if (nLen > nMatchLen && Request.GetPath().Left(nLen) == Route.strPath.Left(nLen))
 			{
-				m_OnDownloadFile.pProc(
-					m_OnDownloadFile.pParam,
-					this,
-					m_DownloadFileTask.strUrl,
-					m_DownloadFileTask.strLocalFileName,
-					m_nErrorCode
-					);
+				pResult = &Route;
+				nMatchLen = nLen;
 			}
 		}
-		break;
+		else if (Route.strPath == Request.GetPath())
+			return &Route;
+	}
 
-	case OT_REQUEST_FILE:
-		if (m_OnRequestFile.pProc)
-		{
-			m_OnRequestFile.pProc(
-				m_OnRequestFile.pParam,
-				this,
-				m_RequestFileTask.strUrl,
-				m_nErrorCode
-				);
-		}
-		break;
+	return pResult;
+}
 
-	case OT_RECEIVE_FILE:
-		if (m_OnReceiveFile.pProc)
-		{
-			m_OnReceiveFile.pProc(
-				m_OnReceiveFile.pParam,
-				this,
-				m_ReceiveFileTask.pBuffer,
-				m_ReceiveFileTask.nSize,
-				m_nErrorCode
-				);
-		}
-		break;
+//-----------------------------------------------------------------------------
+
+void CHttpServer::HandleRequest(CHttpServerRequest& Request, CHttpServerResponse& Response)
+{
+	InterlockedIncrement(&m_nRequestCount);
+
+	const ROUTE_ITEM *pRoute = FindRoute(Request);
+	if (pRoute == NULL)
+	{
+		Response.SetStatus(404);
+		Response.Write(CStringA(Response.GetStatusText()));
+		return;
+	}
+
+	try
+	{
+		if (!pRoute->strLocalDir.IsEmpty())
+			SendStaticFile(*pRoute, Request, Response);
+		else
+			pRoute->OnRequest.pProc(pRoute->OnRequest.pParam, Request, Response);
+	}
+	catch (IFC_EXCEPT_OBJ e)
+	{
+		IFC_DELETE_MFC_EXCEPT_OBJ(e);
+
+		Response = CHttpServerResponse();
+		Response.SetStatus(500);
+		Response.Write(CStringA(Response.GetStatusText()));
 	}
 }
 
 //-----------------------------------------------------------------------------
 
-void CIocpHttpClient::Finalize()
+void CHttpServer::SendStaticFile(const ROUTE_ITEM& Route, const CHttpServerRequest& Request,
+	CHttpServerResponse& Response)
 {
-	delete m_DownloadFileTask.pFileStream;
-	m_DownloadFileTask.pFileStream = NULL;
+	CString strName = Request.GetPath().Mid(Route.strPath.GetLength() - 1);
+	if (strName.IsEmpty())
+		strName = TEXT("index.html");
 
-	if (m_nCurOpType == OT_DOWNLOAD_FILE)
+	// Refuses the names leaving the directory.
+	if (strName.Find(TEXT("..")) >= 0 || strName.Find(':') >= 0 || strName.Find('\\') >= 0)
 	{
-		if (m_bDestroying || m_nErrorCode != EC_HTTP_SUCCESS)
-			DeleteFile(m_DownloadFileTask.strLocalFileName);
+		Response.SetStatus(403);
+		Response.Write(CStringA(Response.GetStatusText()));
+		return;
 	}
+
+	strName.Replace('/', '\\');
+	CString strFileName = Route.strLocalDir + strName;
+
+	Response.SetContentType(GetContentTypeByExt(strFileName));
+	Response.SendFile(strFileName);
 }
 
 //-----------------------------------------------------------------------------
 
-void CIocpHttpClient::PrepareHttpAction(HTTP_METHOD_TYPE nHttpMethod, LPCTSTR lpszUrl,
-	CStream *pRequestContent, CStream *pResponseContent)
+bool CHttpServer::ParseRequestHeader(const CHttpHeaderParser& Parser, CHttpServerRequest& Request)
 {
-	m_nHttpMethod = nHttpMethod;
-	m_strUrl = lpszUrl;
+	// eg: GET /index.html HTTP/1.1
+	CString s = Parser.GetStartLine();
+	Request.m_strMethod = FetchStr(s);
+	Request.m_strUrl = FetchStr(s);
+	CString strVersion = s.Trim();
 
-	m_pRequestContent = pRequestContent;
-	m_pResponseContent = pResponseContent;
-	m_nReqStreamPos = (pRequestContent? pRequestContent->GetPosition() : 0);
-	m_nResStreamPos = (pResponseContent? pResponseContent->GetPosition() : 0);
+	if (Request.m_strMethod.IsEmpty() || Request.m_strUrl.IsEmpty() ||
+		strVersion.Left(7).CompareNoCase(TEXT("HTTP/1.")) != 0)
+		return false;
 
-	m_nRedirectCount = 0;
+	Request.m_nProtocolVersion = (strVersion.CompareNoCase(TEXT("HTTP/1.0")) == 0 ? HPV_1_0 : HPV_1_1);
+
+	int nQueryPos = Request.m_strUrl.Find('?');
+	if (nQueryPos >= 0)
+	{
+		Request.m_strPath = UrlDecode(Request.m_strUrl.Left(nQueryPos));
+		Request.m_strQuery = Request.m_strUrl.Mid(nQueryPos + 1);
+	}
+	else
+		Request.m_strPath = UrlDecode(Request.m_strUrl);
+
+	Parser.GetHeaders(Request.GetRawHeaders());
+	Request.ParseHeaders();
+
+	return true;
 }
 
 //-----------------------------------------------------------------------------
 
-void CIocpHttpClient::ExecuteHttpAction()
+// Appends the data to the last send item of the connection, or to a new one if
+// the last item also sends a file or produced data.
+CHttpServer::SEND_ITEM* CHttpServer::QueueData(CONNECTION *pConn, const void *pBuffer, int nSize)
 {
-	m_nCurOpStep = OS_NONE;
+	SEND_ITEM *pItem = (pConn->SendQueue.empty() ? NULL : pConn->SendQueue.back());
 
-	int nResult = BeforeRequest(m_nHttpMethod, m_strUrl, m_pRequestContent, m_pResponseContent,
-		m_nReqStreamPos, m_nResStreamPos);
+	if (pItem == NULL || pItem->hFile != INVALID_HANDLE_VALUE || pItem->Producer.pProc != NULL)
+	{
+		pItem = new SEND_ITEM();
+		pItem->nDataSize = 0;
+		pItem->nDataSentSize = 0;
+		pItem->hFile = INVALID_HANDLE_VALUE;
+		pItem->nFileSize = 0;
+		pItem->nFileSentSize = 0;
+		pItem->bChunked = false;
+		pConn->SendQueue.push_back(pItem);
+	}
 
-	if (nResult == EC_HTTP_SUCCESS)
+	if (pItem->nDataSize + nSize > pItem->Data.GetSize())
+		pItem->Data.SetSize(Max(pItem->nDataSize + nSize, pItem->Data.GetSize() * 2));
+
+	memcpy(pItem->Data.Data() + pItem->nDataSize, pBuffer, nSize);
+	pItem->nDataSize += nSize;
+
+	return pItem;
+}
+
+//-----------------------------------------------------------------------------
+
+void CHttpServer::QueueResponse(CONNECTION *pConn, const CHttpServerRequest& Request,
+	CHttpServerResponse& Response, bool bKeepAlive)
+{
+	bool bHead = (Request.GetMethod() == TEXT("HEAD"));
+	HANDLE hFile = INVALID_HANDLE_VALUE;
+	INT64 nFileSize = 0;
+	bool bChunked = false;
+
+	if (!Response.m_strFileName.IsEmpty())
 	{
-		m_nCurOpStep = OS_TCP_CONNECT;
-		TcpConnect();
+		LARGE_INTEGER nSize;
+
+		hFile = CreateFile(Response.m_strFileName, GENERIC_READ, FILE_SHARE_READ, NULL,
+			OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (hFile != INVALID_HANDLE_VALUE && !GetFileSizeEx(hFile, &nSize))
+		{
+			CloseHandle(hFile);
+			hFile = INVALID_HANDLE_VALUE;
+		}
+
+		if (hFile != INVALID_HANDLE_VALUE)
+			nFileSize = nSize.QuadPart;
+		else
+		{
+			Response.SetStatus(404);
+			Response.SetContentType(TEXT(""));
+			Response.m_nContentSize = 0;
+			Response.Write(CStringA(Response.GetStatusText()));
+		}
+	}
+
+	if (hFile != INVALID_HANDLE_VALUE)
+		Response.SetContentLength(nFileSize);
+	else if (Response.m_Producer.pProc != NULL)
+	{
+		// HTTP/1.0 clients get the produced data till the connection is closed.
+		if (Request.GetProtocolVersion() == HPV_1_1)
+		{
+			bChunked = true;
+			Response.SetTransferEncoding(TEXT("chunked"));
+		}
+		else
+			bKeepAlive = false;
+		Response.SetContentLength(-1);
 	}
 	else
+		Response.SetContentLength(Response.m_nContentSize);
+
+	Response.SetConnection(bKeepAlive);
+	if (Response.GetServer().IsEmpty())
+		Response.SetServer(m_strServerName);
+	Response.BuildHeaders();
+
+	CString strText = FormatString(TEXT("HTTP/1.1 %d "), Response.GetStatusCode()) +
+		Response.GetStatusText() + TEXT("\r\n");
+	for (int i = 0; i < Response.GetRawHeaders().GetCount(); i++)
+		strText = strText + Response.GetRawHeaders()[i] + TEXT("\r\n");
+	strText += TEXT("\r\n");
+
+	CStringA strHeader(strText);
+	SEND_ITEM *pItem = QueueData(pConn, (LPCSTR)strHeader, strHeader.GetLength());
+
+	if (bHead)
 	{
-		m_nErrorCode = nResult;
-		InvokeCallBack();
+		if (hFile != INVALID_HANDLE_VALUE)
+			CloseHandle(hFile);
 	}
+	else if (hFile != INVALID_HANDLE_VALUE)
+	{
+		pItem->hFile = hFile;
+		pItem->nFileSize = nFileSize;
+	}
+	else if (Response.m_Producer.pProc != NULL)
+	{
+		pItem->Producer = Response.m_Producer;
+		pItem->bChunked = bChunked;
+	}
+	else if (Response.m_nContentSize > 0)
+		QueueData(pConn, Response.m_Content.Data(), Response.m_nContentSize);
+
+	if (!bKeepAlive)
+		pConn->bCloseAfterSend = true;
+}
+
+//-----------------------------------------------------------------------------
+
+void CHttpServer::QueueError(CONNECTION *pConn, int nStatusCode)
+{
+	CHttpServerRequest Request;
+	CHttpServerResponse Response;
+
+	Response.SetStatus(nStatusCode);
+	Response.Write(CStringA(Response.GetStatusText()));
+	QueueResponse(pConn, Request, Response, false);
 }
 
 //-----------------------------------------------------------------------------
 
-void CIocpHttpClient::TcpConnect()
-{
-	if (!m_bLastKeepAlive)
-		m_TcpClient.Disconnect();
+// Handles all the complete requests received, and queues their responses.
+void CHttpServer::ProcessRequests(CONNECTION *pConn)
+{
+	int nPos = 0;
+
+	while (!pConn->bCloseAfterSend)
+	{
+		const char *p = pConn->RecvBuffer.Data() + nPos;
+		int nSize = pConn->nRecvSize - nPos;
+		CHttpHeaderParser& Parser = pConn->HeaderParser;
+
+		// The parser goes on from the lines scanned by the last call.
+		HTTP_PARSE_RESULT nParseResult = Parser.Feed(p, nSize);
+
+		if (nParseResult == HPR_NEED_MORE)
+		{
+			if (nSize > HTTP_SVR_MAX_HEADER_SIZE)
+				QueueError(pConn, 431);
+			break;
+		}
+
+		if (nParseResult == HPR_ERROR)
+		{
+			QueueError(pConn, 400);
+			break;
+		}
+
+		int nHeaderSize = Parser.GetHeaderSize();
+		if (nHeaderSize > HTTP_SVR_MAX_HEADER_SIZE)
+		{
+			QueueError(pConn, 431);
+			break;
+		}
+
+		// Chunked request content is not supported.
+		if (Parser.HasHeader(HHI_TRANSFER_ENCODING))
+		{
+			QueueError(pConn, 501);
+			break;
+		}
+
+		INT64 nContentLength = Max((INT64)0, StrToInt64(Parser.GetValue(HHI_CONTENT_LENGTH), 0));
+		if (nContentLength > HTTP_SVR_MAX_CONTENT_SIZE)
+		{
+			QueueError(pConn, 413);
+			break;
+		}
+
+		if (nSize < nHeaderSize + nContentLength)
+		{
+			if (!pConn->bContinueSent &&
+				SameText(Parser.GetValue(HHI_EXPECT), TEXT("100-continue")))
+			{
+				const char *CONTINUE_TEXT = "HTTP/1.1 100 Continue\r\n\r\n";
+				QueueData(pConn, CONTINUE_TEXT, (int)strlen(CONTINUE_TEXT));
+				pConn->bContinueSent = true;
+			}
+			break;
+		}
+
+		CHttpServerRequest Request;
+		bool bOk = ParseRequestHeader(Parser, Request);
+
+		nPos += nHeaderSize + (int)nContentLength;
+		pConn->bContinueSent = false;
+		Parser.Reset();
+
+		if (!bOk)
+		{
+			QueueError(pConn, 400);
+			break;
+		}
+
+		Request.m_Content.Assign(p + nHeaderSize, (int)nContentLength);
+		Request.m_PeerAddr = pConn->pTcpConn->GetPeerAddr();
 
-	if (m_TcpClient.IsConnected())
-	{
-		CPeerAddress PeerAddr = GetPeerAddrFromUrl(m_Url);
-		if (m_TcpClient.GetPeerAddr() != PeerAddr)
-			m_TcpClient.Disconnect();
+		CHttpServerResponse Response;
+		HandleRequest(Request, Response);
+		QueueResponse(pConn, Request, Response, Request.GetKeepAlive());
 	}
 
-	if (!m_TcpClient.IsConnected())
+	if (nPos > 0)
 	{
-		GetTcpConnectorPoolObject().AddTask(&m_TcpClient, m_Url.GetHost(),
-			StrToInt(m_Url.GetPort(), DEFAULT_HTTP_PORT), TcpConnectResultProc,
-			this, m_Options.nTcpConnectTimeOut);
+		memmove(pConn->RecvBuffer.Data(), pConn->RecvBuffer.Data() + nPos, pConn->nRecvSize - nPos);
+		pConn->nRecvSize -= nPos;
 	}
-	else
-		TcpConnectResultProc(this, &m_TcpClient, true);
 }
 
 //-----------------------------------------------------------------------------
 
-void CIocpHttpClient::TcpConnectResultProc(void *pParam, CTcpClient *pTcpClient, bool bSuccess)
+void CHttpServer::WaitRead(CONNECTION *pConn)
 {
-	CIocpHttpClient *pThis = (CIocpHttpClient*)pParam;
-	if (bSuccess)
-	{
-		pThis->m_nCurOpStep = OS_SEND_REQUEST_HEADER;
-
-		SOCKET nSocketHandle = pTcpClient->GetSocket().GetHandle();
-		GetIocpObject().AssociateHandle(nSocketHandle);
-
-		pThis->MakeRequestBuffer(pThis->m_TransBuffer);
-		GetIocpObject().Send((SOCKET)nSocketHandle, pThis->m_TransBuffer.Data(),
-			pThis->m_TransBuffer.GetSize(), 0, IOCP_CALLBACK_DEF(IocpCallBackProc, NULL),
-			pThis, CIocpParams());
-	}
-	else
 	{
-		pThis->m_nErrorCode = EC_HTTP_SOCKET_ERROR;
-		pThis->InvokeCallBack();
+		CAutoLocker Locker(m_Lock);
+		pConn->bWaitingRead = true;
+		pConn->nLastActiveTicks = GetTickCount();
 	}
+
+	pConn->pTcpConn->WaitReadable();
 }
 
 //-----------------------------------------------------------------------------
 
-void CIocpHttpClient::IocpCallBackProc(const CIocpTaskData& TaskData, void *pParam)
+// Sends the queued items in order. The connection reads again when all are sent.
+void CHttpServer::SendNext(CONNECTION *pConn)
 {
-	CIocpHttpClient *pThis = (CIocpHttpClient*)TaskData.GetCaller();
-	if (pThis->m_bDestroying) return;
+	// Room for the chunk size line before the data, eg: "4000\r\n".
+	const int CHUNK_HEAD_SIZE = 10;
 
-	if (TaskData.GetErrorCode() != 0)
-	{
-		pThis->TcpDisconnect(true);
-		pThis->m_nErrorCode = EC_HTTP_IOCP_ERROR;
-		pThis->InvokeCallBack();
-		return;
-	}
+	CHttpServerSendHandler Handler;
+	Handler.pServer = this;
+	Handler.pConn = pConn;
 
-	if (TaskData.GetBytesTrans() < TaskData.GetDataSize())
+	SOCKET hSocketHandle = pConn->pTcpConn->GetSocket().GetHandle();
+
+	while (!pConn->SendQueue.empty())
 	{
-		if (TaskData.GetTaskType() == ITT_SEND)
+		SEND_ITEM *pItem = pConn->SendQueue.front();
+
+		if (pItem->nDataSentSize < pItem->nDataSize)
 		{
-			GetIocpObject().Send((SOCKET)TaskData.GetFileHandle(),
-				TaskData.GetEntireDataBuf(),
-				TaskData.GetEntireDataSize(),
-				(int)(TaskData.GetDataBuf() - TaskData.GetEntireDataBuf() + TaskData.GetBytesTrans()),
-				TaskData.GetCallBack(), TaskData.GetCaller(), TaskData.GetParams());
+			GetIocp().Send(hSocketHandle, pItem->Data.Data(), pItem->nDataSize,
+				pItem->nDataSentSize, Handler, pConn->pTcpConn);
+			return;
 		}
-		else if (TaskData.GetTaskType() == ITT_RECV)
+
+		if (pItem->nFileSentSize < pItem->nFileSize)
 		{
-			GetIocpObject().Recv((SOCKET)TaskData.GetFileHandle(),
-				TaskData.GetEntireDataBuf(),
-				TaskData.GetEntireDataSize(),
-				(int)(TaskData.GetDataBuf() - TaskData.GetEntireDataBuf() + TaskData.GetBytesTrans()),
-				TaskData.GetCallBack(), TaskData.GetCaller(), TaskData.GetParams());
+			int nSize = (int)Min(pItem->nFileSize - pItem->nFileSentSize, (INT64)0x40000000);
+			GetIocp().TransmitFile(hSocketHandle, pItem->hFile, pItem->nFileSentSize, nSize,
+				Handler, pConn->pTcpConn);
+			return;
 		}
 
-		return;
-	}
-
-	if (pThis->m_nCurOpType == OT_DOWNLOAD_FILE || pThis->m_nCurOpType == OT_REQUEST_FILE)
-	{
-		switch (pThis->m_nCurOpStep)
+		if (pItem->Producer.pProc != NULL)
 		{
-		case OS_SEND_REQUEST_HEADER:
+			int nHeadSize = (pItem->bChunked ? CHUNK_HEAD_SIZE : 0);
+			int nSize = 0;
+
+			if (pItem->Data.GetSize() < CHUNK_HEAD_SIZE + HTTP_SVR_CHUNK_SIZE + 2)
+				pItem->Data.SetSize(CHUNK_HEAD_SIZE + HTTP_SVR_CHUNK_SIZE + 2);
+
+			try
 			{
-				pThis->m_nCurOpStep = OS_RECV_RESPONSE_HEADER;
-				pThis->m_TransBuffer.Clear();
-				pThis->IocpCallBackProc(TaskData, pParam);
-				break;
+				nSize = pItem->Producer.pProc(pItem->Producer.pParam,
+					pItem->Data.Data() + nHeadSize, HTTP_SVR_CHUNK_SIZE);
+			}
+			catch (IFC_EXCEPT_OBJ e)
+			{
+				IFC_DELETE_MFC_EXCEPT_OBJ(e);
+				DestroyConnection(pConn);
+				return;
 			}
 
-		case OS_RECV_RESPONSE_HEADER:
+			nSize = Max(0, Min(nSize, HTTP_SVR_CHUNK_SIZE));
+			if (nSize == 0)
+				pItem->Producer.pProc = NULL;
+
+			if (pItem->bChunked)
 			{
-				bool bHeaderRecved, bError;
-				pThis->CheckResponseHeader(pThis->m_TransBuffer.Data(),
-					 pThis->m_TransBuffer.GetSize(), bHeaderRecved, bError);
-				if (bError)
-				{
-					pThis->m_nErrorCode = EC_HTTP_RESPONSE_TEXT_ERROR;
-					pThis->InvokeCallBack();
-					break;
-				}
+				// The last chunk "0\r\n\r\n" is made the same way.
+				CStringA strHead;
+				strHead.Format("%X\r\n", nSize);
+				pItem->nDataSentSize = CHUNK_HEAD_SIZE - strHead.GetLength();
+				memcpy(pItem->Data.Data() + pItem->nDataSentSize, (LPCSTR)strHead, strHead.GetLength());
+				memcpy(pItem->Data.Data() + CHUNK_HEAD_SIZE + nSize, "\r\n", 2);
+				pItem->nDataSize = CHUNK_HEAD_SIZE + nSize + 2;
+			}
+			else
+			{
+				pItem->nDataSentSize = 0;
+				pItem->nDataSize = nSize;
+			}
+			continue;
+		}
 
-				if (bHeaderRecved)
-				{
-					bool bOk = pThis->ParseResponseHeader(pThis->m_TransBuffer.Data(),
-						pThis->m_TransBuffer.GetSize());
-					if (!bOk)
-					{
-						pThis->m_nErrorCode = EC_HTTP_RESPONSE_TEXT_ERROR;
-						pThis->InvokeCallBack();
-						break;
-					}
+		if (pItem->hFile != INVALID_HANDLE_VALUE)
+			CloseHandle(pItem->hFile);
+		delete pItem;
+		pConn->SendQueue.pop_front();
+	}
 
-					HTTP_NEXT_OP nNextOp = pThis->ProcessResponseHeader();
-					if (nNextOp == HNO_REDIRECT)
-					{
-						pThis->m_strUrl = pThis->m_Response.GetLocation();
-						pThis->ExecuteHttpAction();
-					}
-					else if (nNextOp == HNO_RECV_CONTENT)
-					{
-						pThis->m_nCurOpStep = OS_RECV_RESPONSE_CONTENT;
-						pThis->m_TransBuffer.Clear();
+	if (pConn->bCloseAfterSend)
+		DestroyConnection(pConn);
+	else
+		WaitRead(pConn);
+}
 
-						if (pThis->m_Response.GetContentStream() != NULL)
-							pThis->IocpCallBackProc(TaskData, pParam);
-						else
-							pThis->InvokeCallBack();
-					}
-					else
-					{
-						pThis->m_nErrorCode = EC_HTTP_CANNOT_RECV_CONTENT;
-						pThis->InvokeCallBack();
-					}
-				}
-				else
-				{
-					pThis->m_TransBuffer.SetSize(pThis->m_TransBuffer.GetSize() + 1);
-					GetIocpObject().Recv((SOCKET)TaskData.GetFileHandle(),
-						pThis->m_TransBuffer.Data(), pThis->m_TransBuffer.GetSize(),
-						pThis->m_TransBuffer.GetSize() - 1,
-						TaskData.GetCallBack(), TaskData.GetCaller(), TaskData.GetParams());
-				}
+//-----------------------------------------------------------------------------
 
-				break;
-			}
+void CHttpServer::DestroyConnection(CONNECTION *pConn)
+{
+	{
+		CAutoLocker Locker(m_Lock);
+		m_Connections.Remove(pConn);
+	}
 
-		case OS_RECV_RESPONSE_CONTENT:
-			{
-				INT64 nContentLength = pThis->m_Response.GetContentLength();
-				if (nContentLength <= 0)
-				{
-					pThis->m_nErrorCode = EC_HTTP_CONTENT_LENGTH_ERROR;
-					pThis->InvokeCallBack();
-					break;
-				}
+	for (SEND_QUEUE::iterator iter = pConn->SendQueue.begin(); iter != pConn->SendQueue.end(); ++iter)
+	{
+		if ((*iter)->hFile != INVALID_HANDLE_VALUE)
+			CloseHandle((*iter)->hFile);
+		delete *iter;
+	}
 
-				if (pThis->m_TransBuffer.GetSize() == 0)
-				{
-					pThis->m_nRemainContentSize = nContentLength;
-				}
-				else
-				{
-					pThis->m_nRemainContentSize -= pThis->m_TransBuffer.GetSize();
-					pThis->m_Response.GetContentStream()->WriteBuffer(
-						pThis->m_TransBuffer.Data(), pThis->m_TransBuffer.GetSize());
+	pConn->pTcpConn->Disconnect();
+	delete pConn->pTcpConn;
+	delete pConn;
 
-					if (pThis->m_nRemainContentSize <= 0)
-					{
-						pThis->InvokeCallBack();
-						break;
-					}
-				}
+	// Close() waits for the last connection to be freed.
+	CAutoLocker Locker(m_Lock);
+	if (--m_nLiveConnCount == 0)
+		SetEvent(m_hNoConnEvent);
+}
 
-				if (pThis->m_nRemainContentSize > 0)
-				{
-					const int BLOCK_SIZE = 1024*64;
-					int nBlockSize = (int)Min(pThis->m_nRemainContentSize, (INT64)BLOCK_SIZE);
+//-----------------------------------------------------------------------------
 
-					pThis->m_TransBuffer.SetSize(nBlockSize);
+// Called in the check thread. Closes the connections idle for too long, and returns
+// the milliseconds until the next one may time out.
+UINT CHttpServer::CheckTimeOut()
+{
+	UINT nTicks = GetTickCount();
+	CAutoLocker Locker(m_Lock);
 
-					GetIocpObject().Recv((SOCKET)TaskData.GetFileHandle(),
-						pThis->m_TransBuffer.Data(), pThis->m_TransBuffer.GetSize(), 0,
-						TaskData.GetCallBack(), TaskData.GetCaller(), TaskData.GetParams());
-				}
+	// The connections accepted or waiting later do not time out sooner than this.
+	UINT nResult = (UINT)Max(m_nKeepAliveTimeOut, 0);
 
-				break;
-			}
-		}
-	}
-	else if (pThis->m_nCurOpType == OT_RECEIVE_FILE)
+	for (int i = 0; i < m_Connections.GetCount(); i++)
 	{
-		pThis->InvokeCallBack();
+		CONNECTION *pConn = (CONNECTION*)m_Connections[i];
+		if (!pConn->bWaitingRead)
+			continue;
+
+		UINT nIdleMSecs = GetTickDiff(pConn->nLastActiveTicks, nTicks);
+		if (nIdleMSecs >= (UINT)m_nKeepAliveTimeOut)
+		{
+			pConn->bWaitingRead = false;
+			pConn->pTcpConn->Disconnect();
+		}
+		else
+			nResult = Min(nResult, (UINT)m_nKeepAliveTimeOut - nIdleMSecs);
 	}
+
+	return Max(nResult, (UINT)HTTP_TIMEOUT_CHECK_MIN_INTERVAL);
 }
 
 //-----------------------------------------------------------------------------
 
-void CIocpHttpClient::DownloadFile(LPCTSTR lpszUrl, LPCTSTR lpszLocalFileName)
+void CHttpServer::OnReadable(CONNECTION *pConn, int nErrorCode)
 {
-	IFC_ASSERT(m_nCurOpType == OT_NONE);
+	{
+		CAutoLocker Locker(m_Lock);
+		pConn->bWaitingRead = false;
+	}
 
-	m_bWorking = true;
-	m_nCurOpType = OT_DOWNLOAD_FILE;
-	m_nErrorCode = EC_HTTP_SUCCESS;
+	if (nErrorCode != 0)
+	{
+		DestroyConnection(pConn);
+		return;
+	}
 
-	m_DownloadFileTask.strUrl = lpszUrl;
-	m_DownloadFileTask.strLocalFileName = lpszLocalFileName;
-	m_DownloadFileTask.pFileStream = NULL;
+	// Reads what is available.
+	while (pConn->nRecvSize < HTTP_SVR_MAX_HEADER_SIZE + HTTP_SVR_MAX_CONTENT_SIZE)
+	{
+		if (pConn->RecvBuffer.GetSize() - pConn->nRecvSize < HTTP_SVR_RECV_BLOCK_SIZE)
+			pConn->RecvBuffer.SetSize(pConn->nRecvSize + Max(pConn->nRecvSize, HTTP_SVR_RECV_BLOCK_SIZE));
 
-	ForceDirectories(ExtractFilePath(lpszLocalFileName));
+		int nFreeSize = pConn->RecvBuffer.GetSize() - pConn->nRecvSize;
+		int r = pConn->pTcpConn->RecvBuffer(pConn->RecvBuffer.Data() + pConn->nRecvSize, nFreeSize);
+		if (r < 0)
+		{
+			DestroyConnection(pConn);
+			return;
+		}
 
-	m_DownloadFileTask.pFileStream = new CFileStream();
-	if (m_DownloadFileTask.pFileStream->Open(lpszLocalFileName, FM_CREATE | FM_SHARE_DENY_WRITE))
-	{
-		PrepareHttpAction(HMT_GET, lpszUrl, NULL, m_DownloadFileTask.pFileStream);
-		ExecuteHttpAction();
+		pConn->nRecvSize += r;
+		if (r < nFreeSize) break;
 	}
-	else
+
+	ProcessRequests(pConn);
+	SendNext(pConn);
+}
+
+//-----------------------------------------------------------------------------
+
+void CHttpServer::OnSendComplete(CONNECTION *pConn, const CIocpTaskData& TaskData)
+{
+	if (TaskData.GetErrorCode() != 0 || TaskData.GetBytesTrans() == 0)
 	{
-		m_nErrorCode = EC_HTTP_CANNOT_CREATE_FILE;
-		InvokeCallBack();
+		DestroyConnection(pConn);
+		return;
 	}
+
+	SEND_ITEM *pItem = pConn->SendQueue.front();
+	if (pItem->nDataSentSize < pItem->nDataSize)
+		pItem->nDataSentSize += TaskData.GetBytesTrans();
+	else
+		pItem->nFileSentSize += TaskData.GetBytesTrans();
+
+	SendNext(pConn);
 }
 
 //-----------------------------------------------------------------------------
 
-void CIocpHttpClient::RequestFile(LPCTSTR lpszUrl)
+void CHttpServer::OnAcceptConnProc(void *pParam, CTcpConnection *pConnection)
 {
-	IFC_ASSERT(m_nCurOpType == OT_NONE);
-
-	m_bWorking = true;
-	m_nCurOpType = OT_REQUEST_FILE;
-	m_nErrorCode = EC_HTTP_SUCCESS;
+	CHttpServer *pThis = (CHttpServer*)pParam;
+
+	CONNECTION *pConn = new CONNECTION();
+	pConn->pTcpConn = (CIocpTcpConnection*)pConnection;
+	pConn->RecvBuffer.SetSize(HTTP_SVR_RECV_BLOCK_SIZE);
+	pConn->nRecvSize = 0;
+	pConn->bContinueSent = false;
+	pConn->bCloseAfterSend = false;
+	pConn->bWaitingRead = false;
+	pConn->nLastActiveTicks = GetTickCount();
+	pConnection->CustomData() = pConn;
 
-	m_RequestFileTask.strUrl = lpszUrl;
+	{
+		CAutoLocker Locker(pThis->m_Lock);
+		pThis->m_Connections.Add(pConn);
+		if (pThis->m_nLiveConnCount++ == 0)
+			ResetEvent(pThis->m_hNoConnEvent);
+	}
 
-	PrepareHttpAction(HMT_GET, lpszUrl, NULL, NULL);
-	ExecuteHttpAction();
+	pThis->WaitRead(pConn);
 }
 
 //-----------------------------------------------------------------------------
 
-void CIocpHttpClient::ReceiveFile(void *pBuffer, int nSize)
+void CHttpServer::OnReadableProc(void *pParam, CIocpTcpConnection *pConnection, int nErrorCode)
 {
-	IFC_ASSERT(m_nCurOpType == OT_NONE);
+	CHttpServer *pThis = (CHttpServer*)pParam;
+	pThis->OnReadable((CONNECTION*)pConnection->CustomData(), nErrorCode);
+}
 
-	m_bWorking = true;
-	m_nCurOpType = OT_RECEIVE_FILE;
-	m_nErrorCode = EC_HTTP_SUCCESS;
+//-----------------------------------------------------------------------------
 
-	m_ReceiveFileTask.pBuffer = pBuffer;
-	m_ReceiveFileTask.nSize = nSize;
+void CHttpServer::Open(int nPort)
+{
+	EnsureNetworkInited();
 
-	GetIocpObject().Recv((SOCKET)m_TcpClient.GetSocket().GetHandle(),
-		pBuffer, nSize, 0, IOCP_CALLBACK_DEF(IocpCallBackProc, NULL), this, CIocpParams());
+	m_TcpServer.SetLocalPort(nPort);
+	m_TcpServer.Open();
+
+	if (m_pCheckThread == NULL)
+	{
+		m_pCheckThread = new CCheckThread(*this);
+		m_pCheckThread->Run();
+	}
 }
 
 //-----------------------------------------------------------------------------
 
-void CIocpHttpClient::SetDownloadFileCallBack(IOCPHTTP_ONDOWNLOADFILE_PROC pProc, void *pParam)
+void CHttpServer::Close()
 {
-	m_OnDownloadFile.pProc = pProc;
-	m_OnDownloadFile.pParam = pParam;
+	m_TcpServer.Close();
+
+	if (m_pCheckThread != NULL)
+	{
+		m_pCheckThread->Terminate();
+		m_pCheckThread->WaitFor();
+		delete m_pCheckThread;
+		m_pCheckThread = NULL;
+	}
+
+	// The pending operations of the connections fail, and the connections are
+	// destroyed in the iocp worker threads.
+	{
+		CAutoLocker Locker(m_Lock);
+		for (int i = 0; i < m_Connections.GetCount(); i++)
+			((CONNECTION*)m_Connections[i])->pTcpConn->Disconnect();
+	}
+
+	WaitForSingleObject(m_hNoConnEvent, INFINITE);
 }
 
 //-----------------------------------------------------------------------------
 
-void CIocpHttpClient::SetRequestFileCallBack(IOCPHTTP_ONREQUESTFILE_PROC pProc, void *pParam)
+void CHttpServer::AddRoute(LPCTSTR lpszMethod, LPCTSTR lpszPath, HTTPSVR_ON_REQUEST_PROC pProc,
+	void *pParam)
 {
-	m_OnRequestFile.pProc = pProc;
-	m_OnRequestFile.pParam = pParam;
+	ROUTE_ITEM Route;
+	Route.strMethod = (lpszMethod != NULL ? lpszMethod : TEXT(""));
+	Route.strPath = lpszPath;
+	Route.OnRequest.pProc = pProc;
+	Route.OnRequest.pParam = pParam;
+
+	m_Routes.push_back(Route);
 }
 
 //-----------------------------------------------------------------------------
 
-void CIocpHttpClient::SetReceiveFileCallBack(IOCPHTTP_ONRECEIVEFILE_PROC pProc, void *pParam)
+void CHttpServer::AddStaticDir(LPCTSTR lpszUrlPrefix, LPCTSTR lpszLocalDir)
 {
-	m_OnReceiveFile.pProc = pProc;
-	m_OnReceiveFile.pParam = pParam;
+	ROUTE_ITEM Route;
+	Route.strMethod = TEXT("GET");
+	Route.strPath = lpszUrlPrefix;
+	if (Route.strPath.Right(1) != TEXT("/"))
+		Route.strPath += TEXT("/");
+	Route.strPath += TEXT("*");
+	Route.strLocalDir = PathWithSlash(lpszLocalDir);
+
+	m_Routes.push_back(Route);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
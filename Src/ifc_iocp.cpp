@@ -26,6 +26,9 @@
 #include "ifc_iocp.h"
 #include "ifc_sysutils.h"
 
+#include <mswsock.h>
+#pragma comment(lib, "mswsock.lib")
+
 namespace ifc
 {
 
@@ -156,11 +159,20 @@ CIocpTaskData::CIocpTaskData() :
 	m_pCaller(0),
 	m_pEntireDataBuf(0),
 	m_nEntireDataSize(0),
+	m_nEntireBufferCount(0),
+	m_nOffset(0),
+	m_nWSABufferCount(0),
 	m_nBytesTrans(0),
-	m_nErrorCode(0)
+	m_nErrorCode(0),
+	m_pPendingEntry(NULL),
+	m_pHandlerInvoke(NULL),
+	m_pHandlerDestroy(NULL)
 {
 	m_WSABuffer.buf = NULL;
 	m_WSABuffer.len = 0;
+	memset(m_EntireBuffers, 0, sizeof(m_EntireBuffers));
+	memset(m_WSABuffers, 0, sizeof(m_WSABuffers));
+	memset(&m_HandlerStorage, 0, sizeof(m_HandlerStorage));
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -168,9 +180,26 @@ CIocpTaskData::CIocpTaskData() :
 
 CIocpBufferAllocator::CIocpBufferAllocator(int nBufferSize) :
 	m_nBufferSize(nBufferSize),
+	m_pDepot(NULL),
+	m_nTlsIndex(TLS_OUT_OF_INDEXES),
 	m_nUsedCount(0)
 {
-	// nothing
+	// A free buffer holds an SLIST_ENTRY while it stays in the depot.
+	m_nBufferSize = Max(m_nBufferSize, (int)sizeof(SLIST_ENTRY));
+	m_nBufferSize = (m_nBufferSize + MEMORY_ALLOCATION_ALIGNMENT - 1) &
+		~(MEMORY_ALLOCATION_ALIGNMENT - 1);
+
+	m_pDepot = (PSLIST_HEADER)_aligned_malloc(sizeof(SLIST_HEADER), MEMORY_ALLOCATION_ALIGNMENT);
+	if (m_pDepot == NULL)
+		IfcThrowMemoryException();
+	InitializeSListHead(m_pDepot);
+
+	m_nTlsIndex = TlsAlloc();
+	if (m_nTlsIndex == TLS_OUT_OF_INDEXES)
+	{
+		_aligned_free(m_pDepot);
+		IfcThrowException(FormatString(SEM_IOCP_ERROR, GetLastError()));
+	}
 }
 
 //-----------------------------------------------------------------------------
@@ -186,325 +215,428 @@ void CIocpBufferAllocator::Clear()
 {
 	CAutoLocker Locker(m_Lock);
 
-	for (int i = 0; i < m_Items.GetCount(); i++)
-		delete[] (char*)m_Items[i];
-	m_Items.Clear();
-}
-
-//-----------------------------------------------------------------------------
+	for (int i = 0; i < m_Caches.GetCount(); i++)
+		delete (CThreadCache*)m_Caches[i];
+	m_Caches.Clear();
 
-PVOID CIocpBufferAllocator::AllocBuffer()
-{
-	CAutoLocker Locker(m_Lock);
-	PVOID pResult;
+	for (int i = 0; i < m_Slabs.GetCount(); i++)
+		_aligned_free(m_Slabs[i]);
+	m_Slabs.Clear();
 
-	if (!m_Items.IsEmpty())
+	if (m_nTlsIndex != TLS_OUT_OF_INDEXES)
 	{
-		pResult = m_Items.Last();
-		m_Items.Delete(m_Items.GetCount() - 1);
+		TlsFree(m_nTlsIndex);
+		m_nTlsIndex = TLS_OUT_OF_INDEXES;
 	}
-	else
+
+	if (m_pDepot != NULL)
 	{
-		pResult = new char[m_nBufferSize];
-		if (pResult == NULL)
-			IfcThrowMemoryException();
+		_aligned_free(m_pDepot);
+		m_pDepot = NULL;
 	}
-
-	m_nUsedCount++;
-	return pResult;
 }
 
 //-----------------------------------------------------------------------------
 
-void CIocpBufferAllocator::ReturnBuffer(PVOID pBuffer)
+// Allocates a new slab, returns its first buffer and pushes the rest into the depot.
+PVOID CIocpBufferAllocator::AllocSlab()
 {
-	CAutoLocker Locker(m_Lock);
+	char *pSlab = (char*)_aligned_malloc(m_nBufferSize * SLAB_BUFFER_COUNT,
+		MEMORY_ALLOCATION_ALIGNMENT);
+	if (pSlab == NULL)
+		IfcThrowMemoryException();
 
-	if (pBuffer != NULL && m_Items.IndexOf(pBuffer) == -1)
 	{
-		m_Items.Add(pBuffer);
-		m_nUsedCount--;
+		CAutoLocker Locker(m_Lock);
+		m_Slabs.Add(pSlab);
 	}
+
+	for (int i = SLAB_BUFFER_COUNT - 1; i >= 1; i--)
+		InterlockedPushEntrySList(m_pDepot, (PSLIST_ENTRY)(pSlab + i * m_nBufferSize));
+
+	return pSlab;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// CIocpPendingCounter
+//-----------------------------------------------------------------------------
 
-void CIocpPendingCounter::Inc(PVOID pCaller, IOCP_TASK_TYPE nTaskType)
+void CIocpBufferAllocator::FlushCache(CThreadCache *pCache, int nCount)
 {
-	CAutoLocker Locker(m_Lock);
-
-	ITEMS::iterator iter = m_Items.find(pCaller);
-	if (iter == m_Items.end())
+	nCount = Min(nCount, pCache->nCount);
+	for (int i = 0; i < nCount; i++)
 	{
-		COUNT_DATA Data = {0, 0};
-		iter = m_Items.insert(std::make_pair(pCaller, Data)).first;
+		pCache->nCount--;
+		InterlockedPushEntrySList(m_pDepot, (PSLIST_ENTRY)pCache->pItems[pCache->nCount]);
 	}
-
-	if (nTaskType == ITT_SEND)
-		iter->second.nSendCount++;
-	else if (nTaskType == ITT_RECV)
-		iter->second.nRecvCount++;
 }
 
 //-----------------------------------------------------------------------------
 
-void CIocpPendingCounter::Dec(PVOID pCaller, IOCP_TASK_TYPE nTaskType)
+PVOID CIocpBufferAllocator::AllocBuffer()
 {
-	CAutoLocker Locker(m_Lock);
+	CThreadCache *pCache = (CThreadCache*)TlsGetValue(m_nTlsIndex);
+	PVOID pResult = NULL;
 
-	ITEMS::iterator iter = m_Items.find(pCaller);
-	if (iter != m_Items.end())
+	if (pCache != NULL)
 	{
-		if (nTaskType == ITT_SEND)
-			iter->second.nSendCount--;
-		else if (nTaskType == ITT_RECV)
-			iter->second.nRecvCount--;
+		if (pCache->nCount == 0)
+		{
+			while (pCache->nCount < CACHE_BATCH_SIZE)
+			{
+				PSLIST_ENTRY pEntry = InterlockedPopEntrySList(m_pDepot);
+				if (pEntry == NULL) break;
+				pCache->pItems[pCache->nCount++] = pEntry;
+			}
+		}
 
-		if (iter->second.nSendCount <= 0 && iter->second.nRecvCount <= 0)
-			m_Items.erase(iter);
+		if (pCache->nCount > 0)
+			pResult = pCache->pItems[--pCache->nCount];
 	}
+	else
+		pResult = InterlockedPopEntrySList(m_pDepot);
+
+	if (pResult == NULL)
+		pResult = AllocSlab();
+
+	InterlockedIncrement(&m_nUsedCount);
+	return pResult;
 }
 
 //-----------------------------------------------------------------------------
 
-int CIocpPendingCounter::Get(PVOID pCaller)
+void CIocpBufferAllocator::ReturnBuffer(PVOID pBuffer)
 {
-	CAutoLocker Locker(m_Lock);
+	if (pBuffer == NULL) return;
 
-	ITEMS::iterator iter = m_Items.find(pCaller);
-	if (iter == m_Items.end())
-		return 0;
+	CThreadCache *pCache = (CThreadCache*)TlsGetValue(m_nTlsIndex);
+	if (pCache != NULL)
+	{
+		if (pCache->nCount >= CACHE_CAPACITY)
+			FlushCache(pCache, CACHE_BATCH_SIZE);
+		pCache->pItems[pCache->nCount++] = pBuffer;
+	}
 	else
-		return Max(0, iter->second.nSendCount + iter->second.nRecvCount);
+		InterlockedPushEntrySList(m_pDepot, (PSLIST_ENTRY)pBuffer);
+
+	InterlockedDecrement(&m_nUsedCount);
 }
 
 //-----------------------------------------------------------------------------
 
-int CIocpPendingCounter::Get(IOCP_TASK_TYPE nTaskType)
+void CIocpBufferAllocator::ReturnBuffers(PVOID *pBuffers, int nCount)
 {
-	CAutoLocker Locker(m_Lock);
+	if (nCount <= 0) return;
 
-	int nResult = 0;
-	if (nTaskType == ITT_SEND)
-	{
-		for (ITEMS::iterator iter = m_Items.begin(); iter != m_Items.end(); ++iter)
-			nResult += iter->second.nSendCount;
-	}
-	else if (nTaskType == ITT_RECV)
+	CThreadCache *pCache = (CThreadCache*)TlsGetValue(m_nTlsIndex);
+	for (int i = 0; i < nCount; i++)
 	{
-		for (ITEMS::iterator iter = m_Items.begin(); iter != m_Items.end(); ++iter)
-			nResult += iter->second.nRecvCount;
+		if (pCache != NULL)
+		{
+			if (pCache->nCount >= CACHE_CAPACITY)
+				FlushCache(pCache, CACHE_BATCH_SIZE);
+			pCache->pItems[pCache->nCount++] = pBuffers[i];
+		}
+		else
+			InterlockedPushEntrySList(m_pDepot, (PSLIST_ENTRY)pBuffers[i]);
 	}
 
-	return nResult;
+	InterlockedExchangeAdd(&m_nUsedCount, -nCount);
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// CIocpObject::CIocpWorkerThread
+//-----------------------------------------------------------------------------
 
-CIocpObject::CIocpWorkerThread::CIocpWorkerThread(CIocpObject& IocpObject) :
-	m_IocpObject(IocpObject)
+void CIocpBufferAllocator::AttachThreadCache()
 {
-	SetFreeOnTerminate(false);
+	if (TlsGetValue(m_nTlsIndex) != NULL) return;
+
+	CThreadCache *pCache = new CThreadCache();
+	pCache->nCount = 0;
+	{
+		CAutoLocker Locker(m_Lock);
+		m_Caches.Add(pCache);
+	}
+	TlsSetValue(m_nTlsIndex, pCache);
 }
 
 //-----------------------------------------------------------------------------
 
-void CIocpObject::CIocpWorkerThread::Execute()
+void CIocpBufferAllocator::DetachThreadCache()
 {
-	while (!GetTerminated())
-	try
-	{
-		m_IocpObject.Work();
-	}
-	catch (IFC_EXCEPT_OBJ e)
+	CThreadCache *pCache = (CThreadCache*)TlsGetValue(m_nTlsIndex);
+	if (pCache == NULL) return;
+
+	TlsSetValue(m_nTlsIndex, NULL);
+	FlushCache(pCache, pCache->nCount);
 	{
-		IFC_DELETE_MFC_EXCEPT_OBJ(e);
+		CAutoLocker Locker(m_Lock);
+		m_Caches.Remove(pCache);
 	}
-	catch (...)
-	{}
+	delete pCache;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// CIocpObject
-
-std::auto_ptr<CIocpObject> CIocpObject::s_pSingleton(NULL);
-
-//-----------------------------------------------------------------------------
+// CIocpPendingCounter
 
-CIocpObject::CIocpObject() :
-	m_hIocpHandle(0),
-	m_BufferAlloc(sizeof(CIocpOverlappedData)),
-	m_TaskSeqAlloc(0),
-	m_nErrorCount(0)
+CIocpPendingCounter::~CIocpPendingCounter()
 {
-	Initialize();
+	for (int i = 0; i < SHARD_COUNT; i++)
+	{
+		CShard& Shard = m_Shards[i];
+		CAutoLocker Locker(Shard.Lock);
+
+		for (ITEMS::iterator iter = Shard.Items.begin(); iter != Shard.Items.end(); ++iter)
+		{
+			if (iter->second->hZeroEvent != NULL)
+				CloseHandle(iter->second->hZeroEvent);
+			delete iter->second;
+		}
+		Shard.Items.clear();
+	}
 }
 
 //-----------------------------------------------------------------------------
 
-CIocpObject::~CIocpObject()
+CIocpPendingCounter::CShard& CIocpPendingCounter::GetShard(PVOID pCaller)
 {
-	Finalize();
+	return m_Shards[(((UINT_PTR)pCaller) >> 4) % SHARD_COUNT];
 }
 
 //-----------------------------------------------------------------------------
 
-CIocpObject& CIocpObject::Instance()
+IOCP_PENDING_ENTRY* CIocpPendingCounter::Find(CShard& Shard, PVOID pCaller)
 {
-	if (s_pSingleton.get() == NULL)
-		s_pSingleton.reset(new CIocpObject());
-	return *s_pSingleton;
+	ITEMS::iterator iter = Shard.Items.find(pCaller);
+	return (iter != Shard.Items.end()) ? iter->second : NULL;
 }
 
 //-----------------------------------------------------------------------------
 
-void CIocpObject::Delete()
+// The caller must hold the lock of the shard.
+void CIocpPendingCounter::FreeEntry(CShard& Shard, IOCP_PENDING_ENTRY *pEntry)
 {
-	s_pSingleton.reset(NULL);
+	Shard.Items.erase(pEntry->pCaller);
+	if (pEntry->hZeroEvent != NULL)
+		CloseHandle(pEntry->hZeroEvent);
+	delete pEntry;
 }
 
 //-----------------------------------------------------------------------------
 
-bool CIocpObject::IsAvailable()
+IOCP_PENDING_ENTRY* CIocpPendingCounter::Inc(PVOID pCaller, IOCP_TASK_TYPE nTaskType)
 {
-	return (s_pSingleton.get() != NULL);
+	CShard& Shard = GetShard(pCaller);
+	CAutoLocker Locker(Shard.Lock);
+
+	IOCP_PENDING_ENTRY *pEntry = Find(Shard, pCaller);
+	if (pEntry == NULL)
+	{
+		pEntry = new IOCP_PENDING_ENTRY();
+		memset(pEntry, 0, sizeof(*pEntry));
+		pEntry->pCaller = pCaller;
+		Shard.Items[pCaller] = pEntry;
+	}
+
+	if (nTaskType == ITT_SEND)
+		InterlockedIncrement(&pEntry->nSendCount);
+	else if (nTaskType == ITT_RECV)
+		InterlockedIncrement(&pEntry->nRecvCount);
+	InterlockedIncrement(&pEntry->nTotalCount);
+
+	return pEntry;
 }
 
 //-----------------------------------------------------------------------------
 
-void CIocpObject::Initialize()
+void CIocpPendingCounter::Dec(IOCP_PENDING_ENTRY *pEntry, IOCP_TASK_TYPE nTaskType)
 {
-	SYSTEM_INFO SysInfo;
-	int nThreadCount;
+	if (pEntry == NULL) return;
 
-	GetSystemInfo(&SysInfo);
-	nThreadCount = SysInfo.dwNumberOfProcessors * 2 + 4;
+	// The entry may be freed by others as soon as the count drops to zero.
+	PVOID pCaller = pEntry->pCaller;
 
-	m_hIocpHandle = ::CreateIoCompletionPort(INVALID_HANDLE_VALUE, 0, 0, nThreadCount);
-	if (m_hIocpHandle == 0)
-		ThrowGeneralError();
+	if (nTaskType == ITT_SEND)
+		InterlockedDecrement(&pEntry->nSendCount);
+	else if (nTaskType == ITT_RECV)
+		InterlockedDecrement(&pEntry->nRecvCount);
+	if (InterlockedDecrement(&pEntry->nTotalCount) > 0)
+		return;
 
-	for (int i = 0; i < nThreadCount; i++)
+	CShard& Shard = GetShard(pCaller);
+	CAutoLocker Locker(Shard.Lock);
+
+	pEntry = Find(Shard, pCaller);
+	if (pEntry != NULL && pEntry->nTotalCount <= 0)
 	{
-		CIocpWorkerThread *pThread = new CIocpWorkerThread(*this);
-		m_WorkerThreads.Add(pThread);
-		pThread->Run();
+		if (pEntry->nWaiterCount > 0)
+			SetEvent(pEntry->hZeroEvent);
+		else
+			FreeEntry(Shard, pEntry);
 	}
 }
 
 //-----------------------------------------------------------------------------
 
-void CIocpObject::Finalize()
+void CIocpPendingCounter::WaitFor(PVOID pCaller)
 {
-	// Notify the threads to exit
-	for (int i = 0; i < m_WorkerThreads.GetCount(); i++)
-		((CIocpWorkerThread*)m_WorkerThreads[i])->Terminate();
-	for (int i = 0; i < m_WorkerThreads.GetCount(); i++)
-		::PostQueuedCompletionStatus(m_hIocpHandle, 0, 0, NULL);
+	CShard& Shard = GetShard(pCaller);
+	IOCP_PENDING_ENTRY *pEntry;
+	HANDLE hEvent;
 
-	// Wait for the threads to exit
-	for (int i = 0; i < m_WorkerThreads.GetCount(); i++)
 	{
-		CIocpWorkerThread *pThread = (CIocpWorkerThread*)m_WorkerThreads[i];
-		pThread->WaitFor();
-		delete pThread;
+		CAutoLocker Locker(Shard.Lock);
+
+		pEntry = Find(Shard, pCaller);
+		if (pEntry == NULL || pEntry->nTotalCount <= 0)
+			return;
+
+		if (pEntry->hZeroEvent == NULL)
+		{
+			pEntry->hZeroEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+			if (pEntry->hZeroEvent == NULL)
+				IfcThrowException(FormatString(SEM_IOCP_ERROR, GetLastError()));
+		}
+		else
+			ResetEvent(pEntry->hZeroEvent);
+		pEntry->nWaiterCount++;
+		hEvent = pEntry->hZeroEvent;
 	}
-	m_WorkerThreads.Clear();
 
-	CloseHandle(m_hIocpHandle);
-	m_hIocpHandle = 0;
+	// The entry is not freed while it has waiters. The event may still be set from an
+	// earlier drop to zero that an Inc() has followed, so the count is checked again.
+	while (true)
+	{
+		WaitForSingleObject(hEvent, INFINITE);
+
+		CAutoLocker Locker(Shard.Lock);
+
+		if (pEntry->nTotalCount <= 0)
+		{
+			pEntry->nWaiterCount--;
+			if (pEntry->nWaiterCount == 0)
+				FreeEntry(Shard, pEntry);
+			break;
+		}
+
+		ResetEvent(hEvent);
+	}
 }
 
 //-----------------------------------------------------------------------------
 
-void CIocpObject::ThrowGeneralError()
+int CIocpPendingCounter::Get(PVOID pCaller)
 {
-	IfcThrowException(FormatString(SEM_IOCP_ERROR, GetLastError()));
+	CShard& Shard = GetShard(pCaller);
+	CAutoLocker Locker(Shard.Lock);
+
+	IOCP_PENDING_ENTRY *pEntry = Find(Shard, pCaller);
+	return (pEntry != NULL) ? Max(0, (int)pEntry->nTotalCount) : 0;
 }
 
 //-----------------------------------------------------------------------------
 
-CIocpOverlappedData* CIocpObject::CreateOverlappedData(IOCP_TASK_TYPE nTaskType,
-	HANDLE hFileHandle, PVOID pBuffer, int nSize, int nOffset,
-	const IOCP_CALLBACK_DEF& CallBackDef, PVOID pCaller, const CIocpParams& Params)
+int CIocpPendingCounter::Get(IOCP_TASK_TYPE nTaskType)
 {
-	IFC_ASSERT(pBuffer != NULL);
-	IFC_ASSERT(nSize >= 0);
-	IFC_ASSERT(nOffset >= 0);
-	IFC_ASSERT(nOffset < nSize);
+	int nResult = 0;
 
-	CIocpOverlappedData *pResult = (CIocpOverlappedData*)m_BufferAlloc.AllocBuffer();
-	memset(pResult, 0, sizeof(*pResult));
+	for (int i = 0; i < SHARD_COUNT; i++)
+	{
+		CShard& Shard = m_Shards[i];
+		CAutoLocker Locker(Shard.Lock);
 
-	pResult->TaskData.m_hIocpHandle = m_hIocpHandle;
-	pResult->TaskData.m_hFileHandle = hFileHandle;
-	pResult->TaskData.m_nTaskType = nTaskType;
-	pResult->TaskData.m_nTaskSeqNum = m_TaskSeqAlloc.AllocId();
-	pResult->TaskData.m_CallBack = CallBackDef;
-	pResult->TaskData.m_pCaller = pCaller;
-	pResult->TaskData.m_Params = Params;
-	pResult->TaskData.m_pEntireDataBuf = pBuffer;
-	pResult->TaskData.m_nEntireDataSize = nSize;
-	pResult->TaskData.m_WSABuffer.buf = (char*)pBuffer + nOffset;
-	pResult->TaskData.m_WSABuffer.len = nSize - nOffset;
+		for (ITEMS::iterator iter = Shard.Items.begin(); iter != Shard.Items.end(); ++iter)
+		{
+			if (nTaskType == ITT_SEND)
+				nResult += iter->second->nSendCount;
+			else if (nTaskType == ITT_RECV)
+				nResult += iter->second->nRecvCount;
+		}
+	}
 
-	return pResult;
+	return nResult;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CIocpEngine
+
+int CIocpEngine::GetCompletions(CIocpCompletion *pEntries, int nCount, DWORD nTimeOut)
+{
+	int nResult = 0;
+
+	if (nCount > 0 && GetCompletion(pEntries[0], nTimeOut))
+	{
+		nResult = 1;
+		while (nResult < nCount && GetCompletion(pEntries[nResult], 0))
+			nResult++;
+	}
+
+	return nResult;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CIocpPortEngine
+
+CIocpPortEngine::CIocpPortEngine() :
+	m_hIocpHandle(0),
+	m_pGetQueuedCompletionStatusEx(NULL),
+	m_pRtlNtStatusToDosError(NULL)
+{
+	// Both are unavailable before Windows Vista.
+	m_pGetQueuedCompletionStatusEx = (GET_QUEUED_COMPLETION_STATUS_EX_PROC)
+		GetProcAddress(GetModuleHandle(TEXT("kernel32.dll")), "GetQueuedCompletionStatusEx");
+	m_pRtlNtStatusToDosError = (RTL_NTSTATUS_TO_DOS_ERROR_PROC)
+		GetProcAddress(GetModuleHandle(TEXT("ntdll.dll")), "RtlNtStatusToDosError");
+
+	if (m_pRtlNtStatusToDosError == NULL)
+		m_pGetQueuedCompletionStatusEx = NULL;
 }
 
 //-----------------------------------------------------------------------------
 
-void CIocpObject::DestroyOverlappedData(CIocpOverlappedData *pOvDataPtr)
+CIocpPortEngine::~CIocpPortEngine()
 {
-	m_BufferAlloc.ReturnBuffer(pOvDataPtr);
+	Close();
 }
 
 //-----------------------------------------------------------------------------
 
-void CIocpObject::PostError(int nErrorCode, CIocpOverlappedData *pOvDataPtr)
+void CIocpPortEngine::Open(int nConcurrency)
 {
-	pOvDataPtr->TaskData.m_nErrorCode = nErrorCode;
-	::PostQueuedCompletionStatus(m_hIocpHandle, 0, 0, LPOVERLAPPED(pOvDataPtr));
+	Close();
+
+	m_hIocpHandle = ::CreateIoCompletionPort(INVALID_HANDLE_VALUE, 0, 0, nConcurrency);
+	if (m_hIocpHandle == 0)
+		IfcThrowException(FormatString(SEM_IOCP_ERROR, GetLastError()));
 }
 
 //-----------------------------------------------------------------------------
 
-void CIocpObject::InvokeCallBack(const CIocpTaskData& TaskData)
+void CIocpPortEngine::Close()
 {
-	const IOCP_CALLBACK_DEF& CallBackDef = TaskData.GetCallBack();
-	if (CallBackDef.pProc != NULL)
-		CallBackDef.pProc(TaskData, CallBackDef.pParam);
+	if (m_hIocpHandle != 0)
+	{
+		CloseHandle(m_hIocpHandle);
+		m_hIocpHandle = 0;
+	}
 }
 
 //-----------------------------------------------------------------------------
 
-void CIocpObject::Work()
+bool CIocpPortEngine::AssociateHandle(HANDLE hFileHandle)
 {
-	CIocpOverlappedData *pOverlappedPtr = NULL;
-	DWORD nBytesTransferred = 0, nTemp = 0;
-	int nErrorCode = 0;
+	HANDLE h = ::CreateIoCompletionPort(hFileHandle, m_hIocpHandle, 0, 0);
+	return (h != 0);
+}
 
-	struct CAutoFinalizer
-	{
-	private:
-		CIocpObject& m_IocpObject;
-		CIocpOverlappedData*& m_pOvPtr;
-	public:
-		CAutoFinalizer(CIocpObject& IocpObject, CIocpOverlappedData*& pOvPtr) :
-			m_IocpObject(IocpObject), m_pOvPtr(pOvPtr) {}
-		~CAutoFinalizer()
-		{
-			if (m_pOvPtr)
-			{
-				m_IocpObject.m_PendingCounter.Dec(
-					m_pOvPtr->TaskData.GetCaller(),
-					m_pOvPtr->TaskData.GetTaskType());
-				m_IocpObject.DestroyOverlappedData(m_pOvPtr);
-			}
-		}
-	} AutoFinalizer(*this, pOverlappedPtr);
+//-----------------------------------------------------------------------------
+
+bool CIocpPortEngine::PostCompletion(DWORD nBytesTrans, LPOVERLAPPED pOverlapped)
+{
+	return (::PostQueuedCompletionStatus(m_hIocpHandle, nBytesTrans, 0, pOverlapped) != 0);
+}
 
+//-----------------------------------------------------------------------------
+
+bool CIocpPortEngine::GetCompletion(CIocpCompletion& Entry, DWORD nTimeOut)
+{
 	/*
 	FROM MSDN:
 
@@ -527,123 +659,663 @@ void CIocpObject::Work()
 	ERROR_SUCCESS (0), with *lpOverlapped non-NULL and lpNumberOfBytes equal zero.
 	*/
 
-	if (::GetQueuedCompletionStatus(m_hIocpHandle, &nBytesTransferred, &nTemp,
-		(LPOVERLAPPED*)&pOverlappedPtr, INFINITE))
+	ULONG_PTR nKey = 0;
+
+	Entry.pOverlapped = NULL;
+	Entry.nBytesTrans = 0;
+	Entry.nErrorCode = 0;
+
+	if (!::GetQueuedCompletionStatus(m_hIocpHandle, &Entry.nBytesTrans, &nKey,
+		&Entry.pOverlapped, nTimeOut))
 	{
-		if (pOverlappedPtr != NULL && nBytesTransferred == 0)
-		{
-			nErrorCode = pOverlappedPtr->TaskData.GetErrorCode();
-			if (nErrorCode == 0)
-				nErrorCode = GetLastError();
-			if (nErrorCode == 0)
-				nErrorCode = SOCKET_ERROR;
-		}
+		if (Entry.pOverlapped != NULL)
+			Entry.nErrorCode = GetLastError();
+		else if (GetLastError() == WAIT_TIMEOUT)
+			return false;
+		else
+			IfcThrowException(FormatString(SEM_IOCP_ERROR, GetLastError()));
 	}
-	else
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+
+int CIocpPortEngine::GetCompletions(CIocpCompletion *pEntries, int nCount, DWORD nTimeOut)
+{
+	if (m_pGetQueuedCompletionStatusEx == NULL || nCount <= 1)
+		return CIocpEngine::GetCompletions(pEntries, nCount, nTimeOut);
+
+	PORT_ENTRY PortEntries[IOCP_MAX_BATCH_SIZE];
+	ULONG nRemoved = 0;
+
+	nCount = Min(nCount, IOCP_MAX_BATCH_SIZE);
+	if (!m_pGetQueuedCompletionStatusEx(m_hIocpHandle, PortEntries, nCount, &nRemoved,
+		nTimeOut, FALSE))
 	{
-		if (pOverlappedPtr != NULL)
-			nErrorCode = GetLastError();
+		if (GetLastError() == WAIT_TIMEOUT)
+			return 0;
 		else
-		{
-			if (GetLastError() != WAIT_TIMEOUT)
-				ThrowGeneralError();
-		}
+			IfcThrowException(FormatString(SEM_IOCP_ERROR, GetLastError()));
 	}
 
-	if (pOverlappedPtr != NULL)
+	for (ULONG i = 0; i < nRemoved; i++)
 	{
-		CIocpTaskData *pTaskPtr = &pOverlappedPtr->TaskData;
-		pTaskPtr->m_nBytesTrans = nBytesTransferred;
-		if (pTaskPtr->m_nErrorCode == 0)
-			pTaskPtr->m_nErrorCode = nErrorCode;
-
-		if (pTaskPtr->m_nErrorCode != 0)
-			InterlockedIncrement(&m_nErrorCount);
-
-		InvokeCallBack(*pTaskPtr);
+		CIocpCompletion& Entry = pEntries[i];
+		PORT_ENTRY& PortEntry = PortEntries[i];
+
+		Entry.pOverlapped = PortEntry.lpOverlapped;
+		Entry.nBytesTrans = PortEntry.dwNumberOfBytesTransferred;
+		Entry.nErrorCode = 0;
+
+		// The Internal member holds the NTSTATUS code of the I/O operation. Only the error
+		// severity (NT_ERROR, the top two bits set) is a failure, the informational and
+		// warning codes (eg. STATUS_BUFFER_OVERFLOW) are passed on as success.
+		if (PortEntry.lpOverlapped != NULL && ((ULONG)PortEntry.lpOverlapped->Internal >> 30) == 3)
+			Entry.nErrorCode = m_pRtlNtStatusToDosError((LONG)PortEntry.lpOverlapped->Internal);
 	}
+
+	return (int)nRemoved;
 }
 
 //-----------------------------------------------------------------------------
 
-bool CIocpObject::AssociateHandle(HANDLE hFileHandle)
+int CIocpPortEngine::WriteFile(HANDLE hFileHandle, LPWSABUF pBuffer, LPOVERLAPPED pOverlapped)
 {
-	HANDLE h = ::CreateIoCompletionPort(hFileHandle, m_hIocpHandle, 0, 0);
-	return (h != 0);
+	DWORD nBytes;
+
+	if (!::WriteFile(hFileHandle, pBuffer->buf, pBuffer->len, &nBytes, pOverlapped))
+	{
+		if (GetLastError() != ERROR_IO_PENDING)
+			return GetLastError();
+	}
+	return 0;
 }
 
 //-----------------------------------------------------------------------------
 
-bool CIocpObject::AssociateHandle(SOCKET hSocketHandle)
+int CIocpPortEngine::ReadFile(HANDLE hFileHandle, LPWSABUF pBuffer, LPOVERLAPPED pOverlapped)
 {
-	return AssociateHandle((HANDLE)hSocketHandle);
+	DWORD nBytes;
+
+	if (!::ReadFile(hFileHandle, pBuffer->buf, pBuffer->len, &nBytes, pOverlapped))
+	{
+		if (GetLastError() != ERROR_IO_PENDING)
+			return GetLastError();
+	}
+	return 0;
 }
 
 //-----------------------------------------------------------------------------
 
-void CIocpObject::Send(HANDLE hFileHandle, PVOID pBuffer, int nSize, int nOffset,
-	const IOCP_CALLBACK_DEF& CallBackDef, PVOID pCaller, const CIocpParams& Params)
+int CIocpPortEngine::Send(SOCKET hSocketHandle, LPWSABUF pBuffers, int nBufferCount,
+	LPOVERLAPPED pOverlapped)
 {
-	CIocpOverlappedData *pOvDataPtr;
-	CIocpTaskData *pTaskPtr;
-	DWORD nNumberOfBytesSent;
-
-	m_PendingCounter.Inc(pCaller, ITT_SEND);
+	DWORD nBytes;
 
-	pOvDataPtr = CreateOverlappedData(ITT_SEND, hFileHandle, pBuffer, nSize,
-		nOffset, CallBackDef, pCaller, Params);
-	pTaskPtr = &(pOvDataPtr->TaskData);
-
-	if (!::WriteFile(hFileHandle, pBuffer, nSize, &nNumberOfBytesSent, (LPWSAOVERLAPPED)pOvDataPtr))
+	if (::WSASend(hSocketHandle, pBuffers, nBufferCount, &nBytes, 0,
+		pOverlapped, NULL) == SOCKET_ERROR)
 	{
 		if (GetLastError() != ERROR_IO_PENDING)
-			PostError(GetLastError(), pOvDataPtr);
+			return GetLastError();
 	}
+	return 0;
 }
 
 //-----------------------------------------------------------------------------
 
-void CIocpObject::Recv(HANDLE hFileHandle, PVOID pBuffer, int nSize, int nOffset,
-	const IOCP_CALLBACK_DEF& CallBackDef, PVOID pCaller, const CIocpParams& Params)
+int CIocpPortEngine::Recv(SOCKET hSocketHandle, LPWSABUF pBuffers, int nBufferCount,
+	LPOVERLAPPED pOverlapped)
 {
-	CIocpOverlappedData *pOvDataPtr;
-	CIocpTaskData *pTaskPtr;
-	DWORD nNumberOfBytesSent;
-
-	m_PendingCounter.Inc(pCaller, ITT_RECV);
+	DWORD nBytes, nFlags = 0;
 
-	pOvDataPtr = CreateOverlappedData(ITT_RECV, hFileHandle, pBuffer, nSize,
-		nOffset, CallBackDef, pCaller, Params);
-	pTaskPtr = &(pOvDataPtr->TaskData);
-
-	if (!::ReadFile(hFileHandle, pBuffer, nSize, &nNumberOfBytesSent, (LPWSAOVERLAPPED)pOvDataPtr))
+	if (::WSARecv(hSocketHandle, pBuffers, nBufferCount, &nBytes, &nFlags,
+		pOverlapped, NULL) == SOCKET_ERROR)
 	{
 		if (GetLastError() != ERROR_IO_PENDING)
-			PostError(GetLastError(), pOvDataPtr);
+			return GetLastError();
 	}
+	return 0;
 }
 
 //-----------------------------------------------------------------------------
 
-void CIocpObject::Send(SOCKET hSocketHandle, PVOID pBuffer, int nSize, int nOffset,
+int CIocpPortEngine::SendTo(SOCKET hSocketHandle, const CPeerAddress& PeerAddr,
+	LPWSABUF pBuffers, int nBufferCount, LPOVERLAPPED pOverlapped)
+{
+	DWORD nBytes;
+	SOCK_ADDR SockAddr;
+
+	GetSocketAddr(SockAddr, PeerAddr.nIp, PeerAddr.nPort);
+
+	if (::WSASendTo(hSocketHandle, pBuffers, nBufferCount, &nBytes, 0,
+		(sockaddr*)&SockAddr, sizeof(SockAddr), pOverlapped, NULL) == SOCKET_ERROR)
+	{
+		if (GetLastError() != ERROR_IO_PENDING)
+			return GetLastError();
+	}
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+
+int CIocpPortEngine::TransmitFile(SOCKET hSocketHandle, HANDLE hFileHandle, DWORD nBytes,
+	LPOVERLAPPED pOverlapped)
+{
+	if (!::TransmitFile(hSocketHandle, hFileHandle, nBytes, 0, pOverlapped, NULL, 0))
+	{
+		if (WSAGetLastError() != ERROR_IO_PENDING)
+			return WSAGetLastError();
+	}
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CIocpObject::CIocpWorkerThread
+
+CIocpObject::CIocpWorkerThread::CIocpWorkerThread(CIocpObject& IocpObject) :
+	m_IocpObject(IocpObject)
+{
+	SetFreeOnTerminate(false);
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpObject::CIocpWorkerThread::Execute()
+{
+	m_IocpObject.m_BufferAlloc.AttachThreadCache();
+
+	while (!GetTerminated())
+	try
+	{
+		m_IocpObject.Work();
+	}
+	catch (IFC_EXCEPT_OBJ e)
+	{
+		IFC_DELETE_MFC_EXCEPT_OBJ(e);
+	}
+	catch (...)
+	{}
+
+	m_IocpObject.m_BufferAlloc.DetachThreadCache();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CIocpObject
+
+std::auto_ptr<CIocpObject> CIocpObject::s_pSingleton(NULL);
+CIocpOptions CIocpObject::s_DefaultOptions;
+
+//-----------------------------------------------------------------------------
+
+CIocpObject::CIocpObject(const CIocpOptions& Options) :
+	m_Options(Options),
+	m_nWorkerAffinity(0),
+	m_pEngine(NULL),
+	m_BufferAlloc(sizeof(CIocpOverlappedData)),
+	m_TaskSeqAlloc(0),
+	m_nErrorCount(0)
+{
+	Initialize();
+}
+
+//-----------------------------------------------------------------------------
+
+CIocpObject::~CIocpObject()
+{
+	Finalize();
+}
+
+//-----------------------------------------------------------------------------
+
+CIocpObject& CIocpObject::Instance()
+{
+	if (s_pSingleton.get() == NULL)
+		s_pSingleton.reset(new CIocpObject(s_DefaultOptions));
+	return *s_pSingleton;
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpObject::Delete()
+{
+	s_pSingleton.reset(NULL);
+}
+
+//-----------------------------------------------------------------------------
+
+bool CIocpObject::IsAvailable()
+{
+	return (s_pSingleton.get() != NULL);
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpObject::Initialize()
+{
+	int nThreadCount = m_Options.nWorkerThreadCount;
+	if (nThreadCount <= 0)
+	{
+		SYSTEM_INFO SysInfo;
+		GetSystemInfo(&SysInfo);
+		nThreadCount = SysInfo.dwNumberOfProcessors * 2 + 4;
+	}
+	m_Options.nWorkerThreadCount = nThreadCount;
+	m_Options.nBatchSize = EnsureRange(m_Options.nBatchSize, 1, IOCP_MAX_BATCH_SIZE);
+	m_nWorkerAffinity = GetWorkerAffinity();
+
+	m_pEngine = new CIocpPortEngine();
+	m_pEngine->Open(nThreadCount);
+
+	for (int i = 0; i < nThreadCount; i++)
+	{
+		CIocpWorkerThread *pThread = new CIocpWorkerThread(*this);
+		pThread->SetName(FormatString(TEXT("IOCP Worker #%d"), i));
+		pThread->SetAffinityMask(GetWorkerThreadAffinity(i));
+		m_WorkerThreads.Add(pThread);
+		pThread->Run();
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+// Returns the affinity mask of the worker threads, 0 if they are not bound.
+DWORD_PTR CIocpObject::GetWorkerAffinity()
+{
+	typedef BOOL (WINAPI *GET_NUMA_NODE_PROCESSOR_MASK_PROC)(UCHAR Node, PULONGLONG ProcessorMask);
+
+	DWORD_PTR nProcessMask = 0, nSystemMask = 0;
+	DWORD_PTR nResult = m_Options.nAffinityMask;
+
+	if (m_Options.nNumaNode >= 0)
+	{
+		// Not available before Windows XP SP2.
+		GET_NUMA_NODE_PROCESSOR_MASK_PROC pGetNumaNodeProcessorMask =
+			(GET_NUMA_NODE_PROCESSOR_MASK_PROC)GetProcAddress(
+			GetModuleHandle(TEXT("kernel32.dll")), "GetNumaNodeProcessorMask");
+		ULONGLONG nNodeMask = 0;
+
+		if (pGetNumaNodeProcessorMask != NULL &&
+			pGetNumaNodeProcessorMask((UCHAR)m_Options.nNumaNode, &nNodeMask) && nNodeMask != 0)
+		{
+			if (nResult == 0)
+				nResult = (DWORD_PTR)nNodeMask;
+			else if ((nResult & (DWORD_PTR)nNodeMask) != 0)
+				nResult &= (DWORD_PTR)nNodeMask;
+		}
+	}
+
+	// A mask outside the process affinity would make SetThreadAffinityMask fail.
+	if (GetProcessAffinityMask(GetCurrentProcess(), &nProcessMask, &nSystemMask))
+	{
+		if ((nResult & nProcessMask) == 0)
+			nResult = 0;
+		else
+			nResult &= nProcessMask;
+	}
+
+	return nResult;
+}
+
+//-----------------------------------------------------------------------------
+
+// Returns the affinity mask of the specified worker thread, 0 if it is not bound.
+DWORD_PTR CIocpObject::GetWorkerThreadAffinity(int nIndex)
+{
+	DWORD_PTR nMask = m_nWorkerAffinity;
+	DWORD_PTR nProcessMask = 0, nSystemMask = 0;
+	int nCount = 0;
+
+	if (!m_Options.bPinWorkerThreads)
+		return nMask;
+
+	if (nMask == 0 && GetProcessAffinityMask(GetCurrentProcess(), &nProcessMask, &nSystemMask))
+		nMask = nProcessMask;
+
+	for (DWORD_PTR nBits = nMask; nBits != 0; nBits &= nBits - 1)
+		nCount++;
+	if (nCount == 0)
+		return 0;
+
+	// The threads take the processors of the mask in turn.
+	for (int i = 0; i < nIndex % nCount; i++)
+		nMask &= nMask - 1;
+
+	return nMask & (~nMask + 1);
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpObject::Finalize()
+{
+	// Notify the threads to exit
+	for (int i = 0; i < m_WorkerThreads.GetCount(); i++)
+		((CIocpWorkerThread*)m_WorkerThreads[i])->Terminate();
+	for (int i = 0; i < m_WorkerThreads.GetCount(); i++)
+		m_pEngine->PostCompletion(0, NULL);
+
+	// Wait for the threads to exit
+	for (int i = 0; i < m_WorkerThreads.GetCount(); i++)
+	{
+		CIocpWorkerThread *pThread = (CIocpWorkerThread*)m_WorkerThreads[i];
+		pThread->WaitFor();
+		delete pThread;
+	}
+	m_WorkerThreads.Clear();
+
+	delete m_pEngine;
+	m_pEngine = NULL;
+}
+
+//-----------------------------------------------------------------------------
+
+CIocpOverlappedData* CIocpObject::AllocOverlappedData(IOCP_TASK_TYPE nTaskType,
+	HANDLE hFileHandle, const WSABUF *pBuffers, int nBufferCount, int nOffset, PVOID pCaller)
+{
+	IFC_ASSERT(pBuffers != NULL);
+	IFC_ASSERT(nBufferCount > 0);
+	IFC_ASSERT(nOffset >= 0);
+
+	if (nBufferCount > IOCP_MAX_BUFFER_COUNT)
+		IfcThrowException(SEM_IOCP_TOO_MANY_BUFFERS);
+
+	CIocpOverlappedData *pResult = (CIocpOverlappedData*)m_BufferAlloc.AllocBuffer();
+	memset(&pResult->Overlapped, 0, sizeof(pResult->Overlapped));
+
+	CIocpTaskData& TaskData = pResult->TaskData;
+	TaskData.m_hIocpHandle = m_pEngine->GetHandle();
+	TaskData.m_hFileHandle = hFileHandle;
+	TaskData.m_nTaskType = nTaskType;
+	TaskData.m_nTaskSeqNum = m_TaskSeqAlloc.AllocId();
+	TaskData.m_CallBack.pProc = NULL;
+	TaskData.m_CallBack.pParam = NULL;
+	TaskData.m_pCaller = pCaller;
+	TaskData.m_Params.Clear();
+	TaskData.m_pEntireDataBuf = pBuffers[0].buf;
+	TaskData.m_nEntireBufferCount = nBufferCount;
+	TaskData.m_nOffset = nOffset;
+	TaskData.m_WSABuffer.buf = NULL;
+	TaskData.m_WSABuffer.len = 0;
+	TaskData.m_nWSABufferCount = 0;
+	TaskData.m_nBytesTrans = 0;
+	TaskData.m_nErrorCode = 0;
+	TaskData.m_pHandlerInvoke = NULL;
+	TaskData.m_pHandlerDestroy = NULL;
+
+	// Skips the segments which are already transferred and trims the first partial one.
+	int nSegStart = 0;
+	for (int i = 0; i < nBufferCount; i++)
+	{
+		int nSegSize = (int)pBuffers[i].len;
+
+		TaskData.m_EntireBuffers[i] = pBuffers[i];
+		if (nOffset < nSegStart + nSegSize)
+		{
+			int nSkipSize = Max(0, nOffset - nSegStart);
+			WSABUF& Buffer = TaskData.m_WSABuffers[TaskData.m_nWSABufferCount++];
+			Buffer.buf = pBuffers[i].buf + nSkipSize;
+			Buffer.len = nSegSize - nSkipSize;
+		}
+		nSegStart += nSegSize;
+	}
+
+	// A zero-byte task (see WaitReadable) keeps one empty buffer.
+	if (nSegStart == 0)
+		TaskData.m_WSABuffers[TaskData.m_nWSABufferCount++] = pBuffers[0];
+
+	IFC_ASSERT(nOffset < nSegStart || nSegStart == 0);
+
+	TaskData.m_nEntireDataSize = nSegStart;
+	if (TaskData.m_nWSABufferCount > 0)
+		TaskData.m_WSABuffer = TaskData.m_WSABuffers[0];
+	TaskData.m_pPendingEntry = m_PendingCounter.Inc(pCaller, nTaskType);
+
+	return pResult;
+}
+
+//-----------------------------------------------------------------------------
+
+CIocpOverlappedData* CIocpObject::CreateOverlappedData(IOCP_TASK_TYPE nTaskType,
+	HANDLE hFileHandle, PVOID pBuffer, int nSize, int nOffset,
+	const IOCP_CALLBACK_DEF& CallBackDef, PVOID pCaller, const CIocpParams& Params)
+{
+	IFC_ASSERT(pBuffer != NULL || nSize == 0);
+	IFC_ASSERT(nSize >= 0);
+
+	WSABUF Buffer;
+	Buffer.buf = (char*)pBuffer;
+	Buffer.len = nSize;
+
+	return CreateOverlappedData(nTaskType, hFileHandle, &Buffer, 1, nOffset,
+		CallBackDef, pCaller, Params);
+}
+
+//-----------------------------------------------------------------------------
+
+CIocpOverlappedData* CIocpObject::CreateOverlappedData(IOCP_TASK_TYPE nTaskType,
+	HANDLE hFileHandle, const WSABUF *pBuffers, int nBufferCount, int nOffset,
+	const IOCP_CALLBACK_DEF& CallBackDef, PVOID pCaller, const CIocpParams& Params)
+{
+	CIocpOverlappedData *pResult = AllocOverlappedData(nTaskType, hFileHandle,
+		pBuffers, nBufferCount, nOffset, pCaller);
+
+	pResult->TaskData.m_CallBack = CallBackDef;
+	pResult->TaskData.m_Params = Params;
+
+	return pResult;
+}
+
+//-----------------------------------------------------------------------------
+
+// Gives back an overlapped data which is not submitted.
+void CIocpObject::AbortOverlappedData(CIocpOverlappedData *pOvDataPtr)
+{
+	m_PendingCounter.Dec(pOvDataPtr->TaskData.m_pPendingEntry, pOvDataPtr->TaskData.GetTaskType());
+	DestroyOverlappedData(pOvDataPtr);
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpObject::StartFileTask(CIocpOverlappedData *pOvDataPtr)
+{
+	CIocpTaskData& TaskData = pOvDataPtr->TaskData;
+	int nErrorCode;
+
+	if (TaskData.m_nTaskType == ITT_SEND)
+		nErrorCode = m_pEngine->WriteFile(TaskData.m_hFileHandle, &TaskData.m_WSABuffers[0],
+			(LPOVERLAPPED)pOvDataPtr);
+	else
+		nErrorCode = m_pEngine->ReadFile(TaskData.m_hFileHandle, &TaskData.m_WSABuffers[0],
+			(LPOVERLAPPED)pOvDataPtr);
+
+	if (nErrorCode != 0)
+		PostError(nErrorCode, pOvDataPtr);
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpObject::StartSocketTask(CIocpOverlappedData *pOvDataPtr)
+{
+	CIocpTaskData& TaskData = pOvDataPtr->TaskData;
+	SOCKET hSocketHandle = (SOCKET)TaskData.m_hFileHandle;
+	int nErrorCode;
+
+	if (TaskData.m_nTaskType == ITT_SEND)
+		nErrorCode = m_pEngine->Send(hSocketHandle, TaskData.m_WSABuffers,
+			TaskData.m_nWSABufferCount, (LPOVERLAPPED)pOvDataPtr);
+	else
+		nErrorCode = m_pEngine->Recv(hSocketHandle, TaskData.m_WSABuffers,
+			TaskData.m_nWSABufferCount, (LPOVERLAPPED)pOvDataPtr);
+
+	if (nErrorCode != 0)
+		PostError(nErrorCode, pOvDataPtr);
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpObject::DestroyOverlappedData(CIocpOverlappedData *pOvDataPtr)
+{
+	m_BufferAlloc.ReturnBuffer(pOvDataPtr);
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpObject::PostError(int nErrorCode, CIocpOverlappedData *pOvDataPtr)
+{
+	pOvDataPtr->TaskData.m_nErrorCode = nErrorCode;
+	m_pEngine->PostCompletion(0, LPOVERLAPPED(pOvDataPtr));
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpObject::InvokeCallBack(const CIocpTaskData& TaskData)
+{
+	if (TaskData.m_pHandlerInvoke != NULL)
+	{
+		TaskData.m_pHandlerInvoke((PVOID)&TaskData.m_HandlerStorage, TaskData);
+	}
+	else
+	{
+		const IOCP_CALLBACK_DEF& CallBackDef = TaskData.GetCallBack();
+		if (CallBackDef.pProc != NULL)
+			CallBackDef.pProc(TaskData, CallBackDef.pParam);
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpObject::ProcessCompletion(const CIocpCompletion& Entry)
+{
+	CIocpTaskData *pTaskPtr = &((CIocpOverlappedData*)Entry.pOverlapped)->TaskData;
+	int nErrorCode = Entry.nErrorCode;
+
+	struct CAutoFinalizer
+	{
+	private:
+		CIocpObject& m_IocpObject;
+		CIocpTaskData& m_TaskData;
+	public:
+		CAutoFinalizer(CIocpObject& IocpObject, CIocpTaskData& TaskData) :
+			m_IocpObject(IocpObject), m_TaskData(TaskData) {}
+		~CAutoFinalizer()
+		{
+			if (m_TaskData.m_pHandlerDestroy != NULL)
+				m_TaskData.m_pHandlerDestroy((PVOID)&m_TaskData.m_HandlerStorage);
+			m_IocpObject.m_PendingCounter.Dec(
+				m_TaskData.m_pPendingEntry,
+				m_TaskData.GetTaskType());
+		}
+	} AutoFinalizer(*this, *pTaskPtr);
+
+	// Zero bytes transferred means the peer closed, unless nothing was asked for.
+	if (Entry.nBytesTrans == 0 && nErrorCode == 0 && pTaskPtr->GetEntireDataSize() > 0)
+	{
+		nErrorCode = pTaskPtr->GetErrorCode();
+		if (nErrorCode == 0)
+			nErrorCode = SOCKET_ERROR;
+	}
+
+	pTaskPtr->m_nBytesTrans = Entry.nBytesTrans;
+	if (pTaskPtr->m_nErrorCode == 0)
+		pTaskPtr->m_nErrorCode = nErrorCode;
+
+	if (pTaskPtr->m_nErrorCode != 0)
+		InterlockedIncrement(&m_nErrorCount);
+
+	InvokeCallBack(*pTaskPtr);
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpObject::Work()
+{
+	CIocpCompletion Entries[IOCP_MAX_BATCH_SIZE];
+	PVOID pBuffers[IOCP_MAX_BATCH_SIZE];
+	int nBufferCount = 0;
+	int nWakeUpCount = 0;
+
+	struct CAutoFinalizer
+	{
+	private:
+		CIocpObject& m_IocpObject;
+		PVOID *m_pBuffers;
+		int& m_nCount;
+	public:
+		CAutoFinalizer(CIocpObject& IocpObject, PVOID *pBuffers, int& nCount) :
+			m_IocpObject(IocpObject), m_pBuffers(pBuffers), m_nCount(nCount) {}
+		~CAutoFinalizer()
+		{
+			m_IocpObject.m_BufferAlloc.ReturnBuffers(m_pBuffers, m_nCount);
+		}
+	} AutoFinalizer(*this, pBuffers, nBufferCount);
+
+	int nCount = m_pEngine->GetCompletions(Entries, m_Options.nBatchSize, INFINITE);
+
+	for (int i = 0; i < nCount; i++)
+	{
+		if (Entries[i].pOverlapped == NULL)
+		{
+			nWakeUpCount++;
+			continue;
+		}
+
+		pBuffers[nBufferCount++] = Entries[i].pOverlapped;
+		try
+		{
+			ProcessCompletion(Entries[i]);
+		}
+		catch (IFC_EXCEPT_OBJ e)
+		{
+			IFC_DELETE_MFC_EXCEPT_OBJ(e);
+		}
+		catch (...)
+		{}
+	}
+
+	// Each exiting worker thread consumes one wake-up packet, so the extra ones are requeued.
+	for (int i = 1; i < nWakeUpCount; i++)
+		m_pEngine->PostCompletion(0, NULL);
+}
+
+//-----------------------------------------------------------------------------
+
+bool CIocpObject::AssociateHandle(HANDLE hFileHandle)
+{
+	return m_pEngine->AssociateHandle(hFileHandle);
+}
+
+//-----------------------------------------------------------------------------
+
+bool CIocpObject::AssociateHandle(SOCKET hSocketHandle)
+{
+	return AssociateHandle((HANDLE)hSocketHandle);
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpObject::Send(HANDLE hFileHandle, PVOID pBuffer, int nSize, int nOffset,
 	const IOCP_CALLBACK_DEF& CallBackDef, PVOID pCaller, const CIocpParams& Params)
 {
-	CIocpOverlappedData *pOvDataPtr;
-	CIocpTaskData *pTaskPtr;
-	DWORD nNumberOfBytesSent;
+	StartFileTask(CreateOverlappedData(ITT_SEND, hFileHandle, pBuffer, nSize,
+		nOffset, CallBackDef, pCaller, Params));
+}
 
-	m_PendingCounter.Inc(pCaller, ITT_SEND);
+//-----------------------------------------------------------------------------
 
-	pOvDataPtr = CreateOverlappedData(ITT_SEND, (HANDLE)hSocketHandle, pBuffer, nSize,
-		nOffset, CallBackDef, pCaller, Params);
-	pTaskPtr = &(pOvDataPtr->TaskData);
+void CIocpObject::Recv(HANDLE hFileHandle, PVOID pBuffer, int nSize, int nOffset,
+	const IOCP_CALLBACK_DEF& CallBackDef, PVOID pCaller, const CIocpParams& Params)
+{
+	StartFileTask(CreateOverlappedData(ITT_RECV, hFileHandle, pBuffer, nSize,
+		nOffset, CallBackDef, pCaller, Params));
+}
 
-	if (::WSASend(hSocketHandle, &pTaskPtr->m_WSABuffer, 1, &nNumberOfBytesSent, 0,
-		(LPWSAOVERLAPPED)pOvDataPtr, NULL) == SOCKET_ERROR)
-	{
-		if (GetLastError() != ERROR_IO_PENDING)
-			PostError(GetLastError(), pOvDataPtr);
-	}
+//-----------------------------------------------------------------------------
+
+void CIocpObject::Send(SOCKET hSocketHandle, PVOID pBuffer, int nSize, int nOffset,
+	const IOCP_CALLBACK_DEF& CallBackDef, PVOID pCaller, const CIocpParams& Params)
+{
+	StartSocketTask(CreateOverlappedData(ITT_SEND, (HANDLE)hSocketHandle, pBuffer, nSize,
+		nOffset, CallBackDef, pCaller, Params));
 }
 
 //-----------------------------------------------------------------------------
@@ -651,22 +1323,26 @@ void CIocpObject::Send(SOCKET hSocketHandle, PVOID pBuffer, int nSize, int nOffs
 void CIocpObject::Recv(SOCKET hSocketHandle, PVOID pBuffer, int nSize, int nOffset,
 	const IOCP_CALLBACK_DEF& CallBackDef, PVOID pCaller, const CIocpParams& Params)
 {
-	CIocpOverlappedData *pOvDataPtr;
-	CIocpTaskData *pTaskPtr;
-	DWORD nNumberOfBytesRecvd, nFlags = 0;
+	StartSocketTask(CreateOverlappedData(ITT_RECV, (HANDLE)hSocketHandle, pBuffer, nSize,
+		nOffset, CallBackDef, pCaller, Params));
+}
 
-	m_PendingCounter.Inc(pCaller, ITT_RECV);
+//-----------------------------------------------------------------------------
 
-	pOvDataPtr = CreateOverlappedData(ITT_RECV, (HANDLE)hSocketHandle, pBuffer, nSize,
-		nOffset, CallBackDef, pCaller, Params);
-	pTaskPtr = &(pOvDataPtr->TaskData);
+void CIocpObject::SendV(SOCKET hSocketHandle, const WSABUF *pBuffers, int nBufferCount,
+	int nOffset, const IOCP_CALLBACK_DEF& CallBackDef, PVOID pCaller, const CIocpParams& Params)
+{
+	StartSocketTask(CreateOverlappedData(ITT_SEND, (HANDLE)hSocketHandle, pBuffers,
+		nBufferCount, nOffset, CallBackDef, pCaller, Params));
+}
 
-	if (::WSARecv(hSocketHandle, &pTaskPtr->m_WSABuffer, 1, &nNumberOfBytesRecvd, &nFlags,
-		(LPWSAOVERLAPPED)pOvDataPtr, NULL) == SOCKET_ERROR)
-	{
-		if (GetLastError() != ERROR_IO_PENDING)
-			PostError(GetLastError(), pOvDataPtr);
-	}
+//-----------------------------------------------------------------------------
+
+void CIocpObject::RecvV(SOCKET hSocketHandle, const WSABUF *pBuffers, int nBufferCount,
+	int nOffset, const IOCP_CALLBACK_DEF& CallBackDef, PVOID pCaller, const CIocpParams& Params)
+{
+	StartSocketTask(CreateOverlappedData(ITT_RECV, (HANDLE)hSocketHandle, pBuffers,
+		nBufferCount, nOffset, CallBackDef, pCaller, Params));
 }
 
 //-----------------------------------------------------------------------------
@@ -677,32 +1353,23 @@ void CIocpObject::SendTo(SOCKET hSocketHandle, const CPeerAddress& PeerAddr,
 {
 	CIocpOverlappedData *pOvDataPtr;
 	CIocpTaskData *pTaskPtr;
-	DWORD nNumberOfBytesSent;
-
-	SOCK_ADDR SockAddr;
-	GetSocketAddr(SockAddr, PeerAddr.nIp, PeerAddr.nPort);
-
-	m_PendingCounter.Inc(pCaller, ITT_SEND);
+	int nErrorCode;
 
 	pOvDataPtr = CreateOverlappedData(ITT_SEND, (HANDLE)hSocketHandle, pBuffer, nSize,
 		nOffset, CallBackDef, pCaller, Params);
 	pTaskPtr = &(pOvDataPtr->TaskData);
 
-	if (::WSASendTo(hSocketHandle, &pTaskPtr->m_WSABuffer, 1, &nNumberOfBytesSent, 0,
-		(sockaddr*)&SockAddr, sizeof(SockAddr),
-		(LPWSAOVERLAPPED)pOvDataPtr, NULL) == SOCKET_ERROR)
-	{
-		if (GetLastError() != ERROR_IO_PENDING)
-			PostError(GetLastError(), pOvDataPtr);
-	}
+	nErrorCode = m_pEngine->SendTo(hSocketHandle, PeerAddr, pTaskPtr->m_WSABuffers,
+		pTaskPtr->m_nWSABufferCount, (LPOVERLAPPED)pOvDataPtr);
+	if (nErrorCode != 0)
+		PostError(nErrorCode, pOvDataPtr);
 }
 
 //-----------------------------------------------------------------------------
 
 void CIocpObject::WaitForComplete(PVOID pCaller)
 {
-	while (m_PendingCounter.Get(pCaller) > 0)
-		Sleep(1);
+	m_PendingCounter.WaitFor(pCaller);
 }
 
 //-----------------------------------------------------------------------------
@@ -743,6 +1410,374 @@ int CIocpObject::GetPendingCount(IOCP_TASK_TYPE nTaskType)
 	return m_PendingCounter.Get(nTaskType);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// CIocpReadableHandler
+
+struct CIocpReadableHandler
+{
+	CIocpTcpConnection *pConnection;
+
+	void operator() (const CIocpTaskData& TaskData) const
+	{
+		pConnection->OnReadable(TaskData.GetErrorCode());
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// CIocpTcpConnection
+
+CIocpTcpConnection::CIocpTcpConnection(CIocpTcpServer& Server, SOCKET nSocketHandle,
+	const CPeerAddress& PeerAddr) :
+		CTcpConnection(nSocketHandle, PeerAddr),
+		m_Server(Server)
+{
+	// nothing
+}
+
+//-----------------------------------------------------------------------------
+
+CIocpTcpConnection::~CIocpTcpConnection()
+{
+	// nothing
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpTcpConnection::OnReadable(int nErrorCode)
+{
+	const CCallBackDef<IOCP_TCPSVR_ON_READABLE_PROC>& OnReadable = m_Server.m_OnReadable;
+
+	if (OnReadable.pProc)
+		OnReadable.pProc(OnReadable.pParam, this, nErrorCode);
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpTcpConnection::WaitReadable()
+{
+	CIocpReadableHandler Handler;
+	Handler.pConnection = this;
+
+	m_Server.GetIocp().WaitReadable(m_Socket.GetHandle(), Handler, this);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CIocpTcpServer
+
+CIocpTcpServer::CIocpTcpServer() :
+	m_pIocpObject(NULL)
+{
+	// nothing
+}
+
+//-----------------------------------------------------------------------------
+
+CIocpTcpServer::~CIocpTcpServer()
+{
+	Close();
+}
+
+//-----------------------------------------------------------------------------
+
+CTcpConnection* CIocpTcpServer::CreateConnection(SOCKET nSocketHandle, const CPeerAddress& PeerAddr)
+{
+	return new CIocpTcpConnection(*this, nSocketHandle, PeerAddr);
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpTcpServer::AcceptConnection(CTcpConnection *pConnection)
+{
+	if (!GetIocp().AssociateHandle(pConnection->GetSocket().GetHandle()))
+	{
+		delete pConnection;
+		return;
+	}
+
+	CTcpServer::AcceptConnection(pConnection);
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpTcpServer::SetOnReadableCallBack(IOCP_TCPSVR_ON_READABLE_PROC pProc, void *pParam)
+{
+	m_OnReadable.pProc = pProc;
+	m_OnReadable.pParam = pParam;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CIocpFileSinkHandler
+
+struct CIocpFileSinkHandler
+{
+	CIocpFileSink *pFileSink;
+	PVOID pBlock;
+
+	void operator() (const CIocpTaskData& TaskData) const
+	{
+		pFileSink->OnWriteComplete(pBlock, TaskData);
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// CIocpFileSink
+
+CIocpFileSink::CIocpFileSink(CIocpObject& IocpObject, int nBlockSize, int nBlockCount) :
+	m_IocpObject(IocpObject),
+	m_hFileHandle(INVALID_HANDLE_VALUE),
+	m_nBlockSize(Max(nBlockSize, 1024)),
+	m_nBlockCount(Max(nBlockCount, 1)),
+	m_nWritePos(0),
+	m_nPendingCount(0),
+	m_nBusyCount(0),
+	m_nErrorCode(0),
+	m_bWaitingBlock(false),
+	m_bFinishing(false)
+{
+	m_hIdleEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+}
+
+//-----------------------------------------------------------------------------
+
+CIocpFileSink::~CIocpFileSink()
+{
+	Close();
+
+	// Only the callbacks of this thread are left, they must not touch the sink any more.
+	for (int i = 0; i < m_CallBackEntries.GetCount(); i++)
+		((CALLBACK_ENTRY*)m_CallBackEntries[i])->bDestroyed = true;
+
+	CloseHandle(m_hIdleEvent);
+}
+
+//-----------------------------------------------------------------------------
+
+// Called from the iocp worker threads when a block is written.
+void CIocpFileSink::OnWriteComplete(PVOID pBlock, const CIocpTaskData& TaskData)
+{
+	CCallBackDef<IOCP_FILESINK_PROC> OnBlockFree, OnFinished;
+	CALLBACK_ENTRY Entry;
+	int nErrorCode;
+
+	Entry.nThreadId = GetCurrentThreadId();
+	Entry.bDestroyed = false;
+
+	{
+		CAutoLocker Locker(m_Lock);
+
+		if (m_nErrorCode == 0)
+		{
+			if (TaskData.GetErrorCode() != 0)
+				m_nErrorCode = TaskData.GetErrorCode();
+			else if (TaskData.GetBytesTrans() < TaskData.GetDataSize())
+				m_nErrorCode = ERROR_HANDLE_DISK_FULL;
+		}
+
+		m_FreeBlocks.Add(pBlock);
+		m_nPendingCount--;
+		nErrorCode = m_nErrorCode;
+
+		if (m_bWaitingBlock)
+		{
+			m_bWaitingBlock = false;
+			OnBlockFree = m_OnBlockFree;
+		}
+
+		if (m_bFinishing && m_nPendingCount == 0)
+		{
+			m_bFinishing = false;
+			OnFinished = m_OnFinished;
+		}
+
+		m_CallBackEntries.Add(&Entry);
+	}
+
+	if (OnBlockFree.pProc)
+		OnBlockFree.pProc(OnBlockFree.pParam, this, nErrorCode);
+	if (OnFinished.pProc && !Entry.bDestroyed)
+		OnFinished.pProc(OnFinished.pParam, this, nErrorCode);
+
+	// Close() waits for this, unless the sink has been deleted in the callbacks.
+	if (!Entry.bDestroyed)
+	{
+		CAutoLocker Locker(m_Lock);
+		m_CallBackEntries.Remove(&Entry);
+		m_nBusyCount--;
+		SetEvent(m_hIdleEvent);
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+// Returns the number of the completions running the callbacks on the specified thread.
+int CIocpFileSink::GetCallBackCount(DWORD nThreadId)
+{
+	int nResult = 0;
+
+	for (int i = 0; i < m_CallBackEntries.GetCount(); i++)
+	{
+		if (((CALLBACK_ENTRY*)m_CallBackEntries[i])->nThreadId == nThreadId)
+			nResult++;
+	}
+
+	return nResult;
+}
+
+//-----------------------------------------------------------------------------
+
+bool CIocpFileSink::Open(LPCTSTR lpszFileName)
+{
+	Close();
+
+	m_hFileHandle = CreateFile(lpszFileName, GENERIC_WRITE, FILE_SHARE_READ, NULL,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN,
+		NULL);
+	if (m_hFileHandle == INVALID_HANDLE_VALUE)
+		return false;
+
+	if (!m_IocpObject.AssociateHandle(m_hFileHandle))
+	{
+		CloseHandle(m_hFileHandle);
+		m_hFileHandle = INVALID_HANDLE_VALUE;
+		return false;
+	}
+
+	for (int i = 0; i < m_nBlockCount; i++)
+	{
+		PVOID pBlock = new char[m_nBlockSize];
+		m_Blocks.Add(pBlock);
+		m_FreeBlocks.Add(pBlock);
+	}
+
+	m_nWritePos = 0;
+	m_nErrorCode = 0;
+	m_bWaitingBlock = false;
+	m_bFinishing = false;
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpFileSink::Close()
+{
+	DWORD nThreadId = GetCurrentThreadId();
+
+	while (true)
+	{
+		{
+			CAutoLocker Locker(m_Lock);
+			if (m_nBusyCount <= GetCallBackCount(nThreadId)) break;
+			ResetEvent(m_hIdleEvent);
+		}
+		WaitForSingleObject(m_hIdleEvent, INFINITE);
+	}
+
+	if (m_hFileHandle != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(m_hFileHandle);
+		m_hFileHandle = INVALID_HANDLE_VALUE;
+	}
+
+	for (int i = 0; i < m_Blocks.GetCount(); i++)
+		delete[] (char*)m_Blocks[i];
+	m_Blocks.Clear();
+	m_FreeBlocks.Clear();
+}
+
+//-----------------------------------------------------------------------------
+
+// Sets the file size, and skips the zeroing of the file data if allowed.
+bool CIocpFileSink::Preallocate(INT64 nSize)
+{
+	LARGE_INTEGER nFilePos;
+	nFilePos.QuadPart = nSize;
+
+	if (!SetFilePointerEx(m_hFileHandle, nFilePos, NULL, FILE_BEGIN) ||
+		!SetEndOfFile(m_hFileHandle))
+		return false;
+
+	// Needs SE_MANAGE_VOLUME_NAME, and it is fine to go without it.
+	SetFileValidData(m_hFileHandle, nSize);
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+
+PVOID CIocpFileSink::AcquireBlock()
+{
+	CAutoLocker Locker(m_Lock);
+
+	if (m_FreeBlocks.GetCount() == 0)
+	{
+		m_bWaitingBlock = true;
+		return NULL;
+	}
+
+	PVOID pBlock = m_FreeBlocks.Last();
+	m_FreeBlocks.Delete(m_FreeBlocks.GetCount() - 1);
+	return pBlock;
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpFileSink::CommitBlock(PVOID pBlock, int nDataSize)
+{
+	IFC_ASSERT(nDataSize > 0 && nDataSize <= m_nBlockSize);
+
+	CIocpFileSinkHandler Handler;
+	Handler.pFileSink = this;
+	Handler.pBlock = pBlock;
+
+	INT64 nFilePos;
+	{
+		CAutoLocker Locker(m_Lock);
+		nFilePos = m_nWritePos;
+		m_nWritePos += nDataSize;
+		m_nPendingCount++;
+		m_nBusyCount++;
+	}
+
+	m_IocpObject.WriteFileAt(m_hFileHandle, nFilePos, pBlock, nDataSize, Handler, this);
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpFileSink::Finish()
+{
+	int nErrorCode;
+
+	{
+		CAutoLocker Locker(m_Lock);
+
+		if (m_nPendingCount > 0)
+		{
+			m_bFinishing = true;
+			return;
+		}
+		nErrorCode = m_nErrorCode;
+	}
+
+	if (m_OnFinished.pProc)
+		m_OnFinished.pProc(m_OnFinished.pParam, this, nErrorCode);
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpFileSink::SetOnBlockFreeCallBack(IOCP_FILESINK_PROC pProc, void *pParam)
+{
+	m_OnBlockFree.pProc = pProc;
+	m_OnBlockFree.pParam = pParam;
+}
+
+//-----------------------------------------------------------------------------
+
+void CIocpFileSink::SetOnFinishedCallBack(IOCP_FILESINK_PROC pProc, void *pParam)
+{
+	m_OnFinished.pProc = pProc;
+	m_OnFinished.pParam = pParam;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 
 } // namespace ifc
@@ -35,7 +35,8 @@ namespace ifc
 CNamedPipeServer::CNamedPipeServer(bool bUseIocp) :
 	m_pListenerThread(NULL),
 	m_nMaxConnCount(PIPE_DEF_MAX_CONN_COUNT),
-	m_bUseIocp(bUseIocp)
+	m_bUseIocp(bUseIocp),
+	m_pIocpObject(NULL)
 {
 	m_pConnList = new CNamedPipeConnList(*this);
 }
@@ -206,7 +207,7 @@ CNamedPipeConnection::CNamedPipeConnection(CNamedPipeServer& Server, HANDLE hPip
 	InitVariables();
 
 	if (m_pServer->IsUseIocp())
-		GetIocpObject().AssociateHandle(hPipeHandle);
+		m_pServer->GetIocp().AssociateHandle(hPipeHandle);
 	InitConnection();
 
 	m_pServer->GetConnList().RegisterItem(this);
@@ -360,7 +361,7 @@ int CNamedPipeConnection::SendBuffer(void *pBuffer, int nSize, PVOID pParam, int
 {
 	if (m_pServer && m_pServer->IsUseIocp())
 	{
-		GetIocpObject().Send(m_hPipeHandle, pBuffer, nSize, 0,
+		m_pServer->GetIocp().Send(m_hPipeHandle, pBuffer, nSize, 0,
 			IOCP_CALLBACK_DEF(CNamedPipeServer::IocpCallBackProc, NULL),
 			this, CIocpParams(1, pParam));
 		return 0;
@@ -377,7 +378,7 @@ int CNamedPipeConnection::RecvBuffer(void *pBuffer, int nSize, PVOID pParam, int
 {
 	if (m_pServer && m_pServer->IsUseIocp())
 	{
-		GetIocpObject().Recv(m_hPipeHandle, pBuffer, nSize, 0,
+		m_pServer->GetIocp().Recv(m_hPipeHandle, pBuffer, nSize, 0,
 			IOCP_CALLBACK_DEF(CNamedPipeServer::IocpCallBackProc, NULL),
 			this, CIocpParams(1, pParam));
 		return 0;
@@ -326,11 +326,10 @@ CString GetLocalIp()
 CString LookupHostAddr(LPCTSTR lpszHost)
 {
 	CString strResult;
-	CStringA strHost(lpszHost);
+	DWORD nIp;
 
-	struct hostent* pHost = gethostbyname(strHost);
-	if (pHost != NULL)
-		strResult = IpToString(ntohl(((struct in_addr *)pHost->h_addr)->s_addr));
+	if (CDnsResolver::Instance().Lookup(lpszHost, nIp))
+		strResult = IpToString(nIp);
 
 	return strResult;
 }
@@ -356,6 +355,20 @@ void DeleteTcpConnectorPoolObject()
 	CTcpConnectorPool::Delete();
 }
 
+//-----------------------------------------------------------------------------
+
+CDnsResolver& GetDnsResolverObject()
+{
+	return CDnsResolver::Instance();
+}
+
+//-----------------------------------------------------------------------------
+
+void DeleteDnsResolverObject()
+{
+	CDnsResolver::Delete();
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // CIfcSocket
 
@@ -464,6 +477,16 @@ void CIfcSocket::SetHandle(SOCKET nValue)
 
 //-----------------------------------------------------------------------------
 
+SOCKET CIfcSocket::Detach()
+{
+	SOCKET nResult = m_nHandle;
+	m_nHandle = INVALID_SOCKET;
+	m_bActive = false;
+	return nResult;
+}
+
+//-----------------------------------------------------------------------------
+
 void CIfcSocket::Bind(int nPort, bool bForce)
 {
 	SOCK_ADDR Addr;
@@ -517,6 +540,37 @@ void CIfcSocket::Close()
 ///////////////////////////////////////////////////////////////////////////////
 // CUdpSocket
 
+// Sends one datagram. A non-blocking socket (e.g. a CUdpServer whose listener threads
+// use WSAEventSelect) waits here for the send buffer as a blocking one would.
+int CUdpSocket::SendTo(void *pBuffer, int nSize, const SOCK_ADDR& Addr)
+{
+	const int SELECT_WAIT_MSEC = 250;
+
+	int nResult;
+	fd_set fds;
+	struct timeval tv;
+
+	while (true)
+	{
+		nResult = sendto(m_nHandle, (char*)pBuffer, nSize, 0, (struct sockaddr*)&Addr, sizeof(Addr));
+		if (nResult >= 0 || IfcSocketGetLastError() != SS_EWOULDBLOCK || !GetActive())
+			break;
+
+		tv.tv_sec = 0;
+		tv.tv_usec = SELECT_WAIT_MSEC * 1000;
+
+		FD_ZERO(&fds);
+		FD_SET((DWORD)m_nHandle, &fds);
+
+		if (select(0, NULL, &fds, NULL, &tv) < 0 && IfcSocketGetLastError() != SS_EINTR)
+			break;
+	}
+
+	return nResult;
+}
+
+//-----------------------------------------------------------------------------
+
 int CUdpSocket::RecvBuffer(void *pBuffer, int nSize)
 {
 	CPeerAddress PeerAddr;
@@ -549,12 +603,31 @@ int CUdpSocket::SendBuffer(void *pBuffer, int nSize, const CPeerAddress& PeerAdd
 {
 	int nResult = 0;
 	SOCK_ADDR Addr;
-	socklen_t nSockLen = sizeof(Addr);
 
 	GetSocketAddr(Addr, PeerAddr.nIp, PeerAddr.nPort);
 
 	for (int i = 0; i < nSendTimes; i++)
-		nResult = sendto(m_nHandle, (char*)pBuffer, nSize, 0, (struct sockaddr*)&Addr, nSockLen);
+		nResult = SendTo(pBuffer, nSize, Addr);
+
+	return nResult;
+}
+
+//-----------------------------------------------------------------------------
+
+int CUdpSocket::SendBuffers(const CUdpDatagram *pDatagrams, int nCount)
+{
+	int nResult = 0;
+	SOCK_ADDR Addr;
+
+	for (int i = 0; i < nCount; i++)
+	{
+		const CUdpDatagram& Datagram = pDatagrams[i];
+
+		GetSocketAddr(Addr, Datagram.PeerAddr.nIp, Datagram.PeerAddr.nPort);
+		if (SendTo(Datagram.pBuffer, Datagram.nSize, Addr) < 0)
+			break;
+		nResult++;
+	}
 
 	return nResult;
 }
@@ -588,7 +661,9 @@ void CUdpSocket::Open()
 CUdpServer::CUdpServer() :
 	m_nLocalPort(0),
 	m_bForceBind(false),
-	m_pListenerThreadPool(NULL)
+	m_pListenerThreadPool(NULL),
+	m_nListenerAffinity(0),
+	m_nRecvBatchSize(UDP_DEF_RECV_BATCH_SIZE)
 {
 	m_pListenerThreadPool = new CUdpListenerThreadPool(this);
 	SetListenerThreadCount(1);
@@ -603,10 +678,16 @@ CUdpServer::~CUdpServer()
 
 //-----------------------------------------------------------------------------
 
-void CUdpServer::DataReceived(void *pPacketBuffer, int nPacketSize, const CPeerAddress& PeerAddr)
+void CUdpServer::DataReceived(const CUdpDatagram *pDatagrams, int nCount)
 {
-	if (m_OnRecvData.pProc)
-		m_OnRecvData.pProc(m_OnRecvData.pParam, pPacketBuffer, nPacketSize, PeerAddr);
+	if (m_OnRecvBatch.pProc)
+		m_OnRecvBatch.pProc(m_OnRecvBatch.pParam, pDatagrams, nCount);
+	else if (m_OnRecvData.pProc)
+	{
+		for (int i = 0; i < nCount; i++)
+			m_OnRecvData.pProc(m_OnRecvData.pParam, pDatagrams[i].pBuffer,
+				pDatagrams[i].nSize, pDatagrams[i].PeerAddr);
+	}
 }
 
 //-----------------------------------------------------------------------------
@@ -687,12 +768,27 @@ void CUdpServer::SetListenerThreadCount(int nValue)
 
 //-----------------------------------------------------------------------------
 
+void CUdpServer::SetRecvBatchSize(int nValue)
+{
+	m_nRecvBatchSize = Max(1, Min(nValue, UDP_MAX_RECV_BATCH_SIZE));
+}
+
+//-----------------------------------------------------------------------------
+
 void CUdpServer::SetOnRecvDataCallBack(UDPSVR_ON_RECV_DATA_PROC pProc, void *pParam)
 {
 	m_OnRecvData.pProc = pProc;
 	m_OnRecvData.pParam = pParam;
 }
 
+//-----------------------------------------------------------------------------
+
+void CUdpServer::SetOnRecvBatchCallBack(UDPSVR_ON_RECV_BATCH_PROC pProc, void *pParam)
+{
+	m_OnRecvBatch.pProc = pProc;
+	m_OnRecvBatch.pParam = pParam;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // CDtpConnection
 
@@ -1137,13 +1233,33 @@ int CTcpClient::CheckAsyncConnectState(int nTimeOutMSecs)
 	return nResult;
 }
 
+//-----------------------------------------------------------------------------
+
+void CTcpClient::Attach(SOCKET nSocketHandle, const CPeerAddress& PeerAddr)
+{
+	if (IsConnected()) Disconnect();
+
+	m_Socket.SetHandle(nSocketHandle);
+	m_Socket.SetBlockMode(false);
+	m_PeerAddr = PeerAddr;
+}
+
+//-----------------------------------------------------------------------------
+
+SOCKET CTcpClient::Detach()
+{
+	m_PeerAddr = CPeerAddress(0, 0);
+	return m_Socket.Detach();
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // CTcpServer
 
 CTcpServer::CTcpServer() :
 	m_nLocalPort(0),
 	m_bForceBind(false),
-	m_pListenerThread(NULL)
+	m_pListenerThread(NULL),
+	m_nListenerAffinity(0)
 {
 	// nothing
 }
@@ -1187,6 +1303,8 @@ void CTcpServer::StartListenerThread()
 	if (!m_pListenerThread)
 	{
 		m_pListenerThread = new CTcpListenerThread(this);
+		m_pListenerThread->SetName(TEXT("TCP Listener"));
+		m_pListenerThread->SetAffinityMask(m_nListenerAffinity);
 		m_pListenerThread->Run();
 	}
 }
@@ -1301,40 +1419,40 @@ CUdpListenerThread::~CUdpListenerThread()
 void CUdpListenerThread::Execute()
 {
 	const int MAX_UDP_BUFFER_SIZE = 8192;   // The max size of UDP packet (bytes)
-	const int SELECT_WAIT_MSEC    = 100;    // The waiting interval (ms)
 
-	fd_set fds;
-	struct timeval tv;
-	SOCKET nSocketHandle = m_pUdpServer->GetHandle();
-	CBuffer PacketBuffer(MAX_UDP_BUFFER_SIZE);
-	CPeerAddress PeerAddr;
-	int r, n;
+	int nBatchSize = m_pUdpServer->GetRecvBatchSize();
+	CBuffer PacketBuffers(MAX_UDP_BUFFER_SIZE * nBatchSize);
+	CUdpDatagram Datagrams[UDP_MAX_RECV_BATCH_SIZE];
+	HANDLE Events[2] = { m_pThreadPool->GetRecvEvent(), m_pThreadPool->GetStopEvent() };
+
+	for (int i = 0; i < nBatchSize; i++)
+		Datagrams[i].pBuffer = PacketBuffers.Data() + i * MAX_UDP_BUFFER_SIZE;
 
 	while (!GetTerminated() && m_pUdpServer->GetActive())
 	try
 	{
-		tv.tv_sec = 0;
-		tv.tv_usec = SELECT_WAIT_MSEC * 1000;
-
-		FD_ZERO(&fds);
-		FD_SET((DWORD)nSocketHandle, &fds);
-
-		r = select(0, &fds, NULL, NULL, &tv);
+		DWORD nRet = WaitForMultipleObjects(2, Events, FALSE, INFINITE);
+		if (nRet != WAIT_OBJECT_0)
+			break;  // stopped or error
 
-		if (r > 0 && m_pUdpServer->GetActive() && FD_ISSET(nSocketHandle, &fds))
+		// Drains the socket (non-blocking) into the buffer ring.
+		int nCount = 0;
+		while (nCount < nBatchSize && m_pUdpServer->GetActive())
 		{
-			n = m_pUdpServer->RecvBuffer(PacketBuffer.Data(), MAX_UDP_BUFFER_SIZE, PeerAddr);
-			if (n > 0)
-			{
-				m_pUdpServer->DataReceived(PacketBuffer.Data(), n, PeerAddr);
-			}
-		}
-		else if (r < 0)
-		{
-			int nError = IfcSocketGetLastError();
-			if (nError != SS_EINTR && nError != SS_EINPROGRESS)
-				break;  // error
+			CUdpDatagram& Datagram = Datagrams[nCount];
+			Datagram.nSize = m_pUdpServer->RecvBuffer(Datagram.pBuffer,
+				MAX_UDP_BUFFER_SIZE, Datagram.PeerAddr);
+			if (Datagram.nSize <= 0)
+				break;
+			nCount++;
 		}
+
+		// More datagrams may be pending, let another listener thread take them.
+		if (nCount == nBatchSize)
+			SetEvent(Events[0]);
+
+		if (nCount > 0)
+			m_pUdpServer->DataReceived(Datagrams, nCount);
 	}
 	catch (IFC_EXCEPT_OBJ e)
 	{
@@ -1351,14 +1469,16 @@ CUdpListenerThreadPool::CUdpListenerThreadPool(CUdpServer *pUdpServer) :
 	m_pUdpServer(pUdpServer),
 	m_nMaxThreadCount(0)
 {
-	// nothing
+	m_hRecvEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	m_hStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
 }
 
 //-----------------------------------------------------------------------------
 
 CUdpListenerThreadPool::~CUdpListenerThreadPool()
 {
-	// nothing
+	CloseHandle(m_hRecvEvent);
+	CloseHandle(m_hStopEvent);
 }
 
 //-----------------------------------------------------------------------------
@@ -1384,10 +1504,18 @@ void CUdpListenerThreadPool::UnregisterThread(CUdpListenerThread *pThread)
 
 void CUdpListenerThreadPool::StartThreads()
 {
+	ResetEvent(m_hStopEvent);
+
+	// Makes the socket non-blocking and signals m_hRecvEvent when datagrams arrive.
+	if (WSAEventSelect(m_pUdpServer->GetHandle(), m_hRecvEvent, FD_READ) == SOCKET_ERROR)
+		IfcThrowSocketLastError();
+
 	for (int i = 0; i < m_nMaxThreadCount; i++)
 	{
 		CUdpListenerThread *pThread;
 		pThread = new CUdpListenerThread(this, i);
+		pThread->SetName(FormatString(TEXT("UDP Listener #%d"), i));
+		pThread->SetAffinityMask(m_pUdpServer->GetListenerAffinityMask());
 		pThread->Run();
 	}
 }
@@ -1401,6 +1529,7 @@ void CUdpListenerThreadPool::StopThreads()
 	double nWaitSecs = 0;
 
 	// Notify the threads to terminate.
+	SetEvent(m_hStopEvent);
 	{
 		CAutoLocker Locker(m_Lock);
 
@@ -1443,56 +1572,498 @@ CTcpListenerThread::CTcpListenerThread(CTcpServer *pTcpServer) :
 	m_pTcpServer(pTcpServer)
 {
 	SetFreeOnTerminate(false);
+
+	m_hAcceptEvent = WSACreateEvent();
+	m_hStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
 }
 
 //-----------------------------------------------------------------------------
 
-void CTcpListenerThread::Execute()
+CTcpListenerThread::~CTcpListenerThread()
 {
-	const int SELECT_WAIT_MSEC = 100;    // The waiting interval (ms).
+	WSACloseEvent(m_hAcceptEvent);
+	CloseHandle(m_hStopEvent);
+}
 
-	fd_set fds;
-	struct timeval tv;
-	SOCK_ADDR Addr;
-	socklen_t nSockLen = sizeof(Addr);
+//-----------------------------------------------------------------------------
+
+// Accepts all the pending connections until the listen queue is empty.
+void CTcpListenerThread::AcceptConnections()
+{
 	SOCKET nSocketHandle = m_pTcpServer->GetSocket().GetHandle();
+	SOCK_ADDR Addr;
+	socklen_t nSockLen;
 	CPeerAddress PeerAddr;
-	int r;
+
+	while (!GetTerminated() && m_pTcpServer->GetActive())
+	{
+		nSockLen = sizeof(Addr);
+		SOCKET nAcceptHandle = accept(nSocketHandle, (struct sockaddr*)&Addr, &nSockLen);
+		if (nAcceptHandle == INVALID_SOCKET)
+			break;
+
+		// The accepted socket inherits the event selection of the listening socket.
+		WSAEventSelect(nAcceptHandle, NULL, 0);
+
+		PeerAddr = CPeerAddress(ntohl(Addr.sin_addr.s_addr), ntohs(Addr.sin_port));
+		CTcpConnection *pConnection = m_pTcpServer->CreateConnection(nAcceptHandle, PeerAddr);
+		m_pTcpServer->AcceptConnection(pConnection);
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+void CTcpListenerThread::BeforeTerminate()
+{
+	SetEvent(m_hStopEvent);
+}
+
+//-----------------------------------------------------------------------------
+
+void CTcpListenerThread::Execute()
+{
+	SOCKET nSocketHandle = m_pTcpServer->GetSocket().GetHandle();
+	HANDLE Events[2] = { m_hAcceptEvent, m_hStopEvent };
+
+	// Makes the listening socket non-blocking and signals m_hAcceptEvent on incoming connections.
+	if (WSAEventSelect(nSocketHandle, m_hAcceptEvent, FD_ACCEPT) == SOCKET_ERROR)
+		return;
 
 	while (!GetTerminated() && m_pTcpServer->GetActive())
 	try
 	{
-		tv.tv_sec = 0;
-		tv.tv_usec = SELECT_WAIT_MSEC * 1000;
+		DWORD nRet = WaitForMultipleObjects(2, Events, FALSE, INFINITE);
 
-		FD_ZERO(&fds);
-		FD_SET((DWORD)nSocketHandle, &fds);
+		if (nRet == WAIT_OBJECT_0)
+		{
+			WSANETWORKEVENTS NetEvents;
+			WSAEnumNetworkEvents(nSocketHandle, m_hAcceptEvent, &NetEvents);
+			AcceptConnections();
+		}
+		else
+			break;  // stopped or error
+	}
+	catch (IFC_EXCEPT_OBJ e)
+	{
+		IFC_DELETE_MFC_EXCEPT_OBJ(e);
+	}
+	catch (...)
+	{}
+}
 
-		r = select(0, &fds, NULL, NULL, &tv);
+///////////////////////////////////////////////////////////////////////////////
+// CDnsResolver
 
-		if (r > 0 && m_pTcpServer->GetActive() && FD_ISSET(nSocketHandle, &fds))
+std::auto_ptr<CDnsResolver> CDnsResolver::s_pSingleton(NULL);
+CCriticalSection CDnsResolver::s_SingletonLock;
+
+//-----------------------------------------------------------------------------
+
+CDnsResolver::CDnsResolver() :
+	m_QueueSemaphore(NULL, 0, 0x7FFFFFFF)
+{
+	// nothing
+}
+
+//-----------------------------------------------------------------------------
+
+CDnsResolver::~CDnsResolver()
+{
+	StopWorkerThreads();
+
+	// The queries not started yet have no waiter but the owner.
+	for (QUERY_QUEUE::iterator it = m_QueryQueue.begin(); it != m_QueryQueue.end(); ++it)
+	{
+		m_Queries.erase((*it)->strHost);
+		ReleaseQuery(*it);
+	}
+	m_QueryQueue.clear();
+}
+
+//-----------------------------------------------------------------------------
+
+// Called by many CHttpClient threads at once, so the resolver is created under the lock.
+CDnsResolver& CDnsResolver::Instance()
+{
+	if (s_pSingleton.get() == NULL)
+	{
+		CAutoLocker Locker(s_SingletonLock);
+		if (s_pSingleton.get() == NULL)
+			s_pSingleton.reset(new CDnsResolver());
+	}
+	return *s_pSingleton;
+}
+
+//-----------------------------------------------------------------------------
+
+void CDnsResolver::Delete()
+{
+	CAutoLocker Locker(s_SingletonLock);
+	s_pSingleton.reset(NULL);
+}
+
+//-----------------------------------------------------------------------------
+
+void CDnsResolver::Process(CWorkerThread *pThread)
+{
+	while (!pThread->GetTerminated())
+	{
+		m_QueueSemaphore.WaitFor(INFINITE);
+		if (pThread->GetTerminated()) break;
+
+		QUERY_ITEM *pQuery = NULL;
 		{
-			SOCKET nAcceptHandle = accept(nSocketHandle, (struct sockaddr*)&Addr, &nSockLen);
-			if (nAcceptHandle != INVALID_SOCKET)
+			CAutoLocker Locker(m_Lock);
+			if (!m_QueryQueue.empty())
 			{
-				PeerAddr = CPeerAddress(ntohl(Addr.sin_addr.s_addr), ntohs(Addr.sin_port));
-				CTcpConnection *pConnection = m_pTcpServer->CreateConnection(nAcceptHandle, PeerAddr);
-				m_pTcpServer->AcceptConnection(pConnection);
+				pQuery = m_QueryQueue.front();
+				m_QueryQueue.pop_front();
 			}
 		}
-		else if (r < 0)
+
+		if (pQuery != NULL)
 		{
-			int nError = IfcSocketGetLastError();
-			if (nError != SS_EINTR && nError != SS_EINPROGRESS)
-				break;  // error
+			ExecuteQuery(pQuery);
+			ReleaseQuery(pQuery);
 		}
 	}
-	catch (IFC_EXCEPT_OBJ e)
+}
+
+//-----------------------------------------------------------------------------
+
+void CDnsResolver::StartWorkerThreads()
+{
+	while (m_WorkerThreads.GetCount() < DNS_RESOLVER_THREAD_COUNT)
 	{
-		IFC_DELETE_MFC_EXCEPT_OBJ(e);
+		CWorkerThread *pThread = new CWorkerThread(*this);
+		m_WorkerThreads.Add(pThread);
+		pThread->Run();
 	}
-	catch (...)
-	{}
+}
+
+//-----------------------------------------------------------------------------
+
+void CDnsResolver::StopWorkerThreads()
+{
+	for (int i = 0; i < m_WorkerThreads.GetCount(); i++)
+		m_WorkerThreads[i]->Terminate();
+	if (m_WorkerThreads.GetCount() > 0)
+		m_QueueSemaphore.Unlock(m_WorkerThreads.GetCount());
+	for (int i = 0; i < m_WorkerThreads.GetCount(); i++)
+		m_WorkerThreads[i]->WaitFor();
+	m_WorkerThreads.Clear();
+}
+
+//-----------------------------------------------------------------------------
+
+// Looks up the hosts overrides and the cache, the caller must hold m_Lock.
+bool CDnsResolver::FindCached(const CString& strHost, DWORD& nIp, bool& bSuccess)
+{
+	HOSTS_MAP::iterator iHost = m_Hosts.find(strHost);
+	if (iHost != m_Hosts.end())
+	{
+		nIp = iHost->second;
+		bSuccess = true;
+		return true;
+	}
+
+	CACHE_MAP::iterator iCache = m_Cache.find(strHost);
+	if (iCache != m_Cache.end())
+	{
+		CACHE_ITEM& Item = iCache->second;
+		if (GetTickDiff(Item.nCacheTicks, GetTickCount()) < Item.nTimeToLive)
+		{
+			nIp = Item.nIp;
+			bSuccess = (Item.nIp != 0);
+			return true;
+		}
+		m_Cache.erase(iCache);
+	}
+
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+
+// Creates a query which is owned by the caller, the caller must hold m_Lock.
+CDnsResolver::QUERY_ITEM* CDnsResolver::CreateQuery(const CString& strHost)
+{
+	QUERY_ITEM *pQuery = new QUERY_ITEM();
+	pQuery->strHost = strHost;
+	pQuery->hDoneEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	pQuery->nRefCount = 1;
+	pQuery->nIp = 0;
+	pQuery->bSuccess = false;
+
+	m_Queries[strHost] = pQuery;
+	return pQuery;
+}
+
+//-----------------------------------------------------------------------------
+
+void CDnsResolver::ReleaseQuery(QUERY_ITEM *pQuery)
+{
+	CAutoLocker Locker(m_Lock);
+
+	if (--pQuery->nRefCount == 0)
+	{
+		CloseHandle(pQuery->hDoneEvent);
+		delete pQuery;
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+// Resolves the name, caches the result and wakes up all the waiters of the query.
+void CDnsResolver::ExecuteQuery(QUERY_ITEM *pQuery)
+{
+	DWORD nIp = 0;
+	CStringA strHost(pQuery->strHost);
+
+	struct hostent* pHost = gethostbyname(strHost);
+	if (pHost != NULL && pHost->h_addr != NULL)
+		nIp = ntohl(((struct in_addr *)pHost->h_addr)->s_addr);
+
+	CAutoLocker NotifyLocker(m_NotifyLock);
+	CALLBACK_LIST Callbacks;
+	{
+		CAutoLocker Locker(m_Lock);
+
+		pQuery->nIp = nIp;
+		pQuery->bSuccess = (nIp != 0);
+
+		if ((int)m_Cache.size() >= DNS_MAX_CACHE_SIZE)
+			PurgeCache();
+		CACHE_ITEM& Item = m_Cache[pQuery->strHost];
+		Item.nIp = nIp;
+		Item.nCacheTicks = GetTickCount();
+		Item.nTimeToLive = (nIp != 0 ? DNS_CACHE_TTL : DNS_NEGATIVE_CACHE_TTL);
+
+		m_Queries.erase(pQuery->strHost);
+		Callbacks.swap(pQuery->Callbacks);
+		SetEvent(pQuery->hDoneEvent);
+	}
+
+	for (int i = 0; i < (int)Callbacks.size(); i++)
+	{
+		try
+		{
+			Callbacks[i].pProc(Callbacks[i].pParam, pQuery->strHost, nIp, nIp != 0);
+		}
+		catch (IFC_EXCEPT_OBJ e)
+		{
+			IFC_DELETE_MFC_EXCEPT_OBJ(e);
+		}
+		catch (...)
+		{}
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+// Drops the expired items, or the whole cache if it is still full.
+void CDnsResolver::PurgeCache()
+{
+	UINT nTicks = GetTickCount();
+
+	for (CACHE_MAP::iterator it = m_Cache.begin(); it != m_Cache.end(); )
+	{
+		if (GetTickDiff(it->second.nCacheTicks, nTicks) >= it->second.nTimeToLive)
+			m_Cache.erase(it++);
+		else
+			++it;
+	}
+
+	if ((int)m_Cache.size() >= DNS_MAX_CACHE_SIZE)
+		m_Cache.clear();
+}
+
+//-----------------------------------------------------------------------------
+
+CString CDnsResolver::GetHostKey(LPCTSTR lpszHost)
+{
+	CString strResult(lpszHost);
+	strResult.Trim();
+	strResult.MakeLower();
+	return strResult;
+}
+
+//-----------------------------------------------------------------------------
+
+// Parses the dotted IP string, which needs no lookup.
+bool CDnsResolver::ParseIp(LPCTSTR lpszHost, DWORD& nIp)
+{
+	CStringA strHost(lpszHost);
+	strHost.Trim();
+	if (strHost.IsEmpty()) return false;
+
+	unsigned long nValue = inet_addr(strHost);
+	bool bResult = (nValue != INADDR_NONE);
+	if (bResult)
+		nIp = ntohl(nValue);
+
+	return bResult;
+}
+
+//-----------------------------------------------------------------------------
+
+bool CDnsResolver::Lookup(LPCTSTR lpszHost, DWORD& nIp)
+{
+	if (ParseIp(lpszHost, nIp)) return true;
+
+	CString strHost = GetHostKey(lpszHost);
+	if (strHost.IsEmpty()) return false;
+
+	QUERY_ITEM *pQuery;
+	bool bOwner = false;
+	{
+		CAutoLocker Locker(m_Lock);
+
+		bool bSuccess;
+		if (FindCached(strHost, nIp, bSuccess))
+			return bSuccess;
+
+		QUERY_MAP::iterator it = m_Queries.find(strHost);
+		if (it != m_Queries.end())
+		{
+			pQuery = it->second;
+			pQuery->nRefCount++;
+		}
+		else
+		{
+			pQuery = CreateQuery(strHost);
+			bOwner = true;
+		}
+	}
+
+	// Joins the lookup in progress rather than starting another one.
+	if (bOwner)
+		ExecuteQuery(pQuery);
+	else
+		WaitForSingleObject(pQuery->hDoneEvent, INFINITE);
+
+	bool bResult = pQuery->bSuccess;
+	nIp = pQuery->nIp;
+	ReleaseQuery(pQuery);
+
+	return bResult;
+}
+
+//-----------------------------------------------------------------------------
+
+void CDnsResolver::Resolve(LPCTSTR lpszHost, DNS_ON_RESOLVED_PROC pOnResolvedProc, void *pProcParam)
+{
+	if (pOnResolvedProc == NULL) return;
+
+	DWORD nIp = 0;
+	bool bSuccess = false;
+	bool bDone = true;
+
+	if (ParseIp(lpszHost, nIp))
+		bSuccess = true;
+	else
+	{
+		CString strHost = GetHostKey(lpszHost);
+		if (!strHost.IsEmpty())
+		{
+			CAutoLocker Locker(m_Lock);
+
+			bDone = FindCached(strHost, nIp, bSuccess);
+			if (!bDone)
+			{
+				QUERY_ITEM *pQuery;
+				QUERY_MAP::iterator it = m_Queries.find(strHost);
+				if (it != m_Queries.end())
+					pQuery = it->second;
+				else
+				{
+					pQuery = CreateQuery(strHost);
+					m_QueryQueue.push_back(pQuery);
+					StartWorkerThreads();
+					m_QueueSemaphore.Unlock();
+				}
+
+				CALLBACK_ITEM Item;
+				Item.pProc = pOnResolvedProc;
+				Item.pParam = pProcParam;
+				pQuery->Callbacks.push_back(Item);
+			}
+		}
+	}
+
+	if (bDone)
+		pOnResolvedProc(pProcParam, lpszHost, nIp, bSuccess);
+}
+
+//-----------------------------------------------------------------------------
+
+void CDnsResolver::RemoveCallbacks(DNS_ON_RESOLVED_PROC pOnResolvedProc, void *pProcParam)
+{
+	CAutoLocker NotifyLocker(m_NotifyLock);
+	CAutoLocker Locker(m_Lock);
+
+	for (QUERY_MAP::iterator it = m_Queries.begin(); it != m_Queries.end(); ++it)
+	{
+		CALLBACK_LIST& Callbacks = it->second->Callbacks;
+		for (int i = (int)Callbacks.size() - 1; i >= 0; i--)
+		{
+			if (Callbacks[i].pProc == pOnResolvedProc && Callbacks[i].pParam == pProcParam)
+				Callbacks.erase(Callbacks.begin() + i);
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+bool CDnsResolver::LoadHostsFile(LPCTSTR lpszFileName)
+{
+	CStrList Lines;
+	bool bResult = Lines.LoadFromFile(lpszFileName, false);
+	if (bResult)
+	{
+		for (int i = 0; i < Lines.GetCount(); i++)
+		{
+			CString strLine = Lines[i];
+			int nPos = strLine.Find(TEXT('#'));
+			if (nPos >= 0)
+				strLine = strLine.Left(nPos);
+
+			nPos = 0;
+			DWORD nIp;
+			CString strToken = strLine.Tokenize(TEXT(" \t"), nPos);
+			if (strToken.IsEmpty() || !ParseIp(strToken, nIp))
+				continue;
+
+			while (!(strToken = strLine.Tokenize(TEXT(" \t"), nPos)).IsEmpty())
+				AddHost(strToken, nIp);
+		}
+	}
+
+	return bResult;
+}
+
+//-----------------------------------------------------------------------------
+
+void CDnsResolver::AddHost(LPCTSTR lpszHost, DWORD nIp)
+{
+	CAutoLocker Locker(m_Lock);
+	m_Hosts[GetHostKey(lpszHost)] = nIp;
+}
+
+//-----------------------------------------------------------------------------
+
+void CDnsResolver::ClearHosts()
+{
+	CAutoLocker Locker(m_Lock);
+	m_Hosts.clear();
+}
+
+//-----------------------------------------------------------------------------
+
+void CDnsResolver::ClearCache()
+{
+	CAutoLocker Locker(m_Lock);
+	m_Cache.clear();
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -1507,7 +2078,8 @@ CTcpConnectorPool::CTcpConnectorPool() :
 	m_AddList(true, true),
 	m_pWorkerThread(NULL)
 {
-	// nothing
+	m_hWakeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	m_hConnectEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
 }
 
 //-----------------------------------------------------------------------------
@@ -1515,7 +2087,11 @@ CTcpConnectorPool::CTcpConnectorPool() :
 CTcpConnectorPool::~CTcpConnectorPool()
 {
 	Stop();
+	CDnsResolver::Instance().RemoveCallbacks(OnDnsResolved, this);
 	Clear();
+
+	CloseHandle(m_hWakeEvent);
+	CloseHandle(m_hConnectEvent);
 }
 
 //-----------------------------------------------------------------------------
@@ -1538,13 +2114,21 @@ void CTcpConnectorPool::Delete()
 
 void CTcpConnectorPool::Process(CWorkerThread *pThread)
 {
+	HANDLE Events[2] = { m_hWakeEvent, m_hConnectEvent };
+
 	while (!pThread->GetTerminated())
 	{
+		DWORD nTimeOut = INFINITE;
+
 		try
 		{
 			ProcessAddList();
 			ProcessConnect();
+			ProcessTimeOut();
 			ProcessResult();
+
+			CAutoLocker Locker(m_Lock);
+			nTimeOut = m_TimerWheel.GetNextTimeOut();
 		}
 		catch (IFC_EXCEPT_OBJ e)
 		{
@@ -1553,7 +2137,8 @@ void CTcpConnectorPool::Process(CWorkerThread *pThread)
 		catch (...)
 		{}
 
-		Sleep(10);
+		// Sleeps until a task is added, a connect completes or a timeout is due.
+		WaitForMultipleObjects(2, Events, FALSE, nTimeOut);
 	}
 }
 
@@ -1567,6 +2152,8 @@ void CTcpConnectorPool::ProcessAddList()
 		CAutoLocker Locker(m_Lock);
 
 		pTask->nStartTicks = GetTickCount();
+		if (pTask->nTimeOutMSecs >= 0)
+			pTask->nTimerId = m_TimerWheel.Add(pTask, pTask->nTimeOutMSecs);
 		m_TaskList.Add(pTask);
 	}
 }
@@ -1577,26 +2164,50 @@ void CTcpConnectorPool::ProcessConnect()
 {
 	CAutoLocker Locker(m_Lock);
 
+	// Resets before polling, so a connect which completes meanwhile signals it again.
+	ResetEvent(m_hConnectEvent);
+
 	for (int i = 0; i < m_TaskList.GetCount(); i++)
 	{
 		TASK_ITEM *pTask = m_TaskList[i];
 		if (pTask->nConnectState == ACS_NONE)
 		{
-			CString strIp = LookupHostAddr(pTask->strConnectToHost);
-			if (strIp.IsEmpty())
-				pTask->nConnectState = ACS_FAILED;
-			else
-				pTask->nConnectState = pTask->pTcpClient->AsyncConnect(strIp, pTask->nConnectToPort, 0);
+			if (!pTask->bResolving)
+				StartConnect(pTask);
 		}
 		else if (pTask->nConnectState == ACS_CONNECTING)
 		{
-			pTask->nConnectState = pTask->pTcpClient->CheckAsyncConnectState(0);
+			WSANETWORKEVENTS NetEvents;
+			SOCKET nHandle = pTask->pTcpClient->GetSocket().GetHandle();
+
+			if (WSAEnumNetworkEvents(nHandle, NULL, &NetEvents) == SOCKET_ERROR)
+				pTask->nConnectState = ACS_FAILED;
+			else if (NetEvents.lNetworkEvents & FD_CONNECT)
+				pTask->nConnectState = (NetEvents.iErrorCode[FD_CONNECT_BIT] == 0 ?
+					ACS_CONNECTED : ACS_FAILED);
 		}
 	}
 }
 
 //-----------------------------------------------------------------------------
 
+void CTcpConnectorPool::ProcessTimeOut()
+{
+	CAutoLocker Locker(m_Lock);
+	CPointerList Expired;
+
+	m_TimerWheel.Advance(Expired);
+	for (int i = 0; i < Expired.GetCount(); i++)
+	{
+		TASK_ITEM *pTask = (TASK_ITEM*)Expired[i];
+		pTask->nTimerId = NULL;
+		if (pTask->nConnectState != ACS_CONNECTED)
+			pTask->nConnectState = ACS_FAILED;
+	}
+}
+
+//-----------------------------------------------------------------------------
+
 void CTcpConnectorPool::ProcessResult()
 {
 	CAutoLocker Locker(m_Lock);
@@ -1605,9 +2216,9 @@ void CTcpConnectorPool::ProcessResult()
 	{
 		TASK_ITEM *pTask = m_TaskList[i];
 		if (pTask->nConnectState == ACS_CONNECTED ||
-			pTask->nConnectState == ACS_FAILED ||
-			(pTask->nTimeOutMSecs >= 0 && GetTickDiff(pTask->nStartTicks, GetTickCount()) >= (UINT)pTask->nTimeOutMSecs))
+			pTask->nConnectState == ACS_FAILED)
 		{
+			ReleaseTask(pTask);
 			pTask->OnResult.pProc(pTask->OnResult.pParam, pTask->pTcpClient,
 				pTask->nConnectState == ACS_CONNECTED);
 			m_TaskList.Delete(i);
@@ -1617,6 +2228,50 @@ void CTcpConnectorPool::ProcessResult()
 
 //-----------------------------------------------------------------------------
 
+// Starts a non-blocking connect, whose completion signals m_hConnectEvent.
+void CTcpConnectorPool::StartConnect(TASK_ITEM *pTask)
+{
+	if (pTask->nConnectToIp == 0)
+	{
+		// OnDnsResolved is called back at once if the name is cached.
+		pTask->bResolving = true;
+		CDnsResolver::Instance().Resolve(pTask->strConnectToHost, OnDnsResolved, this);
+		if (pTask->bResolving || pTask->nConnectState != ACS_NONE)
+			return;
+	}
+
+	pTask->nConnectState = pTask->pTcpClient->AsyncConnect(IpToString(pTask->nConnectToIp),
+		pTask->nConnectToPort, 0);
+	if (pTask->nConnectState == ACS_CONNECTING)
+	{
+		SOCKET nHandle = pTask->pTcpClient->GetSocket().GetHandle();
+
+		if (WSAEventSelect(nHandle, m_hConnectEvent, FD_CONNECT) == SOCKET_ERROR)
+			pTask->nConnectState = ACS_FAILED;
+		else
+			// The connect may have completed before the event was selected.
+			pTask->nConnectState = pTask->pTcpClient->CheckAsyncConnectState(0);
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+// Cancels the timer and the event selection of the task.
+void CTcpConnectorPool::ReleaseTask(TASK_ITEM *pTask)
+{
+	if (pTask->nTimerId != NULL)
+	{
+		m_TimerWheel.Remove(pTask->nTimerId);
+		pTask->nTimerId = NULL;
+	}
+
+	CTcpSocket& Socket = pTask->pTcpClient->GetSocket();
+	if (Socket.GetActive())
+		WSAEventSelect(Socket.GetHandle(), NULL, 0);
+}
+
+//-----------------------------------------------------------------------------
+
 CTcpConnectorPool::TASK_ITEM* CTcpConnectorPool::FindTask(CTcpClient *pTcpClient)
 {
 	TASK_ITEM *pResult = NULL;
@@ -1635,6 +2290,30 @@ CTcpConnectorPool::TASK_ITEM* CTcpConnectorPool::FindTask(CTcpClient *pTcpClient
 
 //-----------------------------------------------------------------------------
 
+// Hands the result to all the tasks waiting for the host name.
+void CTcpConnectorPool::OnDnsResolved(void *pParam, LPCTSTR lpszHost, DWORD nIp, bool bSuccess)
+{
+	CTcpConnectorPool *pThis = (CTcpConnectorPool*)pParam;
+	CAutoLocker Locker(pThis->m_Lock);
+
+	for (int i = 0; i < pThis->m_TaskList.GetCount(); i++)
+	{
+		TASK_ITEM *pTask = pThis->m_TaskList[i];
+		if (pTask->bResolving && pTask->strConnectToHost.CompareNoCase(lpszHost) == 0)
+		{
+			pTask->bResolving = false;
+			if (bSuccess)
+				pTask->nConnectToIp = nIp;
+			else
+				pTask->nConnectState = ACS_FAILED;
+		}
+	}
+
+	SetEvent(pThis->m_hWakeEvent);
+}
+
+//-----------------------------------------------------------------------------
+
 void CTcpConnectorPool::Start()
 {
 	if (!m_pWorkerThread)
@@ -1651,6 +2330,7 @@ void CTcpConnectorPool::Stop()
 	if (m_pWorkerThread)
 	{
 		m_pWorkerThread->Terminate();
+		SetEvent(m_hWakeEvent);
 		m_pWorkerThread->WaitFor();
 		delete m_pWorkerThread;
 		m_pWorkerThread = NULL;
@@ -1668,14 +2348,19 @@ bool CTcpConnectorPool::AddTask(CTcpClient *pTcpClient, LPCTSTR lpszHost, int nP
 		TASK_ITEM *pTask = new TASK_ITEM();
 		pTask->pTcpClient = pTcpClient;
 		pTask->strConnectToHost = lpszHost;
+		pTask->strConnectToHost.Trim();
 		pTask->nConnectToPort = nPort;
 		pTask->nTimeOutMSecs = nTimeOutMSecs;
 		pTask->nStartTicks = 0;
 		pTask->nConnectState = ACS_NONE;
+		pTask->nTimerId = NULL;
+		pTask->nConnectToIp = 0;
+		pTask->bResolving = false;
 		pTask->OnResult.pProc = pOnResultProc;
 		pTask->OnResult.pParam = pProcParam;
 
 		m_AddList.Add(pTask);
+		SetEvent(m_hWakeEvent);
 	}
 
 	return bResult;
@@ -1690,7 +2375,10 @@ bool CTcpConnectorPool::RemoveTask(CTcpClient *pTcpClient)
 	TASK_ITEM *pTask = FindTask(pTcpClient);
 	bool bResult = (pTask != NULL);
 	if (bResult)
+	{
+		ReleaseTask(pTask);
 		m_TaskList.Remove(pTask);
+	}
 
 	return bResult;
 }
@@ -1704,7 +2392,10 @@ void CTcpConnectorPool::RemoveTasks(TCPCP_ON_RESULT_PROC pOnResultProc)
 	for (int i = m_TaskList.GetCount() - 1; i >= 0; i--)
 	{
 		if (m_TaskList[i]->OnResult.pProc == pOnResultProc)
+		{
+			ReleaseTask(m_TaskList[i]);
 			m_TaskList.Delete(i);
+		}
 	}
 }
 
@@ -1713,6 +2404,9 @@ void CTcpConnectorPool::RemoveTasks(TCPCP_ON_RESULT_PROC pOnResultProc)
 void CTcpConnectorPool::Clear()
 {
 	CAutoLocker Locker(m_Lock);
+
+	for (int i = 0; i < m_TaskList.GetCount(); i++)
+		ReleaseTask(m_TaskList[i]);
 	m_TaskList.Clear();
 }
 
@@ -210,6 +210,179 @@ bool CSemaphoreObject::Unlock(int nCount)
 	return (::ReleaseSemaphore(m_hObject, nCount, NULL) != FALSE);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// CLightMutex
+
+CLightMutex::CLightMutex(int nSpinCount) :
+	m_nState(0),
+	m_hParkEvent(NULL),
+	m_nSpinCount(nSpinCount)
+{
+	SYSTEM_INFO SysInfo;
+	GetSystemInfo(&SysInfo);
+	if (SysInfo.dwNumberOfProcessors <= 1)
+		m_nSpinCount = 0;
+}
+
+//-----------------------------------------------------------------------------
+
+CLightMutex::~CLightMutex()
+{
+	if (m_hParkEvent != NULL)
+		CloseHandle(m_hParkEvent);
+}
+
+//-----------------------------------------------------------------------------
+
+void CLightMutex::LockSlow()
+{
+	for (int i = 0; i < m_nSpinCount; i++)
+	{
+		if (m_nState == 0 && InterlockedCompareExchange(&m_nState, 1, 0) == 0)
+			return;
+		YieldProcessor();
+	}
+
+	if (m_hParkEvent == NULL)
+	{
+		HANDLE hEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if (hEvent == NULL)
+			IfcThrowOsException();
+		if (InterlockedCompareExchangePointer((PVOID volatile*)&m_hParkEvent, hEvent, NULL) != NULL)
+			CloseHandle(hEvent);
+	}
+
+	// The state stays 2 while anyone may be sleeping, so Unlock() knows to wake one up.
+	while (InterlockedExchange(&m_nState, 2) != 0)
+		WaitForSingleObject(m_hParkEvent, INFINITE);
+}
+
+//-----------------------------------------------------------------------------
+
+void CLightMutex::WakeWaiter()
+{
+	SetEvent(m_hParkEvent);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CRWLock
+
+CRWLock::CRWLock() :
+	m_nActiveCount(0),
+	m_nWaitingReaders(0),
+	m_nWaitingWriters(0)
+{
+	m_hReadSemaphore = CreateSemaphore(NULL, 0, MAXLONG, NULL);
+	m_hWriteSemaphore = CreateSemaphore(NULL, 0, MAXLONG, NULL);
+	if (m_hReadSemaphore == NULL || m_hWriteSemaphore == NULL)
+		IfcThrowOsException();
+}
+
+//-----------------------------------------------------------------------------
+
+CRWLock::~CRWLock()
+{
+	CloseHandle(m_hReadSemaphore);
+	CloseHandle(m_hWriteSemaphore);
+}
+
+//-----------------------------------------------------------------------------
+
+// Hands the lock to the next writer, or to all of the waiting readers.
+void CRWLock::Release()
+{
+	HANDLE hSemaphore = NULL;
+	LONG nCount = 1;
+
+	m_Lock.Lock();
+
+	if (m_nActiveCount > 0)
+		m_nActiveCount--;
+	else
+		m_nActiveCount = 0;
+
+	if (m_nActiveCount == 0)
+	{
+		if (m_nWaitingWriters > 0)
+		{
+			m_nActiveCount = -1;
+			m_nWaitingWriters--;
+			hSemaphore = m_hWriteSemaphore;
+		}
+		else if (m_nWaitingReaders > 0)
+		{
+			m_nActiveCount = m_nWaitingReaders;
+			m_nWaitingReaders = 0;
+			hSemaphore = m_hReadSemaphore;
+			nCount = m_nActiveCount;
+		}
+	}
+
+	m_Lock.Unlock();
+
+	if (hSemaphore != NULL)
+		ReleaseSemaphore(hSemaphore, nCount, NULL);
+}
+
+//-----------------------------------------------------------------------------
+
+void CRWLock::LockShared()
+{
+	m_Lock.Lock();
+	bool bWait = (m_nWaitingWriters > 0 || m_nActiveCount < 0);
+	if (bWait)
+		m_nWaitingReaders++;
+	else
+		m_nActiveCount++;
+	m_Lock.Unlock();
+
+	// Release() counts the reader active before waking it up.
+	if (bWait)
+		WaitForSingleObject(m_hReadSemaphore, INFINITE);
+}
+
+//-----------------------------------------------------------------------------
+
+void CRWLock::LockExclusive()
+{
+	m_Lock.Lock();
+	bool bWait = (m_nActiveCount != 0);
+	if (bWait)
+		m_nWaitingWriters++;
+	else
+		m_nActiveCount = -1;
+	m_Lock.Unlock();
+
+	if (bWait)
+		WaitForSingleObject(m_hWriteSemaphore, INFINITE);
+}
+
+//-----------------------------------------------------------------------------
+
+bool CRWLock::TryLockShared()
+{
+	m_Lock.Lock();
+	bool bResult = (m_nWaitingWriters == 0 && m_nActiveCount >= 0);
+	if (bResult)
+		m_nActiveCount++;
+	m_Lock.Unlock();
+
+	return bResult;
+}
+
+//-----------------------------------------------------------------------------
+
+bool CRWLock::TryLockExclusive()
+{
+	m_Lock.Lock();
+	bool bResult = (m_nActiveCount == 0);
+	if (bResult)
+		m_nActiveCount = -1;
+	m_Lock.Unlock();
+
+	return bResult;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 
 } // namespace ifc
@@ -0,0 +1,505 @@
+/****************************************************************************\
+*                                                                            *
+*  IFC (Iris Foundation Classes) Project                                     *
+*  http://github.com/haoxingeng/ifc                                          *
+*                                                                            *
+*  Copyright 2008 HaoXinGeng (haoxingeng@gmail.com)                          *
+*  All rights reserved.                                                      *
+*                                                                            *
+*  Licensed under the Apache License, Version 2.0 (the "License");           *
+*  you may not use this file except in compliance with the License.          *
+*  You may obtain a copy of the License at                                   *
+*                                                                            *
+*      http://www.apache.org/licenses/LICENSE-2.0                            *
+*                                                                            *
+*  Unless required by applicable law or agreed to in writing, software       *
+*  distributed under the License is distributed on an "AS IS" BASIS,         *
+*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+*  See the License for the specific language governing permissions and       *
+*  limitations under the License.                                            *
+*                                                                            *
+\****************************************************************************/
+
+/// @file ifc_task_pool.cpp
+
+#include "stdafx.h"
+#include "ifc_task_pool.h"
+#include "ifc_sysutils.h"
+#include "ifc_exceptions.h"
+#include "ifc_errmsgs.h"
+
+namespace ifc
+{
+
+///////////////////////////////////////////////////////////////////////////////
+// Misc Routines
+
+static std::auto_ptr<CTaskPool> s_pTaskPool(NULL);
+static CCriticalSection s_TaskPoolLock;
+
+//-----------------------------------------------------------------------------
+
+// Called from the iocp completions at once, so the pool is created under the lock,
+// and published only after it is started.
+CTaskPool& GetTaskPoolObject()
+{
+	if (s_pTaskPool.get() == NULL)
+	{
+		CAutoLocker Locker(s_TaskPoolLock);
+		if (s_pTaskPool.get() == NULL)
+		{
+			std::auto_ptr<CTaskPool> pTaskPool(new CTaskPool());
+			pTaskPool->Start();
+			s_pTaskPool = pTaskPool;
+		}
+	}
+	return *s_pTaskPool;
+}
+
+//-----------------------------------------------------------------------------
+
+void DeleteTaskPoolObject()
+{
+	CAutoLocker Locker(s_TaskPoolLock);
+	s_pTaskPool.reset(NULL);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CTask
+
+CTask::CTask() :
+	m_nRefCount(1),
+	m_bDone(0),
+	m_bFailed(false),
+	m_hDoneEvent(NULL),
+	m_pPool(NULL)
+{
+	// nothing
+}
+
+//-----------------------------------------------------------------------------
+
+CTask::~CTask()
+{
+	for (int i = 0; i < (int)m_Continuations.size(); i++)
+		m_Continuations[i]->Release();
+
+	if (m_hDoneEvent != NULL)
+		CloseHandle(m_hDoneEvent);
+}
+
+//-----------------------------------------------------------------------------
+
+void CTask::Run()
+{
+	try
+	{
+		Execute();
+	}
+	catch (IFC_EXCEPT_OBJ e)
+	{
+		m_bFailed = true;
+		IFC_DELETE_MFC_EXCEPT_OBJ(e);
+	}
+	catch (...)
+	{
+		m_bFailed = true;
+	}
+
+	NotifyDone();
+}
+
+//-----------------------------------------------------------------------------
+
+// Wakes up the waiters and submits the continuations.
+void CTask::NotifyDone()
+{
+	std::vector<CTask*> Continuations;
+	{
+		CAutoLocker Locker(m_Lock);
+		InterlockedExchange(&m_bDone, 1);
+		Continuations.swap(m_Continuations);
+	}
+
+	// A waiter creates the event before checking m_bDone, so either side sees the other.
+	HANDLE hEvent = (HANDLE)InterlockedCompareExchangePointer((PVOID volatile*)&m_hDoneEvent, NULL, NULL);
+	if (hEvent != NULL)
+		SetEvent(hEvent);
+
+	for (int i = 0; i < (int)Continuations.size(); i++)
+	{
+		m_pPool->Submit(Continuations[i]);
+		Continuations[i]->Release();
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+HANDLE CTask::GetDoneEvent()
+{
+	if (m_hDoneEvent == NULL)
+	{
+		HANDLE hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+		if (InterlockedCompareExchangePointer((PVOID volatile*)&m_hDoneEvent, hEvent, NULL) != NULL)
+			CloseHandle(hEvent);
+	}
+
+	return m_hDoneEvent;
+}
+
+//-----------------------------------------------------------------------------
+
+void CTask::AddRef()
+{
+	InterlockedIncrement(&m_nRefCount);
+}
+
+//-----------------------------------------------------------------------------
+
+void CTask::Release()
+{
+	if (InterlockedDecrement(&m_nRefCount) == 0)
+		delete this;
+}
+
+//-----------------------------------------------------------------------------
+
+bool CTask::Wait(DWORD nTimeOut)
+{
+	if (IsDone()) return true;
+
+	HANDLE hEvent = GetDoneEvent();
+	CTaskPool *pPool = m_pPool;
+	int nIndex = (pPool != NULL ? pPool->GetCurrentIndex() : -1);
+
+	if (nIndex < 0)
+		return IsDone() || WaitForSingleObject(hEvent, nTimeOut) == WAIT_OBJECT_0;
+
+	// Blocking a worker might starve the task waited for, so runs the pending tasks instead.
+	UINT nStartTicks = GetTickCount();
+	while (!IsDone())
+	{
+		if (nTimeOut != INFINITE && GetTickDiff(nStartTicks, GetTickCount()) >= nTimeOut)
+			return false;
+		if (!pPool->RunOneTask(nIndex))
+			WaitForSingleObject(hEvent, 1);
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+
+void CTask::ContinueWith(CTask *pTask)
+{
+	bool bDone;
+	{
+		CAutoLocker Locker(m_Lock);
+		bDone = IsDone();
+		if (!bDone)
+		{
+			pTask->AddRef();
+			m_Continuations.push_back(pTask);
+		}
+	}
+
+	if (bDone)
+		m_pPool->Submit(pTask);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CTaskPool
+
+CTaskPool::CTaskPool(int nThreadCount) :
+	m_nThreadCount(nThreadCount),
+	m_pQueues(NULL),
+	m_nTlsIndex(TLS_OUT_OF_INDEXES),
+	m_hWakeSemaphore(NULL),
+	m_nIdleCount(0),
+	m_nPendingCount(0)
+{
+	if (m_nThreadCount <= 0)
+	{
+		SYSTEM_INFO SysInfo;
+		GetSystemInfo(&SysInfo);
+		m_nThreadCount = SysInfo.dwNumberOfProcessors;
+	}
+
+	m_nTlsIndex = TlsAlloc();
+	if (m_nTlsIndex == TLS_OUT_OF_INDEXES)
+		IfcThrowException(FormatString(SEM_TASK_POOL_ERROR, GetLastError()));
+
+	m_pQueues = new WORKER_QUEUE[m_nThreadCount];
+	m_hWakeSemaphore = CreateSemaphore(NULL, 0, 0x7FFFFFFF, NULL);
+}
+
+//-----------------------------------------------------------------------------
+
+CTaskPool::~CTaskPool()
+{
+	Stop();
+
+	delete[] m_pQueues;
+	CloseHandle(m_hWakeSemaphore);
+	TlsFree(m_nTlsIndex);
+}
+
+//-----------------------------------------------------------------------------
+
+void CTaskPool::Process(CWorkerThread *pThread)
+{
+	int nIndex = pThread->GetIndex();
+	TlsSetValue(m_nTlsIndex, pThread);
+
+	while (!pThread->GetTerminated())
+	{
+		if (RunOneTask(nIndex)) continue;
+
+		// Counts itself idle before looking again, so a task submitted meanwhile wakes it up.
+		InterlockedIncrement(&m_nIdleCount);
+		if (!RunOneTask(nIndex) && !pThread->GetTerminated())
+			WaitForSingleObject(m_hWakeSemaphore, TASK_POOL_IDLE_MSECS);
+		InterlockedDecrement(&m_nIdleCount);
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+// Takes the newest task of the own deque, then the oldest of the shared queue,
+// then steals the oldest task of another worker.
+CTask* CTaskPool::FindTask(int nIndex)
+{
+	CTask *pTask = NULL;
+
+	if (nIndex >= 0)
+	{
+		WORKER_QUEUE& Queue = m_pQueues[nIndex];
+		CAutoLocker Locker(Queue.Lock);
+		if (!Queue.Tasks.empty())
+		{
+			pTask = Queue.Tasks.back();
+			Queue.Tasks.pop_back();
+			return pTask;
+		}
+	}
+
+	{
+		CAutoLocker Locker(m_SharedQueue.Lock);
+		if (!m_SharedQueue.Tasks.empty())
+		{
+			pTask = m_SharedQueue.Tasks.front();
+			m_SharedQueue.Tasks.pop_front();
+			return pTask;
+		}
+	}
+
+	for (int i = 1; i <= m_nThreadCount; i++)
+	{
+		int nVictim = (nIndex + i) % m_nThreadCount;
+		if (nVictim == nIndex) continue;
+
+		WORKER_QUEUE& Queue = m_pQueues[nVictim];
+		CAutoLocker Locker(Queue.Lock);
+		if (!Queue.Tasks.empty())
+		{
+			pTask = Queue.Tasks.front();
+			Queue.Tasks.pop_front();
+			return pTask;
+		}
+	}
+
+	return NULL;
+}
+
+//-----------------------------------------------------------------------------
+
+bool CTaskPool::RunOneTask(int nIndex)
+{
+	CTask *pTask = FindTask(nIndex);
+	bool bResult = (pTask != NULL);
+	if (bResult)
+	{
+		pTask->Run();
+		InterlockedDecrement(&m_nPendingCount);
+		pTask->Release();
+	}
+
+	return bResult;
+}
+
+//-----------------------------------------------------------------------------
+
+void CTaskPool::WakeWorker()
+{
+	if (InterlockedCompareExchange(&m_nIdleCount, 0, 0) > 0)
+		ReleaseSemaphore(m_hWakeSemaphore, 1, NULL);
+}
+
+//-----------------------------------------------------------------------------
+
+// Returns the index of the calling worker, or -1 if called from other threads.
+int CTaskPool::GetCurrentIndex()
+{
+	CWorkerThread *pThread = (CWorkerThread*)TlsGetValue(m_nTlsIndex);
+	return (pThread != NULL ? pThread->GetIndex() : -1);
+}
+
+//-----------------------------------------------------------------------------
+
+// Takes chunks of the range until all indexes are taken.
+void CTaskPool::RunParallelFor(PARALLEL_FOR_CONTEXT& Context)
+{
+	while (true)
+	{
+		int nFrom = InterlockedExchangeAdd(&Context.nNext, Context.nGrainSize);
+		if (nFrom >= Context.nEnd) break;
+		int nTo = Min(nFrom + Context.nGrainSize, Context.nEnd);
+
+		for (int i = nFrom; i < nTo; i++)
+		{
+			try
+			{
+				Context.Proc.pProc(Context.Proc.pParam, i);
+			}
+			catch (IFC_EXCEPT_OBJ e)
+			{
+				IFC_DELETE_MFC_EXCEPT_OBJ(e);
+			}
+			catch (...)
+			{}
+		}
+
+		if (InterlockedExchangeAdd(&Context.nRemainCount, -(nTo - nFrom)) == nTo - nFrom)
+			SetEvent(Context.hDoneEvent);
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+void CTaskPool::ReleaseContext(PARALLEL_FOR_CONTEXT *pContext)
+{
+	if (InterlockedDecrement(&pContext->nRefCount) == 0)
+	{
+		CloseHandle(pContext->hDoneEvent);
+		delete pContext;
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+void CTaskPool::Start()
+{
+	if (m_Threads.GetCount() == 0)
+	{
+		for (int i = 0; i < m_nThreadCount; i++)
+		{
+			CWorkerThread *pThread = new CWorkerThread(*this, i);
+			pThread->SetName(FormatString(TEXT("Task Pool Worker #%d"), i));
+			m_Threads.Add(pThread);
+			pThread->Run();
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+void CTaskPool::Stop()
+{
+	if (m_Threads.GetCount() > 0)
+	{
+		for (int i = 0; i < m_Threads.GetCount(); i++)
+			m_Threads[i]->Terminate();
+		ReleaseSemaphore(m_hWakeSemaphore, m_Threads.GetCount(), NULL);
+		for (int i = 0; i < m_Threads.GetCount(); i++)
+			m_Threads[i]->WaitFor();
+		m_Threads.Clear();
+	}
+
+	// The dropped tasks are marked failed, so nobody waits for them forever.
+	CTask *pTask;
+	while ((pTask = FindTask(-1)) != NULL)
+	{
+		pTask->m_bFailed = true;
+		pTask->NotifyDone();
+		InterlockedDecrement(&m_nPendingCount);
+		pTask->Release();
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+void CTaskPool::Submit(CTask *pTask)
+{
+	pTask->AddRef();
+	pTask->m_pPool = this;
+	InterlockedIncrement(&m_nPendingCount);
+
+	int nIndex = GetCurrentIndex();
+	WORKER_QUEUE& Queue = (nIndex >= 0 ? m_pQueues[nIndex] : m_SharedQueue);
+	{
+		CAutoLocker Locker(Queue.Lock);
+		Queue.Tasks.push_back(pTask);
+	}
+
+	WakeWorker();
+}
+
+//-----------------------------------------------------------------------------
+
+CTask* CTaskPool::Submit(TASK_PROC pProc, void *pParam)
+{
+	CTask *pTask = new CProcTask(pProc, pParam);
+	Submit(pTask);
+	return pTask;
+}
+
+//-----------------------------------------------------------------------------
+
+void CTaskPool::ParallelFor(int nBegin, int nEnd, PARALLEL_FOR_PROC pProc, void *pParam,
+	int nGrainSize)
+{
+	if (nEnd <= nBegin || pProc == NULL) return;
+
+	int nCount = nEnd - nBegin;
+	if (nGrainSize <= 0)
+		nGrainSize = Max(1, nCount / (m_nThreadCount * TASK_POOL_CHUNKS_PER_WORKER));
+
+	PARALLEL_FOR_CONTEXT *pContext = new PARALLEL_FOR_CONTEXT();
+	pContext->Proc.pProc = pProc;
+	pContext->Proc.pParam = pParam;
+	pContext->nNext = nBegin;
+	pContext->nEnd = nEnd;
+	pContext->nGrainSize = nGrainSize;
+	pContext->nRemainCount = nCount;
+	pContext->hDoneEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	pContext->nRefCount = 1;
+
+	// The late tasks find nothing left, they only keep the context alive.
+	int nTaskCount = Min(m_nThreadCount, (nCount + nGrainSize - 1) / nGrainSize - 1);
+	for (int i = 0; i < nTaskCount; i++)
+	{
+		CTask *pTask = new CParallelForTask(pContext);
+		Submit(pTask);
+		pTask->Release();
+	}
+
+	RunParallelFor(*pContext);
+
+	int nIndex = GetCurrentIndex();
+	if (nIndex < 0)
+		WaitForSingleObject(pContext->hDoneEvent, INFINITE);
+	else
+	{
+		while (InterlockedCompareExchange(&pContext->nRemainCount, 0, 0) > 0)
+		{
+			if (!RunOneTask(nIndex))
+				WaitForSingleObject(pContext->hDoneEvent, 1);
+		}
+	}
+
+	ReleaseContext(pContext);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+} // namespace ifc
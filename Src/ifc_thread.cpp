@@ -30,6 +30,58 @@
 namespace ifc
 {
 
+///////////////////////////////////////////////////////////////////////////////
+// Misc Routines
+
+// Passes the thread name to the attached debugger through the MS_VC_EXCEPTION.
+// Kept apart from SetThreadName() since __try is not allowed with objects to unwind.
+static void RaiseThreadNameException(DWORD nThreadId, LPCSTR lpszName)
+{
+	const DWORD MS_VC_EXCEPTION = 0x406D1388;
+
+#pragma pack(push, 8)
+	struct THREADNAME_INFO
+	{
+		DWORD dwType;        // Must be 0x1000.
+		LPCSTR szName;       // The name of the thread.
+		DWORD dwThreadID;    // The thread ID, -1 for the calling thread.
+		DWORD dwFlags;       // Reserved, must be zero.
+	};
+#pragma pack(pop)
+
+	THREADNAME_INFO Info;
+	Info.dwType = 0x1000;
+	Info.szName = lpszName;
+	Info.dwThreadID = nThreadId;
+	Info.dwFlags = 0;
+
+	__try
+	{
+		RaiseException(MS_VC_EXCEPTION, 0, sizeof(Info) / sizeof(ULONG_PTR), (ULONG_PTR*)&Info);
+	}
+	__except (EXCEPTION_EXECUTE_HANDLER)
+	{}
+}
+
+//-----------------------------------------------------------------------------
+
+// Names the thread for the debuggers and profilers.
+static void SetThreadName(HANDLE hThread, DWORD nThreadId, LPCTSTR lpszName)
+{
+	typedef HRESULT (WINAPI *SET_THREAD_DESCRIPTION_PROC)(HANDLE hThread, PCWSTR lpThreadDescription);
+
+	// Not available before Windows 10 1607, the profilers read the name from here.
+	SET_THREAD_DESCRIPTION_PROC pSetThreadDescription =
+		(SET_THREAD_DESCRIPTION_PROC)GetProcAddress(
+		GetModuleHandle(TEXT("kernel32.dll")), "SetThreadDescription");
+
+	if (pSetThreadDescription != NULL)
+		pSetThreadDescription(hThread, CT2W(lpszName));
+
+	if (IsDebuggerPresent())
+		RaiseThreadNameException(nThreadId, CT2A(lpszName));
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // CThread
 
@@ -48,7 +100,9 @@ CThread::CThread() :
 	m_bRunCalled(false),
 	m_bFinished(false),
 	m_pExecProc(NULL),
-	m_pThreadParam(NULL)
+	m_pThreadParam(NULL),
+	m_nAffinityMask(0),
+	m_nStackSize(0)
 {
 	// nothing
 }
@@ -125,13 +179,18 @@ void CThread::Run()
 		IfcThrowThreadException(SEM_THREAD_RUN_ONCE);
 	m_bRunCalled = true;
 
-	m_hHandle = (HANDLE)_beginthreadex(NULL, 0, ThreadExecProc, (LPVOID)this,
-		CREATE_SUSPENDED, (UINT*)&m_nThreadId);
+	m_hHandle = (HANDLE)_beginthreadex(NULL, m_nStackSize, ThreadExecProc, (LPVOID)this,
+		CREATE_SUSPENDED | (m_nStackSize != 0 ? STACK_SIZE_PARAM_IS_A_RESERVATION : 0),
+		(UINT*)&m_nThreadId);
 
 	if (m_hHandle == 0)
 		IfcThrowThreadException(SEM_THREAD_CREATE_ERROR);
 
 	SetPriority(m_nPriority);
+	if (m_nAffinityMask != 0)
+		SetAffinityMask(m_nAffinityMask);
+	if (!m_strName.IsEmpty())
+		SetThreadName(m_hHandle, m_nThreadId, m_strName);
 	::ResumeThread(m_hHandle);
 }
 
@@ -255,6 +314,39 @@ void CThread::SetTerminated(bool bValue)
 	}
 }
 
+//-----------------------------------------------------------------------------
+
+void CThread::SetAffinityMask(DWORD_PTR nValue)
+{
+	m_nAffinityMask = nValue;
+
+	if (m_nThreadId != 0)
+	{
+		DWORD_PTR nProcessMask = 0, nSystemMask = 0;
+
+		// A mask outside the process affinity would make SetThreadAffinityMask fail.
+		if (GetProcessAffinityMask(GetCurrentProcess(), &nProcessMask, &nSystemMask))
+		{
+			if ((nValue & nProcessMask) == 0)
+				nValue = nProcessMask;
+			else
+				nValue &= nProcessMask;
+
+			SetThreadAffinityMask(m_hHandle, nValue);
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+void CThread::SetName(LPCTSTR lpszName)
+{
+	m_strName = lpszName;
+
+	if (m_nThreadId != 0)
+		SetThreadName(m_hHandle, m_nThreadId, m_strName);
+}
+
 
 #else
 
@@ -274,7 +366,9 @@ CThread::CThread() :
 	m_bRunCalled(false),
 	m_bFinished(false),
 	m_pExecProc(NULL),
-	m_pThreadParam(NULL)
+	m_pThreadParam(NULL),
+	m_nAffinityMask(0),
+	m_nStackSize(0)
 {
 }
 
@@ -350,13 +444,18 @@ void CThread::Run()
 		IfcThrowThreadException(SEM_THREAD_RUN_ONCE);
 	m_bRunCalled = true;
 
-	m_hHandle = (HANDLE)_beginthreadex(NULL, 0, ThreadExecProc, (LPVOID)this, 
-		CREATE_SUSPENDED, (UINT*)&m_nThreadId);
+	m_hHandle = (HANDLE)_beginthreadex(NULL, m_nStackSize, ThreadExecProc, (LPVOID)this,
+		CREATE_SUSPENDED | (m_nStackSize != 0 ? STACK_SIZE_PARAM_IS_A_RESERVATION : 0),
+		(UINT*)&m_nThreadId);
 
 	if (m_hHandle == 0)
 		IfcThrowThreadException(SEM_THREAD_CREATE_ERROR);
 
 	SetPriority(m_nPriority);
+	if (m_nAffinityMask != 0)
+		SetAffinityMask(m_nAffinityMask);
+	if (!m_strName.IsEmpty())
+		SetThreadName(m_hHandle, m_nThreadId, m_strName);
 	::ResumeThread(m_hHandle);
 }
 
@@ -480,6 +579,39 @@ void CThread::SetTerminated(bool bValue)
 	}
 }
 
+//-----------------------------------------------------------------------------
+
+void CThread::SetAffinityMask(DWORD_PTR nValue)
+{
+	m_nAffinityMask = nValue;
+
+	if (m_nThreadId != 0)
+	{
+		DWORD_PTR nProcessMask = 0, nSystemMask = 0;
+
+		// A mask outside the process affinity would make SetThreadAffinityMask fail.
+		if (GetProcessAffinityMask(GetCurrentProcess(), &nProcessMask, &nSystemMask))
+		{
+			if ((nValue & nProcessMask) == 0)
+				nValue = nProcessMask;
+			else
+				nValue &= nProcessMask;
+
+			SetThreadAffinityMask(m_hHandle, nValue);
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+void CThread::SetName(LPCTSTR lpszName)
+{
+	m_strName = lpszName;
+
+	if (m_nThreadId != 0)
+		SetThreadName(m_hHandle, m_nThreadId, m_strName);
+}
+
 #endif
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -49,6 +49,8 @@ void CThreadProcessor::CWorkerThread::Execute()
 		try
 		{
 			m_Processor.m_SleepController.NeedSleep() = true;
+			if (m_Processor.RunPostedTasks())
+				m_Processor.m_SleepController.NeedSleep() = false;
 			m_Processor.Process();
 		}
 		catch (...)
@@ -81,7 +83,7 @@ CThreadProcessor::CSleepController::~CSleepController()
 void CThreadProcessor::CSleepController::Sleep(int nMilliseconds)
 {
 	if (nMilliseconds != 0)
-		::WaitForSingleObject(m_hSleepEvent, nMilliseconds);
+		::WaitForSingleObject(m_hSleepEvent, nMilliseconds < 0 ? INFINITE : nMilliseconds);
 	ResetEvent(m_hSleepEvent);
 }
 
@@ -95,10 +97,11 @@ void CThreadProcessor::CSleepController::InterruptSleep()
 ///////////////////////////////////////////////////////////////////////////////
 // CThreadProcessor
 
-CThreadProcessor::CThreadProcessor() :
-	m_pWorkerThread(NULL)
+CThreadProcessor::CThreadProcessor(int nSleepMSecs) :
+	m_pWorkerThread(NULL),
+	m_nWorkerAffinity(0)
 {
-	// nothing
+	m_SleepController.SleepMSecs() = nSleepMSecs;
 }
 
 //-----------------------------------------------------------------------------
@@ -115,6 +118,8 @@ void CThreadProcessor::Start()
 	if (!m_pWorkerThread)
 	{
 		m_pWorkerThread = new CWorkerThread(*this);
+		m_pWorkerThread->SetName(m_strWorkerName);
+		m_pWorkerThread->SetAffinityMask(m_nWorkerAffinity);
 		m_pWorkerThread->Run();
 	}
 }
@@ -128,12 +133,86 @@ void CThreadProcessor::Stop()
 		m_SleepController.InterruptSleep();
 		BeforeTerminate();
 		m_pWorkerThread->Terminate();
+		// The worker may have gone to sleep again before seeing the terminated flag.
+		m_SleepController.InterruptSleep();
 		m_pWorkerThread->WaitFor();
 		delete m_pWorkerThread;
 		m_pWorkerThread = NULL;
 	}
 }
 
+//-----------------------------------------------------------------------------
+
+void CThreadProcessor::SetWorkerName(LPCTSTR lpszName)
+{
+	m_strWorkerName = lpszName;
+	if (m_pWorkerThread)
+		m_pWorkerThread->SetName(m_strWorkerName);
+}
+
+//-----------------------------------------------------------------------------
+
+void CThreadProcessor::SetWorkerAffinityMask(DWORD_PTR nValue)
+{
+	m_nWorkerAffinity = nValue;
+	if (m_pWorkerThread)
+		m_pWorkerThread->SetAffinityMask(m_nWorkerAffinity);
+}
+
+//-----------------------------------------------------------------------------
+
+// Runs the tasks posted so far, returns true if more tasks are waiting.
+bool CThreadProcessor::RunPostedTasks()
+{
+	TASK_QUEUE Tasks;
+	{
+		CAutoLocker Locker(m_TaskLock);
+		Tasks.swap(m_TaskQueue);
+	}
+
+	for (int i = 0; i < (int)Tasks.size(); i++)
+	{
+		try
+		{
+			Tasks[i].pProc(Tasks[i].pParam);
+		}
+		catch (IFC_EXCEPT_OBJ e)
+		{
+			IFC_DELETE_MFC_EXCEPT_OBJ(e);
+		}
+		catch (...)
+		{}
+	}
+
+	CAutoLocker Locker(m_TaskLock);
+	return !m_TaskQueue.empty();
+}
+
+//-----------------------------------------------------------------------------
+
+void CThreadProcessor::Post(THREAD_PSR_TASK_PROC pProc, void *pParam)
+{
+	if (pProc)
+	{
+		CCallBackDef<THREAD_PSR_TASK_PROC> Task;
+		Task.pProc = pProc;
+		Task.pParam = pParam;
+		{
+			CAutoLocker Locker(m_TaskLock);
+			m_TaskQueue.push_back(Task);
+		}
+		m_SleepController.InterruptSleep();
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+int CThreadProcessor::GetPostedCount()
+{
+	CAutoLocker Locker(m_TaskLock);
+	return (int)m_TaskQueue.size();
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // CDaemonJob
 
@@ -141,21 +220,32 @@ CDaemonJob::CDaemonJob() :
 	m_pJobPsr(NULL),
 	m_nLastProcTicks(0),
 	m_nProcessCount(0),
+	m_pTask(NULL),
 	m_nDelay(0),
 	m_nInterval(0)
 {
 	// nothing
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// CDaemonJobPsr::CJobTask
+
+void CDaemonJobPsr::CJobTask::Execute()
+{
+	CDaemonJobPsr::ExecuteJob(m_pJob);
+	m_JobPsr.OnJobDone(m_pJob);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // CDaemonJobPsr
 
 CDaemonJobPsr::CDaemonJobPsr() :
+	CThreadProcessor(THREAD_PSR_SLEEP_INFINITE),
 	m_JobList(false, true),
-	m_AddList(true, true)
+	m_TimerWheel(1),
+	m_pTaskPool(NULL)
 {
-	const int LOOP_INTERVAL = 1;   // ms
-	m_SleepController.SleepMSecs() = LOOP_INTERVAL;
+	SetWorkerName(TEXT("Daemon Job Processor"));
 }
 
 //-----------------------------------------------------------------------------
@@ -167,6 +257,81 @@ CDaemonJobPsr::~CDaemonJobPsr()
 
 //-----------------------------------------------------------------------------
 
+// Adds the job to the timer wheel, due after the delay or the interval since its last run.
+void CDaemonJobPsr::ScheduleJob(CDaemonJob *pJob)
+{
+	UINT nWait = (pJob->m_nProcessCount == 0 ? pJob->m_nDelay : pJob->m_nInterval);
+	UINT nElapsed = GetTickDiff(pJob->m_nLastProcTicks, GetTickCount());
+
+	m_TimerWheel.Add(pJob, nElapsed < nWait ? nWait - nElapsed : 0);
+}
+
+//-----------------------------------------------------------------------------
+
+void CDaemonJobPsr::RunJob(CDaemonJob *pJob)
+{
+	pJob->m_nLastProcTicks = GetTickCount();
+
+	if (m_pTaskPool != NULL)
+	{
+		pJob->m_pTask = new CJobTask(*this, pJob);
+		m_pTaskPool->Submit(pJob->m_pTask);
+	}
+	else
+	{
+		ExecuteJob(pJob);
+		pJob->m_nProcessCount++;
+		ScheduleJob(pJob);
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+// Called by the task pool when a job returns.
+void CDaemonJobPsr::OnJobDone(CDaemonJob *pJob)
+{
+	{
+		CAutoLocker Locker(m_Lock);
+		m_DoneList.push_back(pJob);
+	}
+	m_SleepController.InterruptSleep();
+}
+
+//-----------------------------------------------------------------------------
+
+// Waits for the jobs running on the task pool.
+void CDaemonJobPsr::WaitForTasks()
+{
+	for (int i = 0; i < m_JobList.GetCount(); i++)
+	{
+		CDaemonJob *pJob = m_JobList[i];
+		if (pJob->m_pTask != NULL)
+		{
+			pJob->m_pTask->Wait();
+			pJob->m_pTask->Release();
+			pJob->m_pTask = NULL;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+void CDaemonJobPsr::ExecuteJob(CDaemonJob *pJob)
+{
+	try
+	{
+		pJob->Process();
+	}
+	catch (IFC_EXCEPT_OBJ e)
+	{
+		IFC_DELETE_MFC_EXCEPT_OBJ(e);
+	}
+	catch (...)
+	{}
+}
+
+//-----------------------------------------------------------------------------
+
 void CDaemonJobPsr::BeforeTerminate()
 {
 	for (int i = m_JobList.GetCount() - 1; i >= 0; i--)
@@ -177,43 +342,46 @@ void CDaemonJobPsr::BeforeTerminate()
 
 void CDaemonJobPsr::Process()
 {
-	while (true)
+	CJobArray AddList, DoneList;
 	{
-		CDaemonJob *pJob = m_AddList.Extract(0);
-		if (pJob)
-			m_JobList.Add(pJob);
-		else
-			break;
+		CAutoLocker Locker(m_Lock);
+		AddList.swap(m_AddList);
+		DoneList.swap(m_DoneList);
 	}
 
-	UINT nCurTicks = GetTickCount();
-	for (int i = m_JobList.GetCount() - 1; i >= 0; i--)
+	for (int i = 0; i < (int)AddList.size(); i++)
 	{
-		CDaemonJob& Job = *(m_JobList[i]);
+		CDaemonJob *pJob = AddList[i];
+		pJob->m_nLastProcTicks = GetTickCount();
+		m_JobList.Add(pJob);
+		ScheduleJob(pJob);
+	}
 
-		if (Job.m_nLastProcTicks == 0)
-			Job.m_nLastProcTicks = nCurTicks;
+	for (int i = 0; i < (int)DoneList.size(); i++)
+	{
+		CDaemonJob *pJob = DoneList[i];
+		pJob->m_pTask->Release();
+		pJob->m_pTask = NULL;
+		pJob->m_nProcessCount++;
+		ScheduleJob(pJob);
+	}
 
-		if (Job.m_nProcessCount == 0 && GetTickDiff(Job.m_nLastProcTicks, nCurTicks) < Job.m_nDelay)
-			continue;
+	CPointerList Expired;
+	m_TimerWheel.Advance(Expired);
+	for (int i = 0; i < Expired.GetCount(); i++)
+	{
+		CDaemonJob *pJob = (CDaemonJob*)Expired[i];
 
-		if (Job.m_nProcessCount == 0 || GetTickDiff(Job.m_nLastProcTicks, nCurTicks) >= Job.m_nInterval)
-		{
-			Job.m_nLastProcTicks = nCurTicks;
-			try
-			{
-				Job.Process();
-			}
-			catch (IFC_EXCEPT_OBJ e)
-			{
-				IFC_DELETE_MFC_EXCEPT_OBJ(e);
-			}
-			catch (...)
-			{}
-
-			Job.m_nProcessCount++;
-		}
+		// The wheel clamps very long delays, such a job is put back until it is really due.
+		UINT nWait = (pJob->m_nProcessCount == 0 ? pJob->m_nDelay : pJob->m_nInterval);
+		if (GetTickDiff(pJob->m_nLastProcTicks, GetTickCount()) < nWait)
+			ScheduleJob(pJob);
+		else
+			RunJob(pJob);
 	}
+
+	DWORD nTimeOut = m_TimerWheel.GetNextTimeOut();
+	m_SleepController.SleepMSecs() = (nTimeOut == INFINITE ? THREAD_PSR_SLEEP_INFINITE : (int)nTimeOut);
 }
 
 //-----------------------------------------------------------------------------
@@ -223,7 +391,11 @@ void CDaemonJobPsr::AddJob(CDaemonJob *pJob)
 	if (pJob)
 	{
 		pJob->m_pJobPsr = this;
-		m_AddList.Add(pJob);
+		{
+			CAutoLocker Locker(m_Lock);
+			m_AddList.push_back(pJob);
+		}
+		m_SleepController.InterruptSleep();
 	}
 }
 
@@ -232,8 +404,14 @@ void CDaemonJobPsr::AddJob(CDaemonJob *pJob)
 void CDaemonJobPsr::Terminate()
 {
 	Stop();
+	WaitForTasks();
+
+	m_TimerWheel.Clear();
 	m_JobList.Clear();
-	m_AddList.Clear();
+	m_DoneList.clear();
+	for (int i = 0; i < (int)m_AddList.size(); i++)
+		delete m_AddList[i];
+	m_AddList.clear();
 }
 
 ///////////////////////////////////////////////////////////////////////////////